@@ -40,6 +40,7 @@ import android.os.Bundle;
 import android.os.Handler;
 import android.os.Looper;
 import android.os.ParcelFileDescriptor;
+import android.text.TextUtils;
 import android.util.Log;
 import android.widget.Toast;
 
@@ -51,16 +52,23 @@ import androidx.localbroadcastmanager.content.LocalBroadcastManager;
 import androidx.preference.PreferenceManager;
 
 import com.emanuelef.remote_capture.activities.MainActivity;
+import com.emanuelef.remote_capture.model.AppShaperStats;
+import com.emanuelef.remote_capture.model.BlocklistHit;
 import com.emanuelef.remote_capture.model.ConnectionDescriptor;
+import com.emanuelef.remote_capture.model.DnsUpstream;
+import com.emanuelef.remote_capture.model.HeavyHitter;
+import com.emanuelef.remote_capture.model.LatencyHistograms;
 import com.emanuelef.remote_capture.model.Prefs;
 import com.emanuelef.remote_capture.model.VPNStats;
 
+import java.io.File;
 import java.io.FileNotFoundException;
 import java.io.IOException;
 import java.io.OutputStream;
 import java.net.InetAddress;
 import java.net.InetSocketAddress;
 import java.net.UnknownHostException;
+import java.util.List;
 
 public class CaptureService extends VpnService implements Runnable {
     private static final String TAG = "CaptureService";
@@ -73,11 +81,13 @@ public class CaptureService extends VpnService implements Runnable {
     private String vpn_ipv4;
     private String vpn_dns;
     private String dns_server;
+    private String dns_servers; // comma separated, the upstreams of the native DNS forwarder
     private String collector_address;
     private String socks5_proxy_address;
     private Prefs.DumpMode dump_mode;
     private boolean socks5_enabled;
     private boolean ipv6_enabled;
+    private String app_rate_limits;
     private int collector_port;
     private int http_server_port;
     private int socks5_proxy_port;
@@ -98,6 +108,23 @@ public class CaptureService extends VpnService implements Runnable {
      * Max Estimated max memory usage: less than 4 MB. */
     public static final int CONNECTIONS_LOG_SIZE = 8192;
 
+    /* The memory budget of the native engine. When hit, the DPI state and then the metadata
+     * of the closed connections are evicted. */
+    public static final int NATIVE_MEMORY_BUDGET_MB = 32;
+
+    /* Must match bw_resolution_t */
+    public static final int BW_RESOLUTION_SECONDS = 0;  // 1 s slots, up to 10 minutes
+    public static final int BW_RESOLUTION_MINUTES = 1;  // 1 min slots, up to 24 hours
+
+    /* Heavy hitters trackers, must match top_tracker_t */
+    public static final int TOP_HOSTS = 0;
+    public static final int TOP_IPS = 1;
+    public static final int TOP_APP_HOSTS = 2;
+
+    /* See getLatencyHistograms */
+    public static final int LATENCY_BY_APP = 0;
+    public static final int LATENCY_BY_HOST = 1;
+
     public static final String FALLBACK_DNS_SERVER = "8.8.8.8";
     public static final String IPV6_DNS_SERVER = "2001:4860:4860::8888";
 
@@ -156,17 +183,21 @@ public class CaptureService extends VpnService implements Runnable {
 
         // Retrieve DNS server
         dns_server = FALLBACK_DNS_SERVER;
+        dns_servers = FALLBACK_DNS_SERVER;
 
         if (android.os.Build.VERSION.SDK_INT >= android.os.Build.VERSION_CODES.M) {
             ConnectivityManager cm = (ConnectivityManager) getSystemService(Service.CONNECTIVITY_SERVICE);
             Network net = cm.getActiveNetwork();
 
             if(net != null) {
-                dns_server = Utils.getDnsServer(cm, net);
+                List<String> net_dns_servers = Utils.getDnsServers(cm, net);
+
+                if(!net_dns_servers.isEmpty()) {
+                    // The native DNS forwarder only uses the fallback DNS server (see
+                    // getFallbackDnsServer) when the network DNS servers do not respond
+                    dns_server = net_dns_servers.get(0);
+                    dns_servers = TextUtils.join(",", net_dns_servers);
 
-                if(dns_server == null)
-                    dns_server = FALLBACK_DNS_SERVER;
-                else {
                     // If the network goes offline we roll back to the fallback DNS server to
                     // avoid possibly using a private IP DNS server not reachable anymore
                     mMonitoredNetwork = net.getNetworkHandle();
@@ -188,6 +219,7 @@ public class CaptureService extends VpnService implements Runnable {
         socks5_proxy_port = Prefs.getSocks5ProxyPort(prefs);
         dump_mode = Prefs.getDumpMode(prefs);
         ipv6_enabled = Prefs.getIPv6Enabled(prefs);
+        app_rate_limits = Prefs.getAppRateLimits(prefs);
         last_bytes = 0;
         last_connections = 0;
 
@@ -529,6 +561,14 @@ public class CaptureService extends VpnService implements Runnable {
         return(dns_server);
     }
 
+    public String getDnsServers() {
+        return(dns_servers);
+    }
+
+    public String getFallbackDnsServer() {
+        return(FALLBACK_DNS_SERVER);
+    }
+
     public String getIpv6DnsServer() { return(IPV6_DNS_SERVER); }
 
     public String getPcapCollectorAddress() {
@@ -547,6 +587,29 @@ public class CaptureService extends VpnService implements Runnable {
 
     public int getIPv6Enabled() { return(ipv6_enabled ? 1 : 0); }
 
+    // the per-app upstream shaping, "<uid>:<rate_kbps>[:<weight>]" entries separated by commas,
+    // plus an optional "all:<rate_kbps>" rate shared by the apps by weight
+    public String getAppRateLimits() { return(app_rate_limits); }
+
+    public int getMemoryBudgetMB() { return(NATIVE_MEMORY_BUDGET_MB); }
+
+    // the log of the closed connections, kept until the next capture starts
+    public String getConnLogPath() {
+        return(new File(getCacheDir(), "connections.log").getAbsolutePath());
+    }
+
+    // the domains blocklist, one domain per line or in the hosts format. Compiled by the native
+    // code into blocklist.txt.bin on the first capture after each change.
+    public String getBlocklistPath() {
+        return(new File(getFilesDir(), "blocklist.txt").getAbsolutePath());
+    }
+
+    // the IP rules, one "<ip or cidr> <action>[,<action>...]" per line. The actions are block,
+    // nodpi, noexport and tag=<name>.
+    public String getIpRulesPath() {
+        return(new File(getFilesDir(), "ip_rules.txt").getAbsolutePath());
+    }
+
     // returns 1 if dumpPcapData should be called
     public int dumpPcapToJava() {
         return(((dump_mode == Prefs.DumpMode.HTTP_SERVER) || (dump_mode == Prefs.DumpMode.PCAP_FILE)) ? 1 : 0);
@@ -574,15 +637,16 @@ public class CaptureService extends VpnService implements Runnable {
     }
 
     public void sendConnectionsDump(ConnectionDescriptor[] new_conns, ConnectionDescriptor[] conns_updates) {
-        // synchronize the conn_reg to ensure that newConnections and connectionsUpdates run atomically
-        // thus preventing the ConnectionsAdapter from interleaving other operations
-        synchronized (conn_reg) {
-            if(new_conns.length > 0)
-                conn_reg.newConnections(new_conns);
-
-            if(conns_updates.length > 0)
-                conn_reg.connectionsUpdates(conns_updates);
-            }
+        // The register publishes a snapshot after each call, readers never block this thread
+        if(new_conns.length > 0)
+            conn_reg.newConnections(new_conns);
+
+        if(conns_updates.length > 0)
+            conn_reg.connectionsUpdates(conns_updates);
+    }
+
+    public void sendAppsStatsDump(long[] data) {
+        conn_reg.appsStatsUpdate(data);
     }
 
     public void sendStatsDump(VPNStats stats) {
@@ -640,5 +704,24 @@ public class CaptureService extends VpnService implements Runnable {
     public static native void stopPacketLoop();
     public static native void askStatsDump();
     public static native int getFdSetSize();
+    /* Export the active connections of the native engine, format is a ConnectionsExporter.NATIVE_FORMAT_* */
+    public static native boolean exportConnectionsToFd(int fd, int format);
+    /* Get the bandwidth series of an uid (Utils.UID_NO_FILTER for all the apps), resolution is a
+     * BW_RESOLUTION_*. Returns [newest_slot_time, sent_0, rcvd_0, sent_1, rcvd_1...], oldest first */
+    public static native long[] getBandwidthSeries(int uid, int resolution, int num_slots);
+    /* Get the top k talkers by bytes of a TOP_* tracker, k <= 256 */
+    public static native HeavyHitter[] getHeavyHitters(int tracker, int k);
+    /* Query the log of the closed connections. from/to are in seconds, uid can be Utils.UID_NO_FILTER */
+    public static native int[] connLogQuery(long from, long to, int uid, int max);
+    public static native ConnectionDescriptor[] connLogGet(int[] ids);
+    public static native boolean connLogExport(int fd, int format, long from, long to, int uid);
+    /* Get the stats of the upstream servers of the native DNS forwarder, updated every 5 seconds */
+    public static native DnsUpstream[] getDnsUpstreamsStats();
+    /* Get up to k blocklist rules with the most hits, null if no blocklist is loaded */
+    public static native BlocklistHit[] getBlocklistHits(int k);
+    /* Get the stats of the shaped apps, updated every 5 seconds */
+    public static native AppShaperStats[] getAppsShaperStats();
+    /* Get the connection setup latency histograms, by is a LATENCY_BY_* */
+    public static native LatencyHistograms[] getLatencyHistograms(int by);
     public static native void setDnsServer(String server);
 }
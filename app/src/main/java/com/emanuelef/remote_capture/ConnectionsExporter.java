@@ -0,0 +1,183 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+package com.emanuelef.remote_capture;
+
+import android.content.Context;
+import android.os.SystemClock;
+import android.util.Log;
+
+import com.emanuelef.remote_capture.model.AppDescriptor;
+import com.emanuelef.remote_capture.model.ConnectionDescriptor;
+
+import java.io.BufferedWriter;
+import java.io.IOException;
+import java.io.OutputStream;
+import java.io.OutputStreamWriter;
+import java.io.Writer;
+import java.nio.charset.StandardCharsets;
+
+/* Streams the connections of a ConnectionsRegister.Snapshot to an OutputStream, one row at a time,
+ * without building the whole dump in memory. */
+public class ConnectionsExporter {
+    private static final String TAG = "ConnectionsExporter";
+    private static final int BUFFER_SIZE = 64 * 1024;
+
+    public enum Format {
+        CSV,
+        NDJSON,
+    }
+
+    /* Must match the conn_export_format_t of the native exporter */
+    public static final int NATIVE_FORMAT_CSV = 0;
+    public static final int NATIVE_FORMAT_NDJSON = 1;
+
+    private final Context mContext;
+    private final AppsResolver mResolver;
+    private final Format mFormat;
+    private final int mUidFilter;
+
+    public ConnectionsExporter(Context context, Format format, int uidFilter) {
+        mContext = context;
+        mResolver = new AppsResolver(context);
+        mFormat = format;
+        mUidFilter = uidFilter;
+    }
+
+    /* Returns the number of exported rows. The stream is flushed but not closed. */
+    public int export(ConnectionsRegister.Snapshot snapshot, OutputStream out) throws IOException {
+        Writer writer = new BufferedWriter(new OutputStreamWriter(out, StandardCharsets.UTF_8), BUFFER_SIZE);
+        long start_ms = SystemClock.elapsedRealtime();
+        int rows = 0;
+
+        if(mFormat == Format.CSV) {
+            writer.write(mContext.getString(R.string.connections_csv_fields_v1));
+            writer.write("\n");
+        }
+
+        for(int i = 0; i < snapshot.getConnCount(); i++) {
+            ConnectionDescriptor conn = snapshot.getConn(i);
+
+            if((conn == null) || ((mUidFilter != Utils.UID_NO_FILTER) && (conn.uid != mUidFilter)))
+                continue;
+
+            AppDescriptor app = mResolver.get(conn.uid);
+            String app_name = (app != null) ? app.getName() : "";
+
+            if(mFormat == Format.CSV)
+                writeCsvRow(writer, conn, app_name);
+            else
+                writeJsonRow(writer, conn, app_name);
+
+            rows++;
+        }
+
+        writer.flush();
+
+        long elapsed_ms = Math.max(SystemClock.elapsedRealtime() - start_ms, 1);
+        Log.d(TAG, "Exported " + rows + " rows in " + elapsed_ms + " ms (" + (rows * 1000L / elapsed_ms) + " rows/s)");
+
+        return rows;
+    }
+
+    private void writeCsvRow(Writer w, ConnectionDescriptor conn, String app_name) throws IOException {
+        w.write(Integer.toString(conn.ipproto));                    w.write(',');
+        w.write(conn.src_ip);                                       w.write(',');
+        w.write(Integer.toString(conn.src_port));                   w.write(',');
+        w.write(conn.dst_ip);                                       w.write(',');
+        w.write(Integer.toString(conn.dst_port));                   w.write(',');
+        w.write(Integer.toString(conn.uid));                        w.write(',');
+        writeCsvField(w, app_name);                                 w.write(',');
+        writeCsvField(w, conn.l7proto);                             w.write(',');
+        w.write(conn.getStatusLabel(mContext));                     w.write(',');
+        writeCsvField(w, conn.info);                                w.write(',');
+        w.write(Long.toString(conn.sent_bytes));                    w.write(',');
+        w.write(Long.toString(conn.rcvd_bytes));                    w.write(',');
+        w.write(Integer.toString(conn.sent_pkts));                  w.write(',');
+        w.write(Integer.toString(conn.rcvd_pkts));                  w.write(',');
+        w.write(Long.toString(conn.first_seen));                    w.write(',');
+        w.write(Long.toString(conn.last_seen));                     w.write('\n');
+    }
+
+    private void writeJsonRow(Writer w, ConnectionDescriptor conn, String app_name) throws IOException {
+        w.write("{\"ipproto\":");   w.write(Integer.toString(conn.ipproto));
+        w.write(",\"src_ip\":");    writeJsonString(w, conn.src_ip);
+        w.write(",\"src_port\":");  w.write(Integer.toString(conn.src_port));
+        w.write(",\"dst_ip\":");    writeJsonString(w, conn.dst_ip);
+        w.write(",\"dst_port\":");  w.write(Integer.toString(conn.dst_port));
+        w.write(",\"uid\":");       w.write(Integer.toString(conn.uid));
+        w.write(",\"app\":");       writeJsonString(w, app_name);
+        w.write(",\"proto\":");     writeJsonString(w, conn.l7proto);
+        w.write(",\"status\":");    writeJsonString(w, conn.getStatusLabel(mContext));
+        w.write(",\"info\":");      writeJsonString(w, conn.info);
+        w.write(",\"url\":");       writeJsonString(w, conn.url);
+        w.write(",\"bytes_sent\":");    w.write(Long.toString(conn.sent_bytes));
+        w.write(",\"bytes_rcvd\":");    w.write(Long.toString(conn.rcvd_bytes));
+        w.write(",\"pkts_sent\":");     w.write(Integer.toString(conn.sent_pkts));
+        w.write(",\"pkts_rcvd\":");     w.write(Integer.toString(conn.rcvd_pkts));
+        w.write(",\"first_seen\":");    w.write(Long.toString(conn.first_seen));
+        w.write(",\"last_seen\":");     w.write(Long.toString(conn.last_seen));
+        w.write("}\n");
+    }
+
+    /* Quote the field if it contains a separator, a quote or a line break, doubling the quotes (RFC 4180) */
+    private static void writeCsvField(Writer w, String s) throws IOException {
+        if(s == null)
+            return;
+
+        boolean quote = false;
+
+        for(int i = 0; (i < s.length()) && !quote; i++) {
+            char c = s.charAt(i);
+            quote = (c == ',') || (c == '"') || (c == '\r') || (c == '\n');
+        }
+
+        if(!quote) {
+            w.write(s);
+            return;
+        }
+
+        w.write('"');
+        w.write(s.replace("\"", "\"\""));
+        w.write('"');
+    }
+
+    private static void writeJsonString(Writer w, String s) throws IOException {
+        if(s == null) {
+            w.write("\"\"");
+            return;
+        }
+
+        w.write('"');
+
+        for(int i = 0; i < s.length(); i++) {
+            char c = s.charAt(i);
+
+            if((c == '"') || (c == '\\')) {
+                w.write('\\');
+                w.write(c);
+            } else if(c < 0x20)
+                w.write(String.format("\\u%04x", (int) c));
+            else
+                w.write(c);
+        }
+
+        w.write('"');
+    }
+}
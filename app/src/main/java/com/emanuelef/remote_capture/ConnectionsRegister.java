@@ -19,42 +19,202 @@
 
 package com.emanuelef.remote_capture;
 
-import android.content.Context;
 import android.os.Handler;
 import android.util.Log;
 import android.widget.Toast;
 
 import com.emanuelef.remote_capture.interfaces.ConnectionsListener;
-import com.emanuelef.remote_capture.model.AppDescriptor;
 import com.emanuelef.remote_capture.model.AppStats;
 import com.emanuelef.remote_capture.model.ConnectionDescriptor;
 
 import java.util.ArrayList;
 import java.util.Arrays;
+import java.util.Collections;
 import java.util.HashMap;
 import java.util.HashSet;
 import java.util.List;
 import java.util.Map;
 import java.util.Set;
 
+/* The writer (the capture thread) modifies the register under the register lock and, after every
+ * change, publishes an immutable Snapshot. Readers (UI, exports) only access the latest snapshot
+ * and never block on the writer. The ring is split into pages, which are shared with the published
+ * snapshot and copied on write, so that a dump only copies the pages it touches. */
 public class ConnectionsRegister {
-    private final ConnectionDescriptor[] items_ring;
+    private static final int PAGE_SHIFT = 8;
+    private static final int PAGE_SIZE = 1 << PAGE_SHIFT;
+    private static final int PAGE_MASK = PAGE_SIZE - 1;
+    private ConnectionDescriptor[][] mPages;
+    private boolean[] mPageShared; // true if the page is referenced by the published snapshot
     private int tail;
     private final int size;
     private int num_items;
     private int untracked_items;
-    private final Map<Integer, AppStats> mAppsStats;
+    private volatile List<AppStats> mAppsStats;
+    private final Map<Integer, UidIndex> mUidIndex;
+    private final Set<Integer> mDirtyUids;
     private final ArrayList<ConnectionsListener> mListeners;
+    private volatile Snapshot mSnapshot;
     private static final String TAG = "ConnectionsRegister";
 
+    /* The incr_id of the connections of a given uid, in the ring order. Since connections leave
+     * the ring in the same order they enter it, the index is a FIFO. The array is append-only: the
+     * published ids are never overwritten and a new array is allocated when it is full, so that
+     * the snapshots can share it. */
+    private static class UidIndex {
+        private int[] incr_ids = new int[16];
+        private int start = 0;
+        private int end = 0;
+
+        void add(int incr_id) {
+            if(end == incr_ids.length) {
+                int count = size();
+                int[] grown = new int[Math.max(16, count * 2)];
+
+                System.arraycopy(incr_ids, start, grown, 0, count);
+                incr_ids = grown;
+                start = 0;
+                end = count;
+            }
+
+            incr_ids[end++] = incr_id;
+        }
+
+        void removeFirst() {
+            start++;
+        }
+
+        int size() {
+            return end - start;
+        }
+
+        UidConns view() {
+            return new UidConns(incr_ids, start, end);
+        }
+    }
+
+    /* The incr_ids of a uid in a snapshot: a range of the UidIndex array at publish time */
+    private static class UidConns {
+        private final int[] incr_ids;
+        private final int start;
+        private final int end;
+
+        UidConns(int[] _incr_ids, int _start, int _end) {
+            incr_ids = _incr_ids;
+            start = _start;
+            end = _end;
+        }
+
+        int size() {
+            return end - start;
+        }
+
+        int get(int i) {
+            return incr_ids[start + i];
+        }
+    }
+
+    /* An immutable view of the register. The connections are ordered from the oldest. */
+    public static class Snapshot {
+        private final ConnectionDescriptor[][] pages;
+        private final int ring_size;
+        private final int first_pos;
+        private final int num_items;
+        private final int untracked_items;
+        private final Map<Integer, UidConns> uid_conns;
+
+        private Snapshot(ConnectionDescriptor[][] _pages, int _ring_size, int _first_pos, int _num_items,
+                         int _untracked_items, Map<Integer, UidConns> _uid_conns) {
+            pages = _pages;
+            ring_size = _ring_size;
+            first_pos = _first_pos;
+            num_items = _num_items;
+            untracked_items = _untracked_items;
+            uid_conns = _uid_conns;
+        }
+
+        private static Snapshot empty() {
+            return new Snapshot(new ConnectionDescriptor[0][], 1, 0, 0, 0, new HashMap<>());
+        }
+
+        public int getConnCount() {
+            return num_items;
+        }
+
+        public int getUntrackedConnCount() {
+            return untracked_items;
+        }
+
+        public ConnectionDescriptor getConn(int i) {
+            if((i < 0) || (i >= num_items))
+                return null;
+
+            int pos = (first_pos + i) % ring_size;
+            return pages[pos >> PAGE_SHIFT][pos & PAGE_MASK];
+        }
+
+        public int getConnPositionByIncrId(int incr_id) {
+            if(num_items == 0)
+                return -1;
+
+            int pos = incr_id - getConn(0).incr_id;
+            return ((pos >= 0) && (pos < num_items)) ? pos : -1;
+        }
+
+        public int getUidConnCount(int uid) {
+            UidConns ids = uid_conns.get(uid);
+            return (ids != null) ? ids.size() : 0;
+        }
+
+        public ConnectionDescriptor getUidConn(int uid, int target_pos) {
+            // pos is relative to the connections matching the provided uid
+            UidConns ids = uid_conns.get(uid);
+
+            if((ids == null) || (target_pos < 0) || (target_pos >= ids.size()))
+                return null;
+
+            return getConn(getConnPositionByIncrId(ids.get(target_pos)));
+        }
+
+        public Set<Integer> getSeenUids() {
+            return Collections.unmodifiableSet(uid_conns.keySet());
+        }
+    }
+
     public ConnectionsRegister(int _size) {
         tail = 0;
         num_items = 0;
         untracked_items = 0;
         size = _size;
-        items_ring = new ConnectionDescriptor[size];
+        allocPages();
         mListeners = new ArrayList<>();
-        mAppsStats = new HashMap<>(); // uid -> AppStats
+        mAppsStats = new ArrayList<>();
+        mUidIndex = new HashMap<>(); // uid -> UidIndex
+        mDirtyUids = new HashSet<>();
+        mSnapshot = Snapshot.empty();
+    }
+
+    private void allocPages() {
+        int num_pages = (size + PAGE_SIZE - 1) >> PAGE_SHIFT;
+
+        mPages = new ConnectionDescriptor[num_pages][PAGE_SIZE];
+        mPageShared = new boolean[num_pages];
+    }
+
+    private ConnectionDescriptor getItem(int pos) {
+        return mPages[pos >> PAGE_SHIFT][pos & PAGE_MASK];
+    }
+
+    /* A page referenced by the published snapshot is copied before being modified */
+    private void setItem(int pos, ConnectionDescriptor conn) {
+        int page = pos >> PAGE_SHIFT;
+
+        if(mPageShared[page]) {
+            mPages[page] = mPages[page].clone();
+            mPageShared[page] = false;
+        }
+
+        mPages[page][pos & PAGE_MASK] = conn;
     }
 
     private int firstPos() {
@@ -65,6 +225,55 @@ public class ConnectionsRegister {
         return (tail - 1 + size) % size;
     }
 
+    /* The incr_id of the connections in the ring are contiguous, so the position of a connection
+     * can be computed from its incr_id. Returns -1 if the connection is not in the ring. */
+    private int getPosByIncrId(int incr_id) {
+        if(num_items == 0)
+            return -1;
+
+        int first_pos = firstPos();
+        int offset = incr_id - getItem(first_pos).incr_id;
+
+        if((offset < 0) || (offset >= num_items))
+            return -1;
+
+        return (first_pos + offset) % size;
+    }
+
+    /* Must be called with the register lock held, before notifying the listeners. Only the page
+     * table is copied: all the pages become shared with the new snapshot. */
+    private void publish() {
+        Snapshot prev = mSnapshot;
+        ConnectionDescriptor[][] pages = mPages.clone();
+
+        Arrays.fill(mPageShared, true);
+
+        Map<Integer, UidConns> uid_conns = prev.uid_conns;
+
+        if(!mDirtyUids.isEmpty()) {
+            // The ids of the changed uids are shared, only their range is updated
+            uid_conns = new HashMap<>(prev.uid_conns);
+
+            for(int uid: mDirtyUids) {
+                UidIndex index = mUidIndex.get(uid);
+
+                if(index != null)
+                    uid_conns.put(uid, index.view());
+                else
+                    uid_conns.remove(uid);
+            }
+
+            mDirtyUids.clear();
+        }
+
+        mSnapshot = new Snapshot(pages, size, firstPos(), num_items, untracked_items, uid_conns);
+    }
+
+    /* Returns a consistent view of the register. Never blocks. */
+    public Snapshot getSnapshot() {
+        return mSnapshot;
+    }
+
     public synchronized void newConnections(ConnectionDescriptor[] conns) {
         if(conns.length > size) {
             // take the most recent
@@ -77,19 +286,22 @@ public class ConnectionsRegister {
         int insert_pos = num_items;
 
         if(out_items > 0) {
-            int pos = tail;
+            // the evicted connections are the oldest out_items ones
+            int pos = firstPos();
 
-            // update the apps stats
+            // update the uid index, in FIFO order
             for(int i=0; i<out_items; i++) {
-                ConnectionDescriptor conn = items_ring[pos];
+                ConnectionDescriptor conn = getItem(pos);
 
                 if(conn != null) {
                     int uid = conn.uid;
-                    AppStats stats = mAppsStats.get(uid);
-                    stats.bytes -= conn.rcvd_bytes + conn.sent_bytes;
+                    UidIndex index = mUidIndex.get(uid);
+                    index.removeFirst();
+
+                    if(index.size() == 0)
+                        mUidIndex.remove(uid);
 
-                    if(--stats.num_connections <= 0)
-                        mAppsStats.remove(uid);
+                    mDirtyUids.add(uid);
                 }
 
                 pos = (pos + 1) % size;
@@ -97,24 +309,25 @@ public class ConnectionsRegister {
         }
 
         for(ConnectionDescriptor conn: conns) {
-            items_ring[tail] = conn;
+            setItem(tail, conn);
             tail = (tail + 1) % size;
             num_items = Math.min(num_items + 1, size);
 
-            // update the apps stats
+            // update the uid index
             int uid = conn.uid;
-            AppStats stats = mAppsStats.get(uid);
+            UidIndex index = mUidIndex.get(uid);
 
-            if(stats == null) {
-                stats = new AppStats(uid);
-                mAppsStats.put(uid, stats);
+            if(index == null) {
+                index = new UidIndex();
+                mUidIndex.put(uid, index);
             }
 
-            stats.num_connections++;
-            stats.bytes += conn.rcvd_bytes + conn.sent_bytes;
+            index.add(conn.incr_id);
+            mDirtyUids.add(uid);
         }
 
         untracked_items += out_items;
+        publish();
 
         for(ConnectionsListener listener: mListeners) {
             if(out_items > 0)
@@ -127,34 +340,27 @@ public class ConnectionsRegister {
 
     public synchronized void connectionsUpdates(ConnectionDescriptor[] conns) {
         int first_pos = firstPos();
-        int first_id = items_ring[first_pos].incr_id;
-        int last_id = items_ring[lastPos()].incr_id;
         int []changed_pos = new int[conns.length];
         int k = 0;
 
-        Log.d(TAG, "connectionsUpdates: items=" + num_items + ", first_id=" + first_id + ", last_id=" + last_id);
+        Log.d(TAG, "connectionsUpdates: items=" + num_items + ", updates=" + conns.length);
 
         for(ConnectionDescriptor conn: conns) {
-            int id = conn.incr_id;
+            int pos = getPosByIncrId(conn.incr_id);
 
             // ignore updates for untracked items
-            if((id >= first_id) && (id <= last_id)) {
-                int pos = ((id - first_id) + first_pos) % size;
-                ConnectionDescriptor old = items_ring[pos];
+            if(pos >= 0) {
+                ConnectionDescriptor old = getItem(pos);
 
-                assert(old.incr_id == id);
-                items_ring[pos] = conn;
-
-                // update the apps stats
-                long old_bytes = old.rcvd_bytes + old.sent_bytes;
-                long bytes_delta = (conn.rcvd_bytes + conn.sent_bytes) - old_bytes;
-                AppStats stats = mAppsStats.get(conn.uid);
-                stats.bytes += bytes_delta;
+                assert(old.incr_id == conn.incr_id);
+                setItem(pos, conn);
 
                 changed_pos[k++] = (pos + size - first_pos) % size;
             }
         }
 
+        publish();
+
         for(ConnectionsListener listener: mListeners) {
             if(k != conns.length) {
                 // some untracked items where skipped, shrink the array
@@ -167,13 +373,14 @@ public class ConnectionsRegister {
     }
 
     public synchronized void reset() {
-        for(int i=0; i<size; i++)
-            items_ring[i] = null;
-
+        allocPages();
         num_items = 0;
         untracked_items = 0;
         tail = 0;
-        mAppsStats.clear();
+        mAppsStats = new ArrayList<>();
+        mUidIndex.clear();
+        mDirtyUids.clear();
+        mSnapshot = Snapshot.empty();
 
         for(ConnectionsListener listener: mListeners)
             listener.connectionsChanges(num_items);
@@ -194,120 +401,49 @@ public class ConnectionsRegister {
         Log.d(TAG, "(remove) new connections listeners size: " + mListeners.size());
     }
 
+    /* The following getters read the latest snapshot. Callers which need consistency across
+     * multiple calls should use getSnapshot. */
     public int getConnCount() {
-        return num_items;
+        return mSnapshot.getConnCount();
     }
 
     public int getUntrackedConnCount() {
-        return untracked_items;
+        return mSnapshot.getUntrackedConnCount();
     }
 
-    public synchronized ConnectionDescriptor getConn(int i) {
-        if(i >= num_items)
-            return null;
-
-        int pos = (firstPos() + i) % size;
-        return items_ring[pos];
+    public ConnectionDescriptor getConn(int i) {
+        return mSnapshot.getConn(i);
     }
 
-    public synchronized ConnectionDescriptor getUidConn(int uid, int target_pos) {
-        // pos is relative to the connections matching the provided uid
-        int first = firstPos();
-        int virt_pos = 0;
-
-        for(int i = 0; i < num_items; i++) {
-            int pos = (first + i) % size;
-            ConnectionDescriptor item = items_ring[pos];
-
-            if((item != null) && (item.uid == uid)) {
-                if(virt_pos == target_pos)
-                    return item;
-
-                virt_pos++;
-            }
-        }
-
-        return null;
+    public ConnectionDescriptor getUidConn(int uid, int target_pos) {
+        return mSnapshot.getUidConn(uid, target_pos);
     }
 
-    public synchronized int getConnPositionByIncrId(int incr_id) {
-        int first = firstPos();
-
-        for(int i = 0; i < num_items; i++) {
-            int pos = (first + i) % size;
-            ConnectionDescriptor item = items_ring[pos];
-
-            if((item != null) && (item.incr_id == incr_id)) {
-                return pos;
-            }
-        }
-
-        return -1;
+    public int getConnPositionByIncrId(int incr_id) {
+        return mSnapshot.getConnPositionByIncrId(incr_id);
     }
 
-    public synchronized List<AppStats> getAppsStats() {
-        ArrayList<AppStats> rv = new ArrayList<>(mAppsStats.size());
+    /* Invoked by the native code via CaptureService. data contains AppStats.NATIVE_FIELDS items for
+     * each app, see AppStats.fromNative. */
+    public void appsStatsUpdate(long[] data) {
+        ArrayList<AppStats> stats = new ArrayList<>(data.length / AppStats.NATIVE_FIELDS);
 
-        for (Map.Entry<Integer, AppStats> pair : mAppsStats.entrySet()) {
-            // Create a clone to avoid concurrency issues
-            AppStats stats = pair.getValue().clone();
+        for(int i = 0; (i + AppStats.NATIVE_FIELDS) <= data.length; i += AppStats.NATIVE_FIELDS)
+            stats.add(AppStats.fromNative(data, i));
 
-            rv.add(stats);
-        }
-
-        return rv;
+        mAppsStats = stats;
     }
 
-    public synchronized Set<Integer> getSeenUids() {
-        HashSet<Integer> rv = new HashSet<>();
-
-        for (Map.Entry<Integer, AppStats> pair : mAppsStats.entrySet()) {
-            rv.add(pair.getKey());
-        }
-
-        return rv;
+    /* The per-app totals, as aggregated by the native code. The returned AppStats must not be modified. */
+    public List<AppStats> getAppsStats() {
+        return new ArrayList<>(mAppsStats);
     }
 
-    public synchronized int getUidConnCount(int uid) {
-        AppStats stats = mAppsStats.get(uid);
-
-        if(stats == null)
-            return 0;
-        return stats.num_connections;
+    public Set<Integer> getSeenUids() {
+        return mSnapshot.getSeenUids();
     }
 
-    public synchronized String dumpConnectionsCsv(Context context, int uidFilter) {
-        StringBuilder builder = new StringBuilder();
-        AppsResolver resolver = new AppsResolver(context);
-
-        // Header
-        builder.append(context.getString(R.string.connections_csv_fields_v1));
-        builder.append("\n");
-
-        // Contents
-        for(int i=0; i<getConnCount(); i++) {
-            ConnectionDescriptor conn = getConn(i);
-            AppDescriptor app = resolver.get(conn.uid);
-
-            if((conn != null) && ((uidFilter == Utils.UID_NO_FILTER) || (conn.uid == uidFilter))) {
-                builder.append(conn.ipproto);                               builder.append(",");
-                builder.append(conn.src_ip);                                builder.append(",");
-                builder.append(conn.src_port);                              builder.append(",");
-                builder.append(conn.dst_ip);                                builder.append(",");
-                builder.append(conn.dst_port);                              builder.append(",");
-                builder.append(conn.uid);                                   builder.append(",");
-                builder.append((app != null) ? app.getName() : "");         builder.append(",");
-                builder.append(conn.l7proto);                               builder.append(",");
-                builder.append(conn.getStatusLabel(context));               builder.append(",");
-                builder.append((conn.info != null) ? conn.info : "");       builder.append(",");
-                builder.append(conn.sent_bytes);                            builder.append(",");
-                builder.append(conn.rcvd_bytes);                            builder.append(",");
-                builder.append(conn.sent_pkts);                             builder.append(",");
-                builder.append(conn.rcvd_pkts);                             builder.append(",");
-                builder.append(conn.first_seen);                            builder.append(",");
-                builder.append(conn.last_seen);                             builder.append("\n");
-            }
-        }
-        return builder.toString();
+    public int getUidConnCount(int uid) {
+        return mSnapshot.getUidConnCount(uid);
     }
 }
@@ -72,6 +72,7 @@ import java.net.UnknownHostException;
 import java.nio.ByteOrder;
 import java.text.DateFormat;
 import java.text.SimpleDateFormat;
+import java.util.ArrayList;
 import java.util.Calendar;
 import java.util.Collections;
 import java.util.Date;
@@ -175,21 +176,19 @@ public class Utils {
         }
     }
 
-    public static String getDnsServer(ConnectivityManager cm, Network net) {
+    /* Get the IPv4 DNS servers of the network */
+    public static List<String> getDnsServers(ConnectivityManager cm, Network net) {
         LinkProperties props = cm.getLinkProperties(net);
+        List<String> rv = new ArrayList<>();
 
         if(props != null) {
-            List<InetAddress> dns_servers = props.getDnsServers();
-
-            for(InetAddress addr : dns_servers) {
-                // Get the first IPv4 DNS server
-                if(addr instanceof Inet4Address) {
-                    return addr.getHostAddress();
-                }
+            for(InetAddress addr : props.getDnsServers()) {
+                if(addr instanceof Inet4Address)
+                    rv.add(addr.getHostAddress());
             }
         }
 
-        return null;
+        return rv;
     }
 
     // https://gist.github.com/mathieugerard/0de2b6f5852b6b0b37ed106cab41eba1
@@ -38,10 +38,14 @@ import android.widget.TableLayout;
 import android.widget.TextView;
 
 import com.emanuelef.remote_capture.CaptureService;
+import com.emanuelef.remote_capture.ConnectionsRegister;
 import com.emanuelef.remote_capture.R;
 import com.emanuelef.remote_capture.Utils;
+import com.emanuelef.remote_capture.model.AppStats;
 import com.emanuelef.remote_capture.model.VPNStats;
 
+import java.util.List;
+
 public class StatsActivity extends BaseActivity {
     private BroadcastReceiver mReceiver;
     private TextView mBytesSent;
@@ -55,6 +59,10 @@ public class StatsActivity extends BaseActivity {
     private TextView mOpenSocks;
     private TextView mDnsServer;
     private TextView mDnsQueries;
+    private TextView mDnsCache;
+    private TextView mIoScheduling;
+    private TextView mNativeMemory;
+    private TextView mActiveApps;
     private TableLayout mTable;
 
     @Override
@@ -74,6 +82,10 @@ public class StatsActivity extends BaseActivity {
         mMaxFd = findViewById(R.id.max_fd);
         mOpenSocks = findViewById(R.id.open_sockets);
         mDnsQueries = findViewById(R.id.dns_queries);
+        mDnsCache = findViewById(R.id.dns_cache);
+        mIoScheduling = findViewById(R.id.io_scheduling);
+        mNativeMemory = findViewById(R.id.native_memory);
+        mActiveApps = findViewById(R.id.active_apps);
         mDnsServer = findViewById(R.id.dns_server);
 
         mReceiver = new BroadcastReceiver() {
@@ -117,8 +129,34 @@ public class StatsActivity extends BaseActivity {
         mMaxFd.setText(Utils.formatNumber(this, stats.max_fd));
         mOpenSocks.setText(Utils.formatNumber(this, stats.num_open_sockets));
         mDnsQueries.setText(Utils.formatNumber(this, stats.num_dns_queries));
+
+        int dns_lookups = stats.dns_cache_hits + stats.dns_cache_misses;
+        mDnsCache.setText(getString(R.string.dns_cache_hits,
+                (dns_lookups > 0) ? (stats.dns_cache_hits * 100 / dns_lookups) : 0,
+                Utils.formatNumber(this, stats.dns_saved_ms),
+                Utils.formatNumber(this, stats.dns_coalesced)));
+        mIoScheduling.setText(getString(R.string.io_scheduling_counts,
+                Utils.formatNumber(this, stats.tun_pkts),
+                Utils.formatNumber(this, stats.sock_events),
+                Utils.formatNumber(this, stats.tun_full_batches)));
+        mNativeMemory.setText(Utils.formatBytes(stats.getMemUsage()) + " / " + Utils.formatBytes(stats.mem_budget));
         mDnsServer.setText(CaptureService.getDNSServer());
 
+        ConnectionsRegister reg = CaptureService.getConnsRegister();
+
+        if(reg != null) {
+            // The apps totals are aggregated natively, no need to walk the connections
+            List<AppStats> apps = reg.getAppsStats();
+            int active_apps = 0;
+
+            for(AppStats app: apps) {
+                if(app.active_connections > 0)
+                    active_apps++;
+            }
+
+            mActiveApps.setText(Utils.formatNumber(this, active_apps) + " / " + Utils.formatNumber(this, apps.size()));
+        }
+
         if(stats.num_dropped_conns > 0)
             mDroppedConns.setTextColor(Color.RED);
     }
@@ -56,6 +56,7 @@ import com.emanuelef.remote_capture.CaptureService;
 import com.emanuelef.remote_capture.model.AppState;
 import com.emanuelef.remote_capture.AppsResolver;
 import com.emanuelef.remote_capture.adapters.ConnectionsAdapter;
+import com.emanuelef.remote_capture.ConnectionsExporter;
 import com.emanuelef.remote_capture.ConnectionsRegister;
 import com.emanuelef.remote_capture.views.EmptyRecyclerView;
 import com.emanuelef.remote_capture.R;
@@ -483,8 +484,6 @@ public class ConnectionsFragment extends Fragment implements ConnectionsListener
         if(reg == null)
             return;
 
-        String dump = reg.dumpConnectionsCsv(requireContext(), mAdapter.getUidFilter());
-
         if(mCsvFname != null) {
             Log.d(TAG, "Writing CSV file: " + mCsvFname);
             boolean error = true;
@@ -493,7 +492,11 @@ public class ConnectionsFragment extends Fragment implements ConnectionsListener
                 OutputStream stream = requireActivity().getContentResolver().openOutputStream(mCsvFname);
 
                 if(stream != null) {
-                    stream.write(dump.getBytes());
+                    ConnectionsExporter exporter = new ConnectionsExporter(requireContext(),
+                            ConnectionsExporter.Format.CSV, mAdapter.getUidFilter());
+
+                    // rows are streamed to the file, the dump is never built in memory
+                    exporter.export(reg.getSnapshot(), stream);
                     stream.close();
                 }
 
@@ -0,0 +1,53 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+package com.emanuelef.remote_capture.model;
+
+/* The upstream shaping stats of an app. The queue delays are computed on all the sent packets,
+ * including the ones which were not queued. */
+public class AppShaperStats {
+    public final int uid;
+    public final int rate_kbps; // 0 if unlimited
+    public final int weight;
+    public final int backlog_pkts;
+    public final int backlog_bytes;
+    public final long sent_bytes;
+    public final int sent_pkts;
+    public final int queued_pkts; // sent after being queued
+    public final int dropped_pkts;
+    public final int avg_delay_ms;
+    public final int max_delay_ms;
+
+    /* Invoked by native code */
+    public AppShaperStats(int _uid, int _rate_kbps, int _weight, int _backlog_pkts, int _backlog_bytes,
+                          long _sent_bytes, int _sent_pkts, int _queued_pkts, int _dropped_pkts,
+                          int _avg_delay_ms, int _max_delay_ms) {
+        uid = _uid;
+        rate_kbps = _rate_kbps;
+        weight = _weight;
+        backlog_pkts = _backlog_pkts;
+        backlog_bytes = _backlog_bytes;
+        sent_bytes = _sent_bytes;
+        sent_pkts = _sent_pkts;
+        queued_pkts = _queued_pkts;
+        dropped_pkts = _dropped_pkts;
+        avg_delay_ms = _avg_delay_ms;
+        max_delay_ms = _max_delay_ms;
+    }
+}
@@ -22,9 +22,20 @@ package com.emanuelef.remote_capture.model;
 import androidx.annotation.NonNull;
 
 public class AppStats implements Cloneable {
+    /* The number of items of each app in the native apps stats dump, see app_stats.h */
+    public static final int NATIVE_FIELDS = 10;
+
     private final int uid;
     public long bytes;
     public int num_connections;
+    public long sent_bytes;
+    public long rcvd_bytes;
+    public int sent_pkts;
+    public int rcvd_pkts;
+    public int active_connections;
+    public long tcp_bytes;
+    public long udp_bytes;
+    public long other_bytes;
 
     public AppStats(int _uid) {
         uid = _uid;
@@ -32,6 +43,23 @@ public class AppStats implements Cloneable {
         num_connections = 0;
     }
 
+    public static AppStats fromNative(long[] data, int offset) {
+        AppStats stats = new AppStats((int) data[offset]);
+
+        stats.sent_bytes = data[offset + 1];
+        stats.rcvd_bytes = data[offset + 2];
+        stats.sent_pkts = (int) data[offset + 3];
+        stats.rcvd_pkts = (int) data[offset + 4];
+        stats.active_connections = (int) data[offset + 5];
+        stats.num_connections = (int) data[offset + 6];
+        stats.tcp_bytes = data[offset + 7];
+        stats.udp_bytes = data[offset + 8];
+        stats.other_bytes = data[offset + 9];
+        stats.bytes = stats.sent_bytes + stats.rcvd_bytes;
+
+        return stats;
+    }
+
     public int getUid() {
         return uid;
     }
@@ -41,6 +69,14 @@ public class AppStats implements Cloneable {
         AppStats rv = new AppStats(uid);
         rv.bytes = bytes;
         rv.num_connections = num_connections;
+        rv.sent_bytes = sent_bytes;
+        rv.rcvd_bytes = rcvd_bytes;
+        rv.sent_pkts = sent_pkts;
+        rv.rcvd_pkts = rcvd_pkts;
+        rv.active_connections = active_connections;
+        rv.tcp_bytes = tcp_bytes;
+        rv.udp_bytes = udp_bytes;
+        rv.other_bytes = other_bytes;
 
         return rv;
     }
@@ -61,6 +61,16 @@ public class ConnectionDescriptor implements Serializable {
     public int incr_id;
     public int status;
 
+    /* Upstream socket, TCP only */
+    public int rcvbuf;
+    public int sndbuf;
+    public int throughput_kbps;
+    public int rtt_us;
+    public int rttvar_us;
+    public int retrans;
+    public int cwnd;
+    public long delivery_rate; // bytes/s
+
     /* Invoked by native code
     * NOTE: interleaving String and int in the parameters is not good as it makes the app crash
     * nto the emulator! Better to put the strings first. */
@@ -91,6 +101,20 @@ public class ConnectionDescriptor implements Serializable {
         incr_id = _incr_id;
     }
 
+    /* Invoked by native code, with the buffer sizes of the upstream socket, as tuned for the
+     * achieved throughput, and its latest TCP_INFO sample */
+    public void setSocketData(int _rcvbuf, int _sndbuf, int _throughput_kbps, int _rtt_us,
+                              int _rttvar_us, int _retrans, int _cwnd, long _delivery_rate) {
+        rcvbuf = _rcvbuf;
+        sndbuf = _sndbuf;
+        throughput_kbps = _throughput_kbps;
+        rtt_us = _rtt_us;
+        rttvar_us = _rttvar_us;
+        retrans = _retrans;
+        cwnd = _cwnd;
+        delivery_rate = _delivery_rate;
+    }
+
     public String getStatusLabel(Context ctx) {
         int resid;
 
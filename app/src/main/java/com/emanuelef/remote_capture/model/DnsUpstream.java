@@ -0,0 +1,48 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+package com.emanuelef.remote_capture.model;
+
+/* The stats of an upstream server of the native DNS forwarder. The RTT percentiles are
+ * computed on the last 128 responses, 0 if not measured yet. */
+public class DnsUpstream {
+    public final String address;
+    public final boolean healthy;
+    public final int queries;
+    public final int responses;
+    public final int failures; // lost races and timeouts
+    public final int srtt_ms;
+    public final int rtt_p50_ms;
+    public final int rtt_p90_ms;
+    public final int rtt_p99_ms;
+
+    /* Invoked by native code */
+    public DnsUpstream(String _address, boolean _healthy, int _queries, int _responses, int _failures,
+                       int _srtt_ms, int _rtt_p50_ms, int _rtt_p90_ms, int _rtt_p99_ms) {
+        address = _address;
+        healthy = _healthy;
+        queries = _queries;
+        responses = _responses;
+        failures = _failures;
+        srtt_ms = _srtt_ms;
+        rtt_p50_ms = _rtt_p50_ms;
+        rtt_p90_ms = _rtt_p90_ms;
+        rtt_p99_ms = _rtt_p99_ms;
+    }
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+package com.emanuelef.remote_capture.model;
+
+/* A top talker, as reported by the native heavy hitters trackers. The bytes are an upper
+ * bound: the actual bytes are in the [bytes - error, bytes] range. */
+public class HeavyHitter {
+    public final String label;
+    public final int uid;
+    public final long bytes;
+    public final long error;
+
+    /* Invoked by native code */
+    public HeavyHitter(String _label, int _uid, long _bytes, long _error) {
+        label = _label;
+        uid = _uid;
+        bytes = _bytes;
+        error = _error;
+    }
+}
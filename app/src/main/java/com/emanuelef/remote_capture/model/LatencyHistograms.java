@@ -0,0 +1,79 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+package com.emanuelef.remote_capture.model;
+
+/* The connection setup latency histograms of an app or of a host. Each histogram has log2
+ * buckets: bucket 0 counts the latencies below 1 ms, bucket i the ones in [2^(i-1), 2^i) ms. */
+public class LatencyHistograms {
+    /* Must match lat_kind_t */
+    public static final int CONNECT = 0;    // client SYN -> upstream connected
+    public static final int HANDSHAKE = 1;  // client SYN -> first response payload
+    public static final int DNS = 2;        // first request -> first response
+    public static final int HTTP = 3;
+    public static final int TLS = 4;
+    public static final int NUM_KINDS = 5;
+    public static final int NUM_BUCKETS = 16;
+
+    public final String host; // null for the apps
+    public final int uid;     // UID_UNKNOWN for the hosts
+    private final int[] mCounts;
+    private final long[] mSumUs;
+
+    /* Invoked by native code */
+    public LatencyHistograms(String _host, int _uid, int[] _counts, long[] _sum_us) {
+        host = _host;
+        uid = _uid;
+        mCounts = _counts;
+        mSumUs = _sum_us;
+    }
+
+    public int getBucket(int kind, int bucket) {
+        return mCounts[kind * NUM_BUCKETS + bucket];
+    }
+
+    public int getCount(int kind) {
+        int count = 0;
+
+        for(int i = 0; i < NUM_BUCKETS; i++)
+            count += getBucket(kind, i);
+        return count;
+    }
+
+    public long getAvgUs(int kind) {
+        int count = getCount(kind);
+        return (count > 0) ? (mSumUs[kind] / count) : 0;
+    }
+
+    /* Returns the upper bound, in ms, of the bucket containing the percentile, -1 if there are
+     * no samples or it falls in the last (open) bucket */
+    public long getPercentileMs(int kind, int perc) {
+        long target = ((long)getCount(kind) * perc + 99) / 100;
+        long seen = 0;
+
+        for(int i = 0; (i < NUM_BUCKETS - 1) && (target > 0); i++) {
+            seen += getBucket(kind, i);
+
+            if(seen >= target)
+                return (1L << i);
+        }
+
+        return -1;
+    }
+}
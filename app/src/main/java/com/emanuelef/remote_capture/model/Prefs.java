@@ -40,6 +40,7 @@ public class Prefs {
     public static final String PREF_IPV6_ENABLED = "ipv6_enabled";
     public static final String PREF_APP_LANGUAGE = "app_language";
     public static final String PREF_APP_THEME = "app_theme";
+    public static final String PREF_APP_RATE_LIMITS = "app_rate_limits";
 
     public enum DumpMode {
         NONE,
@@ -69,5 +70,6 @@ public class Prefs {
     public static int getSocks5ProxyPort(SharedPreferences p)       { return(Integer.parseInt(p.getString(Prefs.PREF_SOCKS5_PROXY_PORT_KEY, "8080"))); }
     public static String getAppFilter(SharedPreferences p)       { return(p.getString(PREF_APP_FILTER, "")); }
     public static boolean getIPv6Enabled(SharedPreferences p)    { return(p.getBoolean(PREF_IPV6_ENABLED, false)); }
+    public static String getAppRateLimits(SharedPreferences p)   { return(p.getString(PREF_APP_RATE_LIMITS, "")); }
     public static boolean useEnglishLanguage(SharedPreferences p){ return("english".equals(p.getString(PREF_APP_LANGUAGE, "system")));}
 }
@@ -33,6 +33,29 @@ public class VPNStats implements Serializable {
     public int tot_conns;
     public int num_dns_queries;
 
+    /* Native memory usage, in bytes */
+    public long mem_conns;
+    public long mem_ndpi;
+    public long mem_hosts;
+    public long mem_buffers;
+    public long mem_store;
+    public long mem_series;
+    public long mem_budget;
+    public int dpi_evictions;
+    public int meta_evictions;
+
+    /* Native DNS cache */
+    public int dns_cache_hits;
+    public int dns_cache_misses;
+    public int dns_coalesced; // queries answered with the response of an identical in-flight query
+    public long dns_saved_ms; // upstream latency saved by the hits
+
+    /* Native event loop */
+    public long tun_pkts;       // packets read from the tun (upstream)
+    public long sock_events;    // ready sockets serviced (downstream)
+    public int tun_full_batches; // iterations which read the max tun packets before servicing the sockets
+    public int loop_iterations;
+
     /* Invoked by native code */
     public void setData(long _bytes_sent,  long _bytes_rcvd, int _pkts_sent, int _pkts_rcvd,
                         int _num_dropped_conns, int _num_open_sockets, int _max_fd,
@@ -48,4 +71,40 @@ public class VPNStats implements Serializable {
         tot_conns = _tot_conns;
         num_dns_queries = _num_dns_queries;
     }
+
+    /* Invoked by native code */
+    public void setMemData(long _mem_conns, long _mem_ndpi, long _mem_hosts, long _mem_buffers,
+                           long _mem_store, long _mem_series, long _mem_budget,
+                           int _dpi_evictions, int _meta_evictions) {
+        mem_conns = _mem_conns;
+        mem_ndpi = _mem_ndpi;
+        mem_hosts = _mem_hosts;
+        mem_buffers = _mem_buffers;
+        mem_store = _mem_store;
+        mem_series = _mem_series;
+        mem_budget = _mem_budget;
+        dpi_evictions = _dpi_evictions;
+        meta_evictions = _meta_evictions;
+    }
+
+    /* Invoked by native code */
+    public void setDnsCacheData(int _dns_cache_hits, int _dns_cache_misses, int _dns_coalesced,
+                                long _dns_saved_ms) {
+        dns_cache_hits = _dns_cache_hits;
+        dns_cache_misses = _dns_cache_misses;
+        dns_coalesced = _dns_coalesced;
+        dns_saved_ms = _dns_saved_ms;
+    }
+
+    /* Invoked by native code */
+    public void setSchedData(long _tun_pkts, long _sock_events, int _tun_full_batches, int _loop_iterations) {
+        tun_pkts = _tun_pkts;
+        sock_events = _sock_events;
+        tun_full_batches = _tun_full_batches;
+        loop_iterations = _loop_iterations;
+    }
+
+    public long getMemUsage() {
+        return(mem_conns + mem_ndpi + mem_hosts + mem_buffers + mem_store + mem_series);
+    }
 }
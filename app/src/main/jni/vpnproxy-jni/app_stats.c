@@ -0,0 +1,92 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include "app_stats.h"
+
+/* ******************************************************* */
+
+/* Returns the stats of the given uid, allocating them if necessary. Returns NULL on failure. */
+app_stats_t* apps_stats_get(apps_stats_t *apps, jint uid) {
+    app_stats_t *stats;
+
+    HASH_FIND_INT(apps->table, &uid, stats);
+
+    if(stats)
+        return(stats);
+
+    stats = calloc(1, sizeof(app_stats_t));
+
+    if(!stats)
+        return(NULL);
+
+    stats->uid = uid;
+    HASH_ADD_INT(apps->table, uid, stats);
+    apps->num_apps++;
+
+    return(stats);
+}
+
+/* ******************************************************* */
+
+/* Returns the stats of the given uid, or NULL if not found */
+app_stats_t* apps_stats_find(const apps_stats_t *apps, jint uid) {
+    app_stats_t *stats;
+
+    HASH_FIND_INT(apps->table, &uid, stats);
+    return(stats);
+}
+
+/* ******************************************************* */
+
+/* Serialize the stats into out, which must hold num_apps * APP_STATS_NUM_FIELDS items */
+void apps_stats_fill(const apps_stats_t *apps, jlong *out) {
+    app_stats_t *stats, *tmp;
+
+    HASH_ITER(hh, apps->table, stats, tmp) {
+        *out++ = stats->uid;
+        *out++ = stats->sent_bytes;
+        *out++ = stats->rcvd_bytes;
+        *out++ = stats->sent_pkts;
+        *out++ = stats->rcvd_pkts;
+        *out++ = stats->active_conns;
+        *out++ = stats->tot_conns;
+
+        for(int i = 0; i < APP_PROTO_MAX; i++)
+            *out++ = stats->proto_bytes[i];
+    }
+}
+
+/* ******************************************************* */
+
+void apps_stats_destroy(apps_stats_t *apps) {
+    app_stats_t *stats, *tmp;
+
+    HASH_ITER(hh, apps->table, stats, tmp) {
+        HASH_DELETE(hh, apps->table, stats);
+
+        if(stats->bw)
+            free(stats->bw);
+        if(stats->lat)
+            free(stats->lat);
+        free(stats);
+    }
+
+    apps->num_apps = 0;
+}
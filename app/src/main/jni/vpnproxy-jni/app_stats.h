@@ -0,0 +1,77 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __APP_STATS_H__
+#define __APP_STATS_H__
+
+#include <jni.h>
+#include <stdbool.h>
+#include <netinet/in.h>
+#include "third_party/uthash.h"
+#include "bandwidth.h"
+#include "latency.h"
+
+/* Per-protocol breakdown of the app traffic */
+typedef enum {
+    APP_PROTO_TCP = 0,
+    APP_PROTO_UDP,
+    APP_PROTO_OTHER,
+    APP_PROTO_MAX
+} app_proto_t;
+
+typedef struct app_stats {
+    jint uid;
+    jlong sent_bytes;
+    jlong rcvd_bytes;
+    jint sent_pkts;
+    jint rcvd_pkts;
+    jint active_conns;
+    jint tot_conns;
+    jlong proto_bytes[APP_PROTO_MAX];
+    bw_series_t *bw; /* NULL if not allocated, see the memory budget */
+    lat_hists_t *lat; /* NULL until the first latency sample */
+    UT_hash_handle hh;
+} app_stats_t;
+
+/* uid -> app_stats_t. Entries are never removed before apps_stats_destroy, so pointers to
+ * them can be cached in the connections. */
+typedef struct apps_stats {
+    app_stats_t *table;
+    int num_apps;
+    bool changed;
+} apps_stats_t;
+
+/* The number of jlong for each app in the apps_stats_fill output. Must match
+ * AppStats.NATIVE_FIELDS. */
+#define APP_STATS_NUM_FIELDS (7 + APP_PROTO_MAX)
+
+app_stats_t* apps_stats_get(apps_stats_t *apps, jint uid);
+app_stats_t* apps_stats_find(const apps_stats_t *apps, jint uid);
+void apps_stats_fill(const apps_stats_t *apps, jlong *out);
+void apps_stats_destroy(apps_stats_t *apps);
+
+static inline app_proto_t app_proto(int ipproto) {
+    switch(ipproto) {
+        case IPPROTO_TCP: return(APP_PROTO_TCP);
+        case IPPROTO_UDP: return(APP_PROTO_UDP);
+        default:          return(APP_PROTO_OTHER);
+    }
+}
+
+#endif // __APP_STATS_H__
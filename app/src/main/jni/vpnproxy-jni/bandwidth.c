@@ -0,0 +1,81 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <string.h>
+#include "bandwidth.h"
+
+/* ******************************************************* */
+
+/* Zero the slots in the (last, now] interval, at most the whole ring */
+#define ZERO_SLOTS(ring, num_slots, last, now) do {                 \
+    u_int32_t __n = ((now) - (last));                               \
+                                                                    \
+    if(__n >= (num_slots))                                          \
+        memset(ring, 0, sizeof(ring));                              \
+    else {                                                          \
+        for(u_int32_t __t = (last) + 1; __t <= (now); __t++)        \
+            memset(ring[__t % (num_slots)], 0, sizeof(ring[0]));    \
+    }                                                               \
+} while(0)
+
+/* Move the newest slot to now_sec. now_sec must be greater than bw->last_sec. */
+void bw_series_advance(bw_series_t *bw, u_int32_t now_sec) {
+    u_int32_t last_min = bw->last_sec / 60;
+    u_int32_t now_min = now_sec / 60;
+
+    ZERO_SLOTS(bw->sec_bytes, BW_SECS_SLOTS, bw->last_sec, now_sec);
+
+    if(now_min > last_min)
+        ZERO_SLOTS(bw->min_bytes, BW_MINS_SLOTS, last_min, now_min);
+
+    bw->last_sec = now_sec;
+}
+
+/* ******************************************************* */
+
+/* Fill out with the num_slots slots ending at now_sec, oldest first, as (sent, rcvd) pairs.
+ * out must hold 2 * num_slots items. The slots not covered by the ring are 0.
+ * Returns the number of slots filled, which is capped to the ring size. */
+int bw_series_get(const bw_series_t *bw, u_int32_t now_sec, bw_resolution_t res, int num_slots, jlong *out) {
+    bool secs = (res == BW_RES_SECONDS);
+    u_int32_t ring_slots = secs ? BW_SECS_SLOTS : BW_MINS_SLOTS;
+    u_int32_t now = secs ? now_sec : (now_sec / 60);
+    u_int32_t last = secs ? bw->last_sec : (bw->last_sec / 60);
+
+    if(num_slots > (int) ring_slots)
+        num_slots = ring_slots;
+
+    for(int i = 0; i < num_slots; i++) {
+        u_int32_t t = now - (num_slots - 1 - i);
+
+        if((t > last) || ((last - t) >= ring_slots)) {
+            /* not written yet, or overwritten */
+            *out++ = 0;
+            *out++ = 0;
+        } else if(secs) {
+            *out++ = bw->sec_bytes[t % BW_SECS_SLOTS][0];
+            *out++ = bw->sec_bytes[t % BW_SECS_SLOTS][1];
+        } else {
+            *out++ = (jlong) bw->min_bytes[t % BW_MINS_SLOTS][0];
+            *out++ = (jlong) bw->min_bytes[t % BW_MINS_SLOTS][1];
+        }
+    }
+
+    return(num_slots);
+}
@@ -0,0 +1,64 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __BANDWIDTH_H__
+#define __BANDWIDTH_H__
+
+#include <jni.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Fixed-size throughput time series. Each series holds two rings: one with a 1 second
+ * resolution, covering the last 10 minutes, and one with a 1 minute resolution, covering the
+ * last 24 hours. A ring slot is indexed by (time % slots), the slots between the newest slot
+ * and the current time are zeroed when the series advances, so an update is O(1) amortized.
+ */
+
+#define BW_SECS_SLOTS   600
+#define BW_MINS_SLOTS   1440
+
+/* Must match CaptureService.BW_RESOLUTION_* */
+typedef enum {
+    BW_RES_SECONDS = 0,
+    BW_RES_MINUTES,
+} bw_resolution_t;
+
+typedef struct bw_series {
+    u_int32_t last_sec; /* the time of the newest slot, in seconds */
+    u_int32_t sec_bytes[BW_SECS_SLOTS][2]; /* sent, rcvd */
+    u_int64_t min_bytes[BW_MINS_SLOTS][2];
+} bw_series_t;
+
+void bw_series_advance(bw_series_t *bw, u_int32_t now_sec);
+int bw_series_get(const bw_series_t *bw, u_int32_t now_sec, bw_resolution_t res, int num_slots, jlong *out);
+
+static inline void bw_series_add(bw_series_t *bw, u_int32_t now_sec, int size, bool sent) {
+    int dir = sent ? 0 : 1;
+
+    if(now_sec > bw->last_sec)
+        bw_series_advance(bw, now_sec);
+    else
+        now_sec = bw->last_sec; // the clock went back
+
+    bw->sec_bytes[now_sec % BW_SECS_SLOTS][dir] += size;
+    bw->min_bytes[(now_sec / 60) % BW_MINS_SLOTS][dir] += size;
+}
+
+#endif // __BANDWIDTH_H__
@@ -0,0 +1,150 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include "bench.h"
+
+/*
+ * Per-packet counter updates over uniformly random flows, with the counters in a heap allocated
+ * connection (the conn_data_t layout before the hot/cold split) and in a contiguous pool of
+ * compact records. Each heap connection is followed by an nDPI flow sized allocation, as in a
+ * real capture, so that the connections are spread in memory.
+ */
+
+#define NUM_PACKETS 20000000
+
+typedef struct {
+    u_int16_t master_protocol, app_protocol;
+    int category;
+} l7proto_t;
+
+/* The conn_data_t layout before the split */
+typedef struct {
+    int32_t incr_id;
+    void *ndpi_flow;
+    void *src_id, *dst_id;
+    l7proto_t l7proto;
+    int64_t first_seen;
+    int64_t last_seen;
+    int64_t sent_bytes;
+    int64_t rcvd_bytes;
+    int32_t sent_pkts;
+    int32_t rcvd_pkts;
+    int status;
+    char *info;
+    char *url;
+    int32_t uid;
+    bool pending_notification;
+} heap_conn_t;
+
+/* The hot record of the pool */
+typedef struct {
+    int64_t sent_bytes;
+    int64_t rcvd_bytes;
+    int64_t last_seen;
+    int32_t sent_pkts;
+    int32_t rcvd_pkts;
+    u_int8_t status;
+    u_int8_t flags;
+} pooled_conn_t;
+
+/* ******************************************************* */
+
+static void run(int num_conns, u_int32_t *seq) {
+    u_int64_t rng = 88172645463325252ULL;
+    heap_conn_t **conns = malloc(num_conns * sizeof(heap_conn_t*));
+    void **flows = malloc(num_conns * sizeof(void*));
+    pooled_conn_t *pool = calloc(num_conns, sizeof(pooled_conn_t));
+    double start, heap_ns, pool_ns;
+    int64_t now;
+
+    for(int i = 0; i < NUM_PACKETS; i++)
+        seq[i] = bench_rand(&rng) % num_conns;
+
+    for(int i = 0; i < num_conns; i++) {
+        conns[i] = calloc(1, sizeof(heap_conn_t));
+        flows[i] = calloc(1, 1000 + (bench_rand(&rng) % 400));
+        conns[i]->ndpi_flow = flows[i];
+    }
+
+    /* the previous code called time() per packet */
+    start = bench_now_ns();
+    for(int i = 0; i < NUM_PACKETS; i++) {
+        heap_conn_t *conn = conns[seq[i]];
+        int size = 60 + (i & 1023);
+
+        if(i & 1) {
+            conn->sent_pkts++;
+            conn->sent_bytes += size;
+        } else {
+            conn->rcvd_pkts++;
+            conn->rcvd_bytes += size;
+        }
+
+        conn->last_seen = time(NULL);
+        conn->status = 2;
+        conn->pending_notification = true;
+    }
+    heap_ns = bench_now_ns() - start;
+
+    start = bench_now_ns();
+    now = time(NULL);
+    for(int i = 0; i < NUM_PACKETS; i++) {
+        pooled_conn_t *conn = &pool[seq[i]];
+        int size = 60 + (i & 1023);
+
+        if(i & 1) {
+            conn->sent_pkts++;
+            conn->sent_bytes += size;
+        } else {
+            conn->rcvd_pkts++;
+            conn->rcvd_bytes += size;
+        }
+
+        conn->last_seen = now;
+        conn->status = 2;
+        conn->flags |= 1;
+    }
+    pool_ns = bench_now_ns() - start;
+
+    printf("%6d flows: heap %.1f ns/pkt (%zu B), pooled %.1f ns/pkt (%zu B)\n", num_conns,
+           heap_ns / NUM_PACKETS, sizeof(heap_conn_t), pool_ns / NUM_PACKETS, sizeof(pooled_conn_t));
+
+    for(int i = 0; i < num_conns; i++) {
+        free(conns[i]);
+        free(flows[i]);
+    }
+    free(conns);
+    free(flows);
+    free(pool);
+}
+
+/* ******************************************************* */
+
+int main() {
+    u_int32_t *seq = malloc(NUM_PACKETS * sizeof(u_int32_t));
+
+    run(10000, seq);
+    run(30000, seq);
+    run(100000, seq);
+
+    free(seq);
+    return(0);
+}
@@ -0,0 +1,159 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "bench.h"
+#include "vpnproxy.h"
+
+/*
+ * Counts the string allocations per connection, before and after the inline connection strings.
+ * Before, ip_lru_find returned a strdup'd copy of the cached host name, and each info/url update
+ * was a new heap copy. Now a conn_str_t only allocates the strings which do not fit inline.
+ * The allocation of conn_data_t itself, the same in both cases, is not counted.
+ */
+
+static int num_allocs;
+
+static char* counted_strndup(const char *s, size_t n) {
+    num_allocs++;
+    return(strndup(s, n));
+}
+
+/* ******************************************************* */
+
+/* The previous conn_set_str */
+static void old_set_str(char **field, const char *value) {
+    if(*field)
+        free(*field);
+
+    *field = value ? counted_strndup(value, CONN_STR_MAX_LEN) : NULL;
+}
+
+/* ******************************************************* */
+
+/* The same policy as conn_str_set in vpnproxy.c, without the memory accounting */
+static void new_set_str(conn_str_t *str, const char *value) {
+    size_t len = (value ? strnlen(value, CONN_STR_MAX_LEN) : 0);
+
+    if(str->heap) {
+        free(str->heap);
+        str->heap = NULL;
+    }
+
+    if(len < CONN_STR_INLINE_SIZE) {
+        memcpy(str->inl, value, len);
+        str->inl[len] = '\0';
+        return;
+    }
+
+    str->inl[0] = '\0';
+    str->heap = counted_strndup(value, len);
+}
+
+/* ******************************************************* */
+
+/* Host names commonly seen in Android captures */
+static const char *hosts[] = {
+    "www.google.com", "play.googleapis.com", "android.clients.google.com",
+    "connectivitycheck.gstatic.com", "firebaseinstallations.googleapis.com", "fcm.googleapis.com",
+    "mtalk.google.com", "i.ytimg.com", "rr3---sn-hpa7kn7s.googlevideo.com", "www.youtube.com",
+    "graph.facebook.com", "scontent.xx.fbcdn.net", "edge-chat.facebook.com",
+    "static.whatsapp.net", "mmg.whatsapp.net", "g.whatsapp.net", "api.twitter.com",
+    "pbs.twimg.com", "i.instagram.com", "scontent-mxp1-1.cdninstagram.com", "app-measurement.com",
+    "firebase-settings.crashlytics.com", "settings.crashlytics.com",
+    "pagead2.googlesyndication.com", "googleads.g.doubleclick.net", "www.googletagmanager.com",
+    "api.spotify.com", "audio-ak-spotify-com.akamaized.net", "spclient.wg.spotify.com",
+    "d3c33hcgiwev3.cloudfront.net", "s3.eu-west-1.amazonaws.com", "api.github.com",
+    "ocsp.pki.goog", "time.android.com", "dns.google", "update.googleapis.com",
+    "lh3.googleusercontent.com", "mobile.events.data.microsoft.com", "login.microsoftonline.com",
+    "outlook.office365.com", "api-prod.accounts.example-weather-provider-cdn.com",
+};
+
+static const char *urls[] = {
+    "/generate_204", "/favicon.ico", "/api/v1/config?platform=android&version=4.2.1&locale=en_US",
+    "/static/js/main.8f3a2c1b.chunk.js", "/gen_204?ved=0ahUKEwi&ei=abc123&bl=boq_gsa&s=web&t=aft",
+};
+
+#define NUM_HOSTS   ((int)(sizeof(hosts) / sizeof(*hosts)))
+#define NUM_URLS    ((int)(sizeof(urls) / sizeof(*urls)))
+
+typedef struct {
+    const char *name;
+    bool lru_hit;   /* the host name is set from the DNS cache on the connection start */
+    bool dpi_host;  /* nDPI then sets the host name, e.g. the TLS SNI */
+    bool dpi_url;   /* nDPI also sets the HTTP URL */
+} scenario_t;
+
+static const scenario_t scenarios[] = {
+    {"LRU hit, then the TLS SNI",           true,   true,   false},
+    {"LRU miss, then the TLS SNI",          false,  true,   false},
+    {"LRU hit, then the HTTP Host and URL", true,   true,   true},
+    {"DPI with an empty host name",         false,  false,  false},
+};
+
+/* ******************************************************* */
+
+int main() {
+    int hosts_inline = 0, urls_inline = 0;
+
+    for(int i = 0; i < NUM_HOSTS; i++)
+        hosts_inline += (strlen(hosts[i]) < CONN_STR_INLINE_SIZE);
+    for(int i = 0; i < NUM_URLS; i++)
+        urls_inline += (strlen(urls[i]) < CONN_STR_INLINE_SIZE);
+
+    printf("Inline strings: %d/%d host names, %d/%d URLs\n",
+           hosts_inline, NUM_HOSTS, urls_inline, NUM_URLS);
+
+    for(int s = 0; s < (int)(sizeof(scenarios) / sizeof(*scenarios)); s++) {
+        const scenario_t *sc = &scenarios[s];
+        int old_allocs = 0, new_allocs = 0;
+
+        for(int i = 0; i < NUM_HOSTS; i++) {
+            const char *url = urls[i % NUM_URLS];
+            char *old_info = NULL, *old_url = NULL;
+            conn_str_t new_info = {0}, new_url = {0};
+
+            num_allocs = 0;
+            if(sc->lru_hit)
+                old_info = counted_strndup(hosts[i], CONN_STR_MAX_LEN);
+            old_set_str(&old_info, sc->dpi_host ? hosts[i] : "");
+            if(sc->dpi_url)
+                old_set_str(&old_url, url);
+            old_allocs += num_allocs;
+            free(old_info);
+            free(old_url);
+
+            num_allocs = 0;
+            if(sc->lru_hit)
+                new_set_str(&new_info, hosts[i]);
+            new_set_str(&new_info, sc->dpi_host ? hosts[i] : "");
+            if(sc->dpi_url)
+                new_set_str(&new_url, url);
+            new_allocs += num_allocs;
+            free(new_info.heap);
+            free(new_url.heap);
+        }
+
+        printf("%-36s %.2f before, %.2f after (string allocations per connection)\n",
+               sc->name, (double)old_allocs / NUM_HOSTS, (double)new_allocs / NUM_HOSTS);
+    }
+
+    return(0);
+}
@@ -0,0 +1,256 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include "bench.h"
+#include "dns_forward.h"
+
+/*
+ * Receive throughput of the DNS forwarder, with and without UDP_GRO. A fake upstream on
+ * 127.0.0.1:53 (binding it needs root) answers each round of queries with one UDP_SEGMENT send
+ * per forwarder socket, as a burst of same-sized responses from a real upstream would arrive.
+ * Only dns_fwd_handle_fds is timed. The run without GRO makes the UDP_GRO probe of dns_fwd_init
+ * fail, so that the forwarder takes its fallback path as on a kernel before 5.0.
+ */
+
+#define NUM_ROUNDS          2000
+#define QUERIES_PER_ROUND   128
+#define CLIENT_PORT_BASE    1000
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+static bool fail_gro_probe;
+static int num_responses, num_mismatches;
+
+/* ******************************************************* */
+
+/* Overrides the libc setsockopt for the forwarder, to simulate a kernel without UDP_GRO */
+int setsockopt(int sock, int level, int name, const void *val, socklen_t len) {
+    static int (*libc_setsockopt)(int, int, int, const void*, socklen_t);
+
+    if(fail_gro_probe && (level == IPPROTO_UDP) && (name == UDP_GRO) && *(const int*)val)
+        return(-1);
+
+    if(!libc_setsockopt)
+        libc_setsockopt = dlsym(RTLD_NEXT, "setsockopt");
+
+    return(libc_setsockopt(sock, level, name, val, len));
+}
+
+/* ******************************************************* */
+
+static bool protect_socket(int sock, void *userdata) {
+    return(true);
+}
+
+/* ******************************************************* */
+
+static void on_response(const dns_fwd_client_t *client, u_int8_t *rsp, int rsp_len, void *userdata) {
+    u_int16_t txid = (rsp[0] << 8) | rsp[1];
+
+    num_responses++;
+    if(ntohs(client->port) - CLIENT_PORT_BASE != txid)
+        num_mismatches++;
+
+    /* the reply headers are built in place, as in send_dns_reply */
+    memset(rsp - 28, 0xAA, 28);
+}
+
+/* ******************************************************* */
+
+/* Builds an A query for h<id>.example.com, with txid id. All the queries have the same size. */
+static int build_query(u_int8_t *buf, int id) {
+    char name[32];
+    u_int8_t *p = buf + 12;
+    char *label = name;
+
+    snprintf(name, sizeof(name), "h%05d.example.com", id);
+    memset(buf, 0, 12);
+    buf[0] = id >> 8;
+    buf[1] = id;
+    buf[2] = 0x01; /* RD */
+    buf[5] = 1;    /* QDCOUNT */
+
+    while(*label) {
+        char *dot = strchr(label, '.');
+        int len = dot ? (dot - label) : strlen(label);
+
+        *p++ = len;
+        memcpy(p, label, len);
+        p += len;
+        label += len + (dot ? 1 : 0);
+    }
+
+    *p++ = 0;
+    *p++ = 0; *p++ = 1; /* QTYPE A */
+    *p++ = 0; *p++ = 1; /* QCLASS IN */
+    return(p - buf);
+}
+
+/* ******************************************************* */
+
+/* Answers the pending queries with a UDP_SEGMENT send per forwarder socket */
+static void answer_queries(int upstream, int num_queries) {
+    static u_int8_t groups[DNS_FWD_NUM_SOCKETS][65536];
+    struct sockaddr_in group_addr[DNS_FWD_NUM_SOCKETS];
+    int group_len[DNS_FWD_NUM_SOCKETS] = {0};
+    int num_groups = 0, seg_size = 0;
+
+    for(int i = 0; i < num_queries; i++) {
+        u_int8_t msg[512];
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int len = recvfrom(upstream, msg, sizeof(msg), 0, (struct sockaddr*)&from, &from_len);
+        int g;
+
+        if(len <= 0)
+            break;
+
+        msg[2] |= 0x80; /* QR */
+        seg_size = len;
+
+        for(g = 0; g < num_groups; g++) {
+            if(group_addr[g].sin_port == from.sin_port)
+                break;
+        }
+        if(g == num_groups)
+            group_addr[num_groups++] = from;
+
+        memcpy(groups[g] + group_len[g], msg, len);
+        group_len[g] += len;
+    }
+
+    for(int g = 0; g < num_groups; g++) {
+        char control[CMSG_SPACE(sizeof(u_int16_t))] = {0};
+        struct iovec iov = {groups[g], group_len[g]};
+        struct msghdr msg = {
+            .msg_name = &group_addr[g],
+            .msg_namelen = sizeof(group_addr[g]),
+            .msg_iov = &iov,
+            .msg_iovlen = 1,
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(u_int16_t));
+        *(u_int16_t*)CMSG_DATA(cmsg) = seg_size;
+
+        if(sendmsg(upstream, &msg, 0) < 0)
+            perror("sendmsg");
+    }
+}
+
+/* ******************************************************* */
+
+static int run(int upstream, bool gro) {
+    u_int32_t upstream_ip = htonl(INADDR_LOOPBACK);
+    const dns_fwd_stats_t *stats;
+    dns_fwd_t *fwd;
+    double elapsed = 0;
+    int total = 0;
+
+    fail_gro_probe = !gro;
+    num_responses = num_mismatches = 0;
+
+    if(!(fwd = dns_fwd_init(protect_socket, NULL))) {
+        fprintf(stderr, "dns_fwd_init failed\n");
+        return(-1);
+    }
+
+    dns_fwd_set_upstreams(fwd, &upstream_ip, 1, 0);
+
+    for(int r = 0; r < NUM_ROUNDS; r++) {
+        int before = num_responses;
+        double start;
+
+        for(int i = 0; i < QUERIES_PER_ROUND; i++) {
+            u_int8_t query[512];
+            dns_query_t q;
+            int len = build_query(query, i);
+
+            dns_parse_query(query, len, &q);
+            dns_fwd_query(fwd, &q, query, len, htonl(0x0a000001), htons(CLIENT_PORT_BASE + i), 1000);
+        }
+
+        answer_queries(upstream, QUERIES_PER_ROUND);
+        usleep(2000);
+
+        start = bench_now_ns();
+        while(num_responses - before < QUERIES_PER_ROUND) {
+            fd_set fds;
+            int max_fd = 0;
+
+            FD_ZERO(&fds);
+            dns_fwd_fds(fwd, &max_fd, &fds);
+            dns_fwd_handle_fds(fwd, &fds, 1010, on_response, NULL);
+        }
+        elapsed += bench_now_ns() - start;
+        total += QUERIES_PER_ROUND;
+    }
+
+    stats = dns_fwd_get_stats(fwd);
+    printf("GRO %s: %.0f kpps (%.0f ns/response), %u answered, %u dropped, %d mismatching, "
+           "%u coalesced, %zu B\n", stats->gro ? "enabled" : "disabled",
+           total / (elapsed / 1e9) / 1000, elapsed / total, stats->answered, stats->dropped,
+           num_mismatches, stats->gro_segments, dns_fwd_mem_usage(fwd));
+
+    dns_fwd_destroy(fwd);
+    return(0);
+}
+
+/* ******************************************************* */
+
+int main() {
+    struct sockaddr_in addr = {
+        .sin_family = AF_INET,
+        .sin_port = htons(53),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    int rcvbuf = 8 << 20;
+    int upstream = socket(AF_INET, SOCK_DGRAM, 0);
+    int rv;
+
+    setsockopt(upstream, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    if(bind(upstream, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        perror("bind 127.0.0.1:53");
+        return(1);
+    }
+
+    rv = run(upstream, true) | run(upstream, false);
+
+    close(upstream);
+    return(rv ? 1 : 0);
+}
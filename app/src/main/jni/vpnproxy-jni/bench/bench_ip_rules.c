@@ -0,0 +1,214 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "bench.h"
+#include "ip_rules.h"
+
+/*
+ * Builds 1M random prefixes per IP version and runs 10M lookups of random addresses. The lookups
+ * are first cross-checked against a brute-force matcher on random nested sets, both below and
+ * above the size which builds the buckets index.
+ */
+
+#define NUM_PREFIXES    1000000
+#define NUM_LOOKUPS     10000000
+#define NUM_ADDRESSES   65536
+#define CHECK_ROUNDS    40
+#define CHECK_LOOKUPS   4000
+
+typedef struct {
+    u_int8_t addr[16];
+    int prefix_len;
+    u_int8_t actions;
+    int tag;
+} check_rule_t;
+
+static u_int64_t rng = 88172645463325252ULL;
+
+/* ******************************************************* */
+
+static bool rule_contains(const check_rule_t *rule, const u_int8_t *addr) {
+    for(int b = 0; b < rule->prefix_len; b++) {
+        if(((addr[b / 8] ^ rule->addr[b / 8]) >> (7 - b % 8)) & 1)
+            return(false);
+    }
+
+    return(true);
+}
+
+/* ******************************************************* */
+
+static void format_rule(const check_rule_t *rule, int ipver, char *buf, size_t size) {
+    inet_ntop((ipver == 4) ? AF_INET : AF_INET6, rule->addr, buf, size);
+    snprintf(buf + strlen(buf), size - strlen(buf), "/%d", rule->prefix_len);
+}
+
+/* ******************************************************* */
+
+/* Returns the number of mismatches */
+static int check_round(int ipver, int num_rules) {
+    int addr_len = (ipver == 4) ? 4 : 16, max_len = (ipver == 4) ? 32 : 128;
+    check_rule_t *rules = calloc(num_rules, sizeof(check_rule_t));
+    ip_rules_t *ip_rules = ip_rules_init();
+    int mismatches = 0;
+
+    for(int i = 0; i < num_rules; i++) {
+        check_rule_t *rule = &rules[i];
+        char cidr[64], tag[8];
+
+        /* few distinct leading bytes, so that the prefixes nest */
+        for(int j = 0; j < addr_len; j++)
+            rule->addr[j] = (j < 2) ? (bench_rand(&rng) % 3) : bench_rand(&rng);
+
+        rule->prefix_len = (bench_rand(&rng) % 4) ? (8 + bench_rand(&rng) % (max_len - 7)) :
+                (bench_rand(&rng) % (max_len + 1));
+
+        for(int b = rule->prefix_len; b < max_len; b++)
+            rule->addr[b / 8] &= ~(0x80 >> (b % 8));
+
+        rule->actions = 1 << (bench_rand(&rng) % 3);
+        rule->tag = (bench_rand(&rng) % 3) ? 0 : (1 + bench_rand(&rng) % 5);
+
+        format_rule(rule, ipver, cidr, sizeof(cidr));
+        snprintf(tag, sizeof(tag), "t%d", rule->tag);
+        ip_rules_add(ip_rules, cidr, rule->actions, rule->tag ? tag : NULL);
+    }
+
+    ip_rules_build(ip_rules);
+
+    for(int n = 0; n < CHECK_LOOKUPS; n++) {
+        u_int8_t addr[16] = {0};
+        u_int8_t actions = 0;
+        int tag = 0, tag_len = -1;
+        bool found = false, matched;
+        ip_rule_match_t match = {0};
+        const char *tag_name;
+
+        if(bench_rand(&rng) % 2) {
+            memcpy(addr, rules[bench_rand(&rng) % num_rules].addr, addr_len);
+            addr[addr_len - 1] ^= bench_rand(&rng) & 3;
+        } else {
+            for(int j = 0; j < addr_len; j++)
+                addr[j] = (j < 2) ? (bench_rand(&rng) % 3) : bench_rand(&rng);
+        }
+
+        /* the actions of all the containing prefixes, the tag of the most specific tagged one */
+        for(int i = 0; i < num_rules; i++) {
+            if(rule_contains(&rules[i], addr)) {
+                found = true;
+                actions |= rules[i].actions;
+
+                if(rules[i].tag && (rules[i].prefix_len >= tag_len)) {
+                    tag_len = rules[i].prefix_len;
+                    tag = rules[i].tag;
+                }
+            }
+        }
+
+        matched = ip_rules_lookup(ip_rules, ipver, (const zdtun_ip_t*)addr, &match);
+        tag_name = matched ? ip_rules_tag_name(ip_rules, match.tag) : NULL;
+
+        if((matched != found) ||
+           (found && ((match.actions != actions) || ((tag_name ? atoi(tag_name + 1) : 0) != tag))))
+            mismatches++;
+    }
+
+    ip_rules_destroy(ip_rules);
+    free(rules);
+    return(mismatches);
+}
+
+/* ******************************************************* */
+
+static void run(int ipver) {
+    ip_rules_t *rules = ip_rules_init();
+    zdtun_ip_t *addrs = calloc(NUM_ADDRESSES, sizeof(zdtun_ip_t));
+    double start, build_ns, lookup_ns;
+    u_int32_t hits = 0;
+    char cidr[64];
+
+    for(int i = 0; i < NUM_PREFIXES; i++) {
+        u_int32_t r = bench_rand(&rng);
+
+        if(ipver == 4)
+            snprintf(cidr, sizeof(cidr), "%u.%u.%u.%u/%d", r >> 24, (r >> 16) & 0xFF,
+                     (r >> 8) & 0xFF, r & 0xFF, (int)(8 + bench_rand(&rng) % 25));
+        else
+            snprintf(cidr, sizeof(cidr), "2001:%x:%x:%x::/%d", r & 0xFFFF, r >> 16,
+                     (u_int32_t)(bench_rand(&rng) & 0xFFFF), (int)(32 + bench_rand(&rng) % 33));
+
+        ip_rules_add(rules, cidr, (i & 1) ? IP_RULE_BLOCK : IP_RULE_NO_DPI, NULL);
+    }
+
+    start = bench_now_ns();
+    ip_rules_build(rules);
+    build_ns = bench_now_ns() - start;
+
+    for(int i = 0; i < NUM_ADDRESSES; i++) {
+        if(ipver == 4)
+            addrs[i].ip4 = bench_rand(&rng);
+        else {
+            u_int16_t *words = (u_int16_t*)&addrs[i];
+            u_int64_t r = bench_rand(&rng);
+
+            words[0] = htons(0x2001);
+            for(int w = 1; w <= 4; w++)
+                words[w] = r >> (16 * (w - 1));
+        }
+    }
+
+    start = bench_now_ns();
+    for(int i = 0; i < NUM_LOOKUPS; i++) {
+        ip_rule_match_t match;
+
+        hits += ip_rules_lookup(rules, ipver, &addrs[i % NUM_ADDRESSES], &match);
+    }
+    lookup_ns = (bench_now_ns() - start) / NUM_LOOKUPS;
+
+    printf("IPv%d: %d distinct prefixes, build %.2f s, %.1f MB, %.1f ns/lookup (%u hits)\n",
+           ipver, ip_rules_size(rules), build_ns / 1e9, ip_rules_mem_usage(rules) / 1048576.0,
+           lookup_ns, hits);
+
+    ip_rules_destroy(rules);
+    free(addrs);
+}
+
+/* ******************************************************* */
+
+int main() {
+    int mismatches = 0;
+
+    for(int round = 0; round < CHECK_ROUNDS; round++) {
+        int ipver = (round & 1) ? 6 : 4;
+        int num_rules = (round < CHECK_ROUNDS / 2) ? (50 + bench_rand(&rng) % 3000) :
+                (5000 + bench_rand(&rng) % 5000);
+
+        mismatches += check_round(ipver, num_rules);
+    }
+
+    printf("Cross-check: %d mismatches in %d lookups\n", mismatches, CHECK_ROUNDS * CHECK_LOOKUPS);
+
+    run(4);
+    run(6);
+
+    return(mismatches != 0);
+}
@@ -0,0 +1,177 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "bench.h"
+#include "bandwidth.h"
+#include "heavy_hitters.h"
+
+/*
+ * The bandwidth series and heavy hitters updates of account_packet, under the stats lock on
+ * every packet and batched as in queue_pending_traffic/publish_pending_traffic. The packets come
+ * in bursts of the same connection, as a read batch of a flow. A reader can take the lock every
+ * 1 ms, as the JNI getters do.
+ */
+
+#define NUM_PACKETS     20000000
+#define NUM_CONNS       10000
+#define BURST_PACKETS   8
+#define PACKET_SIZE     1400
+#define MAX_PENDING     256
+
+typedef struct {
+    u_int64_t key;
+    u_int32_t now_sec;
+    u_int32_t size;
+    bool sent;
+} pending_t;
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static volatile bool stop_reader;
+static bw_series_t bw;
+static hh_tracker_t *top;
+static u_int64_t keys[NUM_CONNS];
+
+/* ******************************************************* */
+
+static void* reader_thread(void *arg) {
+    jlong out[240];
+    struct timespec ts = {0, 1000000};
+
+    while(!stop_reader) {
+        pthread_mutex_lock(&stats_mutex);
+        bw_series_get(&bw, bw.last_sec, BW_RES_SECONDS, 60, out);
+        pthread_mutex_unlock(&stats_mutex);
+
+        nanosleep(&ts, NULL);
+    }
+
+    return(NULL);
+}
+
+/* ******************************************************* */
+
+static inline int packet_conn(int i) {
+    return(((i / BURST_PACKETS) * 7919) % NUM_CONNS);
+}
+
+static inline bool packet_sent(int i, bool alternate) {
+    return(alternate ? (i & 1) : ((i / BURST_PACKETS) & 1));
+}
+
+/* ******************************************************* */
+
+static double run_locked(bool alternate) {
+    double start = bench_now_ns();
+
+    for(int i = 0; i < NUM_PACKETS; i++) {
+        u_int32_t now_sec = 1000 + i / 1000000;
+
+        pthread_mutex_lock(&stats_mutex);
+        bw_series_add(&bw, now_sec, PACKET_SIZE, packet_sent(i, alternate));
+        hh_tracker_add(top, keys[packet_conn(i)], PACKET_SIZE, -1);
+        pthread_mutex_unlock(&stats_mutex);
+    }
+
+    return((bench_now_ns() - start) / NUM_PACKETS);
+}
+
+/* ******************************************************* */
+
+static void publish(pending_t *pending, int num_pending) {
+    pthread_mutex_lock(&stats_mutex);
+
+    for(int i = 0; i < num_pending; i++) {
+        bw_series_add(&bw, pending[i].now_sec, pending[i].size, pending[i].sent);
+        hh_tracker_add(top, pending[i].key, pending[i].size, -1);
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/* ******************************************************* */
+
+static double run_batched(bool alternate) {
+    static pending_t pending[MAX_PENDING];
+    int num_pending = 0;
+    double start = bench_now_ns();
+
+    for(int i = 0; i < NUM_PACKETS; i++) {
+        u_int64_t key = keys[packet_conn(i)];
+        u_int32_t now_sec = 1000 + i / 1000000;
+        bool sent = packet_sent(i, alternate);
+
+        if(num_pending > 0) {
+            pending_t *item = &pending[num_pending - 1];
+
+            if((item->key == key) && (item->now_sec == now_sec) && (item->sent == sent)) {
+                item->size += PACKET_SIZE;
+                continue;
+            }
+        }
+
+        if(num_pending == MAX_PENDING) {
+            publish(pending, num_pending);
+            num_pending = 0;
+        }
+
+        pending[num_pending++] = (pending_t) {key, now_sec, PACKET_SIZE, sent};
+    }
+
+    publish(pending, num_pending);
+    return((bench_now_ns() - start) / NUM_PACKETS);
+}
+
+/* ******************************************************* */
+
+static void run(const char *name, bool with_reader, bool alternate) {
+    pthread_t reader;
+    double locked_ns, batched_ns;
+
+    stop_reader = false;
+    if(with_reader)
+        pthread_create(&reader, NULL, reader_thread, NULL);
+
+    locked_ns = run_locked(alternate);
+    batched_ns = run_batched(alternate);
+
+    stop_reader = true;
+    if(with_reader)
+        pthread_join(reader, NULL);
+
+    printf("%-40s per-packet lock %.1f ns/pkt, batched %.1f ns/pkt\n", name, locked_ns, batched_ns);
+}
+
+/* ******************************************************* */
+
+int main() {
+    top = hh_tracker_init(256);
+
+    for(int i = 0; i < NUM_CONNS; i++)
+        keys[i] = hh_hash(&i, sizeof(i), 0);
+
+    run("Uncontended", false, false);
+    run("With a reader", true, false);
+    run("Direction alternating on each packet", false, true);
+
+    hh_tracker_destroy(top);
+    return(0);
+}
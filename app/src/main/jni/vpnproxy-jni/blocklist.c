@@ -0,0 +1,455 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <android/log.h>
+#include "blocklist.h"
+#include "jni_helpers.h"
+#include "third_party/uthash.h"
+
+#define BLOCKLIST_MAGIC     0x5044424c /* PDBL */
+#define BLOCKLIST_VERSION   1
+#define MAX_DOMAIN_LEN      (BLOCKLIST_DOMAIN_SIZE - 1)
+
+#define FNV64_OFFSET        0xcbf29ce484222325ULL
+#define FNV64_PRIME         0x100000001b3ULL
+
+typedef struct blocklist_header {
+    u_int32_t magic;
+    u_int32_t version;
+    u_int32_t num_rules;
+    u_int32_t num_slots;     /* power of 2 */
+    u_int32_t strings_size;
+    u_int32_t reserved;
+} blocklist_header_t;
+
+typedef struct blocklist_slot {
+    u_int64_t hash;          /* 0 if empty */
+    u_int32_t domain_ofs;    /* in the strings area */
+    u_int32_t domain_len;
+} blocklist_slot_t;
+
+/* The rules which matched at least once */
+typedef struct rule_hits {
+    int rule;
+    u_int32_t hits;
+    UT_hash_handle hh;
+} rule_hits_t;
+
+struct blocklist {
+    void *map;
+    size_t map_size;
+    const blocklist_header_t *hdr;
+    const blocklist_slot_t *slots;
+    const char *strings;
+    rule_hits_t *hits;
+    u_int32_t num_hit_rules;
+    u_int32_t total_hits;
+};
+
+/* ******************************************************* */
+
+static inline u_int64_t hash_step(u_int64_t h, char c) {
+    return((h ^ (u_int8_t) tolower((unsigned char) c)) * FNV64_PRIME);
+}
+
+/* 0 marks the empty slots */
+static inline u_int64_t slot_hash(u_int64_t h) {
+    return(h ? h : 1);
+}
+
+/* ******************************************************* */
+
+/* Hash a domain right to left, the same way as blocklist_match */
+static u_int64_t domain_hash(const char *domain, int len) {
+    u_int64_t h = FNV64_OFFSET;
+
+    for(int i = len - 1; i >= 0; i--)
+        h = hash_step(h, domain[i]);
+
+    return(slot_hash(h));
+}
+
+/* ******************************************************* */
+
+/* Returns the slot of the domain, or of the empty slot where it should be inserted */
+static u_int32_t find_slot(const blocklist_slot_t *slots, u_int32_t num_slots, const char *strings,
+                           u_int64_t hash, const char *domain, int len) {
+    u_int32_t mask = num_slots - 1;
+    u_int32_t i = hash & mask;
+
+    while(slots[i].hash != 0) {
+        if((slots[i].hash == hash) && (slots[i].domain_len == len) &&
+           (strncasecmp(strings + slots[i].domain_ofs, domain, len) == 0))
+            break;
+
+        i = (i + 1) & mask;
+    }
+
+    return(i);
+}
+
+/* ******************************************************* */
+
+/* Extract the domain of a line, lowercase. Returns its length, 0 if the line has no domain. */
+static int parse_line(char *line, char **domain) {
+    char *tok, *saveptr;
+    char *last = NULL;
+    int len;
+
+    if((tok = strchr(line, '#')))
+        *tok = '\0';
+
+    /* hosts format: the domain is the last token */
+    for(tok = strtok_r(line, " \t\r\n", &saveptr); tok; tok = strtok_r(NULL, " \t\r\n", &saveptr))
+        last = tok;
+
+    if(!last)
+        return(0);
+
+    if(strncmp(last, "*.", 2) == 0)
+        last += 2;
+
+    len = strlen(last);
+    if((len > 0) && (last[len - 1] == '.'))
+        last[--len] = '\0';
+
+    if((len == 0) || (len > MAX_DOMAIN_LEN) || !strchr(last, '.'))
+        return(0); /* also skips "localhost" and the like */
+
+    for(int i = 0; i < len; i++)
+        last[i] = tolower((unsigned char) last[i]);
+
+    *domain = last;
+    return(len);
+}
+
+/* ******************************************************* */
+
+/* Compile the text blocklist at path into bin_path. Returns 0 on success. */
+static int blocklist_compile(const char *path, const char *bin_path) {
+    blocklist_header_t hdr = {0};
+    blocklist_slot_t *slots = NULL;
+    char *strings = NULL;
+    u_int32_t strings_size = 0, strings_capacity = 0;
+    u_int32_t num_slots = 1024;
+    char *line = NULL;
+    size_t line_size = 0;
+    char tmp_path[PATH_MAX];
+    FILE *in, *out = NULL;
+    int rv = -1;
+
+    if(!(in = fopen(path, "r")))
+        return(-1);
+
+    if(!(slots = calloc(num_slots, sizeof(blocklist_slot_t))))
+        goto out;
+
+    while(getline(&line, &line_size, in) > 0) {
+        char *domain;
+        int len = parse_line(line, &domain);
+        u_int64_t hash;
+        u_int32_t slot;
+
+        if(len == 0)
+            continue;
+
+        /* keep the load factor under 50% */
+        if((hdr.num_rules + 1) * 2 > num_slots) {
+            u_int32_t new_slots = num_slots * 2;
+            blocklist_slot_t *grown = calloc(new_slots, sizeof(blocklist_slot_t));
+
+            if(!grown)
+                goto out;
+
+            for(u_int32_t i = 0; i < num_slots; i++) {
+                if(slots[i].hash != 0) {
+                    u_int32_t j = slots[i].hash & (new_slots - 1);
+
+                    while(grown[j].hash != 0)
+                        j = (j + 1) & (new_slots - 1);
+                    grown[j] = slots[i];
+                }
+            }
+
+            free(slots);
+            slots = grown;
+            num_slots = new_slots;
+        }
+
+        hash = domain_hash(domain, len);
+        slot = find_slot(slots, num_slots, strings, hash, domain, len);
+
+        if(slots[slot].hash != 0)
+            continue; /* duplicate */
+
+        if((strings_size + len) > strings_capacity) {
+            u_int32_t new_capacity = strings_capacity ? (strings_capacity * 2) : 65536;
+            char *grown = realloc(strings, new_capacity);
+
+            if(!grown)
+                goto out;
+
+            strings = grown;
+            strings_capacity = new_capacity;
+        }
+
+        memcpy(strings + strings_size, domain, len);
+        slots[slot].hash = hash;
+        slots[slot].domain_ofs = strings_size;
+        slots[slot].domain_len = len;
+        strings_size += len;
+        hdr.num_rules++;
+    }
+
+    hdr.magic = BLOCKLIST_MAGIC;
+    hdr.version = BLOCKLIST_VERSION;
+    hdr.num_slots = num_slots;
+    hdr.strings_size = strings_size;
+
+    /* Write to a temporary file, so that a partial file is never loaded */
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", bin_path);
+
+    if(!(out = fopen(tmp_path, "w")))
+        goto out;
+
+    if((fwrite(&hdr, sizeof(hdr), 1, out) != 1) ||
+       (fwrite(slots, sizeof(blocklist_slot_t), num_slots, out) != num_slots) ||
+       (strings_size && (fwrite(strings, strings_size, 1, out) != 1))) {
+        fclose(out);
+        unlink(tmp_path);
+        goto out;
+    }
+
+    if((fclose(out) == 0) && (rename(tmp_path, bin_path) == 0)) {
+        log_android(ANDROID_LOG_INFO, "Blocklist compiled: %u domains", hdr.num_rules);
+        rv = 0;
+    }
+
+out:
+    if(rv != 0)
+        log_android(ANDROID_LOG_ERROR, "Blocklist compilation failed[%d]: %s", errno, strerror(errno));
+
+    fclose(in);
+    if(line)
+        free(line);
+    if(slots)
+        free(slots);
+    if(strings)
+        free(strings);
+
+    return(rv);
+}
+
+/* ******************************************************* */
+
+static int blocklist_map(blocklist_t *bl, const char *bin_path) {
+    struct stat st;
+    int fd = open(bin_path, O_RDONLY);
+
+    if(fd < 0)
+        return(-1);
+
+    if((fstat(fd, &st) != 0) || (st.st_size < sizeof(blocklist_header_t))) {
+        close(fd);
+        return(-1);
+    }
+
+    bl->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if(bl->map == MAP_FAILED) {
+        bl->map = NULL;
+        return(-1);
+    }
+
+    bl->map_size = st.st_size;
+    bl->hdr = (const blocklist_header_t*) bl->map;
+    bl->slots = (const blocklist_slot_t*) (bl->hdr + 1);
+    bl->strings = (const char*) (bl->slots + bl->hdr->num_slots);
+
+    if((bl->hdr->magic != BLOCKLIST_MAGIC) || (bl->hdr->version != BLOCKLIST_VERSION) ||
+       (bl->hdr->num_slots == 0) || (bl->hdr->num_slots & (bl->hdr->num_slots - 1)) ||
+       (bl->map_size != (sizeof(blocklist_header_t) + (size_t) bl->hdr->num_slots * sizeof(blocklist_slot_t)
+                         + bl->hdr->strings_size))) {
+        munmap(bl->map, bl->map_size);
+        bl->map = NULL;
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Load the blocklist at path, compiling it if needed. Returns NULL if the file does not exist
+ * or on error. */
+blocklist_t* blocklist_open(const char *path) {
+    char bin_path[PATH_MAX];
+    struct stat st, bin_st;
+    blocklist_t *bl;
+
+    if(stat(path, &st) != 0)
+        return(NULL);
+
+    snprintf(bin_path, sizeof(bin_path), "%s.bin", path);
+
+    if(!(bl = calloc(1, sizeof(blocklist_t))))
+        return(NULL);
+
+    if((stat(bin_path, &bin_st) != 0) || (bin_st.st_mtime < st.st_mtime) || (blocklist_map(bl, bin_path) != 0)) {
+        if((blocklist_compile(path, bin_path) != 0) || (blocklist_map(bl, bin_path) != 0)) {
+            free(bl);
+            return(NULL);
+        }
+    }
+
+    return(bl);
+}
+
+/* ******************************************************* */
+
+void blocklist_close(blocklist_t *bl) {
+    rule_hits_t *entry, *tmp;
+
+    HASH_ITER(hh, bl->hits, entry, tmp) {
+        HASH_DELETE(hh, bl->hits, entry);
+        free(entry);
+    }
+
+    munmap(bl->map, bl->map_size);
+    free(bl);
+}
+
+/* ******************************************************* */
+
+/* Match a domain name, or any of its parent domains, against the blocklist. Returns the
+ * matching rule, or -1 if the name is not blocked. */
+int blocklist_match(blocklist_t *bl, const char *name) {
+    int len = strlen(name);
+    u_int64_t h = FNV64_OFFSET;
+
+    if((len > 0) && (name[len - 1] == '.'))
+        len--;
+
+    if((len == 0) || (len > MAX_DOMAIN_LEN))
+        return(-1);
+
+    for(int i = len - 1; i >= 0; i--) {
+        h = hash_step(h, name[i]);
+
+        /* a label boundary: look up the suffix */
+        if((i == 0) || (name[i - 1] == '.')) {
+            u_int64_t hash = slot_hash(h);
+            u_int32_t slot = find_slot(bl->slots, bl->hdr->num_slots, bl->strings, hash, name + i, len - i);
+
+            if(bl->slots[slot].hash != 0)
+                return(slot);
+        }
+    }
+
+    return(-1);
+}
+
+/* ******************************************************* */
+
+void blocklist_hit(blocklist_t *bl, int rule) {
+    rule_hits_t *entry;
+
+    bl->total_hits++;
+    HASH_FIND_INT(bl->hits, &rule, entry);
+
+    if(!entry) {
+        if(!(entry = malloc(sizeof(rule_hits_t))))
+            return;
+
+        entry->rule = rule;
+        entry->hits = 0;
+        HASH_ADD_INT(bl->hits, rule, entry);
+        bl->num_hit_rules++;
+    }
+
+    entry->hits++;
+}
+
+/* ******************************************************* */
+
+static int cmp_hits(const void *a, const void *b) {
+    u_int32_t ha = ((const blocklist_hit_t*) a)->hits;
+    u_int32_t hb = ((const blocklist_hit_t*) b)->hits;
+
+    return((ha < hb) ? 1 : ((ha > hb) ? -1 : 0));
+}
+
+/* ******************************************************* */
+
+/* Get up to k rules with the most hits, sorted by hits. Returns the number of rules. */
+int blocklist_top_hits(blocklist_t *bl, blocklist_hit_t *out, int k) {
+    blocklist_hit_t *all;
+    rule_hits_t *entry, *tmp;
+    int num = 0;
+
+    if((bl->num_hit_rules == 0) || !(all = malloc(bl->num_hit_rules * sizeof(blocklist_hit_t))))
+        return(0);
+
+    HASH_ITER(hh, bl->hits, entry, tmp) {
+        const blocklist_slot_t *slot = &bl->slots[entry->rule];
+
+        all[num].domain = bl->strings + slot->domain_ofs;
+        all[num].domain_len = slot->domain_len;
+        all[num].hits = entry->hits;
+        num++;
+    }
+
+    qsort(all, num, sizeof(blocklist_hit_t), cmp_hits);
+
+    num = (num < k) ? num : k;
+    memcpy(out, all, num * sizeof(blocklist_hit_t));
+    free(all);
+
+    return(num);
+}
+
+/* ******************************************************* */
+
+u_int32_t blocklist_size(blocklist_t *bl) {
+    return(bl->hdr->num_rules);
+}
+
+/* ******************************************************* */
+
+u_int32_t blocklist_total_hits(blocklist_t *bl) {
+    return(bl->total_hits);
+}
+
+/* ******************************************************* */
+
+/* The heap memory usage. The compiled list is file-backed and excluded. */
+size_t blocklist_mem_usage(blocklist_t *bl) {
+    return(sizeof(blocklist_t) + bl->num_hit_rules * sizeof(rule_hits_t));
+}
@@ -0,0 +1,53 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __BLOCKLIST_H__
+#define __BLOCKLIST_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A domains blocklist, loaded from a text file with one domain per line (the hosts file format
+ * is also accepted). A domain also matches its subdomains. The list is compiled into
+ * <path>.bin, which is rebuilt when the text file changes, and memory-mapped. The compiled
+ * file is an open addressing hash table of the domains, hashed right to left, so that all the
+ * parent domains of a name are looked up in a single pass over it.
+ */
+
+#define BLOCKLIST_DOMAIN_SIZE   254 /* max domain length + 1 */
+
+typedef struct blocklist_hit {
+    const char *domain; /* owned by the blocklist, not NUL-terminated */
+    int domain_len;
+    u_int32_t hits;
+} blocklist_hit_t;
+
+typedef struct blocklist blocklist_t;
+
+blocklist_t* blocklist_open(const char *path);
+void blocklist_close(blocklist_t *bl);
+int blocklist_match(blocklist_t *bl, const char *name);
+void blocklist_hit(blocklist_t *bl, int rule);
+int blocklist_top_hits(blocklist_t *bl, blocklist_hit_t *out, int k);
+u_int32_t blocklist_size(blocklist_t *bl);
+u_int32_t blocklist_total_hits(blocklist_t *bl);
+size_t blocklist_mem_usage(blocklist_t *bl);
+
+#endif // __BLOCKLIST_H__
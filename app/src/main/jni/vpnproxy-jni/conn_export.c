@@ -0,0 +1,482 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+// Streaming export of the native connections store to a file descriptor. Rows are formatted into
+// a fixed buffer which is flushed when full, so the export memory does not depend on the
+// number of connections. The store is exported from the capture thread, so its export is
+// incremental (see conn_export_step): the fd is non-blocking and at most EXPORT_TICK_ROWS rows
+// are formatted per loop iteration, so that a slow reader cannot stall the packets forwarding.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <android/log.h>
+#include "conn_export.h"
+#include "jni_helpers.h"
+
+#define EXPORT_BUFFER_SIZE (16 * 1024)
+#define EXPORT_MAX_ROW_SIZE 2048
+#define EXPORT_TICK_ROWS 256
+#define EXPORT_STALL_TIMEOUT_MS 30000 /* abort the export if the reader makes no progress */
+
+/* Same fields of the connections_csv_fields_v1 of the Java exporter */
+#define CSV_HEADER "IPProto,SrcIP,SrcPort,DstIp,DstPort,Uid,App,Proto,Status,Info,BytesSent,BytesRcvd,PktsSent,PktsRcvd,FirstSeen,LastSeen\n"
+
+typedef struct {
+    int fd;
+    char buf[EXPORT_BUFFER_SIZE];
+    int idx;
+    bool error;
+} export_buffer_t;
+
+struct conn_export {
+    export_buffer_t out;
+    conn_export_format_t format;
+    int ofs; /* the bytes of out.buf already written */
+    int rows;
+    u_int64_t last_progress_ms;
+    struct timespec start;
+};
+
+/* ******************************************************* */
+
+static void export_flush(export_buffer_t *out) {
+    int ofs = 0;
+
+    while(!out->error && (ofs < out->idx)) {
+        ssize_t rv = write(out->fd, out->buf + ofs, out->idx - ofs);
+
+        if(rv < 0) {
+            if(errno == EINTR)
+                continue;
+
+            log_android(ANDROID_LOG_ERROR, "export write failed[%d]: %s", errno, strerror(errno));
+            out->error = true;
+        } else
+            ofs += rv;
+    }
+
+    out->idx = 0;
+}
+
+/* ******************************************************* */
+
+static void export_write(export_buffer_t *out, const char *data, int len) {
+    if((EXPORT_BUFFER_SIZE - out->idx) < len)
+        export_flush(out);
+
+    memcpy(out->buf + out->idx, data, len);
+    out->idx += len;
+}
+
+/* ******************************************************* */
+
+/* JSON-escape src into dst. The output is truncated if dst is too small. */
+static void json_escape(const char *src, char *dst, int dst_size) {
+    int i = 0;
+
+    for(; src && *src && (i < (dst_size - 7)); src++) {
+        unsigned char c = (unsigned char) *src;
+
+        if((c == '"') || (c == '\\')) {
+            dst[i++] = '\\';
+            dst[i++] = c;
+        } else if(c < 0x20)
+            i += snprintf(dst + i, dst_size - i, "\\u%04x", c);
+        else
+            dst[i++] = c;
+    }
+
+    dst[i] = '\0';
+}
+
+/* ******************************************************* */
+
+/* Quote src as a CSV field if it contains a separator, a quote or a line break, doubling the
+ * quotes (RFC 4180). The output is truncated if dst is too small. */
+static void csv_escape(const char *src, char *dst, int dst_size) {
+    int i = 0;
+
+    if(!src)
+        src = "";
+
+    if(!src[strcspn(src, ",\"\r\n")]) {
+        snprintf(dst, dst_size, "%s", src);
+        return;
+    }
+
+    dst[i++] = '"';
+
+    for(; *src && (i < (dst_size - 3)); src++) {
+        if(*src == '"')
+            dst[i++] = '"';
+        dst[i++] = *src;
+    }
+
+    dst[i++] = '"';
+    dst[i] = '\0';
+}
+
+/* ******************************************************* */
+
+static const char* status_label(u_int8_t status) {
+    switch(status) {
+        case CONN_STATUS_NEW:
+        case CONN_STATUS_CONNECTING:
+        case CONN_STATUS_CONNECTED:
+            return("Open");
+        case CONN_STATUS_CLOSED:
+        case CONN_STATUS_RESET:
+            return("Closed");
+        case CONN_STATUS_UNREACHABLE:
+            return("Unreachable");
+        default:
+            return("Error");
+    }
+}
+
+/* ******************************************************* */
+
+/* A connection to export, from either the connections store or the connections log */
+typedef struct {
+    u_int8_t ipver;
+    u_int8_t ipproto;
+    u_int8_t status;
+    const void *src_ip;
+    const void *dst_ip;
+    u_int16_t src_port; /* network byte order */
+    u_int16_t dst_port;
+    int uid;
+    const char *proto;
+    const char *info;
+    const char *url;
+    const char *tag;
+    int64_t sent_bytes;
+    int64_t rcvd_bytes;
+    int sent_pkts;
+    int rcvd_pkts;
+    int64_t first_seen;
+    int64_t last_seen;
+    u_int32_t rcvbuf; /* the upstream socket buffers, 0 if unknown */
+    u_int32_t sndbuf;
+    u_int32_t tput_kbps;
+    const tcp_health_t *tcp; /* NULL if unknown */
+    const conn_latency_t *lat; /* NULL if unknown */
+} export_row_t;
+
+/* ******************************************************* */
+
+static int format_row(const export_row_t *r, conn_export_format_t format, char *row, int row_size) {
+    char srcip[INET6_ADDRSTRLEN], dstip[INET6_ADDRSTRLEN];
+    int family = (r->ipver == 4) ? AF_INET : AF_INET6;
+    int len;
+
+    if((inet_ntop(family, r->src_ip, srcip, sizeof(srcip)) == NULL) ||
+       (inet_ntop(family, r->dst_ip, dstip, sizeof(dstip)) == NULL))
+        return(-1);
+
+    if(format == CONN_EXPORT_CSV) {
+        char info_esc[CONN_STR_MAX_LEN * 2 + 3], proto_esc[64];
+
+        csv_escape(r->info, info_esc, sizeof(info_esc));
+        csv_escape(r->proto, proto_esc, sizeof(proto_esc));
+
+        /* The app name is not known natively */
+        len = snprintf(row, row_size, "%d,%s,%u,%s,%u,%d,,%s,%s,%s,%lld,%lld,%d,%d,%lld,%lld\n",
+                       r->ipproto, srcip, ntohs(r->src_port), dstip, ntohs(r->dst_port),
+                       r->uid, proto_esc, status_label(r->status), info_esc,
+                       (long long) r->sent_bytes, (long long) r->rcvd_bytes,
+                       r->sent_pkts, r->rcvd_pkts,
+                       (long long) r->first_seen, (long long) r->last_seen);
+    } else {
+        char info_esc[CONN_STR_MAX_LEN * 2], url_esc[CONN_STR_MAX_LEN * 2];
+        char tag_esc[(IP_RULES_MAX_TAG_LEN + 1) * 2];
+        const tcp_health_t no_tcp = {0};
+        const tcp_health_t *tcp = r->tcp ? r->tcp : &no_tcp;
+        const conn_latency_t no_lat = {0};
+        const conn_latency_t *lat = r->lat ? r->lat : &no_lat;
+
+        json_escape(r->info, info_esc, sizeof(info_esc));
+        json_escape(r->url, url_esc, sizeof(url_esc));
+        json_escape(r->tag, tag_esc, sizeof(tag_esc));
+
+        len = snprintf(row, row_size, "{\"ipproto\":%d,\"src_ip\":\"%s\",\"src_port\":%u,"
+                       "\"dst_ip\":\"%s\",\"dst_port\":%u,\"uid\":%d,\"proto\":\"%s\",\"status\":\"%s\","
+                       "\"info\":\"%s\",\"url\":\"%s\",\"tag\":\"%s\",\"bytes_sent\":%lld,\"bytes_rcvd\":%lld,"
+                       "\"pkts_sent\":%d,\"pkts_rcvd\":%d,\"first_seen\":%lld,\"last_seen\":%lld,"
+                       "\"rcvbuf\":%u,\"sndbuf\":%u,\"throughput_kbps\":%u,\"rtt_us\":%u,\"rttvar_us\":%u,"
+                       "\"retrans\":%u,\"cwnd\":%u,\"delivery_rate\":%llu,\"connect_us\":%u,"
+                       "\"handshake_us\":%u,\"response_us\":%u}\n",
+                       r->ipproto, srcip, ntohs(r->src_port), dstip, ntohs(r->dst_port),
+                       r->uid, r->proto, status_label(r->status), info_esc, url_esc, tag_esc,
+                       (long long) r->sent_bytes, (long long) r->rcvd_bytes,
+                       r->sent_pkts, r->rcvd_pkts,
+                       (long long) r->first_seen, (long long) r->last_seen,
+                       r->rcvbuf, r->sndbuf, r->tput_kbps, tcp->rtt_us, tcp->rttvar_us,
+                       tcp->retrans, tcp->cwnd, (unsigned long long) tcp->delivery_rate,
+                       lat->connect_us, lat->handshake_us, lat->response_us);
+    }
+
+    return(((len < 0) || (len >= row_size)) ? -1 : len);
+}
+
+/* ******************************************************* */
+
+static export_buffer_t* export_begin(int fd, conn_export_format_t format, struct timespec *start) {
+    export_buffer_t *out = malloc(sizeof(export_buffer_t));
+
+    if(!out) {
+        log_android(ANDROID_LOG_ERROR, "malloc(export_buffer_t) failed");
+        return(NULL);
+    }
+
+    out->fd = fd;
+    out->idx = 0;
+    out->error = false;
+    clock_gettime(CLOCK_MONOTONIC, start);
+
+    if(format == CONN_EXPORT_CSV)
+        export_write(out, CSV_HEADER, sizeof(CSV_HEADER) - 1);
+
+    return(out);
+}
+
+/* ******************************************************* */
+
+static void export_row(export_buffer_t *out, const export_row_t *r, conn_export_format_t format, int *rows) {
+    char row[EXPORT_MAX_ROW_SIZE];
+    int len;
+
+    if((len = format_row(r, format, row, sizeof(row))) < 0)
+        return;
+
+    export_write(out, row, len);
+    (*rows)++;
+}
+
+/* ******************************************************* */
+
+static void log_export_done(int rows, const struct timespec *start) {
+    struct timespec end;
+    u_int64_t elapsed_us;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    elapsed_us = (end.tv_sec - start->tv_sec) * 1000000ULL + (end.tv_nsec - start->tv_nsec) / 1000 + 1;
+
+    log_android(ANDROID_LOG_INFO, "Exported %d connections in %llu us (%llu rows/s)", rows,
+                (unsigned long long) elapsed_us, (unsigned long long) (rows * 1000000ULL / elapsed_us));
+}
+
+/* ******************************************************* */
+
+/* Returns the number of exported rows, -1 on error */
+static int export_end(export_buffer_t *out, int rows, const struct timespec *start) {
+    export_flush(out);
+
+    if(!out->error)
+        log_export_done(rows, start);
+    else
+        rows = -1;
+
+    free(out);
+    return(rows);
+}
+
+/* ******************************************************* */
+
+/* Write the pending data without blocking. Returns false if some data is still pending. */
+static bool export_flush_nb(conn_export_t *exp, u_int64_t now_ms) {
+    export_buffer_t *out = &exp->out;
+
+    while(!out->error && (exp->ofs < out->idx)) {
+        ssize_t rv = write(out->fd, out->buf + exp->ofs, out->idx - exp->ofs);
+
+        if(rv < 0) {
+            if(errno == EINTR)
+                continue;
+            if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+                return(false);
+
+            log_android(ANDROID_LOG_ERROR, "export write failed[%d]: %s", errno, strerror(errno));
+            out->error = true;
+        } else {
+            exp->ofs += rv;
+            exp->last_progress_ms = now_ms;
+        }
+    }
+
+    out->idx = 0;
+    exp->ofs = 0;
+    return(true);
+}
+
+/* ******************************************************* */
+
+/* Start the export of the connections in the native store to fd, which is made non-blocking. The
+ * fd is not closed by the export. */
+conn_export_t* conn_export_start(int fd, conn_export_format_t format, u_int64_t now_ms) {
+    conn_export_t *exp = calloc(1, sizeof(conn_export_t));
+
+    if(!exp) {
+        log_android(ANDROID_LOG_ERROR, "calloc(conn_export_t) failed");
+        return(NULL);
+    }
+
+    if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0)
+        log_android(ANDROID_LOG_WARN, "export fcntl failed[%d]: %s", errno, strerror(errno));
+
+    exp->out.fd = fd;
+    exp->format = format;
+    exp->last_progress_ms = now_ms;
+    clock_gettime(CLOCK_MONOTONIC, &exp->start);
+
+    if(format == CONN_EXPORT_CSV)
+        export_write(&exp->out, CSV_HEADER, sizeof(CSV_HEADER) - 1);
+
+    return(exp);
+}
+
+/* ******************************************************* */
+
+/* Export the next connections of the store, starting from the order index *cursor, which is
+ * advanced. Must be called from the capture thread. Returns 1 when the export is complete,
+ * 0 if in progress, -1 on error. */
+int conn_export_step(vpnproxy_data_t *proxy, conn_export_t *exp, u_int32_t *cursor, u_int64_t now_ms) {
+    const conn_store_t *store = &proxy->conns;
+    int budget = EXPORT_TICK_ROWS;
+
+    if(!export_flush_nb(exp, now_ms))
+        goto pending;
+
+    while((budget > 0) && (*cursor < store->num_order) && !exp->out.error) {
+        u_int32_t slot = store->order[*cursor];
+        const zdtun_5tuple_t *tuple = &store->tuple[slot];
+        const conn_data_t *data = store->data[slot];
+        const conn_stats_t *stats = &store->stats[slot];
+
+        /* the row is never split across the iterations */
+        if((EXPORT_BUFFER_SIZE - exp->out.idx) < EXPORT_MAX_ROW_SIZE)
+            break;
+
+        (*cursor)++;
+
+        if(!data || (stats->flags & (CONN_FLAG_IGNORED | CONN_FLAG_NO_EXPORT)))
+            continue;
+
+        export_row_t r = {
+            .ipver = tuple->ipver, .ipproto = tuple->ipproto, .status = stats->status,
+            .src_ip = &tuple->src_ip, .dst_ip = &tuple->dst_ip,
+            .src_port = tuple->src_port, .dst_port = tuple->dst_port,
+            .uid = store->uid[slot],
+            .proto = getProtoName(proxy->ndpi, store->l7proto[slot], tuple->ipproto),
+            .info = conn_str_get(&data->info), .url = conn_str_get(&data->url),
+            .tag = ip_rules_tag_name(proxy->ip_rules, data->rule_tag),
+            .sent_bytes = stats->sent_bytes, .rcvd_bytes = stats->rcvd_bytes,
+            .sent_pkts = stats->sent_pkts, .rcvd_pkts = stats->rcvd_pkts,
+            .first_seen = store->first_seen[slot], .last_seen = stats->last_seen,
+            .rcvbuf = data->tune.rcvbuf, .sndbuf = data->tune.sndbuf,
+            .tput_kbps = data->tune.tput_kbps, .tcp = &data->tcp, .lat = &data->lat,
+        };
+
+        export_row(&exp->out, &r, exp->format, &exp->rows);
+        budget--;
+    }
+
+    if(!export_flush_nb(exp, now_ms))
+        goto pending;
+
+    if(exp->out.error)
+        return(-1);
+
+    if(*cursor < store->num_order)
+        return(0);
+
+    log_export_done(exp->rows, &exp->start);
+    return(1);
+
+pending:
+    if(exp->out.error)
+        return(-1);
+
+    if((now_ms - exp->last_progress_ms) >= EXPORT_STALL_TIMEOUT_MS) {
+        log_android(ANDROID_LOG_ERROR, "export stalled, aborting");
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+void conn_export_destroy(conn_export_t *exp) {
+    free(exp);
+}
+
+/* ******************************************************* */
+
+/* Export the connections of the log closed in [from, to], oldest first, optionally filtered
+ * by uid (CONN_LOG_ANY_UID for all). Can be called from any thread. */
+int conn_export_log(conn_log_t *log, int fd, conn_export_format_t format, int64_t from, int64_t to, int uid) {
+    struct timespec start;
+    export_buffer_t *out;
+    u_int32_t *ids;
+    u_int32_t max_ids = conn_log_count(log);
+    int num_ids;
+    int rows = 0;
+
+    if((ids = malloc((max_ids + 1) * sizeof(u_int32_t))) == NULL)
+        return(-1);
+
+    if((out = export_begin(fd, format, &start)) == NULL) {
+        free(ids);
+        return(-1);
+    }
+
+    num_ids = conn_log_query(log, from, to, uid, ids, (int) max_ids);
+
+    /* the query returns the newest first */
+    for(int i = num_ids - 1; (i >= 0) && !out->error; i--) {
+        conn_log_record_t rec;
+        char info[CONN_STR_MAX_LEN + 1], url[CONN_STR_MAX_LEN + 1];
+
+        if(conn_log_get(log, ids[i], &rec, info, sizeof(info), url, sizeof(url)) != 0)
+            continue;
+
+        export_row_t r = {
+            .ipver = rec.ipver, .ipproto = rec.ipproto, .status = rec.status,
+            .src_ip = rec.src_ip, .dst_ip = rec.dst_ip,
+            .src_port = rec.src_port, .dst_port = rec.dst_port,
+            .uid = rec.uid, .proto = rec.l7proto,
+            .info = info[0] ? info : NULL, .url = url[0] ? url : NULL,
+            .sent_bytes = rec.sent_bytes, .rcvd_bytes = rec.rcvd_bytes,
+            .sent_pkts = (int) rec.sent_pkts, .rcvd_pkts = (int) rec.rcvd_pkts,
+            .first_seen = rec.first_seen, .last_seen = rec.last_seen,
+        };
+
+        export_row(out, &r, format, &rows);
+    }
+
+    free(ids);
+    return(export_end(out, rows, &start));
+}
@@ -0,0 +1,39 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __CONN_EXPORT_H__
+#define __CONN_EXPORT_H__
+
+#include "vpnproxy.h"
+#include "conn_log.h"
+
+/* Must match the NATIVE_FORMAT_* of ConnectionsExporter.java */
+typedef enum {
+    CONN_EXPORT_CSV = 0,
+    CONN_EXPORT_NDJSON,
+} conn_export_format_t;
+
+typedef struct conn_export conn_export_t;
+
+conn_export_t* conn_export_start(int fd, conn_export_format_t format, u_int64_t now_ms);
+int conn_export_step(vpnproxy_data_t *proxy, conn_export_t *exp, u_int32_t *cursor, u_int64_t now_ms);
+void conn_export_destroy(conn_export_t *exp);
+int conn_export_log(conn_log_t *log, int fd, conn_export_format_t format, int64_t from, int64_t to, int uid);
+
+#endif // __CONN_EXPORT_H__
@@ -0,0 +1,515 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <android/log.h>
+#include "conn_log.h"
+#include "jni_helpers.h"
+#include "third_party/uthash.h"
+
+#define CONN_LOG_MAGIC      0x50434c47 /* PCLG */
+#define CONN_LOG_VERSION    2
+#define CONN_LOG_GROW_RECORDS 4096
+
+typedef struct conn_log_header {
+    u_int32_t magic;
+    u_int32_t version;
+    u_int32_t num_columns;
+    u_int32_t num_records;
+    u_int64_t heap_size;
+} conn_log_header_t;
+
+/* The counters are a single column, as they are always read together */
+typedef struct conn_log_counters {
+    int64_t sent_bytes;
+    int64_t rcvd_bytes;
+    u_int32_t sent_pkts;
+    u_int32_t rcvd_pkts;
+} conn_log_counters_t;
+
+/* The fields only needed to show or export a record */
+typedef struct conn_log_meta {
+    u_int8_t src_ip[16];
+    u_int8_t dst_ip[16];
+    int64_t first_seen;
+    int64_t last_seen;
+    u_int32_t info_ofs;
+    u_int32_t url_ofs;
+    u_int16_t src_port;
+    u_int16_t dst_port;
+    u_int8_t ipver;
+    u_int8_t ipproto;
+    u_int8_t status;
+    u_int8_t reserved;
+    char l7proto[16];
+} conn_log_meta_t;
+
+typedef enum {
+    COL_CLOSED_AT = 0,
+    COL_UID,
+    COL_PREV_UID,
+    COL_COUNTERS,
+    COL_META,
+    NUM_COLUMNS
+} conn_log_column_t;
+
+static const struct {
+    const char *suffix;
+    size_t size;
+} columns[NUM_COLUMNS] = {
+    [COL_CLOSED_AT] = { ".closed_at",   sizeof(int64_t) },
+    [COL_UID]       = { ".uid",         sizeof(int32_t) },
+    [COL_PREV_UID]  = { ".prev_uid",    sizeof(u_int32_t) },
+    [COL_COUNTERS]  = { ".counters",    sizeof(conn_log_counters_t) },
+    [COL_META]      = { ".meta",        sizeof(conn_log_meta_t) },
+};
+
+struct uid_entry {
+    int32_t uid;
+    u_int32_t last_record;
+    UT_hash_handle hh;
+};
+
+struct conn_log {
+    pthread_mutex_t lock;
+    int refs;
+    int fd;
+    int heap_fd;
+    int col_fd[NUM_COLUMNS];
+    conn_log_header_t *header; /* the mapped file */
+    void *col[NUM_COLUMNS];    /* the mapped columns */
+    u_int32_t capacity;
+    struct uid_entry *uids;
+};
+
+#define CLOSED_AT(log)  ((int64_t*)(log)->col[COL_CLOSED_AT])
+#define UIDS(log)       ((int32_t*)(log)->col[COL_UID])
+#define PREV_UID(log)   ((u_int32_t*)(log)->col[COL_PREV_UID])
+#define COUNTERS(log)   ((conn_log_counters_t*)(log)->col[COL_COUNTERS])
+#define META(log)       ((conn_log_meta_t*)(log)->col[COL_META])
+
+/* ******************************************************* */
+
+static void unmap_columns(void **cols, u_int32_t capacity) {
+    for(int i = 0; i < NUM_COLUMNS; i++) {
+        if(cols[i])
+            munmap(cols[i], (size_t)capacity * columns[i].size);
+    }
+}
+
+/* ******************************************************* */
+
+/* (Re)map the columns with the given capacity. On failure, the current mappings are kept. */
+static int conn_log_map(conn_log_t *log, u_int32_t capacity) {
+    void *cols[NUM_COLUMNS] = {0};
+
+    for(int i = 0; i < NUM_COLUMNS; i++) {
+        size_t size = (size_t)capacity * columns[i].size;
+
+        if(ftruncate(log->col_fd[i], size) != 0) {
+            log_android(ANDROID_LOG_ERROR, "conn_log ftruncate failed[%d]: %s", errno, strerror(errno));
+            goto err;
+        }
+
+        cols[i] = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, log->col_fd[i], 0);
+
+        if(cols[i] == MAP_FAILED) {
+            log_android(ANDROID_LOG_ERROR, "conn_log mmap failed[%d]: %s", errno, strerror(errno));
+            cols[i] = NULL;
+            goto err;
+        }
+    }
+
+    /* Both map the same files, so the content is already in the new mappings */
+    unmap_columns(log->col, log->capacity);
+    memcpy(log->col, cols, sizeof(cols));
+    log->capacity = capacity;
+    return(0);
+
+err:
+    unmap_columns(cols, capacity);
+    return(-1);
+}
+
+/* ******************************************************* */
+
+/* Creates <path><suffix> aside and renames it over any existing file */
+static int create_file(const char *path, const char *suffix) {
+    char dst_path[PATH_MAX], tmp_path[PATH_MAX];
+    int fd;
+
+    snprintf(dst_path, sizeof(dst_path), "%s%s", path, suffix);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.new", dst_path);
+
+    if((fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+        goto err;
+
+    if(rename(tmp_path, dst_path) != 0) {
+        close(fd);
+        goto err;
+    }
+
+    return(fd);
+
+err:
+    log_android(ANDROID_LOG_ERROR, "conn_log open(%s) failed[%d]: %s", dst_path, errno, strerror(errno));
+    return(-1);
+}
+
+/* ******************************************************* */
+
+/* Creates a new log at path, replacing any existing one. The files are created aside and then
+ * renamed, so that the references to the previous log stay valid. The log is returned with one
+ * reference. */
+conn_log_t* conn_log_open(const char *path) {
+    conn_log_t *log = calloc(1, sizeof(conn_log_t));
+
+    if(!log)
+        return(NULL);
+
+    log->fd = create_file(path, "");
+    log->heap_fd = create_file(path, ".str");
+
+    for(int i = 0; i < NUM_COLUMNS; i++)
+        log->col_fd[i] = create_file(path, columns[i].suffix);
+
+    if((log->fd < 0) || (log->heap_fd < 0))
+        goto err;
+
+    for(int i = 0; i < NUM_COLUMNS; i++) {
+        if(log->col_fd[i] < 0)
+            goto err;
+    }
+
+    if(ftruncate(log->fd, sizeof(conn_log_header_t)) != 0)
+        goto err;
+
+    log->header = mmap(NULL, sizeof(conn_log_header_t), PROT_READ | PROT_WRITE, MAP_SHARED, log->fd, 0);
+
+    if(log->header == MAP_FAILED) {
+        log->header = NULL;
+        goto err;
+    }
+
+    if(conn_log_map(log, CONN_LOG_GROW_RECORDS) != 0)
+        goto err;
+
+    log->header->magic = CONN_LOG_MAGIC;
+    log->header->version = CONN_LOG_VERSION;
+    log->header->num_columns = NUM_COLUMNS;
+    log->header->num_records = 0;
+
+    /* Offset 0 means no string */
+    if(write(log->heap_fd, "", 1) != 1)
+        goto err;
+    log->header->heap_size = 1;
+
+    pthread_mutex_init(&log->lock, NULL);
+    log->refs = 1;
+    return(log);
+
+err:
+    unmap_columns(log->col, log->capacity);
+    if(log->header)
+        munmap(log->header, sizeof(conn_log_header_t));
+    if(log->fd >= 0)
+        close(log->fd);
+    if(log->heap_fd >= 0)
+        close(log->heap_fd);
+    for(int i = 0; i < NUM_COLUMNS; i++) {
+        if(log->col_fd[i] >= 0)
+            close(log->col_fd[i]);
+    }
+    free(log);
+    return(NULL);
+}
+
+/* ******************************************************* */
+
+static void conn_log_close(conn_log_t *log) {
+    struct uid_entry *entry, *tmp;
+
+    HASH_ITER(hh, log->uids, entry, tmp) {
+        HASH_DELETE(hh, log->uids, entry);
+        free(entry);
+    }
+
+    unmap_columns(log->col, log->capacity);
+    munmap(log->header, sizeof(conn_log_header_t));
+
+    for(int i = 0; i < NUM_COLUMNS; i++)
+        close(log->col_fd[i]);
+    close(log->fd);
+    close(log->heap_fd);
+    pthread_mutex_destroy(&log->lock);
+    free(log);
+}
+
+/* ******************************************************* */
+
+void conn_log_ref(conn_log_t *log) {
+    pthread_mutex_lock(&log->lock);
+    log->refs++;
+    pthread_mutex_unlock(&log->lock);
+}
+
+/* ******************************************************* */
+
+/* Release a reference, the log is closed when the last one is released */
+void conn_log_unref(conn_log_t *log) {
+    int refs;
+
+    pthread_mutex_lock(&log->lock);
+    refs = --log->refs;
+    pthread_mutex_unlock(&log->lock);
+
+    if(refs == 0)
+        conn_log_close(log);
+}
+
+/* ******************************************************* */
+
+static u_int32_t heap_add(conn_log_t *log, const char *str) {
+    u_int64_t ofs = log->header->heap_size;
+    size_t len;
+
+    if(!str || !str[0] || (ofs >= UINT32_MAX))
+        return(0);
+
+    len = strlen(str) + 1;
+
+    if(pwrite(log->heap_fd, str, len, (off_t) ofs) != (ssize_t) len)
+        return(0);
+
+    log->header->heap_size += len;
+    return((u_int32_t) ofs);
+}
+
+/* ******************************************************* */
+
+static void heap_get(conn_log_t *log, u_int32_t ofs, char *buf, int size) {
+    ssize_t rv;
+
+    buf[0] = '\0';
+
+    if((ofs == 0) || (size <= 1))
+        return;
+
+    if((rv = pread(log->heap_fd, buf, size - 1, ofs)) > 0)
+        buf[rv] = '\0';
+}
+
+/* ******************************************************* */
+
+/* Appends a record. closed_at is clamped to the one of the previous record, to keep the time
+ * index sorted if the wall clock goes back. The prev_uid_record and the string offsets are
+ * set by this function. */
+int conn_log_append(conn_log_t *log, conn_log_record_t *rec, const char *info, const char *url) {
+    struct uid_entry *entry;
+    conn_log_counters_t *counters;
+    conn_log_meta_t *meta;
+    u_int32_t idx;
+    int rv = -1;
+
+    pthread_mutex_lock(&log->lock);
+
+    idx = log->header->num_records;
+
+    if((idx >= log->capacity) && (conn_log_map(log, log->capacity + CONN_LOG_GROW_RECORDS) != 0))
+        goto out;
+
+    HASH_FIND(hh, log->uids, &rec->uid, sizeof(rec->uid), entry);
+
+    if(!entry) {
+        if((entry = malloc(sizeof(struct uid_entry))) == NULL)
+            goto out;
+
+        entry->uid = rec->uid;
+        entry->last_record = CONN_LOG_NO_RECORD;
+        HASH_ADD(hh, log->uids, uid, sizeof(entry->uid), entry);
+    }
+
+    if((idx > 0) && (rec->closed_at < CLOSED_AT(log)[idx - 1]))
+        rec->closed_at = CLOSED_AT(log)[idx - 1];
+
+    rec->prev_uid_record = entry->last_record;
+    rec->info_ofs = heap_add(log, info);
+    rec->url_ofs = heap_add(log, url);
+
+    CLOSED_AT(log)[idx] = rec->closed_at;
+    UIDS(log)[idx] = rec->uid;
+    PREV_UID(log)[idx] = rec->prev_uid_record;
+
+    counters = &COUNTERS(log)[idx];
+    counters->sent_bytes = rec->sent_bytes;
+    counters->rcvd_bytes = rec->rcvd_bytes;
+    counters->sent_pkts = rec->sent_pkts;
+    counters->rcvd_pkts = rec->rcvd_pkts;
+
+    meta = &META(log)[idx];
+    memcpy(meta->src_ip, rec->src_ip, sizeof(meta->src_ip));
+    memcpy(meta->dst_ip, rec->dst_ip, sizeof(meta->dst_ip));
+    meta->first_seen = rec->first_seen;
+    meta->last_seen = rec->last_seen;
+    meta->info_ofs = rec->info_ofs;
+    meta->url_ofs = rec->url_ofs;
+    meta->src_port = rec->src_port;
+    meta->dst_port = rec->dst_port;
+    meta->ipver = rec->ipver;
+    meta->ipproto = rec->ipproto;
+    meta->status = rec->status;
+    meta->reserved = 0;
+    memcpy(meta->l7proto, rec->l7proto, sizeof(meta->l7proto));
+
+    log->header->num_records = idx + 1;
+    entry->last_record = idx;
+    rv = 0;
+
+out:
+    pthread_mutex_unlock(&log->lock);
+    return(rv);
+}
+
+/* ******************************************************* */
+
+u_int32_t conn_log_count(conn_log_t *log) {
+    u_int32_t rv;
+
+    pthread_mutex_lock(&log->lock);
+    rv = log->header->num_records;
+    pthread_mutex_unlock(&log->lock);
+
+    return(rv);
+}
+
+/* ******************************************************* */
+
+/* Returns the index of the last record with closed_at <= to, CONN_LOG_NO_RECORD if none */
+static u_int32_t find_last_before(conn_log_t *log, int64_t to) {
+    const int64_t *closed_at = CLOSED_AT(log);
+    u_int32_t lo = 0, hi = log->header->num_records;
+
+    while(lo < hi) {
+        u_int32_t mid = lo + (hi - lo) / 2;
+
+        if(closed_at[mid] <= to)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return((lo == 0) ? CONN_LOG_NO_RECORD : (lo - 1));
+}
+
+/* ******************************************************* */
+
+/* Store in out the indexes of the records closed in [from, to], newest first, optionally
+ * filtered by uid. Only the closed_at and prev_uid columns are read. Returns the number of
+ * indexes. */
+int conn_log_query(conn_log_t *log, int64_t from, int64_t to, int uid, u_int32_t *out, int max) {
+    const int64_t *closed_at;
+    u_int32_t idx;
+    int n = 0;
+
+    pthread_mutex_lock(&log->lock);
+
+    closed_at = CLOSED_AT(log);
+
+    if(uid != CONN_LOG_ANY_UID) {
+        const u_int32_t *prev_uid = PREV_UID(log);
+        struct uid_entry *entry;
+
+        HASH_FIND(hh, log->uids, &uid, sizeof(int32_t), entry);
+        idx = entry ? entry->last_record : CONN_LOG_NO_RECORD;
+
+        /* Walk the uid chain */
+        for(; (idx != CONN_LOG_NO_RECORD) && (n < max); idx = prev_uid[idx]) {
+            if(closed_at[idx] < from)
+                break;
+            if(closed_at[idx] <= to)
+                out[n++] = idx;
+        }
+    } else {
+        idx = find_last_before(log, to);
+
+        for(; (idx != CONN_LOG_NO_RECORD) && (n < max); idx--) {
+            if(closed_at[idx] < from)
+                break;
+
+            out[n++] = idx;
+
+            if(idx == 0)
+                break;
+        }
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return(n);
+}
+
+/* ******************************************************* */
+
+/* Assembles the record at idx from the columns */
+int conn_log_get(conn_log_t *log, u_int32_t idx, conn_log_record_t *rec,
+                 char *info, int info_size, char *url, int url_size) {
+    int rv = -1;
+
+    pthread_mutex_lock(&log->lock);
+
+    if(idx < log->header->num_records) {
+        const conn_log_counters_t *counters = &COUNTERS(log)[idx];
+        const conn_log_meta_t *meta = &META(log)[idx];
+
+        memcpy(rec->src_ip, meta->src_ip, sizeof(rec->src_ip));
+        memcpy(rec->dst_ip, meta->dst_ip, sizeof(rec->dst_ip));
+        rec->first_seen = meta->first_seen;
+        rec->last_seen = meta->last_seen;
+        rec->closed_at = CLOSED_AT(log)[idx];
+        rec->sent_bytes = counters->sent_bytes;
+        rec->rcvd_bytes = counters->rcvd_bytes;
+        rec->sent_pkts = counters->sent_pkts;
+        rec->rcvd_pkts = counters->rcvd_pkts;
+        rec->uid = UIDS(log)[idx];
+        rec->prev_uid_record = PREV_UID(log)[idx];
+        rec->info_ofs = meta->info_ofs;
+        rec->url_ofs = meta->url_ofs;
+        rec->src_port = meta->src_port;
+        rec->dst_port = meta->dst_port;
+        rec->ipver = meta->ipver;
+        rec->ipproto = meta->ipproto;
+        rec->status = meta->status;
+        rec->reserved = 0;
+        memcpy(rec->l7proto, meta->l7proto, sizeof(rec->l7proto));
+
+        heap_get(log, rec->info_ofs, info, info_size);
+        heap_get(log, rec->url_ofs, url, url_size);
+        rv = 0;
+    }
+
+    pthread_mutex_unlock(&log->lock);
+    return(rv);
+}
@@ -0,0 +1,80 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __CONN_LOG_H__
+#define __CONN_LOG_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * An append-only on-disk log of the closed connections, stored by column:
+ *  - <path>: the header, with the number of records
+ *  - <path>.closed_at, .uid, .prev_uid, .counters: the hot columns, read by the queries
+ *  - <path>.meta: the remaining fixed-width fields, only read to assemble a record
+ *  - <path>.str: a heap of NUL-terminated strings (info, url), referenced by offset
+ * Each column is memory-mapped and indexed by the record number. Records are appended in close
+ * order, so the closed_at column is sorted and is used as the time index. Each record links to
+ * the previous record of the same uid, and the last record of each uid is kept in memory, to
+ * browse the connections of a uid without a full scan. conn_log_record_t is only the API view
+ * of a record, assembled from the columns by conn_log_get.
+ * The log can be queried from other threads while the capture thread appends. It is reference
+ * counted, so that readers can keep using it without a global lock while a new capture replaces
+ * it: a new log is created aside and renamed over the old files, which stay valid until the
+ * last reference is released.
+ */
+
+#define CONN_LOG_NO_RECORD  0xFFFFFFFF
+#define CONN_LOG_ANY_UID    -2 /* matches Utils.UID_NO_FILTER */
+
+typedef struct conn_log_record {
+    u_int8_t src_ip[16];
+    u_int8_t dst_ip[16];
+    int64_t first_seen;
+    int64_t last_seen;
+    int64_t closed_at;
+    int64_t sent_bytes;
+    int64_t rcvd_bytes;
+    u_int32_t sent_pkts;
+    u_int32_t rcvd_pkts;
+    int32_t uid;
+    u_int32_t prev_uid_record; /* CONN_LOG_NO_RECORD if none */
+    u_int32_t info_ofs;        /* string heap offsets, 0 if not set */
+    u_int32_t url_ofs;
+    u_int16_t src_port;        /* network byte order */
+    u_int16_t dst_port;
+    u_int8_t ipver;
+    u_int8_t ipproto;
+    u_int8_t status;
+    u_int8_t reserved;
+    char l7proto[16];
+} conn_log_record_t;
+
+typedef struct conn_log conn_log_t;
+
+conn_log_t* conn_log_open(const char *path);
+void conn_log_ref(conn_log_t *log);
+void conn_log_unref(conn_log_t *log);
+int conn_log_append(conn_log_t *log, conn_log_record_t *rec, const char *info, const char *url);
+u_int32_t conn_log_count(conn_log_t *log);
+int conn_log_query(conn_log_t *log, int64_t from, int64_t to, int uid, u_int32_t *out, int max);
+int conn_log_get(conn_log_t *log, u_int32_t idx, conn_log_record_t *rec,
+                 char *info, int info_size, char *url, int url_size);
+
+#endif // __CONN_LOG_H__
@@ -0,0 +1,623 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "dns_cache.h"
+#include "third_party/uthash.h"
+
+#define DNS_FLAG_QR             0x8000
+#define DNS_FLAG_TC             0x0200
+#define DNS_FLAG_RD             0x0100
+#define DNS_FLAG_CD             0x0010
+#define DNS_OPCODE(flags)       (((flags) >> 11) & 0x0F)
+#define DNS_RCODE(flags)        ((flags) & 0x0F)
+#define DNS_RCODE_NOERROR       0
+#define DNS_RCODE_NXDOMAIN      3
+#define DNS_FLAG_RA             0x0080
+#define DNS_CLASS_IN            1
+
+#define DNS_TYPE_A              1
+#define DNS_TYPE_SOA            6
+#define DNS_TYPE_AAAA           28
+#define DNS_TYPE_OPT            41
+#define EDNS_FLAG_DO            0x8000
+
+/* The last byte of the key */
+#define KEY_FLAG_EDNS           0x01
+#define KEY_FLAG_DO             0x02
+#define KEY_FLAG_CD             0x04
+
+#define DNS_MAX_TTLS            32 /* responses with more records are not cached */
+#define DNS_PENDING_SLOTS       64
+
+typedef struct dns_entry {
+    u_int8_t *key;
+    u_int8_t *msg;
+    u_int16_t key_len;
+    u_int16_t msg_len;
+    u_int16_t question_len;
+    u_int16_t num_ttls;
+    u_int16_t ttl_ofs[DNS_MAX_TTLS];
+    u_int64_t cached_ms;
+    u_int64_t expire_ms;
+    u_int32_t rtt_ms;
+    u_int8_t ipver;
+    zdtun_ip_t addr;
+    UT_hash_handle hh;
+} dns_entry_t;
+
+/* A parsed response */
+typedef struct dns_response {
+    u_int16_t txid;
+    u_int16_t flags;
+    u_int16_t question_len;
+    u_int16_t num_answers;
+    u_int16_t key_len;
+    u_int8_t key[DNS_MAX_KEY_LEN];
+    char qname[DNS_MAX_NAME_LEN + 1];
+    u_int32_t min_ttl;  /* of the answer and authority sections */
+    u_int32_t neg_ttl;  /* from the SOA, UINT32_MAX if none */
+    int num_ttls;
+    u_int16_t ttl_ofs[DNS_MAX_TTLS];
+    u_int8_t ipver;
+    zdtun_ip_t addr;
+} dns_response_t;
+
+/* A query forwarded upstream, used to measure the upstream RTT */
+typedef struct dns_pending {
+    u_int16_t txid;
+    u_int32_t key_hash;
+    u_int64_t sent_ms;
+} dns_pending_t;
+
+struct dns_cache {
+    dns_entry_t *table;
+    int max_entries;
+    size_t mem_usage;
+    dns_cache_stats_t stats;
+    dns_pending_t pending[DNS_PENDING_SLOTS];
+};
+
+/* ******************************************************* */
+
+static inline u_int16_t get16(const u_int8_t *p) {
+    return((u_int16_t)((p[0] << 8) | p[1]));
+}
+
+static inline u_int32_t get32(const u_int8_t *p) {
+    return(((u_int32_t)p[0] << 24) | ((u_int32_t)p[1] << 16) | ((u_int32_t)p[2] << 8) | p[3]);
+}
+
+static inline void put16(u_int8_t *p, u_int16_t val) {
+    p[0] = val >> 8;
+    p[1] = val & 0xFF;
+}
+
+static inline void put32(u_int8_t *p, u_int32_t val) {
+    p[0] = val >> 24;
+    p[1] = (val >> 16) & 0xFF;
+    p[2] = (val >> 8) & 0xFF;
+    p[3] = val & 0xFF;
+}
+
+static u_int32_t key_hash(const u_int8_t *key, int key_len) {
+    u_int32_t h = 2166136261U;
+
+    for(int i = 0; i < key_len; i++) {
+        h ^= key[i];
+        h *= 16777619U;
+    }
+
+    return(h);
+}
+
+/* ******************************************************* */
+
+/* Parse the (single) question into a lowercase key, without the key flags.
+ * Returns the offset after the question, or -1 on error. */
+static int parse_question(const u_int8_t *data, int len, u_int8_t *key, u_int16_t *key_len, char *qname) {
+    int ofs = DNS_HEADER_LEN;
+    int klen = 0, nlen = 0;
+
+    while(1) {
+        u_int8_t label_len;
+
+        if(ofs >= len)
+            return(-1);
+
+        if((label_len = data[ofs++]) == 0)
+            break;
+
+        /* compression is not expected in the question */
+        if((label_len & 0xC0) || ((ofs + label_len) > len) || ((klen + label_len + 2) > DNS_MAX_NAME_LEN))
+            return(-1);
+
+        key[klen++] = label_len;
+
+        if(nlen > 0)
+            qname[nlen++] = '.';
+
+        for(int i = 0; i < label_len; i++) {
+            u_int8_t c = tolower(data[ofs + i]);
+
+            key[klen++] = c;
+            qname[nlen++] = c;
+        }
+
+        ofs += label_len;
+    }
+
+    key[klen++] = 0;
+    qname[nlen] = '\0';
+
+    /* qtype and qclass */
+    if((ofs + 4) > len)
+        return(-1);
+
+    memcpy(&key[klen], &data[ofs], 4);
+    *key_len = klen + 4;
+
+    return(ofs + 4);
+}
+
+/* ******************************************************* */
+
+/* Returns the offset after the name, or -1 on error */
+static int skip_name(const u_int8_t *data, int len, int ofs) {
+    while(ofs < len) {
+        u_int8_t label_len = data[ofs];
+
+        if(label_len == 0)
+            return(ofs + 1);
+        else if((label_len & 0xC0) == 0xC0) /* compression pointer */
+            return(((ofs + 2) <= len) ? (ofs + 2) : -1);
+        else if(label_len & 0xC0)
+            return(-1);
+
+        ofs += label_len + 1;
+    }
+
+    return(-1);
+}
+
+/* ******************************************************* */
+
+/* Parse a standard query with a single question and, optionally, an EDNS OPT record.
+ * Returns 0 if the query can be answered from the cache, -1 otherwise. */
+int dns_parse_query(const u_int8_t *data, int len, dns_query_t *q) {
+    u_int8_t key_flags = 0;
+    u_int16_t arcount;
+    int ofs;
+
+    if(len < DNS_HEADER_LEN)
+        return(-1);
+
+    q->txid = get16(data);
+    q->flags = get16(data + 2);
+    arcount = get16(data + 10);
+
+    if((q->flags & DNS_FLAG_QR) || (DNS_OPCODE(q->flags) != 0) || (get16(data + 4) != 1) ||
+       (get16(data + 6) != 0) || (get16(data + 8) != 0) || (arcount > 1))
+        return(-1);
+
+    if((ofs = parse_question(data, len, q->key, &q->key_len, q->qname)) < 0)
+        return(-1);
+
+    q->question_len = ofs - DNS_HEADER_LEN;
+    q->udp_size = 512;
+
+    if(arcount == 1) {
+        /* Only the OPT record is supported, which has an empty name */
+        if(((ofs + 11) > len) || (data[ofs] != 0) || (get16(data + ofs + 1) != DNS_TYPE_OPT))
+            return(-1);
+
+        key_flags |= KEY_FLAG_EDNS;
+
+        if(get16(data + ofs + 3) > 512)
+            q->udp_size = get16(data + ofs + 3);
+        if(get16(data + ofs + 7) & EDNS_FLAG_DO)
+            key_flags |= KEY_FLAG_DO;
+    }
+
+    if(q->flags & DNS_FLAG_CD)
+        key_flags |= KEY_FLAG_CD;
+
+    q->key[q->key_len++] = key_flags;
+    return(0);
+}
+
+/* ******************************************************* */
+
+dns_cache_t* dns_cache_init(int max_entries) {
+    dns_cache_t *cache = calloc(1, sizeof(dns_cache_t));
+
+    if(!cache)
+        return(NULL);
+
+    cache->max_entries = max_entries;
+    cache->mem_usage = sizeof(dns_cache_t);
+
+    return(cache);
+}
+
+/* ******************************************************* */
+
+static void remove_entry(dns_cache_t *cache, dns_entry_t *entry) {
+    HASH_DELETE(hh, cache->table, entry);
+    cache->mem_usage -= sizeof(dns_entry_t) + entry->key_len + entry->msg_len;
+    free(entry);
+}
+
+/* ******************************************************* */
+
+void dns_cache_destroy(dns_cache_t *cache) {
+    dns_entry_t *entry, *tmp;
+
+    HASH_ITER(hh, cache->table, entry, tmp)
+        remove_entry(cache, entry);
+
+    free(cache);
+}
+
+/* ******************************************************* */
+
+/* Build the response to the given query into out, if a valid cached response is available.
+ * query is the raw query, which was parsed into q. Returns the response length on hit, -1 on miss. */
+int dns_cache_lookup(dns_cache_t *cache, const dns_query_t *q, const u_int8_t *query,
+                     u_int64_t now_ms, u_int8_t *out, int out_size, dns_cache_hit_t *hit) {
+    dns_entry_t *entry;
+    u_int32_t elapsed;
+
+    HASH_FIND(hh, cache->table, q->key, q->key_len, entry);
+
+    if(entry && (now_ms >= entry->expire_ms)) {
+        remove_entry(cache, entry);
+        entry = NULL;
+    }
+
+    if(!entry || (entry->msg_len > q->udp_size) || (entry->msg_len > out_size) ||
+       (entry->question_len != q->question_len)) {
+        cache->stats.misses++;
+        return(-1);
+    }
+
+    // Bring the entry to the front of the list
+    HASH_DELETE(hh, cache->table, entry);
+    HASH_ADD_KEYPTR(hh, cache->table, entry->key, entry->key_len, entry);
+
+    memcpy(out, entry->msg, entry->msg_len);
+
+    dns_patch_response(out, q->txid, q->flags, query + DNS_HEADER_LEN, q->question_len);
+
+    elapsed = (u_int32_t)((now_ms - entry->cached_ms) / 1000);
+
+    for(int i = 0; i < entry->num_ttls; i++) {
+        u_int8_t *ttl_ptr = out + entry->ttl_ofs[i];
+        u_int32_t ttl = get32(ttl_ptr);
+
+        put32(ttl_ptr, (ttl > elapsed) ? (ttl - elapsed) : 0);
+    }
+
+    hit->rtt_ms = entry->rtt_ms;
+    hit->ipver = entry->ipver;
+    hit->addr = entry->addr;
+
+    cache->stats.hits++;
+    cache->stats.saved_ms += entry->rtt_ms;
+
+    return(entry->msg_len);
+}
+
+/* ******************************************************* */
+
+/* Record a query which missed the cache and was sent upstream, to measure the upstream RTT */
+void dns_cache_query_sent(dns_cache_t *cache, const dns_query_t *q, u_int64_t now_ms) {
+    dns_pending_t *pending = &cache->pending[q->txid % DNS_PENDING_SLOTS];
+
+    pending->txid = q->txid;
+    pending->key_hash = key_hash(q->key, q->key_len);
+    pending->sent_ms = now_ms;
+}
+
+/* ******************************************************* */
+
+/* Parse a response to a standard query with a single question. Returns 0 on success. */
+static int parse_response(const u_int8_t *data, int len, dns_response_t *rsp) {
+    u_int16_t an, ns, ar;
+    u_int8_t key_flags = 0;
+    int ofs;
+
+    if((len < DNS_HEADER_LEN) || (len > DNS_MAX_MSG_SIZE))
+        return(-1);
+
+    rsp->txid = get16(data);
+    rsp->flags = get16(data + 2);
+    an = get16(data + 6);
+    ns = get16(data + 8);
+    ar = get16(data + 10);
+
+    if(!(rsp->flags & DNS_FLAG_QR) || (DNS_OPCODE(rsp->flags) != 0) || (get16(data + 4) != 1))
+        return(-1);
+
+    if((ofs = parse_question(data, len, rsp->key, &rsp->key_len, rsp->qname)) < 0)
+        return(-1);
+
+    rsp->question_len = ofs - DNS_HEADER_LEN;
+    rsp->num_answers = an;
+    rsp->num_ttls = 0;
+    rsp->min_ttl = UINT32_MAX;
+    rsp->neg_ttl = UINT32_MAX;
+    rsp->ipver = 0;
+    memset(&rsp->addr, 0, sizeof(rsp->addr));
+
+    for(int i = 0; i < (an + ns + ar); i++) {
+        u_int16_t type, rdlen;
+        u_int32_t ttl;
+        int rdata;
+
+        if(((ofs = skip_name(data, len, ofs)) < 0) || ((ofs + 10) > len))
+            return(-1);
+
+        type = get16(data + ofs);
+        ttl = get32(data + ofs + 4);
+        rdlen = get16(data + ofs + 8);
+        rdata = ofs + 10;
+
+        if((rdata + rdlen) > len)
+            return(-1);
+
+        if(ttl & 0x80000000)
+            ttl = 0; // RFC 2181
+
+        if(type == DNS_TYPE_OPT) {
+            if(i < (an + ns))
+                return(-1);
+
+            key_flags |= KEY_FLAG_EDNS;
+
+            if(get16(data + ofs + 6) & EDNS_FLAG_DO)
+                key_flags |= KEY_FLAG_DO;
+        } else {
+            /* too many records to patch, will not be cached */
+            if(rsp->num_ttls < DNS_MAX_TTLS)
+                rsp->ttl_ofs[rsp->num_ttls] = ofs + 4;
+            rsp->num_ttls++;
+
+            if(i < an) {
+                rsp->min_ttl = (ttl < rsp->min_ttl) ? ttl : rsp->min_ttl;
+
+                if(!rsp->ipver && (type == DNS_TYPE_A) && (rdlen == 4)) {
+                    memcpy(&rsp->addr.ip4, data + rdata, 4);
+                    rsp->ipver = 4;
+                } else if(!rsp->ipver && (type == DNS_TYPE_AAAA) && (rdlen == 16)) {
+                    memcpy(&rsp->addr.ip6, data + rdata, 16);
+                    rsp->ipver = 6;
+                }
+            } else if(i < (an + ns)) {
+                rsp->min_ttl = (ttl < rsp->min_ttl) ? ttl : rsp->min_ttl;
+
+                if((type == DNS_TYPE_SOA) && (rdlen >= 22)) {
+                    /* RFC 2308: the minimum of the SOA TTL and the SOA MINIMUM field */
+                    u_int32_t soa_min = get32(data + rdata + rdlen - 4);
+
+                    rsp->neg_ttl = (soa_min < ttl) ? soa_min : ttl;
+                }
+            }
+        }
+
+        ofs = rdata + rdlen;
+    }
+
+    if(rsp->flags & DNS_FLAG_CD)
+        key_flags |= KEY_FLAG_CD;
+
+    rsp->key[rsp->key_len++] = key_flags;
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Get the key of a response, which matches the key of the query. Returns 0 on success. */
+int dns_response_key(const u_int8_t *data, int len, u_int8_t *key, u_int16_t *key_len) {
+    dns_response_t rsp;
+
+    if(parse_response(data, len, &rsp) != 0)
+        return(-1);
+
+    memcpy(key, rsp.key, rsp.key_len);
+    *key_len = rsp.key_len;
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Get the name and the first A/AAAA answer (ipver 0 if none) of a response. Returns 0 on success. */
+int dns_response_answer(const u_int8_t *data, int len, char *qname, u_int8_t *ipver, zdtun_ip_t *addr) {
+    dns_response_t rsp;
+
+    if(parse_response(data, len, &rsp) != 0)
+        return(-1);
+
+    strcpy(qname, rsp.qname);
+    *ipver = rsp.ipver;
+    *addr = rsp.addr;
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Patch a response, in place, to match a query with the given id, flags and question */
+void dns_patch_response(u_int8_t *msg, u_int16_t txid, u_int16_t query_flags,
+                        const u_int8_t *question, int question_len) {
+    put16(msg, txid);
+    put16(msg + 2, (get16(msg + 2) & ~DNS_FLAG_RD) | (query_flags & DNS_FLAG_RD));
+
+    /* The question may differ in case (DNS 0x20) */
+    memcpy(msg + DNS_HEADER_LEN, question, question_len);
+}
+
+/* ******************************************************* */
+
+/* Truncate a response, in place, to its header and question, setting the TC flag, so that the
+ * client retries over TCP. Returns the new length. */
+int dns_truncate_response(u_int8_t *msg, int question_len) {
+    put16(msg + 2, get16(msg + 2) | DNS_FLAG_TC);
+    memset(msg + 6, 0, 6); /* no answer/authority/additional records */
+
+    return(DNS_HEADER_LEN + question_len);
+}
+
+/* ******************************************************* */
+
+/* Build the response to a blocked query: the unspecified address (0.0.0.0 or ::) for A/AAAA
+ * queries, NXDOMAIN otherwise. Returns the response length, -1 if out is too small. */
+int dns_build_blocked_response(const dns_query_t *q, const u_int8_t *query, u_int8_t *out, int out_size) {
+    const u_int8_t *question = query + DNS_HEADER_LEN;
+    u_int16_t qtype = get16(question + q->question_len - 4);
+    u_int16_t qclass = get16(question + q->question_len - 2);
+    int rdlen = 0;
+    int len;
+
+    if((qclass == DNS_CLASS_IN) && (qtype == DNS_TYPE_A))
+        rdlen = 4;
+    else if((qclass == DNS_CLASS_IN) && (qtype == DNS_TYPE_AAAA))
+        rdlen = 16;
+
+    len = DNS_HEADER_LEN + q->question_len + (rdlen ? (12 + rdlen) : 0);
+    if(len > out_size)
+        return(-1);
+
+    memset(out, 0, len);
+    put16(out, q->txid);
+    put16(out + 2, DNS_FLAG_QR | (q->flags & (DNS_FLAG_RD | DNS_FLAG_CD)) | DNS_FLAG_RA |
+                   (rdlen ? DNS_RCODE_NOERROR : DNS_RCODE_NXDOMAIN));
+    put16(out + 4, 1);
+    put16(out + 6, rdlen ? 1 : 0);
+    memcpy(out + DNS_HEADER_LEN, question, q->question_len);
+
+    if(rdlen) {
+        u_int8_t *rr = out + DNS_HEADER_LEN + q->question_len;
+
+        put16(rr, 0xC000 | DNS_HEADER_LEN); /* pointer to the question name */
+        put16(rr + 2, qtype);
+        put16(rr + 4, DNS_CLASS_IN);
+        put32(rr + 6, DNS_BLOCKED_TTL);
+        put16(rr + 10, rdlen);
+        /* the address is all zeros */
+    }
+
+    return(len);
+}
+
+/* ******************************************************* */
+
+/* Cache an upstream response, if cacheable */
+void dns_cache_add_response(dns_cache_t *cache, const u_int8_t *data, int len, u_int64_t now_ms) {
+    dns_response_t rsp;
+    u_int32_t ttl, rtt_ms = 0;
+    dns_pending_t *pending;
+    dns_entry_t *entry;
+
+    if(parse_response(data, len, &rsp) != 0)
+        return;
+
+    if((rsp.flags & DNS_FLAG_TC) || (rsp.num_ttls > DNS_MAX_TTLS) ||
+       ((DNS_RCODE(rsp.flags) != DNS_RCODE_NOERROR) && (DNS_RCODE(rsp.flags) != DNS_RCODE_NXDOMAIN)))
+        return;
+
+    if((DNS_RCODE(rsp.flags) == DNS_RCODE_NXDOMAIN) || (rsp.num_answers == 0)) {
+        /* Negative response, only cached if the SOA is available */
+        if(rsp.neg_ttl == UINT32_MAX)
+            return;
+
+        ttl = (rsp.neg_ttl < DNS_CACHE_MAX_NEG_TTL) ? rsp.neg_ttl : DNS_CACHE_MAX_NEG_TTL;
+    } else
+        ttl = (rsp.min_ttl < DNS_CACHE_MAX_TTL) ? rsp.min_ttl : DNS_CACHE_MAX_TTL;
+
+    if(ttl == 0)
+        return;
+
+    /* Measure the RTT of the matching query */
+    pending = &cache->pending[rsp.txid % DNS_PENDING_SLOTS];
+
+    if(pending->sent_ms && (pending->txid == rsp.txid) && (now_ms >= pending->sent_ms) &&
+       (pending->key_hash == key_hash(rsp.key, rsp.key_len))) {
+        rtt_ms = (u_int32_t)(now_ms - pending->sent_ms);
+        pending->sent_ms = 0;
+    }
+
+    HASH_FIND(hh, cache->table, rsp.key, rsp.key_len, entry);
+
+    if(entry)
+        remove_entry(cache, entry);
+
+    if((entry = malloc(sizeof(dns_entry_t) + rsp.key_len + len)) == NULL)
+        return;
+
+    entry->key = (u_int8_t*)(entry + 1);
+    entry->msg = entry->key + rsp.key_len;
+    entry->key_len = rsp.key_len;
+    entry->msg_len = len;
+    entry->question_len = rsp.question_len;
+    entry->num_ttls = rsp.num_ttls;
+    entry->cached_ms = now_ms;
+    entry->expire_ms = now_ms + ttl * 1000ULL;
+    entry->rtt_ms = rtt_ms;
+    entry->ipver = rsp.ipver;
+    entry->addr = rsp.addr;
+    memcpy(entry->ttl_ofs, rsp.ttl_ofs, rsp.num_ttls * sizeof(u_int16_t));
+    memcpy(entry->key, rsp.key, rsp.key_len);
+    memcpy(entry->msg, data, len);
+
+    HASH_ADD_KEYPTR(hh, cache->table, entry->key, entry->key_len, entry);
+    cache->mem_usage += sizeof(dns_entry_t) + rsp.key_len + len;
+
+    if(HASH_COUNT(cache->table) > cache->max_entries) {
+        dns_entry_t *tmp;
+
+        // uthash guarantees that iteration order is same as insertion order
+        HASH_ITER(hh, cache->table, entry, tmp) {
+            // delete the oldest entry
+            remove_entry(cache, entry);
+            break;
+        }
+    }
+}
+
+/* ******************************************************* */
+
+const dns_cache_stats_t* dns_cache_get_stats(dns_cache_t *cache) {
+    return(&cache->stats);
+}
+
+/* ******************************************************* */
+
+int dns_cache_size(dns_cache_t *cache) {
+    return HASH_COUNT(cache->table);
+}
+
+/* ******************************************************* */
+
+/* Approximate, does not include the uthash overhead */
+size_t dns_cache_mem_usage(dns_cache_t *cache) {
+    return(cache->mem_usage);
+}
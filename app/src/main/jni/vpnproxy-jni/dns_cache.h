@@ -0,0 +1,93 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __DNS_CACHE_H__
+#define __DNS_CACHE_H__
+
+#include <stdbool.h>
+#include "zdtun.h"
+
+/*
+ * A cache of the upstream DNS responses, used to answer the repeated queries without an
+ * upstream round-trip. Responses are cached as a whole, keyed by the question (case
+ * insensitive) and by the EDNS/DNSSEC flags of the query, so that the EDNS OPT record of the
+ * response is passed through to the clients which sent an equivalent query. On a hit, the
+ * cached response is patched with the query id, question and flags, and its TTLs are
+ * decremented by the time spent in the cache. Negative responses (NXDOMAIN/NODATA) are cached
+ * according to the SOA record of the authority section, as per RFC 2308.
+ *
+ * The responses passed to the callbacks of the DNS forwarder and coalescer are preceded by
+ * DNS_PKT_HEADROOM writable bytes, enough for an IPv6 + UDP header, so that the reply packet
+ * can be built in place, without copying the payload.
+ */
+
+#define DNS_HEADER_LEN          12
+#define DNS_MAX_NAME_LEN        255
+#define DNS_MAX_KEY_LEN         (DNS_MAX_NAME_LEN + 5)
+#define DNS_MAX_MSG_SIZE        4096
+#define DNS_PKT_HEADROOM        48      /* before the responses passed to the callbacks, see below */
+#define DNS_CACHE_MAX_ENTRIES   1024
+#define DNS_CACHE_MAX_TTL       3600
+#define DNS_CACHE_MAX_NEG_TTL   300
+#define DNS_BLOCKED_TTL         60
+
+/* A query which can be answered from the cache */
+typedef struct dns_query {
+    u_int16_t txid;
+    u_int16_t flags;        /* host byte order */
+    u_int16_t question_len; /* the question section, which starts at DNS_HEADER_LEN */
+    u_int16_t udp_size;     /* the maximum response size accepted by the client */
+    u_int16_t key_len;
+    u_int8_t key[DNS_MAX_KEY_LEN];
+    char qname[DNS_MAX_NAME_LEN + 1]; /* dotted, lowercase */
+} dns_query_t;
+
+typedef struct dns_cache_hit {
+    u_int32_t rtt_ms;   /* the upstream RTT measured when the response was cached, 0 if unknown */
+    u_int8_t ipver;     /* the first A/AAAA answer, 0 if none */
+    zdtun_ip_t addr;
+} dns_cache_hit_t;
+
+typedef struct dns_cache_stats {
+    u_int32_t hits;
+    u_int32_t misses;
+    u_int64_t saved_ms; /* the sum of the upstream RTTs saved by the hits */
+} dns_cache_stats_t;
+
+typedef struct dns_cache dns_cache_t;
+
+int dns_parse_query(const u_int8_t *data, int len, dns_query_t *q);
+int dns_response_key(const u_int8_t *data, int len, u_int8_t *key, u_int16_t *key_len);
+int dns_response_answer(const u_int8_t *data, int len, char *qname, u_int8_t *ipver, zdtun_ip_t *addr);
+void dns_patch_response(u_int8_t *msg, u_int16_t txid, u_int16_t query_flags,
+                        const u_int8_t *question, int question_len);
+int dns_truncate_response(u_int8_t *msg, int question_len);
+int dns_build_blocked_response(const dns_query_t *q, const u_int8_t *query, u_int8_t *out, int out_size);
+
+dns_cache_t* dns_cache_init(int max_entries);
+void dns_cache_destroy(dns_cache_t *cache);
+int dns_cache_lookup(dns_cache_t *cache, const dns_query_t *q, const u_int8_t *query,
+                     u_int64_t now_ms, u_int8_t *out, int out_size, dns_cache_hit_t *hit);
+void dns_cache_query_sent(dns_cache_t *cache, const dns_query_t *q, u_int64_t now_ms);
+void dns_cache_add_response(dns_cache_t *cache, const u_int8_t *data, int len, u_int64_t now_ms);
+const dns_cache_stats_t* dns_cache_get_stats(dns_cache_t *cache);
+int dns_cache_size(dns_cache_t *cache);
+size_t dns_cache_mem_usage(dns_cache_t *cache);
+
+#endif // __DNS_CACHE_H__
@@ -0,0 +1,218 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "dns_coalesce.h"
+#include "third_party/uthash.h"
+
+typedef struct dns_inflight {
+    u_int8_t key[DNS_MAX_KEY_LEN];
+    u_int16_t key_len;
+
+    /* the query sent upstream */
+    u_int32_t leader_ip;
+    u_int16_t leader_port;
+    u_int16_t leader_txid;
+    u_int64_t sent_ms;
+
+    dns_waiter_t *waiters;
+    int num_waiters;
+    UT_hash_handle hh;
+} dns_inflight_t;
+
+struct dns_coalesce {
+    dns_inflight_t *table;
+    u_int32_t num_coalesced;
+    size_t mem_usage;
+};
+
+/* ******************************************************* */
+
+dns_coalesce_t* dns_coalesce_init() {
+    dns_coalesce_t *dc = calloc(1, sizeof(dns_coalesce_t));
+
+    if(!dc)
+        return(NULL);
+
+    dc->mem_usage = sizeof(dns_coalesce_t);
+    return(dc);
+}
+
+/* ******************************************************* */
+
+static void remove_inflight(dns_coalesce_t *dc, dns_inflight_t *inflight) {
+    HASH_DELETE(hh, dc->table, inflight);
+
+    dc->mem_usage -= sizeof(dns_inflight_t) + inflight->num_waiters * sizeof(dns_waiter_t);
+
+    if(inflight->waiters)
+        free(inflight->waiters);
+    free(inflight);
+}
+
+/* ******************************************************* */
+
+void dns_coalesce_destroy(dns_coalesce_t *dc) {
+    dns_inflight_t *inflight, *tmp;
+
+    HASH_ITER(hh, dc->table, inflight, tmp)
+        remove_inflight(dc, inflight);
+
+    free(dc);
+}
+
+/* ******************************************************* */
+
+/* Remove the in-flight queries which got no response in time. Their waiters will retry. */
+void dns_coalesce_purge(dns_coalesce_t *dc, u_int64_t now_ms) {
+    dns_inflight_t *inflight, *tmp;
+
+    HASH_ITER(hh, dc->table, inflight, tmp) {
+        if((now_ms - inflight->sent_ms) >= DNS_INFLIGHT_TIMEOUT_MS)
+            remove_inflight(dc, inflight);
+    }
+}
+
+/* ******************************************************* */
+
+/* Register a query which missed the DNS cache. Returns true if an identical query is in-flight,
+ * in which case the query is held until its response and must not be forwarded. Returns false
+ * if the query must be forwarded upstream. */
+bool dns_coalesce_query(dns_coalesce_t *dc, const dns_query_t *q, const u_int8_t *query,
+                        u_int32_t src_ip, u_int16_t src_port, u_int64_t now_ms) {
+    dns_inflight_t *inflight;
+
+    HASH_FIND(hh, dc->table, q->key, q->key_len, inflight);
+
+    if(inflight && ((now_ms - inflight->sent_ms) >= DNS_INFLIGHT_TIMEOUT_MS)) {
+        remove_inflight(dc, inflight);
+        inflight = NULL;
+    }
+
+    if(inflight) {
+        dns_waiter_t *waiter, *waiters;
+
+        /* Retransmissions of the leader query must go upstream */
+        if((inflight->leader_ip == src_ip) && (inflight->leader_port == src_port) &&
+           (inflight->leader_txid == q->txid))
+            return(false);
+
+        if(inflight->num_waiters >= DNS_INFLIGHT_MAX_WAITERS)
+            return(false);
+
+        waiters = realloc(inflight->waiters, (inflight->num_waiters + 1) * sizeof(dns_waiter_t));
+
+        if(!waiters)
+            return(false);
+
+        inflight->waiters = waiters;
+        waiter = &waiters[inflight->num_waiters++];
+        waiter->ip = src_ip;
+        waiter->port = src_port;
+        waiter->txid = q->txid;
+        waiter->flags = q->flags;
+        waiter->udp_size = q->udp_size;
+        waiter->question_len = q->question_len;
+        memcpy(waiter->question, query + DNS_HEADER_LEN, q->question_len);
+
+        dc->mem_usage += sizeof(dns_waiter_t);
+        dc->num_coalesced++;
+        return(true);
+    }
+
+    if(HASH_COUNT(dc->table) >= DNS_INFLIGHT_MAX_ENTRIES) {
+        dns_coalesce_purge(dc, now_ms);
+
+        if(HASH_COUNT(dc->table) >= DNS_INFLIGHT_MAX_ENTRIES)
+            return(false);
+    }
+
+    /* New leader */
+    if((inflight = calloc(1, sizeof(dns_inflight_t))) == NULL)
+        return(false);
+
+    memcpy(inflight->key, q->key, q->key_len);
+    inflight->key_len = q->key_len;
+    inflight->leader_ip = src_ip;
+    inflight->leader_port = src_port;
+    inflight->leader_txid = q->txid;
+    inflight->sent_ms = now_ms;
+
+    HASH_ADD(hh, dc->table, key, inflight->key_len, inflight);
+    dc->mem_usage += sizeof(dns_inflight_t);
+
+    return(false);
+}
+
+/* ******************************************************* */
+
+/* Handle an upstream response to the client_ip:client_port query. If the query was the leader
+ * of an in-flight query, the response is fanned out to the waiters via cb.
+ * Returns the number of waiters served. */
+int dns_coalesce_response(dns_coalesce_t *dc, const u_int8_t *rsp, int rsp_len,
+                          u_int32_t client_ip, u_int16_t client_port, dns_waiter_cb_t *cb, void *userdata) {
+    u_int8_t key[DNS_MAX_KEY_LEN];
+    u_int8_t buf[DNS_PKT_HEADROOM + DNS_MAX_MSG_SIZE];
+    u_int8_t *reply = buf + DNS_PKT_HEADROOM;
+    dns_inflight_t *inflight;
+    u_int16_t key_len;
+    int num_served;
+
+    if((dc->table == NULL) || (rsp_len < DNS_HEADER_LEN) || (rsp_len > DNS_MAX_MSG_SIZE) ||
+       (dns_response_key(rsp, rsp_len, key, &key_len) != 0))
+        return(0);
+
+    HASH_FIND(hh, dc->table, key, key_len, inflight);
+
+    if(!inflight || (inflight->leader_ip != client_ip) || (inflight->leader_port != client_port) ||
+       (inflight->leader_txid != ((rsp[0] << 8) | rsp[1])))
+        return(0);
+
+    for(int i = 0; i < inflight->num_waiters; i++) {
+        const dns_waiter_t *waiter = &inflight->waiters[i];
+        int reply_len = rsp_len;
+
+        memcpy(reply, rsp, rsp_len);
+        dns_patch_response(reply, waiter->txid, waiter->flags, waiter->question, waiter->question_len);
+
+        if(reply_len > waiter->udp_size)
+            reply_len = dns_truncate_response(reply, waiter->question_len);
+
+        cb(waiter, reply, reply_len, userdata);
+    }
+
+    num_served = inflight->num_waiters;
+    remove_inflight(dc, inflight);
+
+    return(num_served);
+}
+
+/* ******************************************************* */
+
+u_int32_t dns_coalesce_num_coalesced(dns_coalesce_t *dc) {
+    return(dc->num_coalesced);
+}
+
+/* ******************************************************* */
+
+/* Approximate, does not include the uthash overhead */
+size_t dns_coalesce_mem_usage(dns_coalesce_t *dc) {
+    return(dc->mem_usage);
+}
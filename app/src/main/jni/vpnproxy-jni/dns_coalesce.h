@@ -0,0 +1,62 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __DNS_COALESCE_H__
+#define __DNS_COALESCE_H__
+
+#include <stdbool.h>
+#include "dns_cache.h"
+
+/*
+ * Coalescing of the identical in-flight queries to the VPN DNS. The first query (the leader)
+ * is forwarded upstream, while the identical queries (same key as in the DNS cache) received
+ * before its response are held as waiters. When the leader response arrives, it is fanned out
+ * to each waiter, patched with its own transaction id and question.
+ */
+
+#define DNS_INFLIGHT_TIMEOUT_MS     5000
+#define DNS_INFLIGHT_MAX_WAITERS    16
+#define DNS_INFLIGHT_MAX_ENTRIES    256
+
+typedef struct dns_waiter {
+    u_int32_t ip;           /* network byte order */
+    u_int16_t port;         /* network byte order */
+    u_int16_t txid;
+    u_int16_t flags;
+    u_int16_t udp_size;
+    u_int16_t question_len;
+    u_int8_t question[DNS_MAX_KEY_LEN];
+} dns_waiter_t;
+
+/* Called for each waiter with its response payload, preceded by DNS_PKT_HEADROOM bytes */
+typedef void (dns_waiter_cb_t)(const dns_waiter_t *waiter, u_int8_t *rsp, int rsp_len, void *userdata);
+
+typedef struct dns_coalesce dns_coalesce_t;
+
+dns_coalesce_t* dns_coalesce_init();
+void dns_coalesce_destroy(dns_coalesce_t *dc);
+bool dns_coalesce_query(dns_coalesce_t *dc, const dns_query_t *q, const u_int8_t *query,
+                        u_int32_t src_ip, u_int16_t src_port, u_int64_t now_ms);
+int dns_coalesce_response(dns_coalesce_t *dc, const u_int8_t *rsp, int rsp_len,
+                          u_int32_t client_ip, u_int16_t client_port, dns_waiter_cb_t *cb, void *userdata);
+void dns_coalesce_purge(dns_coalesce_t *dc, u_int64_t now_ms);
+u_int32_t dns_coalesce_num_coalesced(dns_coalesce_t *dc);
+size_t dns_coalesce_mem_usage(dns_coalesce_t *dc);
+
+#endif // __DNS_COALESCE_H__
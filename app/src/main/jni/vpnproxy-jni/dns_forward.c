@@ -0,0 +1,742 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* recvmmsg */
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include "dns_forward.h"
+#include "third_party/uthash.h"
+
+typedef struct dns_upstream {
+    u_int32_t ip;
+    u_int32_t srtt_ms;      /* 0 if not measured yet */
+    u_int32_t rttvar_ms;
+    u_int16_t samples[DNS_FWD_RTT_SAMPLES];
+    u_int32_t num_samples;
+    u_int64_t last_sample_ms;
+    u_int32_t queries;
+    u_int32_t responses;
+    u_int32_t failures;
+    int consecutive_failures;
+    u_int32_t backoff_ms;
+    u_int64_t down_until_ms; /* 0 if healthy */
+    bool fallback;          /* only used when all the other upstreams are down */
+} dns_upstream_t;
+
+/* A query waiting for the upstream response */
+typedef struct dns_fwd_pending {
+    u_int32_t id;           /* (socket index << 16) | upstream txid */
+    u_int32_t servers[2];   /* the primary and, if raced, the secondary upstream */
+    u_int64_t sent_ms[2];
+    int num_sent;
+    u_int64_t race_ms;      /* when to race the secondary upstream, 0 if not possible */
+    u_int32_t client_ip;
+    u_int16_t client_port;
+    u_int16_t client_txid;
+    u_int16_t key_len;
+    u_int8_t key[DNS_MAX_KEY_LEN];
+    UT_hash_handle hh;
+    u_int16_t query_len;
+    u_int8_t query[];       /* with the upstream txid, used for the race */
+} dns_fwd_pending_t;
+
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define DNS_FWD_GRO_MSG_SIZE 65535
+
+/* The receive pool, see dns_fwd_handle_fds. Each buffer is DNS_PKT_HEADROOM + msg_size bytes. */
+typedef struct dns_fwd_batch {
+    struct mmsghdr msgs[DNS_FWD_MAX_RECV_BATCH];
+    struct iovec iovs[DNS_FWD_MAX_RECV_BATCH];
+    struct sockaddr_in from[DNS_FWD_MAX_RECV_BATCH];
+    u_int8_t ctrl[DNS_FWD_MAX_RECV_BATCH][CMSG_SPACE(sizeof(int))];
+    int num_bufs;
+    int msg_size;
+    u_int8_t bufs[];
+} dns_fwd_batch_t;
+
+struct dns_fwd {
+    int socks[DNS_FWD_NUM_SOCKETS];
+    int num_socks;
+    int next_sock;
+    dns_upstream_t upstreams[DNS_FWD_MAX_UPSTREAMS];
+    int num_upstreams;
+    int num_raceable;       /* the upstreams other than the fallback */
+    u_int32_t num_queries;
+    dns_fwd_pending_t *pending; /* in sending order */
+    u_int64_t next_timeout_ms;
+    dns_fwd_stats_t stats;
+    dns_fwd_batch_t *batch;
+    size_t mem_usage;
+};
+
+/* ******************************************************* */
+
+static inline u_int16_t get16(const u_int8_t *p) {
+    return((p[0] << 8) | p[1]);
+}
+
+static inline void put16(u_int8_t *p, u_int16_t val) {
+    p[0] = val >> 8;
+    p[1] = val & 0xFF;
+}
+
+/* ******************************************************* */
+
+dns_fwd_t* dns_fwd_init(dns_fwd_protect_cb_t *protect, void *userdata) {
+    dns_fwd_t *fwd = calloc(1, sizeof(dns_fwd_t));
+
+    int num_bufs, msg_size;
+    size_t batch_size;
+
+    if(!fwd)
+        return(NULL);
+
+    fwd->stats.gro = true;
+
+    for(int i = 0; i < DNS_FWD_NUM_SOCKETS; i++) {
+        int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+        if(sock < 0)
+            break;
+
+        if((fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK) < 0) || !protect(sock, userdata)) {
+            close(sock);
+            break;
+        }
+
+        fwd->socks[fwd->num_socks++] = sock;
+
+        /* Probe: unsupported before Linux 5.0 */
+        if(fwd->stats.gro && (setsockopt(sock, IPPROTO_UDP, UDP_GRO, &(int){1}, sizeof(int)) < 0))
+            fwd->stats.gro = false;
+    }
+
+    if(fwd->num_socks == 0) {
+        free(fwd);
+        return(NULL);
+    }
+
+    if(!fwd->stats.gro) {
+        /* Fall back to the plain receive on all the sockets */
+        for(int i = 0; i < fwd->num_socks; i++)
+            setsockopt(fwd->socks[i], IPPROTO_UDP, UDP_GRO, &(int){0}, sizeof(int));
+    }
+
+    num_bufs = fwd->stats.gro ? DNS_FWD_GRO_BATCH : DNS_FWD_MAX_RECV_BATCH;
+    msg_size = fwd->stats.gro ? DNS_FWD_GRO_MSG_SIZE : DNS_MAX_MSG_SIZE;
+    batch_size = sizeof(dns_fwd_batch_t) + (size_t) num_bufs * (DNS_PKT_HEADROOM + msg_size);
+
+    if(!(fwd->batch = malloc(batch_size))) {
+        for(int i = 0; i < fwd->num_socks; i++)
+            close(fwd->socks[i]);
+        free(fwd);
+        return(NULL);
+    }
+
+    fwd->batch->num_bufs = num_bufs;
+    fwd->batch->msg_size = msg_size;
+    fwd->next_timeout_ms = UINT64_MAX;
+    fwd->mem_usage = sizeof(dns_fwd_t) + batch_size;
+    return(fwd);
+}
+
+/* ******************************************************* */
+
+static void remove_pending(dns_fwd_t *fwd, dns_fwd_pending_t *pending) {
+    HASH_DELETE(hh, fwd->pending, pending);
+    fwd->mem_usage -= sizeof(dns_fwd_pending_t) + pending->query_len;
+    free(pending);
+}
+
+/* ******************************************************* */
+
+void dns_fwd_destroy(dns_fwd_t *fwd) {
+    dns_fwd_pending_t *pending, *tmp;
+
+    HASH_ITER(hh, fwd->pending, pending, tmp)
+        remove_pending(fwd, pending);
+
+    for(int i = 0; i < fwd->num_socks; i++)
+        close(fwd->socks[i]);
+
+    free(fwd->batch);
+    free(fwd);
+}
+
+/* ******************************************************* */
+
+static dns_upstream_t* find_upstream(dns_fwd_t *fwd, u_int32_t ip) {
+    for(int i = 0; i < fwd->num_upstreams; i++) {
+        if(fwd->upstreams[i].ip == ip)
+            return(&fwd->upstreams[i]);
+    }
+
+    return(NULL);
+}
+
+/* ******************************************************* */
+
+/* Set the upstream servers, in order of preference for the ones not measured yet, and the
+ * fallback server (0 if none). The fallback is ignored if it is also one of the servers. The
+ * measurements of the upstreams already configured are preserved. */
+void dns_fwd_set_upstreams(dns_fwd_t *fwd, const u_int32_t *servers, int num_servers, u_int32_t fallback) {
+    dns_upstream_t upstreams[DNS_FWD_MAX_UPSTREAMS];
+    int num = 0;
+
+    for(int i = 0; (i <= num_servers) && (num < DNS_FWD_MAX_UPSTREAMS); i++) {
+        bool is_fallback = (i == num_servers);
+        u_int32_t ip = is_fallback ? fallback : servers[i];
+        dns_upstream_t *existing = find_upstream(fwd, ip);
+        bool duplicate = false;
+
+        for(int j = 0; j < num; j++)
+            duplicate |= (upstreams[j].ip == ip);
+
+        if(duplicate || (ip == 0))
+            continue;
+
+        if(existing)
+            upstreams[num] = *existing;
+        else {
+            memset(&upstreams[num], 0, sizeof(dns_upstream_t));
+            upstreams[num].ip = ip;
+        }
+        upstreams[num].fallback = is_fallback;
+        num++;
+    }
+
+    memcpy(fwd->upstreams, upstreams, num * sizeof(dns_upstream_t));
+    fwd->num_upstreams = num;
+    fwd->num_raceable = num - (((num > 0) && upstreams[num - 1].fallback) ? 1 : 0);
+}
+
+/* ******************************************************* */
+
+static inline bool is_healthy(const dns_upstream_t *upstream, u_int64_t now_ms) {
+    /* a down upstream is retried when its backoff expires */
+    return((upstream->down_until_ms == 0) || (now_ms >= upstream->down_until_ms));
+}
+
+/* ******************************************************* */
+
+/* Get the best upstream other than exclude (which can be NULL): the healthy one with the lowest
+ * smoothed RTT, or the one which will be retried first if all are down. The fallback is only
+ * returned if all the other upstreams are down and it is not. */
+static dns_upstream_t* select_upstream(dns_fwd_t *fwd, const dns_upstream_t *exclude, u_int64_t now_ms) {
+    dns_upstream_t *best = NULL;
+    dns_upstream_t *fallback = NULL;
+    bool best_healthy = false;
+
+    for(int i = 0; i < fwd->num_upstreams; i++) {
+        dns_upstream_t *upstream = &fwd->upstreams[i];
+        bool healthy = is_healthy(upstream, now_ms);
+
+        if(upstream->fallback) {
+            if(upstream != exclude)
+                fallback = upstream;
+            continue;
+        }
+
+        if(upstream == exclude)
+            continue;
+
+        if(!best || (healthy && !best_healthy) ||
+           ((healthy == best_healthy) && (healthy ? (upstream->srtt_ms < best->srtt_ms) :
+                                                    (upstream->down_until_ms < best->down_until_ms)))) {
+            best = upstream;
+            best_healthy = healthy;
+        }
+    }
+
+    if(fallback && (!best || (!best_healthy && is_healthy(fallback, now_ms))))
+        return(fallback);
+
+    return(best);
+}
+
+/* ******************************************************* */
+
+/* Get the healthy upstream measured least recently, used to keep measuring all the upstreams.
+ * The fallback is never probed. */
+static dns_upstream_t* select_probe_upstream(dns_fwd_t *fwd, u_int64_t now_ms) {
+    dns_upstream_t *oldest = NULL;
+
+    for(int i = 0; i < fwd->num_upstreams; i++) {
+        dns_upstream_t *upstream = &fwd->upstreams[i];
+
+        if(!upstream->fallback && is_healthy(upstream, now_ms) && (!oldest || (upstream->last_sample_ms < oldest->last_sample_ms)))
+            oldest = upstream;
+    }
+
+    return(oldest);
+}
+
+/* ******************************************************* */
+
+static u_int32_t race_timeout_ms(const dns_upstream_t *upstream) {
+    u_int32_t rto;
+
+    if(upstream->srtt_ms == 0)
+        return(DNS_FWD_MAX_RACE_MS);
+
+    rto = upstream->srtt_ms + 4 * upstream->rttvar_ms;
+
+    if(rto < DNS_FWD_MIN_RACE_MS)
+        return(DNS_FWD_MIN_RACE_MS);
+    return((rto > DNS_FWD_MAX_RACE_MS) ? DNS_FWD_MAX_RACE_MS : rto);
+}
+
+/* ******************************************************* */
+
+/* Update the smoothed RTT, as per RFC 6298 */
+static void update_rtt(dns_upstream_t *upstream, u_int32_t rtt_ms, u_int64_t now_ms) {
+    upstream->last_sample_ms = now_ms;
+
+    if(rtt_ms == 0)
+        rtt_ms = 1;
+
+    if(upstream->srtt_ms == 0) {
+        upstream->srtt_ms = rtt_ms;
+        upstream->rttvar_ms = rtt_ms / 2;
+    } else {
+        u_int32_t delta = (rtt_ms > upstream->srtt_ms) ? (rtt_ms - upstream->srtt_ms) : (upstream->srtt_ms - rtt_ms);
+
+        upstream->rttvar_ms = (3 * upstream->rttvar_ms + delta) / 4;
+        upstream->srtt_ms = (7 * upstream->srtt_ms + rtt_ms) / 8;
+    }
+}
+
+/* ******************************************************* */
+
+static void upstream_response(dns_upstream_t *upstream, u_int32_t rtt_ms, u_int64_t now_ms) {
+    update_rtt(upstream, rtt_ms, now_ms);
+
+    upstream->samples[upstream->num_samples++ % DNS_FWD_RTT_SAMPLES] = (rtt_ms > UINT16_MAX) ? UINT16_MAX : rtt_ms;
+    upstream->responses++;
+    upstream->consecutive_failures = 0;
+    upstream->backoff_ms = 0;
+    upstream->down_until_ms = 0;
+}
+
+/* ******************************************************* */
+
+static void upstream_failure(dns_upstream_t *upstream, u_int64_t now_ms) {
+    upstream->failures++;
+
+    if(++upstream->consecutive_failures >= DNS_FWD_MAX_FAILURES) {
+        upstream->backoff_ms = upstream->backoff_ms ? (upstream->backoff_ms * 2) : DNS_FWD_RETRY_MS;
+
+        if(upstream->backoff_ms > DNS_FWD_MAX_RETRY_MS)
+            upstream->backoff_ms = DNS_FWD_MAX_RETRY_MS;
+
+        upstream->down_until_ms = now_ms + upstream->backoff_ms;
+    }
+}
+
+/* ******************************************************* */
+
+static int send_query(dns_fwd_t *fwd, const dns_fwd_pending_t *pending, u_int32_t server_ip) {
+    struct sockaddr_in servaddr = {0};
+    int sock = fwd->socks[pending->id >> 16];
+
+    servaddr.sin_family = AF_INET;
+    servaddr.sin_port = htons(53);
+    servaddr.sin_addr.s_addr = server_ip;
+
+    if(sendto(sock, pending->query, pending->query_len, 0,
+              (struct sockaddr*) &servaddr, sizeof(servaddr)) != pending->query_len)
+        return(-1);
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Send a query to the best upstream. Returns 0 on success, -1 if the query could not be sent
+ * (e.g. too many pending queries), in which case it should be forwarded via zdtun. */
+int dns_fwd_query(dns_fwd_t *fwd, const dns_query_t *q, const u_int8_t *query, int query_len,
+                  u_int32_t client_ip, u_int16_t client_port, u_int64_t now_ms) {
+    dns_fwd_pending_t *pending, *existing;
+    dns_upstream_t *upstream;
+    int sock_idx;
+    u_int32_t id;
+    int attempts = 0;
+
+    if((query_len > DNS_MAX_MSG_SIZE) || (HASH_COUNT(fwd->pending) >= DNS_FWD_MAX_PENDING))
+        return(-1);
+
+    /* Periodically probe the other upstreams. A slow probe is covered by the race. */
+    upstream = NULL;
+    if((++fwd->num_queries % DNS_FWD_PROBE_INTERVAL) == 0)
+        upstream = select_probe_upstream(fwd, now_ms);
+    if(!upstream)
+        upstream = select_upstream(fwd, NULL, now_ms);
+
+    if(!upstream)
+        return(-1);
+
+    sock_idx = fwd->next_sock;
+    fwd->next_sock = (fwd->next_sock + 1) % fwd->num_socks;
+
+    /* A random id prevents off-path spoofing, retry on the (unlikely) collisions */
+    do {
+        id = ((u_int32_t)sock_idx << 16) | (arc4random() & 0xFFFF);
+        HASH_FIND_INT(fwd->pending, &id, existing);
+    } while(existing && (++attempts < 8));
+
+    if(existing || !(pending = malloc(sizeof(dns_fwd_pending_t) + query_len)))
+        return(-1);
+
+    pending->id = id;
+    pending->query_len = query_len;
+    memcpy(pending->query, query, query_len);
+    put16(pending->query, id & 0xFFFF);
+
+    if(send_query(fwd, pending, upstream->ip) != 0) {
+        free(pending);
+        return(-1);
+    }
+
+    pending->servers[0] = upstream->ip;
+    pending->sent_ms[0] = now_ms;
+    pending->num_sent = 1;
+    pending->race_ms = (!upstream->fallback && (fwd->num_raceable > 1)) ? (now_ms + race_timeout_ms(upstream)) : 0;
+    pending->client_ip = client_ip;
+    pending->client_port = client_port;
+    pending->client_txid = q->txid;
+    pending->key_len = q->key_len;
+    memcpy(pending->key, q->key, q->key_len);
+
+    HASH_ADD_INT(fwd->pending, id, pending);
+    fwd->mem_usage += sizeof(dns_fwd_pending_t) + query_len;
+    fwd->stats.forwarded++;
+    upstream->queries++;
+
+    if(pending->race_ms && (pending->race_ms < fwd->next_timeout_ms))
+        fwd->next_timeout_ms = pending->race_ms;
+    else if((now_ms + DNS_FWD_TIMEOUT_MS) < fwd->next_timeout_ms)
+        fwd->next_timeout_ms = now_ms + DNS_FWD_TIMEOUT_MS;
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+void dns_fwd_fds(dns_fwd_t *fwd, int *max_fd, fd_set *rdfd) {
+    for(int i = 0; i < fwd->num_socks; i++) {
+        FD_SET(fwd->socks[i], rdfd);
+
+        if(fwd->socks[i] > *max_fd)
+            *max_fd = fwd->socks[i];
+    }
+}
+
+/* ******************************************************* */
+
+/* Match a response with its pending query. Returns NULL if the response must be dropped,
+ * otherwise sets the index of the upstream which sent it into server_idx. */
+static dns_fwd_pending_t* match_response(dns_fwd_t *fwd, int sock_idx, const u_int8_t *rsp, int rsp_len,
+                                         const struct sockaddr_in *from, int *server_idx) {
+    u_int8_t key[DNS_MAX_KEY_LEN];
+    u_int16_t key_len;
+    dns_fwd_pending_t *pending;
+    u_int32_t id;
+
+    if((rsp_len < DNS_HEADER_LEN) || (from->sin_port != htons(53)))
+        return(NULL);
+
+    id = ((u_int32_t)sock_idx << 16) | get16(rsp);
+    HASH_FIND_INT(fwd->pending, &id, pending);
+
+    if(!pending)
+        return(NULL);
+
+    *server_idx = -1;
+    for(int i = 0; i < pending->num_sent; i++) {
+        if(pending->servers[i] == from->sin_addr.s_addr)
+            *server_idx = i;
+    }
+
+    if(*server_idx < 0)
+        return(NULL);
+
+    /* The question must match, ignoring the EDNS/DNSSEC flags (the last key byte), which depend
+     * on the upstream. Unparsable responses (e.g. FORMERR without a question) are passed through. */
+    if((dns_response_key(rsp, rsp_len, key, &key_len) == 0) &&
+       ((key_len != pending->key_len) || (memcmp(key, pending->key, key_len - 1) != 0)))
+        return(NULL);
+
+    return(pending);
+}
+
+/* ******************************************************* */
+
+/* Match a response to its pending query and deliver it via cb */
+static void handle_response(dns_fwd_t *fwd, int sock_idx, u_int8_t *rsp, int rsp_len,
+                            const struct sockaddr_in *from, u_int64_t now_ms,
+                            dns_fwd_response_cb_t *cb, void *userdata) {
+    dns_fwd_pending_t *pending;
+    dns_upstream_t *upstream;
+    dns_fwd_client_t client;
+    int server_idx;
+
+    if(!(pending = match_response(fwd, sock_idx, rsp, rsp_len, from, &server_idx))) {
+        fwd->stats.dropped++;
+        return;
+    }
+
+    put16(rsp, pending->client_txid);
+
+    client.ip = pending->client_ip;
+    client.port = pending->client_port;
+    client.rtt_ms = (u_int32_t)(now_ms - pending->sent_ms[server_idx]);
+
+    if((upstream = find_upstream(fwd, pending->servers[server_idx])))
+        upstream_response(upstream, client.rtt_ms, now_ms);
+
+    /* The primary lost the race: its RTT is at least the time elapsed */
+    if((server_idx == 1) && (upstream = find_upstream(fwd, pending->servers[0]))) {
+        update_rtt(upstream, (u_int32_t)(now_ms - pending->sent_ms[0]), now_ms);
+        upstream_failure(upstream, now_ms);
+    }
+
+    remove_pending(fwd, pending);
+    fwd->stats.answered++;
+
+    cb(&client, rsp, rsp_len, userdata);
+}
+
+/* ******************************************************* */
+
+/* Get the GRO segment size of a received datagram, 0 if it was not coalesced */
+static int gro_segment_size(struct msghdr *msg) {
+    for(struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if((cmsg->cmsg_level == IPPROTO_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+            int seg_size;
+
+            memcpy(&seg_size, CMSG_DATA(cmsg), sizeof(int));
+            return(seg_size);
+        }
+    }
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Read the responses from the ready sockets and deliver them to the clients via cb. Returns the
+ * number of ready sockets. */
+int dns_fwd_handle_fds(dns_fwd_t *fwd, fd_set *rdfd, u_int64_t now_ms,
+                       dns_fwd_response_cb_t *cb, void *userdata) {
+    dns_fwd_batch_t *batch = fwd->batch;
+    size_t buf_size = DNS_PKT_HEADROOM + batch->msg_size;
+    int num_ready = 0;
+
+    for(int i = 0; i < fwd->num_socks; i++) {
+        int num_msgs, num_rsps = 0, bucket;
+
+        if(!FD_ISSET(fwd->socks[i], rdfd))
+            continue;
+
+        num_ready++;
+
+        /* Received after the headroom, so that the reply packet can be built in place */
+        for(int j = 0; j < batch->num_bufs; j++) {
+            struct msghdr *hdr = &batch->msgs[j].msg_hdr;
+
+            batch->iovs[j].iov_base = batch->bufs + j * buf_size + DNS_PKT_HEADROOM;
+            batch->iovs[j].iov_len = batch->msg_size;
+
+            memset(hdr, 0, sizeof(struct msghdr));
+            hdr->msg_name = &batch->from[j];
+            hdr->msg_namelen = sizeof(struct sockaddr_in);
+            hdr->msg_iov = &batch->iovs[j];
+            hdr->msg_iovlen = 1;
+
+            if(fwd->stats.gro) {
+                hdr->msg_control = batch->ctrl[j];
+                hdr->msg_controllen = sizeof(batch->ctrl[j]);
+            }
+        }
+
+        num_msgs = recvmmsg(fwd->socks[i], batch->msgs, batch->num_bufs, MSG_DONTWAIT, NULL);
+        fwd->stats.recv_calls++;
+
+        if(num_msgs <= 0)
+            continue; /* EAGAIN or error, e.g. ICMP unreachable */
+
+        for(int j = 0; j < num_msgs; j++) {
+            struct msghdr *hdr = &batch->msgs[j].msg_hdr;
+            u_int8_t *data = batch->iovs[j].iov_base;
+            int data_len = (int) batch->msgs[j].msg_len;
+            int seg_size = fwd->stats.gro ? gro_segment_size(hdr) : 0;
+
+            if(hdr->msg_flags & MSG_TRUNC) {
+                fwd->stats.dropped++;
+                continue;
+            }
+
+            if((seg_size <= 0) || (seg_size >= data_len)) {
+                handle_response(fwd, i, data, data_len, &batch->from[j], now_ms, cb, userdata);
+                num_rsps++;
+                continue;
+            }
+
+            /* Coalesced: all the segments have seg_size bytes, except the last one */
+            for(int off = 0; off < data_len; off += seg_size) {
+                int rsp_len = ((data_len - off) < seg_size) ? (data_len - off) : seg_size;
+
+                handle_response(fwd, i, data + off, rsp_len, &batch->from[j], now_ms, cb, userdata);
+                fwd->stats.gro_segments++;
+                num_rsps++;
+            }
+        }
+
+        for(bucket = 0; (bucket < DNS_FWD_BATCH_BUCKETS - 1) && ((num_rsps >> (bucket + 1)) > 0); bucket++);
+        fwd->stats.batches[bucket]++;
+    }
+
+    return(num_ready);
+}
+
+/* ******************************************************* */
+
+/* Get the time of the next race or timeout, UINT64_MAX if there are no pending queries */
+u_int64_t dns_fwd_next_timeout(dns_fwd_t *fwd) {
+    return(fwd->next_timeout_ms);
+}
+
+/* ******************************************************* */
+
+/* Race the queries whose primary upstream is late and remove the queries which got no
+ * response. In the latter case, the client will retry. */
+void dns_fwd_check_timeouts(dns_fwd_t *fwd, u_int64_t now_ms) {
+    dns_fwd_pending_t *pending, *tmp;
+    u_int64_t next_timeout_ms = UINT64_MAX;
+
+    HASH_ITER(hh, fwd->pending, pending, tmp) {
+        u_int64_t expire_ms = pending->sent_ms[0] + DNS_FWD_TIMEOUT_MS;
+
+        if(now_ms >= expire_ms) {
+            for(int i = 0; i < pending->num_sent; i++) {
+                dns_upstream_t *upstream = find_upstream(fwd, pending->servers[i]);
+
+                if(upstream)
+                    upstream_failure(upstream, now_ms);
+            }
+
+            remove_pending(fwd, pending);
+            fwd->stats.timeouts++;
+            continue;
+        }
+
+        if(pending->race_ms && (now_ms >= pending->race_ms)) {
+            dns_upstream_t *primary = find_upstream(fwd, pending->servers[0]);
+            dns_upstream_t *secondary = select_upstream(fwd, primary, now_ms);
+
+            pending->race_ms = 0;
+
+            /* the fallback is not raced */
+            if(secondary && !secondary->fallback && (send_query(fwd, pending, secondary->ip) == 0)) {
+                pending->servers[1] = secondary->ip;
+                pending->sent_ms[1] = now_ms;
+                pending->num_sent = 2;
+                secondary->queries++;
+                fwd->stats.raced++;
+            }
+        }
+
+        if(pending->race_ms && (pending->race_ms < next_timeout_ms))
+            next_timeout_ms = pending->race_ms;
+        if(expire_ms < next_timeout_ms)
+            next_timeout_ms = expire_ms;
+    }
+
+    fwd->next_timeout_ms = next_timeout_ms;
+}
+
+/* ******************************************************* */
+
+const dns_fwd_stats_t* dns_fwd_get_stats(dns_fwd_t *fwd) {
+    return(&fwd->stats);
+}
+
+/* ******************************************************* */
+
+static int cmp_u16(const void *a, const void *b) {
+    return(*(const u_int16_t*)a - *(const u_int16_t*)b);
+}
+
+/* ******************************************************* */
+
+/* Get the statistics of the upstreams. The RTT percentiles are computed on the last
+ * DNS_FWD_RTT_SAMPLES responses. Returns the number of upstreams. */
+int dns_fwd_get_upstreams(dns_fwd_t *fwd, u_int64_t now_ms, dns_upstream_stats_t *out, int max) {
+    u_int16_t sorted[DNS_FWD_RTT_SAMPLES];
+    int num = (fwd->num_upstreams < max) ? fwd->num_upstreams : max;
+
+    for(int i = 0; i < num; i++) {
+        const dns_upstream_t *upstream = &fwd->upstreams[i];
+        int num_samples = (upstream->num_samples < DNS_FWD_RTT_SAMPLES) ? upstream->num_samples : DNS_FWD_RTT_SAMPLES;
+        dns_upstream_stats_t *stats = &out[i];
+
+        memset(stats, 0, sizeof(*stats));
+        stats->ip = upstream->ip;
+        stats->queries = upstream->queries;
+        stats->responses = upstream->responses;
+        stats->failures = upstream->failures;
+        stats->srtt_ms = upstream->srtt_ms;
+        stats->healthy = is_healthy(upstream, now_ms);
+
+        if(num_samples > 0) {
+            memcpy(sorted, upstream->samples, num_samples * sizeof(u_int16_t));
+            qsort(sorted, num_samples, sizeof(u_int16_t), cmp_u16);
+
+            stats->rtt_p50_ms = sorted[(num_samples - 1) * 50 / 100];
+            stats->rtt_p90_ms = sorted[(num_samples - 1) * 90 / 100];
+            stats->rtt_p99_ms = sorted[(num_samples - 1) * 99 / 100];
+        }
+    }
+
+    return(num);
+}
+
+/* ******************************************************* */
+
+int dns_fwd_num_pending(dns_fwd_t *fwd) {
+    return(HASH_COUNT(fwd->pending));
+}
+
+/* ******************************************************* */
+
+size_t dns_fwd_mem_usage(dns_fwd_t *fwd) {
+    return(fwd->mem_usage);
+}
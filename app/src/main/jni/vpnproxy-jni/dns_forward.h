@@ -0,0 +1,128 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __DNS_FORWARD_H__
+#define __DNS_FORWARD_H__
+
+#include <stdbool.h>
+#include <sys/select.h>
+#include "dns_cache.h"
+
+/*
+ * Forwarding of the queries to the VPN DNS over a small pool of UDP sockets, which are created
+ * and protected once at startup, instead of a zdtun connection per query. Each query is sent
+ * upstream with a random transaction id, unique among the pending queries of its socket, which
+ * maps the response back to the requester. Responses are only accepted from the servers the
+ * query was sent to and must match its question.
+ *
+ * Multiple upstream servers can be configured. The RTT of each upstream is measured on every
+ * response and smoothed as in RFC 6298. Queries are sent to the healthy upstream with the
+ * lowest smoothed RTT, and raced to the second best one if no response arrives within the
+ * retransmission timeout of the first (srtt + 4 * rttvar). An upstream which loses a race is
+ * charged the time elapsed, so that a degraded upstream is promptly demoted, while a periodic
+ * probe keeps the RTT of the other upstreams up to date. After DNS_FWD_MAX_FAILURES consecutive
+ * failures (lost races or timeouts), an upstream is marked down and retried after an
+ * exponential backoff.
+ *
+ * A fallback upstream (e.g. a public resolver) can be set in addition. It is only used when all
+ * the other upstreams are down, and it is never probed or raced, so that the queries do not
+ * leave the network resolvers while they work (which may also serve intranet names).
+ *
+ * The responses of a ready socket are drained with a single recvmmsg into a pool of
+ * DNS_FWD_MAX_RECV_BATCH buffers, allocated once, and then delivered in order. The number of
+ * datagrams read by each call is accounted in a log2 histogram (dns_fwd_stats_t.batches).
+ *
+ * If the kernel supports it (Linux 5.0+), UDP_GRO is enabled on the sockets, so that a burst of
+ * same-sized responses from an upstream is received as a single coalesced datagram. The pool
+ * then has DNS_FWD_GRO_BATCH buffers of the maximum datagram size, and each receive is split
+ * into its responses in one pass. The reply of a response is built in place, which overwrites
+ * the tail of the previous response, already delivered. Sockets which reject UDP_GRO fall back
+ * to the plain receive.
+ */
+
+#define DNS_FWD_NUM_SOCKETS     4
+#define DNS_FWD_MAX_UPSTREAMS   8
+#define DNS_FWD_MAX_PENDING     512
+#define DNS_FWD_TIMEOUT_MS      5000
+#define DNS_FWD_MAX_RECV_BATCH  32      /* max responses read from a socket per call */
+#define DNS_FWD_GRO_BATCH       4       /* coalesced datagrams read from a socket per call, if GRO is enabled */
+#define DNS_FWD_BATCH_BUCKETS   6       /* log2 buckets of the batch sizes, the last is DNS_FWD_MAX_RECV_BATCH+ */
+#define DNS_FWD_RTT_SAMPLES     128     /* the samples used for the RTT percentiles */
+#define DNS_FWD_MIN_RACE_MS     50
+#define DNS_FWD_MAX_RACE_MS     1000    /* also used for the upstreams not measured yet */
+#define DNS_FWD_PROBE_INTERVAL  16      /* one query every N is sent to the least recently measured upstream */
+#define DNS_FWD_MAX_FAILURES    3
+#define DNS_FWD_RETRY_MS        10000   /* doubled on each failed retry */
+#define DNS_FWD_MAX_RETRY_MS    300000
+
+typedef struct dns_fwd_client {
+    u_int32_t ip;       /* network byte order */
+    u_int16_t port;     /* network byte order */
+    u_int32_t rtt_ms;
+} dns_fwd_client_t;
+
+typedef struct dns_fwd_stats {
+    u_int32_t forwarded;
+    u_int32_t answered;
+    u_int32_t raced;    /* queries also sent to a second upstream */
+    u_int32_t timeouts;
+    u_int32_t dropped;  /* unexpected, late, truncated or mismatching responses */
+    u_int32_t recv_calls;
+    u_int32_t batches[DNS_FWD_BATCH_BUCKETS]; /* bucket i: calls which read [2^i, 2^(i+1)) responses */
+    u_int32_t gro_segments; /* responses received coalesced with others */
+    bool gro;               /* UDP_GRO is enabled */
+} dns_fwd_stats_t;
+
+typedef struct dns_upstream_stats {
+    u_int32_t ip;       /* network byte order */
+    u_int32_t queries;
+    u_int32_t responses;
+    u_int32_t failures; /* lost races and timeouts */
+    u_int32_t srtt_ms;  /* 0 if not measured yet */
+    u_int32_t rtt_p50_ms;
+    u_int32_t rtt_p90_ms;
+    u_int32_t rtt_p99_ms;
+    bool healthy;
+} dns_upstream_stats_t;
+
+/* Called to protect each socket from the VPN. Returns false on failure. */
+typedef bool (dns_fwd_protect_cb_t)(int sock, void *userdata);
+
+/* Called for each response, with the transaction id of the client query restored. The response
+ * is preceded by DNS_PKT_HEADROOM writable bytes, which may hold the previous response. */
+typedef void (dns_fwd_response_cb_t)(const dns_fwd_client_t *client, u_int8_t *rsp, int rsp_len, void *userdata);
+
+typedef struct dns_fwd dns_fwd_t;
+
+dns_fwd_t* dns_fwd_init(dns_fwd_protect_cb_t *protect, void *userdata);
+void dns_fwd_destroy(dns_fwd_t *fwd);
+void dns_fwd_set_upstreams(dns_fwd_t *fwd, const u_int32_t *servers, int num_servers, u_int32_t fallback);
+int dns_fwd_query(dns_fwd_t *fwd, const dns_query_t *q, const u_int8_t *query, int query_len,
+                  u_int32_t client_ip, u_int16_t client_port, u_int64_t now_ms);
+void dns_fwd_fds(dns_fwd_t *fwd, int *max_fd, fd_set *rdfd);
+int dns_fwd_handle_fds(dns_fwd_t *fwd, fd_set *rdfd, u_int64_t now_ms,
+                       dns_fwd_response_cb_t *cb, void *userdata);
+u_int64_t dns_fwd_next_timeout(dns_fwd_t *fwd);
+void dns_fwd_check_timeouts(dns_fwd_t *fwd, u_int64_t now_ms);
+const dns_fwd_stats_t* dns_fwd_get_stats(dns_fwd_t *fwd);
+int dns_fwd_get_upstreams(dns_fwd_t *fwd, u_int64_t now_ms, dns_upstream_stats_t *out, int max);
+int dns_fwd_num_pending(dns_fwd_t *fwd);
+size_t dns_fwd_mem_usage(dns_fwd_t *fwd);
+
+#endif // __DNS_FORWARD_H__
@@ -0,0 +1,205 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "heavy_hitters.h"
+#include "third_party/uthash.h"
+
+typedef struct hh_entry {
+    u_int64_t key;
+    u_int64_t count;
+    u_int64_t error;
+    jint uid;
+    int heap_idx;
+    char label[HH_LABEL_SIZE];
+    UT_hash_handle hh;
+} hh_entry_t;
+
+struct hh_tracker {
+    hh_entry_t *entries; /* preallocated */
+    hh_entry_t **heap;   /* min-heap by count */
+    hh_entry_t *table;   /* key -> entry */
+    int capacity;
+    int size;
+};
+
+/* ******************************************************* */
+
+hh_tracker_t* hh_tracker_init(int capacity) {
+    hh_tracker_t *t = calloc(1, sizeof(hh_tracker_t));
+
+    if(!t)
+        return(NULL);
+
+    t->entries = calloc(capacity, sizeof(hh_entry_t));
+    t->heap = calloc(capacity, sizeof(hh_entry_t*));
+    t->capacity = capacity;
+
+    if(!t->entries || !t->heap) {
+        hh_tracker_destroy(t);
+        return(NULL);
+    }
+
+    return(t);
+}
+
+/* ******************************************************* */
+
+void hh_tracker_destroy(hh_tracker_t *t) {
+    HASH_CLEAR(hh, t->table);
+
+    if(t->entries)
+        free(t->entries);
+    if(t->heap)
+        free(t->heap);
+    free(t);
+}
+
+/* ******************************************************* */
+
+static void heap_swap(hh_tracker_t *t, int a, int b) {
+    hh_entry_t *tmp = t->heap[a];
+
+    t->heap[a] = t->heap[b];
+    t->heap[b] = tmp;
+    t->heap[a]->heap_idx = a;
+    t->heap[b]->heap_idx = b;
+}
+
+/* Counts only increase, so an entry can only move down */
+static void heap_sift_down(hh_tracker_t *t, int idx) {
+    while(1) {
+        int left = 2 * idx + 1;
+        int right = left + 1;
+        int smallest = idx;
+
+        if((left < t->size) && (t->heap[left]->count < t->heap[smallest]->count))
+            smallest = left;
+        if((right < t->size) && (t->heap[right]->count < t->heap[smallest]->count))
+            smallest = right;
+
+        if(smallest == idx)
+            break;
+
+        heap_swap(t, idx, smallest);
+        idx = smallest;
+    }
+}
+
+static void heap_sift_up(hh_tracker_t *t, int idx) {
+    while(idx > 0) {
+        int parent = (idx - 1) / 2;
+
+        if(t->heap[parent]->count <= t->heap[idx]->count)
+            break;
+
+        heap_swap(t, idx, parent);
+        idx = parent;
+    }
+}
+
+/* ******************************************************* */
+
+/* Account weight to the given key. If the key is not tracked yet, it is added and its label
+ * buffer (HH_LABEL_SIZE) is returned, to be filled by the caller. Otherwise returns NULL. */
+char* hh_tracker_add(hh_tracker_t *t, u_int64_t key, u_int64_t weight, jint uid) {
+    hh_entry_t *entry;
+
+    HASH_FIND(hh, t->table, &key, sizeof(key), entry);
+
+    if(entry) {
+        entry->count += weight;
+        heap_sift_down(t, entry->heap_idx);
+        return(NULL);
+    }
+
+    if(t->size < t->capacity) {
+        entry = &t->entries[t->size];
+        entry->count = weight;
+        entry->error = 0;
+        entry->heap_idx = t->size;
+        t->heap[t->size++] = entry;
+        heap_sift_up(t, entry->heap_idx);
+    } else {
+        /* Replace the minimum */
+        entry = t->heap[0];
+        HASH_DELETE(hh, t->table, entry);
+
+        entry->error = entry->count;
+        entry->count += weight;
+        heap_sift_down(t, 0);
+    }
+
+    entry->key = key;
+    entry->uid = uid;
+    entry->label[0] = '\0';
+    HASH_ADD(hh, t->table, key, sizeof(entry->key), entry);
+
+    return(entry->label);
+}
+
+/* ******************************************************* */
+
+static int cmp_count_desc(const void *a, const void *b) {
+    const hh_item_t *ia = a, *ib = b;
+
+    if(ia->count == ib->count)
+        return(0);
+    return((ia->count < ib->count) ? 1 : -1);
+}
+
+/* Fill out with the top k items, sorted by count. The labels are owned by the tracker and are
+ * only valid until the next hh_tracker_add. Returns the number of items. */
+int hh_tracker_top(hh_tracker_t *t, hh_item_t *out, int k) {
+    hh_item_t *items;
+
+    if(t->size == 0)
+        return(0);
+
+    if((items = malloc(t->size * sizeof(hh_item_t))) == NULL)
+        return(-1);
+
+    for(int i = 0; i < t->size; i++) {
+        const hh_entry_t *entry = &t->entries[i];
+
+        items[i].label = entry->label;
+        items[i].uid = entry->uid;
+        items[i].count = entry->count;
+        items[i].error = entry->error;
+    }
+
+    qsort(items, t->size, sizeof(hh_item_t), cmp_count_desc);
+
+    if(k > t->size)
+        k = t->size;
+
+    memcpy(out, items, k * sizeof(hh_item_t));
+    free(items);
+
+    return(k);
+}
+
+/* ******************************************************* */
+
+size_t hh_tracker_mem_usage(hh_tracker_t *t) {
+    return(sizeof(hh_tracker_t) +
+        t->capacity * (sizeof(hh_entry_t) + sizeof(hh_entry_t*)) +
+        HASH_OVERHEAD(hh, t->table));
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __HEAVY_HITTERS_H__
+#define __HEAVY_HITTERS_H__
+
+#include <jni.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Top-K tracker based on the Space-Saving algorithm. It monitors at most "capacity" keys.
+ * When a new key is seen and the tracker is full, the key with the lowest count is replaced
+ * and the new key inherits its count, which is recorded as the maximum overestimation (error).
+ * Any key whose weight exceeds total/capacity is guaranteed to be tracked. The counters are
+ * kept in a min-heap, so an update is O(log capacity) and the memory is fixed.
+ */
+
+#define HH_LABEL_SIZE 64
+
+typedef struct hh_tracker hh_tracker_t;
+
+typedef struct hh_item {
+    const char *label;
+    jint uid;
+    u_int64_t count;
+    u_int64_t error;
+} hh_item_t;
+
+hh_tracker_t* hh_tracker_init(int capacity);
+void hh_tracker_destroy(hh_tracker_t *t);
+char* hh_tracker_add(hh_tracker_t *t, u_int64_t key, u_int64_t weight, jint uid);
+int hh_tracker_top(hh_tracker_t *t, hh_item_t *out, int k);
+size_t hh_tracker_mem_usage(hh_tracker_t *t);
+
+/* FNV-1a */
+static inline u_int64_t hh_hash(const void *data, size_t len, u_int64_t seed) {
+    const u_int8_t *p = data;
+    u_int64_t h = 0xcbf29ce484222325ULL ^ seed;
+
+    for(size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    return(h);
+}
+
+#endif // __HEAVY_HITTERS_H__
@@ -32,6 +32,7 @@ struct cache_entry {
 
 struct ip_lru {
     int max_size;
+    size_t mem_usage;
     struct cache_entry *cache;
 };
 
@@ -44,6 +45,7 @@ ip_lru_t* ip_lru_init(int max_size) {
         return NULL;
 
     lru->max_size = max_size;
+    lru->mem_usage = sizeof(ip_lru_t);
     lru->cache = NULL;
 
     return lru;
@@ -95,6 +97,7 @@ void ip_lru_add(ip_lru_t *lru, const zdtun_ip_t *ip, const char *hostname) {
 
     if(entry != NULL) {
         // update existing
+        lru->mem_usage += strlen(host) - strlen(entry->host);
         free(entry->host);
         entry->host = host;
         return;
@@ -109,6 +112,7 @@ void ip_lru_add(ip_lru_t *lru, const zdtun_ip_t *ip, const char *hostname) {
 
     entry->key = *ip;
     entry->host = host;
+    lru->mem_usage += sizeof(struct cache_entry) + strlen(host) + 1;
 
     HASH_ADD(hh, lru->cache, key, sizeof(zdtun_ip_t), entry);
 
@@ -118,6 +122,7 @@ void ip_lru_add(ip_lru_t *lru, const zdtun_ip_t *ip, const char *hostname) {
         HASH_ITER(hh, lru->cache, entry, tmp) {
             // delete the oldest entry
             HASH_DELETE(hh, lru->cache, entry);
+            lru->mem_usage -= sizeof(struct cache_entry) + strlen(entry->host) + 1;
             free(entry->host);
             free(entry);
             break;
@@ -127,14 +132,22 @@ void ip_lru_add(ip_lru_t *lru, const zdtun_ip_t *ip, const char *hostname) {
 
 /* ******************************************************* */
 
-char* ip_lru_find(ip_lru_t *lru, const zdtun_ip_t *ip) {
+/* The returned string is owned by the cache, it is only valid until the next ip_lru_add */
+const char* ip_lru_find(ip_lru_t *lru, const zdtun_ip_t *ip) {
     struct cache_entry *entry = ip_lru_find_entry(lru, ip);
 
-    return(entry ? strdup(entry->host) : NULL);
+    return(entry ? entry->host : NULL);
 }
 
 /* ******************************************************* */
 
 int ip_lru_size(ip_lru_t *lru) {
     return HASH_COUNT(lru->cache);
+}
+
+/* ******************************************************* */
+
+/* Approximate, does not include the uthash overhead */
+size_t ip_lru_mem_usage(ip_lru_t *lru) {
+    return lru->mem_usage;
 }
\ No newline at end of file
@@ -0,0 +1,580 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <android/log.h>
+#include "ip_rules.h"
+#include "jni_helpers.h"
+
+#define INITIAL_PENDING_RULES   64
+#define INDEX_BITS              16
+#define INDEX_MIN_PREFIXES      4096 /* smaller tables are only binary searched */
+
+/* A rule added but not built yet */
+typedef struct pending_rule {
+    u_int32_t seq;          /* the order of addition, the last duplicate rule sets the tag */
+    u_int8_t addr[16];      /* network byte order, masked */
+    u_int8_t prefix_len;
+    u_int8_t actions;
+    u_int8_t tag;
+} pending_rule_t;
+
+typedef struct prefix_meta {
+    int32_t parent;         /* the innermost enclosing prefix, -1 if none */
+    u_int8_t actions;       /* inherited from the enclosing prefixes */
+    u_int8_t tag;           /* the tag of the innermost tagged enclosing prefix */
+} prefix_meta_t;
+
+/* An address in host byte order, compared as an integer. IPv4 addresses are in lo. */
+typedef struct ip_key {
+    u_int64_t hi;
+    u_int64_t lo;
+} ip_key_t;
+
+/*
+ * The built prefixes of an IP version, sorted by start address then by prefix length. The
+ * IPv4 keys are stored in 32 bits. When the table is large, index[k] is the first prefix whose
+ * start has the INDEX_BITS bits after the prefix common to all the starts (index_skip bits,
+ * e.g. 2001:db8::/32) >= k, so that a lookup only searches a bucket.
+ */
+typedef struct prefix_table {
+    bool ipv4;
+    union {
+        u_int32_t *v4;
+        ip_key_t *v6;
+    } starts, ends;
+    prefix_meta_t *meta;
+    u_int32_t *index;       /* (1 << INDEX_BITS) + 1 entries, NULL if not built */
+    u_int64_t index_base;   /* the top 64 bits of the first start */
+    int index_skip;
+    int num;
+} prefix_table_t;
+
+struct ip_rules {
+    pending_rule_t *pending[2]; /* IPv4, IPv6 */
+    int num_pending[2];
+    int pending_capacity[2];
+    prefix_table_t tables[2];
+    char tags[IP_RULES_MAX_TAGS + 1][IP_RULES_MAX_TAG_LEN + 1];
+    int num_tags;
+};
+
+#define FAMILY_IDX(ipver) (((ipver) == 4) ? 0 : 1)
+
+/* ******************************************************* */
+
+ip_rules_t* ip_rules_init() {
+    ip_rules_t *rules = calloc(1, sizeof(ip_rules_t));
+
+    if(!rules)
+        return(NULL);
+
+    rules->tables[0].ipv4 = true;
+    rules->num_tags = 1; /* 0 is no tag */
+
+    return(rules);
+}
+
+/* ******************************************************* */
+
+static void free_table(prefix_table_t *table) {
+    /* v4 and v6 alias the same pointer */
+    if(table->starts.v4)
+        free(table->starts.v4);
+    if(table->ends.v4)
+        free(table->ends.v4);
+    if(table->meta)
+        free(table->meta);
+    if(table->index)
+        free(table->index);
+
+    table->starts.v4 = table->ends.v4 = NULL;
+    table->meta = NULL;
+    table->index = NULL;
+    table->num = 0;
+}
+
+/* ******************************************************* */
+
+void ip_rules_destroy(ip_rules_t *rules) {
+    for(int i = 0; i < 2; i++) {
+        if(rules->pending[i])
+            free(rules->pending[i]);
+        free_table(&rules->tables[i]);
+    }
+
+    free(rules);
+}
+
+/* ******************************************************* */
+
+static u_int8_t get_tag(ip_rules_t *rules, const char *name) {
+    if(!name || !name[0])
+        return(0);
+
+    for(int i = 1; i < rules->num_tags; i++) {
+        if(strcmp(rules->tags[i], name) == 0)
+            return(i);
+    }
+
+    if(rules->num_tags > IP_RULES_MAX_TAGS)
+        return(0);
+
+    snprintf(rules->tags[rules->num_tags], sizeof(rules->tags[0]), "%s", name);
+    return(rules->num_tags++);
+}
+
+/* ******************************************************* */
+
+/* Add a rule for an address or a CIDR (e.g. 10.0.0.0/8). Returns 0 on success. */
+int ip_rules_add(ip_rules_t *rules, const char *cidr, u_int8_t actions, const char *tag) {
+    char addr_str[INET6_ADDRSTRLEN];
+    const char *slash = strchr(cidr, '/');
+    int addr_len = slash ? (int)(slash - cidr) : (int) strlen(cidr);
+    pending_rule_t rule = {0};
+    int ipver, max_len, idx;
+
+    if(addr_len >= sizeof(addr_str))
+        return(-1);
+
+    memcpy(addr_str, cidr, addr_len);
+    addr_str[addr_len] = '\0';
+
+    if(inet_pton(AF_INET, addr_str, rule.addr) == 1)
+        ipver = 4;
+    else if(inet_pton(AF_INET6, addr_str, rule.addr) == 1)
+        ipver = 6;
+    else
+        return(-1);
+
+    max_len = (ipver == 4) ? 32 : 128;
+
+    if(slash) {
+        char *end;
+        long len = strtol(slash + 1, &end, 10);
+
+        if((*end != '\0') || (end == slash + 1) || (len < 0) || (len > max_len))
+            return(-1);
+        rule.prefix_len = len;
+    } else
+        rule.prefix_len = max_len;
+
+    /* mask the host bits */
+    for(int bit = rule.prefix_len; bit < max_len; bit++)
+        rule.addr[bit / 8] &= ~(0x80 >> (bit % 8));
+
+    rule.actions = actions;
+    rule.tag = get_tag(rules, tag);
+
+    idx = FAMILY_IDX(ipver);
+    rule.seq = rules->num_pending[idx];
+
+    if(rules->num_pending[idx] == rules->pending_capacity[idx]) {
+        int capacity = rules->pending_capacity[idx] ? (rules->pending_capacity[idx] * 2) : INITIAL_PENDING_RULES;
+        pending_rule_t *grown = realloc(rules->pending[idx], capacity * sizeof(pending_rule_t));
+
+        if(!grown)
+            return(-1);
+
+        rules->pending[idx] = grown;
+        rules->pending_capacity[idx] = capacity;
+    }
+
+    rules->pending[idx][rules->num_pending[idx]++] = rule;
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Load the rules of a file. Returns the number of rules loaded, -1 if the file cannot be read. */
+int ip_rules_load(ip_rules_t *rules, const char *path) {
+    FILE *f = fopen(path, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    int lineno = 0, num = 0;
+
+    if(!f)
+        return(-1);
+
+    while(getline(&line, &line_size, f) > 0) {
+        char *saveptr, *action_saveptr;
+        char *cidr, *actions_str, *action;
+        const char *tag = NULL;
+        u_int8_t actions = 0;
+
+        lineno++;
+
+        if(!(cidr = strtok_r(line, " \t\r\n", &saveptr)) || (cidr[0] == '#'))
+            continue;
+
+        actions_str = strtok_r(NULL, " \t\r\n", &saveptr);
+
+        for(action = actions_str ? strtok_r(actions_str, ",", &action_saveptr) : NULL; action;
+            action = strtok_r(NULL, ",", &action_saveptr)) {
+            if(strcmp(action, "block") == 0)
+                actions |= IP_RULE_BLOCK;
+            else if(strcmp(action, "nodpi") == 0)
+                actions |= IP_RULE_NO_DPI;
+            else if(strcmp(action, "noexport") == 0)
+                actions |= IP_RULE_NO_EXPORT;
+            else if(strncmp(action, "tag=", 4) == 0)
+                tag = action + 4;
+            else
+                log_android(ANDROID_LOG_WARN, "%s:%d: unknown action \"%s\"", path, lineno, action);
+        }
+
+        if(!actions && !tag)
+            continue;
+
+        if(ip_rules_add(rules, cidr, actions, tag) == 0)
+            num++;
+        else
+            log_android(ANDROID_LOG_WARN, "%s:%d: invalid address \"%s\"", path, lineno, cidr);
+    }
+
+    if(line)
+        free(line);
+    fclose(f);
+
+    return(num);
+}
+
+/* ******************************************************* */
+
+static int cmp_rules4(const void *a, const void *b) {
+    const pending_rule_t *ra = (const pending_rule_t*) a, *rb = (const pending_rule_t*) b;
+    int rv = memcmp(ra->addr, rb->addr, 4);
+
+    if(!rv)
+        rv = ra->prefix_len - rb->prefix_len;
+    return(rv ? rv : ((ra->seq < rb->seq) ? -1 : 1));
+}
+
+static int cmp_rules6(const void *a, const void *b) {
+    const pending_rule_t *ra = (const pending_rule_t*) a, *rb = (const pending_rule_t*) b;
+    int rv = memcmp(ra->addr, rb->addr, 16);
+
+    if(!rv)
+        rv = ra->prefix_len - rb->prefix_len;
+    return(rv ? rv : ((ra->seq < rb->seq) ? -1 : 1));
+}
+
+/* ******************************************************* */
+
+static inline ip_key_t to_key(const u_int8_t *addr, bool ipv4) {
+    ip_key_t key = {0};
+
+    if(ipv4) {
+        u_int32_t ip4;
+
+        memcpy(&ip4, addr, 4);
+        key.lo = ntohl(ip4);
+    } else {
+        for(int i = 0; i < 8; i++) {
+            key.hi = (key.hi << 8) | addr[i];
+            key.lo = (key.lo << 8) | addr[i + 8];
+        }
+    }
+
+    return(key);
+}
+
+/* ******************************************************* */
+
+static inline int key_cmp(ip_key_t a, ip_key_t b) {
+    if(a.hi != b.hi)
+        return((a.hi < b.hi) ? -1 : 1);
+    if(a.lo != b.lo)
+        return((a.lo < b.lo) ? -1 : 1);
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* The last address of the prefix */
+static ip_key_t prefix_end(ip_key_t start, int prefix_len, bool ipv4) {
+    int host_bits = (ipv4 ? 32 : 128) - prefix_len;
+
+    if(host_bits >= 64) {
+        start.lo = ~0ULL;
+        start.hi |= (host_bits == 128) ? ~0ULL : ((1ULL << (host_bits - 64)) - 1);
+    } else if(host_bits > 0)
+        start.lo |= (1ULL << host_bits) - 1;
+
+    return(start);
+}
+
+/* ******************************************************* */
+
+static inline ip_key_t table_start(const prefix_table_t *table, int i) {
+    if(table->ipv4) {
+        ip_key_t key = {0, table->starts.v4[i]};
+        return(key);
+    }
+    return(table->starts.v6[i]);
+}
+
+static inline ip_key_t table_end(const prefix_table_t *table, int i) {
+    if(table->ipv4) {
+        ip_key_t key = {0, table->ends.v4[i]};
+        return(key);
+    }
+    return(table->ends.v6[i]);
+}
+
+/* ******************************************************* */
+
+/* The top 64 bits of the key */
+static inline u_int64_t key_top(ip_key_t key, bool ipv4) {
+    return(ipv4 ? (key.lo << 32) : key.hi);
+}
+
+static inline u_int32_t index_bucket(const prefix_table_t *table, u_int64_t top) {
+    return((u_int32_t)((top << table->index_skip) >> (64 - INDEX_BITS)));
+}
+
+/* ******************************************************* */
+
+static int build_index(prefix_table_t *table) {
+    u_int32_t num_buckets = 1 << INDEX_BITS;
+    u_int64_t first = key_top(table_start(table, 0), table->ipv4);
+    u_int64_t last = key_top(table_start(table, table->num - 1), table->ipv4);
+    int max_skip = (table->ipv4 ? 32 : 64) - INDEX_BITS;
+    u_int32_t i = 0;
+
+    if((table->index = malloc((num_buckets + 1) * sizeof(u_int32_t))) == NULL)
+        return(-1);
+
+    table->index_base = first;
+    table->index_skip = (first == last) ? max_skip : __builtin_clzll(first ^ last);
+    if(table->index_skip > max_skip)
+        table->index_skip = max_skip;
+
+    for(u_int32_t k = 0; k < num_buckets; k++) {
+        while((i < table->num) && (index_bucket(table, key_top(table_start(table, i), table->ipv4)) < k))
+            i++;
+        table->index[k] = i;
+    }
+    table->index[num_buckets] = table->num;
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+static int build_table(prefix_table_t *table, pending_rule_t *rules, int num_rules) {
+    bool ipv4 = table->ipv4;
+    int32_t *stack;
+    int depth = 0;
+    int num = 0;
+
+    free_table(table);
+
+    if(num_rules == 0)
+        return(0);
+
+    qsort(rules, num_rules, sizeof(pending_rule_t), ipv4 ? cmp_rules4 : cmp_rules6);
+
+    if(ipv4) {
+        table->starts.v4 = malloc(num_rules * sizeof(u_int32_t));
+        table->ends.v4 = malloc(num_rules * sizeof(u_int32_t));
+    } else {
+        table->starts.v6 = malloc(num_rules * sizeof(ip_key_t));
+        table->ends.v6 = malloc(num_rules * sizeof(ip_key_t));
+    }
+    table->meta = malloc(num_rules * sizeof(prefix_meta_t));
+    stack = malloc(129 * sizeof(int32_t)); /* max nesting: one prefix per length */
+
+    if(!table->starts.v4 || !table->ends.v4 || !table->meta || !stack) {
+        free_table(table);
+        if(stack)
+            free(stack);
+        return(-1);
+    }
+
+    for(int i = 0; i < num_rules; i++) {
+        const pending_rule_t *rule = &rules[i];
+        ip_key_t start = to_key(rule->addr, ipv4);
+        prefix_meta_t *meta = &table->meta[num];
+
+        /* Pop the prefixes which end before this one. Since CIDRs either nest or are disjoint,
+         * the top of the stack is then the innermost enclosing prefix. */
+        while((depth > 0) && (key_cmp(table_end(table, stack[depth - 1]), start) < 0))
+            depth--;
+
+        if((i > 0) && (rules[i - 1].prefix_len == rule->prefix_len) &&
+           (key_cmp(table_start(table, num - 1), start) == 0)) {
+            /* duplicate prefix: merge */
+            table->meta[num - 1].actions |= rule->actions;
+            if(rule->tag)
+                table->meta[num - 1].tag = rule->tag;
+            continue;
+        }
+
+        if(ipv4) {
+            table->starts.v4[num] = (u_int32_t) start.lo;
+            table->ends.v4[num] = (u_int32_t) prefix_end(start, rule->prefix_len, true).lo;
+        } else {
+            table->starts.v6[num] = start;
+            table->ends.v6[num] = prefix_end(start, rule->prefix_len, false);
+        }
+
+        meta->parent = (depth > 0) ? stack[depth - 1] : -1;
+        meta->actions = rule->actions;
+        meta->tag = rule->tag;
+
+        stack[depth++] = num++;
+    }
+
+    /* Inherit the actions and tags. Parents always precede their children. */
+    for(int i = 0; i < num; i++) {
+        prefix_meta_t *meta = &table->meta[i];
+
+        if(meta->parent >= 0) {
+            meta->actions |= table->meta[meta->parent].actions;
+            if(!meta->tag)
+                meta->tag = table->meta[meta->parent].tag;
+        }
+    }
+
+    table->num = num;
+    free(stack);
+
+    if((num >= INDEX_MIN_PREFIXES) && (build_index(table) != 0)) {
+        free_table(table);
+        return(-1);
+    }
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Build the lookup tables from the rules added. Must be called once, after adding all the rules,
+ * which are then released. Returns 0 on success. */
+int ip_rules_build(ip_rules_t *rules) {
+    int rv = 0;
+
+    for(int i = 0; i < 2; i++) {
+        if(build_table(&rules->tables[i], rules->pending[i], rules->num_pending[i]) != 0)
+            rv = -1;
+
+        if(rules->pending[i])
+            free(rules->pending[i]);
+        rules->pending[i] = NULL;
+        rules->num_pending[i] = rules->pending_capacity[i] = 0;
+    }
+
+    return(rv);
+}
+
+/* ******************************************************* */
+
+/* Look up the most specific rule matching an address. Returns false if no rule matches. */
+bool ip_rules_lookup(const ip_rules_t *rules, int ipver, const zdtun_ip_t *ip, ip_rule_match_t *match) {
+    const prefix_table_t *table = &rules->tables[FAMILY_IDX(ipver)];
+    ip_key_t key = to_key((const u_int8_t*) ip, table->ipv4);
+    int lo = 0, hi = table->num - 1;
+    int i;
+
+    if(table->index) {
+        u_int64_t top = key_top(key, table->ipv4);
+
+        if((table->index_skip == 0) || (((top ^ table->index_base) >> (64 - table->index_skip)) == 0)) {
+            u_int32_t bucket = index_bucket(table, top);
+
+            lo = table->index[bucket];
+            hi = table->index[bucket + 1] - 1;
+        }
+        /* else outside of the common prefix, search the whole table */
+    }
+
+    /* the last prefix which starts at or before the address. All the prefixes before lo do. */
+    i = lo - 1;
+
+    if(table->ipv4) {
+        u_int32_t ip4 = (u_int32_t) key.lo;
+
+        while(lo <= hi) {
+            int mid = (lo + hi) / 2;
+
+            if(table->starts.v4[mid] <= ip4) {
+                i = mid;
+                lo = mid + 1;
+            } else
+                hi = mid - 1;
+        }
+
+        /* the innermost prefix which contains the address is either i or one of its parents */
+        while((i >= 0) && (ip4 > table->ends.v4[i]))
+            i = table->meta[i].parent;
+    } else {
+        while(lo <= hi) {
+            int mid = (lo + hi) / 2;
+
+            if(key_cmp(table->starts.v6[mid], key) <= 0) {
+                i = mid;
+                lo = mid + 1;
+            } else
+                hi = mid - 1;
+        }
+
+        while((i >= 0) && (key_cmp(key, table->ends.v6[i]) > 0))
+            i = table->meta[i].parent;
+    }
+
+    if(i < 0)
+        return(false);
+
+    match->actions = table->meta[i].actions;
+    match->tag = table->meta[i].tag;
+    return(true);
+}
+
+/* ******************************************************* */
+
+const char* ip_rules_tag_name(const ip_rules_t *rules, u_int8_t tag) {
+    return(((tag > 0) && (tag < rules->num_tags)) ? rules->tags[tag] : NULL);
+}
+
+/* ******************************************************* */
+
+int ip_rules_size(const ip_rules_t *rules) {
+    return(rules->tables[0].num + rules->tables[1].num);
+}
+
+/* ******************************************************* */
+
+size_t ip_rules_mem_usage(const ip_rules_t *rules) {
+    size_t size = sizeof(ip_rules_t);
+
+    for(int i = 0; i < 2; i++) {
+        const prefix_table_t *table = &rules->tables[i];
+
+        size += rules->pending_capacity[i] * sizeof(pending_rule_t);
+        size += table->num * ((table->ipv4 ? 2 * sizeof(u_int32_t) : 2 * sizeof(ip_key_t)) + sizeof(prefix_meta_t));
+        if(table->index)
+            size += ((1 << INDEX_BITS) + 1) * sizeof(u_int32_t);
+    }
+
+    return(size);
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __IP_RULES_H__
+#define __IP_RULES_H__
+
+#include <stdbool.h>
+#include "zdtun.h"
+
+/*
+ * A set of IPv4/IPv6 CIDR rules, each with some actions and an optional tag. Rules are added
+ * and then compiled by ip_rules_build into a sorted array of prefixes per IP version, where each
+ * prefix links to its innermost enclosing prefix and carries the actions of all its enclosing
+ * prefixes. A lookup is a binary search of the last prefix starting before the address,
+ * followed by a walk of the enclosing prefixes until one contains it (the most specific match).
+ * Large tables also get a 64K buckets index on the address bits, to narrow the binary search.
+ *
+ * Rules files have one rule per line, in the format "<cidr> <action>[,<action>...]", where the
+ * actions are: block, nodpi, noexport, tag=<name>. Lines starting with # are comments.
+ */
+
+#define IP_RULE_BLOCK           0x01
+#define IP_RULE_NO_DPI          0x02
+#define IP_RULE_NO_EXPORT       0x04
+#define IP_RULE_DNS_SERVER      0x08 /* a known DNS server, see check_dns_req_allowed */
+
+#define IP_RULES_MAX_TAGS       255
+#define IP_RULES_MAX_TAG_LEN    31
+
+typedef struct ip_rule_match {
+    u_int8_t actions;   /* IP_RULE_*, including the ones of the enclosing prefixes */
+    u_int8_t tag;       /* 0 if none, see ip_rules_tag_name */
+} ip_rule_match_t;
+
+typedef struct ip_rules ip_rules_t;
+
+ip_rules_t* ip_rules_init();
+void ip_rules_destroy(ip_rules_t *rules);
+int ip_rules_add(ip_rules_t *rules, const char *cidr, u_int8_t actions, const char *tag);
+int ip_rules_load(ip_rules_t *rules, const char *path);
+int ip_rules_build(ip_rules_t *rules);
+bool ip_rules_lookup(const ip_rules_t *rules, int ipver, const zdtun_ip_t *ip, ip_rule_match_t *match);
+const char* ip_rules_tag_name(const ip_rules_t *rules, u_int8_t tag);
+int ip_rules_size(const ip_rules_t *rules);
+size_t ip_rules_mem_usage(const ip_rules_t *rules);
+
+#endif // __IP_RULES_H__
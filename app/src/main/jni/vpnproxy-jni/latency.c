@@ -0,0 +1,158 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <android/log.h>
+#include "latency.h"
+#include "jni_helpers.h"
+
+struct lat_hosts {
+    lat_host_t *table;
+    lat_host_t *entries; /* preallocated */
+    int capacity;
+    int num;
+    u_int32_t evictions;
+};
+
+/* ******************************************************* */
+
+u_int64_t lat_now_us() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((u_int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/* ******************************************************* */
+
+void lat_hist_add(lat_hist_t *hist, u_int64_t us) {
+    u_int64_t ms = us / 1000;
+    int bucket = 0;
+
+    while(ms && (bucket < (LAT_NUM_BUCKETS - 1))) {
+        ms >>= 1;
+        bucket++;
+    }
+
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->sum_us += us;
+}
+
+/* ******************************************************* */
+
+lat_hosts_t* lat_hosts_init(int capacity) {
+    lat_hosts_t *hosts = calloc(1, sizeof(lat_hosts_t));
+
+    if(!hosts) {
+        log_android(ANDROID_LOG_ERROR, "calloc(lat_hosts_t) failed");
+        return(NULL);
+    }
+
+    if((hosts->entries = calloc(capacity, sizeof(lat_host_t))) == NULL) {
+        log_android(ANDROID_LOG_ERROR, "calloc(lat_host_t) failed");
+        free(hosts);
+        return(NULL);
+    }
+
+    hosts->capacity = capacity;
+    return(hosts);
+}
+
+/* ******************************************************* */
+
+void lat_hosts_destroy(lat_hosts_t *hosts) {
+    HASH_CLEAR(hh, hosts->table);
+    free(hosts->entries);
+    free(hosts);
+}
+
+/* ******************************************************* */
+
+/* Returns the histograms of the host, adding it if necessary. The host name is truncated to
+ * LAT_HOST_SIZE - 1 characters. */
+lat_hists_t* lat_hosts_get(lat_hosts_t *hosts, const char *host) {
+    char key[LAT_HOST_SIZE];
+    lat_host_t *entry;
+
+    snprintf(key, sizeof(key), "%s", host);
+    HASH_FIND_STR(hosts->table, key, entry);
+
+    if(!entry) {
+        u_int32_t samples = 0;
+
+        if(hosts->num < hosts->capacity)
+            entry = &hosts->entries[hosts->num++];
+        else {
+            /* Replace the host with the fewest samples. This only happens on new hosts, which
+             * are seen at the connections rate. As in Space-Saving (see heavy_hitters.h), the
+             * new host inherits the samples count of the replaced one, otherwise it would be the
+             * next one replaced and the table would stop admitting hosts once full. */
+            entry = &hosts->entries[0];
+
+            for(int i = 1; i < hosts->capacity; i++) {
+                if(hosts->entries[i].samples < entry->samples)
+                    entry = &hosts->entries[i];
+            }
+
+            HASH_DELETE(hh, hosts->table, entry);
+            samples = entry->samples;
+            hosts->evictions++;
+        }
+
+        memset(entry, 0, sizeof(*entry));
+        strcpy(entry->host, key);
+        entry->samples = samples;
+        HASH_ADD_STR(hosts->table, host, entry);
+    }
+
+    entry->samples++;
+    return(&entry->hists);
+}
+
+/* ******************************************************* */
+
+int lat_hosts_num(const lat_hosts_t *hosts) {
+    return(hosts->num);
+}
+
+/* ******************************************************* */
+
+/* Iterate the hosts: pass NULL to get the first one. Returns NULL after the last one. */
+const lat_host_t* lat_hosts_iter(const lat_hosts_t *hosts, const lat_host_t *prev) {
+    int idx = prev ? (int)(prev - hosts->entries) + 1 : 0;
+
+    return((idx < hosts->num) ? &hosts->entries[idx] : NULL);
+}
+
+/* ******************************************************* */
+
+u_int32_t lat_hosts_evictions(const lat_hosts_t *hosts) {
+    return(hosts->evictions);
+}
+
+/* ******************************************************* */
+
+size_t lat_hosts_mem_usage(const lat_hosts_t *hosts) {
+    return(sizeof(lat_hosts_t) + hosts->capacity * sizeof(lat_host_t) +
+           HASH_OVERHEAD(hh, hosts->table));
+}
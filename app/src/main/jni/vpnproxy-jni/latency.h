@@ -0,0 +1,99 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __LATENCY_H__
+#define __LATENCY_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "third_party/uthash.h"
+
+/*
+ * Connection setup latencies. Each connection records, in conn_latency_t, the time from the
+ * client SYN to the upstream connect() completion and to the first response payload, and the
+ * time from its first request to its first response. The latencies are aggregated into
+ * log2 histograms, by app and by host. The hosts table is bounded: when full, the host with
+ * the fewest samples is replaced, and the new host inherits its samples count (Space-Saving).
+ * The histograms of the new host only contain its own samples.
+ */
+
+#define LAT_NUM_BUCKETS     16  /* bucket 0: < 1 ms, bucket i: [2^(i-1), 2^i) ms, the last is open */
+#define LAT_HOSTS_CAPACITY  128
+#define LAT_HOST_SIZE       64
+#define LAT_MAX_PACKETS     32  /* packets of a connection after which its latencies are no longer tracked */
+
+/* Must match LatencyHistograms.java */
+typedef enum {
+    LAT_CONNECT = 0,    /* client SYN -> upstream connect() completed */
+    LAT_HANDSHAKE,      /* client SYN -> first response payload, i.e. the first data exchange */
+    LAT_DNS,            /* first request -> first response */
+    LAT_HTTP,
+    LAT_TLS,
+    LAT_NUM_KINDS
+} lat_kind_t;
+
+typedef struct lat_hist {
+    u_int32_t buckets[LAT_NUM_BUCKETS];
+    u_int32_t count;
+    u_int64_t sum_us;
+} lat_hist_t;
+
+typedef struct lat_hists {
+    lat_hist_t kind[LAT_NUM_KINDS];
+} lat_hists_t;
+
+/* Per-connection state, timestamps are from lat_now_us */
+typedef struct conn_latency {
+    u_int64_t syn_us;       /* the client SYN, 0 if not seen */
+    u_int64_t req_us;       /* the first request payload, 0 if not seen */
+    u_int32_t connect_us;   /* the latencies, 0 if not measured */
+    u_int32_t handshake_us;
+    u_int32_t response_us;
+    u_int8_t num_pkts;      /* the packets seen, up to LAT_MAX_PACKETS */
+    bool done;              /* nothing more to measure */
+} conn_latency_t;
+
+typedef struct lat_host {
+    char host[LAT_HOST_SIZE];
+    lat_hists_t hists;
+    u_int32_t samples;      /* including the ones inherited on replacement */
+    UT_hash_handle hh;
+} lat_host_t;
+
+typedef struct lat_hosts lat_hosts_t;
+
+u_int64_t lat_now_us();
+
+/* At least 1 us, as 0 means "not measured" */
+static inline u_int32_t lat_elapsed_us(u_int64_t since_us) {
+    u_int64_t us = lat_now_us() - since_us;
+
+    return((us == 0) ? 1 : ((us > UINT32_MAX) ? UINT32_MAX : (u_int32_t) us));
+}
+void lat_hist_add(lat_hist_t *hist, u_int64_t us);
+lat_hosts_t* lat_hosts_init(int capacity);
+void lat_hosts_destroy(lat_hosts_t *hosts);
+lat_hists_t* lat_hosts_get(lat_hosts_t *hosts, const char *host);
+int lat_hosts_num(const lat_hosts_t *hosts);
+const lat_host_t* lat_hosts_iter(const lat_hosts_t *hosts, const lat_host_t *prev);
+u_int32_t lat_hosts_evictions(const lat_hosts_t *hosts);
+size_t lat_hosts_mem_usage(const lat_hosts_t *hosts);
+
+#endif // __LATENCY_H__
@@ -0,0 +1,429 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <android/log.h>
+#include "shaper.h"
+#include "jni_helpers.h"
+
+typedef struct queued_pkt {
+    struct queued_pkt *next;
+    u_int64_t enqueued_ms;
+    int len;
+    char data[];
+} queued_pkt_t;
+
+/* A token bucket, in bytes */
+typedef struct token_bucket {
+    u_int32_t rate_kbps; /* 0 if unlimited */
+    int64_t tokens;
+    int64_t burst;
+    u_int64_t last_refill_ms;
+} token_bucket_t;
+
+typedef struct shaper_class {
+    int uid;
+    u_int16_t weight;
+    token_bucket_t bucket;
+
+    /* FIFO queue */
+    queued_pkt_t *head;
+    queued_pkt_t *tail;
+    int64_t deficit;
+
+    shaper_class_stats_t stats;
+    u_int64_t tot_delay_ms;
+} shaper_class_t;
+
+struct shaper {
+    token_bucket_t link;
+    shaper_class_t classes[SHAPER_MAX_CLASSES];
+    int num_classes;
+    int next_class; /* round robin position */
+    int num_backlogged;
+    size_t queued_bytes;
+};
+
+/* ******************************************************* */
+
+shaper_t* shaper_init() {
+    return(calloc(1, sizeof(shaper_t)));
+}
+
+/* ******************************************************* */
+
+void shaper_destroy(shaper_t *shaper) {
+    for(int i = 0; i < shaper->num_classes; i++) {
+        queued_pkt_t *pkt = shaper->classes[i].head;
+
+        while(pkt) {
+            queued_pkt_t *next = pkt->next;
+
+            free(pkt);
+            pkt = next;
+        }
+    }
+
+    free(shaper);
+}
+
+/* ******************************************************* */
+
+static shaper_class_t* find_class(shaper_t *shaper, int uid) {
+    for(int i = 0; i < shaper->num_classes; i++) {
+        if(shaper->classes[i].uid == uid)
+            return(&shaper->classes[i]);
+    }
+
+    return(NULL);
+}
+
+/* ******************************************************* */
+
+static void bucket_init(token_bucket_t *bucket, u_int32_t rate_kbps) {
+    bucket->rate_kbps = rate_kbps;
+
+    /* kbps / 8 = bytes per ms */
+    bucket->burst = (int64_t) rate_kbps * SHAPER_BURST_MS / 8;
+    if(bucket->burst < SHAPER_MIN_BURST)
+        bucket->burst = SHAPER_MIN_BURST;
+    bucket->tokens = bucket->burst;
+}
+
+/* ******************************************************* */
+
+static void bucket_refill(token_bucket_t *bucket, u_int64_t now_ms) {
+    if(now_ms > bucket->last_refill_ms) {
+        bucket->tokens += (int64_t)(now_ms - bucket->last_refill_ms) * bucket->rate_kbps / 8;
+        if(bucket->tokens > bucket->burst)
+            bucket->tokens = bucket->burst;
+    }
+
+    bucket->last_refill_ms = now_ms;
+}
+
+/* ******************************************************* */
+
+static inline bool bucket_has_tokens(const token_bucket_t *bucket, int len) {
+    return((bucket->rate_kbps == 0) || (bucket->tokens >= len));
+}
+
+/* ******************************************************* */
+
+/* The time to wait before the bucket has len tokens */
+static inline u_int64_t bucket_wait_ms(const token_bucket_t *bucket, int len) {
+    if(bucket_has_tokens(bucket, len))
+        return(0);
+
+    return(((len - bucket->tokens) * 8 + bucket->rate_kbps - 1) / bucket->rate_kbps);
+}
+
+/* ******************************************************* */
+
+/* Add or update the class of an uid. Returns 0 on success. */
+int shaper_set_class(shaper_t *shaper, int uid, u_int32_t rate_kbps, u_int16_t weight) {
+    shaper_class_t *cls = find_class(shaper, uid);
+
+    if((weight < 1) || (weight > SHAPER_MAX_WEIGHT))
+        return(-1);
+
+    if(!cls) {
+        if(shaper->num_classes >= SHAPER_MAX_CLASSES)
+            return(-1);
+
+        cls = &shaper->classes[shaper->num_classes++];
+        memset(cls, 0, sizeof(*cls));
+        cls->uid = cls->stats.uid = uid;
+    }
+
+    cls->weight = cls->stats.weight = weight;
+    cls->stats.rate_kbps = rate_kbps;
+    bucket_init(&cls->bucket, rate_kbps);
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Set the rate shared by all the classes, 0 for unlimited */
+void shaper_set_link_rate(shaper_t *shaper, u_int32_t rate_kbps) {
+    bucket_init(&shaper->link, rate_kbps);
+}
+
+/* ******************************************************* */
+
+/* Load a "<uid>:<rate_kbps>[:<weight>],..." config. Returns the number of classes loaded. */
+int shaper_load_config(shaper_t *shaper, const char *config) {
+    const char *p = config;
+    int num = 0;
+
+    while(p && *p) {
+        char *end;
+        long uid, rate, weight = 1;
+
+        if(strncmp(p, "all:", 4) == 0) {
+            rate = strtol(p + 4, &end, 10);
+
+            if((end != p + 4) && ((*end == ',') || (*end == '\0')) && (rate >= 0)) {
+                shaper_set_link_rate(shaper, (u_int32_t) rate);
+                num++;
+            } else
+                log_android(ANDROID_LOG_WARN, "Invalid shaper config entry at: %s", p);
+
+            p = strchr(p, ',');
+            if(p)
+                p++;
+            continue;
+        }
+
+        uid = strtol(p, &end, 10);
+
+        if((end != p) && (*end == ':')) {
+            p = end + 1;
+            rate = strtol(p, &end, 10);
+
+            if((end != p) && (*end == ':')) {
+                p = end + 1;
+                weight = strtol(p, &end, 10);
+            }
+
+            if((end != p) && ((*end == ',') || (*end == '\0')) && (rate >= 0) && (rate <= UINT32_MAX) &&
+               (shaper_set_class(shaper, (int) uid, (u_int32_t) rate, (u_int16_t) weight) == 0))
+                num++;
+            else
+                log_android(ANDROID_LOG_WARN, "Invalid shaper config entry at: %s", p);
+        } else
+            log_android(ANDROID_LOG_WARN, "Invalid shaper config entry at: %s", p);
+
+        p = strchr(p, ',');
+        if(p)
+            p++;
+    }
+
+    return(num);
+}
+
+/* ******************************************************* */
+
+int shaper_num_classes(const shaper_t *shaper) {
+    return(shaper->num_classes);
+}
+
+/* ******************************************************* */
+
+static inline bool has_tokens(shaper_t *shaper, shaper_class_t *cls, int len, u_int64_t now_ms) {
+    bucket_refill(&cls->bucket, now_ms);
+    bucket_refill(&shaper->link, now_ms);
+
+    return(bucket_has_tokens(&cls->bucket, len) && bucket_has_tokens(&shaper->link, len));
+}
+
+/* ******************************************************* */
+
+static void account_sent(shaper_t *shaper, shaper_class_t *cls, int len, u_int64_t delay_ms) {
+    if(cls->bucket.rate_kbps)
+        cls->bucket.tokens -= len;
+    if(shaper->link.rate_kbps)
+        shaper->link.tokens -= len;
+
+    cls->stats.sent_pkts++;
+    cls->stats.sent_bytes += len;
+    cls->tot_delay_ms += delay_ms;
+
+    if(delay_ms > cls->stats.max_delay_ms)
+        cls->stats.max_delay_ms = delay_ms;
+}
+
+/* ******************************************************* */
+
+/* Returns 0 if the packet can be sent now, 1 if it was queued, -1 if it must be dropped (the
+ * uid queue is full or out of memory) */
+int shaper_enqueue(shaper_t *shaper, int uid, const char *pkt, int len, u_int64_t now_ms) {
+    shaper_class_t *cls = find_class(shaper, uid);
+    queued_pkt_t *q;
+
+    if(!cls)
+        return(0);
+
+    /* on a shared link, do not overtake the queued packets of the other classes */
+    if(!cls->head && (!shaper->link.rate_kbps || !shaper->num_backlogged) &&
+       has_tokens(shaper, cls, len, now_ms)) {
+        /* pass through */
+        account_sent(shaper, cls, len, 0);
+        return(0);
+    }
+
+    if((cls->stats.backlog_bytes + len) > SHAPER_MAX_QUEUE_BYTES) {
+        cls->stats.dropped_pkts++;
+        return(-1);
+    }
+
+    if((q = malloc(sizeof(queued_pkt_t) + len)) == NULL) {
+        cls->stats.dropped_pkts++;
+        return(-1);
+    }
+
+    q->next = NULL;
+    q->enqueued_ms = now_ms;
+    q->len = len;
+    memcpy(q->data, pkt, len);
+
+    if(cls->tail)
+        cls->tail->next = q;
+    else {
+        cls->head = q;
+        shaper->num_backlogged++;
+    }
+    cls->tail = q;
+
+    cls->stats.backlog_pkts++;
+    cls->stats.backlog_bytes += len;
+    shaper->queued_bytes += len;
+
+    return(1);
+}
+
+/* ******************************************************* */
+
+/* Release up to budget queued packets, via deficit round robin. Returns the number of packets
+ * released. */
+int shaper_dequeue(shaper_t *shaper, u_int64_t now_ms, int budget, shaper_send_cb cb, void *userdata) {
+    int sent = 0;
+
+    while((sent < budget) && (shaper->num_backlogged > 0)) {
+        int start = shaper->next_class;
+        bool progress = false;
+
+        for(int n = 0; n < shaper->num_classes; n++) {
+            int idx = (start + n) % shaper->num_classes;
+            shaper_class_t *cls = &shaper->classes[idx];
+            int64_t quantum = (int64_t) cls->weight * SHAPER_QUANTUM;
+
+            if(!cls->head || !has_tokens(shaper, cls, cls->head->len, now_ms))
+                continue;
+
+            /* a class stopped by the budget or the link rate resumes its turn */
+            if(cls->deficit < cls->head->len)
+                cls->deficit += quantum;
+
+            while(cls->head && (cls->head->len <= cls->deficit) && (sent < budget) &&
+                  has_tokens(shaper, cls, cls->head->len, now_ms)) {
+                queued_pkt_t *q = cls->head;
+
+                if(!(cls->head = q->next))
+                    cls->tail = NULL;
+
+                cls->deficit -= q->len;
+                cls->stats.backlog_pkts--;
+                cls->stats.backlog_bytes -= q->len;
+                cls->stats.queued_pkts++;
+                shaper->queued_bytes -= q->len;
+                account_sent(shaper, cls, q->len, now_ms - q->enqueued_ms);
+
+                cb(q->data, q->len, userdata);
+                free(q);
+
+                sent++;
+                progress = true;
+            }
+
+            shaper->next_class = (idx + 1) % shaper->num_classes;
+
+            if(!cls->head) {
+                cls->deficit = 0;
+                shaper->num_backlogged--;
+            } else if(cls->head->len <= cls->deficit) {
+                if((sent >= budget) || !bucket_has_tokens(&shaper->link, cls->head->len)) {
+                    /* the turn was interrupted, no other class can send now */
+                    shaper->next_class = idx;
+                    return(sent);
+                }
+
+                /* throttled by its own rate: the turn ends, without keeping credit */
+                if(cls->deficit > quantum)
+                    cls->deficit = quantum;
+            }
+        }
+
+        if(!progress)
+            break;
+    }
+
+    return(sent);
+}
+
+/* ******************************************************* */
+
+/* Returns the time at which shaper_dequeue should be called, UINT64_MAX if there are no queued
+ * packets */
+u_int64_t shaper_next_timeout(shaper_t *shaper, u_int64_t now_ms) {
+    u_int64_t next = UINT64_MAX;
+
+    if(shaper->num_backlogged == 0)
+        return(next);
+
+    for(int i = 0; i < shaper->num_classes; i++) {
+        shaper_class_t *cls = &shaper->classes[i];
+        u_int64_t ready_ms, link_ready_ms;
+
+        if(!cls->head)
+            continue;
+
+        if(has_tokens(shaper, cls, cls->head->len, now_ms))
+            return(now_ms);
+
+        ready_ms = now_ms + bucket_wait_ms(&cls->bucket, cls->head->len);
+        link_ready_ms = now_ms + bucket_wait_ms(&shaper->link, cls->head->len);
+        if(link_ready_ms > ready_ms)
+            ready_ms = link_ready_ms;
+
+        if(ready_ms < next)
+            next = ready_ms;
+    }
+
+    return(next);
+}
+
+/* ******************************************************* */
+
+int shaper_get_stats(const shaper_t *shaper, shaper_class_stats_t *out, int max) {
+    int num = (shaper->num_classes < max) ? shaper->num_classes : max;
+
+    for(int i = 0; i < num; i++) {
+        const shaper_class_t *cls = &shaper->classes[i];
+
+        out[i] = cls->stats;
+        out[i].avg_delay_ms = cls->stats.sent_pkts ? (u_int32_t)(cls->tot_delay_ms / cls->stats.sent_pkts) : 0;
+    }
+
+    return(num);
+}
+
+/* ******************************************************* */
+
+size_t shaper_mem_usage(const shaper_t *shaper) {
+    int num_pkts = 0;
+
+    for(int i = 0; i < shaper->num_classes; i++)
+        num_pkts += shaper->classes[i].stats.backlog_pkts;
+
+    return(sizeof(shaper_t) + shaper->queued_bytes + num_pkts * sizeof(queued_pkt_t));
+}
@@ -0,0 +1,78 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __SHAPER_H__
+#define __SHAPER_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Per-app shaping of the upstream traffic (packets read from the tun). Each configured uid has
+ * a class with an optional token bucket rate limit and a weight. An optional link rate is
+ * shared by all the classes. The packets of a class pass through when its queue is empty and
+ * both the class and the link have enough tokens, otherwise they are queued (FIFO, so the
+ * packets order of each connection is preserved). The queued packets are released by
+ * shaper_dequeue with deficit round robin, where each class gets a quantum proportional to its
+ * weight, so that under load the link rate is shared by weight. Packets of the unconfigured uids
+ * are not shaped and do not consume the link tokens.
+ *
+ * The config is a comma separated list of "<uid>:<rate_kbps>[:<weight>]" entries, where a
+ * rate of 0 means unlimited, plus an optional "all:<rate_kbps>" link rate.
+ */
+
+#define SHAPER_MAX_CLASSES      64
+#define SHAPER_MAX_WEIGHT       100
+#define SHAPER_QUANTUM          1500    /* bytes per round, per weight unit */
+#define SHAPER_BURST_MS         50      /* token bucket depth, in ms of traffic at the rate */
+#define SHAPER_MIN_BURST        3000    /* bytes, at least 2 full-size packets */
+#define SHAPER_MAX_QUEUE_BYTES  (256 * 1024) /* per class, tail drop above */
+
+typedef struct shaper shaper_t;
+
+typedef struct shaper_class_stats {
+    int uid;
+    u_int32_t rate_kbps;        /* 0 if unlimited */
+    u_int16_t weight;
+    u_int32_t backlog_pkts;     /* currently queued */
+    u_int32_t backlog_bytes;
+    u_int64_t sent_bytes;
+    u_int32_t sent_pkts;
+    u_int32_t queued_pkts;      /* sent after being queued */
+    u_int32_t dropped_pkts;
+    u_int32_t avg_delay_ms;     /* queue delay of the sent packets, 0 for the ones passed through */
+    u_int32_t max_delay_ms;
+} shaper_class_stats_t;
+
+/* Invoked with a released packet */
+typedef void (*shaper_send_cb)(const char *pkt, int len, void *userdata);
+
+shaper_t* shaper_init();
+void shaper_destroy(shaper_t *shaper);
+int shaper_set_class(shaper_t *shaper, int uid, u_int32_t rate_kbps, u_int16_t weight);
+void shaper_set_link_rate(shaper_t *shaper, u_int32_t rate_kbps);
+int shaper_load_config(shaper_t *shaper, const char *config);
+int shaper_num_classes(const shaper_t *shaper);
+int shaper_enqueue(shaper_t *shaper, int uid, const char *pkt, int len, u_int64_t now_ms);
+int shaper_dequeue(shaper_t *shaper, u_int64_t now_ms, int budget, shaper_send_cb cb, void *userdata);
+u_int64_t shaper_next_timeout(shaper_t *shaper, u_int64_t now_ms);
+int shaper_get_stats(const shaper_t *shaper, shaper_class_stats_t *out, int max);
+size_t shaper_mem_usage(const shaper_t *shaper);
+
+#endif // __SHAPER_H__
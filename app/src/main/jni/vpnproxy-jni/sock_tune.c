@@ -0,0 +1,228 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <android/log.h>
+#include "sock_tune.h"
+#include "jni_helpers.h"
+
+struct sock_tuner {
+    sock_tuner_stats_t stats;
+};
+
+/* ******************************************************* */
+
+sock_tuner_t* sock_tuner_init(u_int64_t max_total) {
+    sock_tuner_t *tuner = calloc(1, sizeof(sock_tuner_t));
+
+    if(!tuner) {
+        log_android(ANDROID_LOG_ERROR, "calloc(sock_tuner_t) failed");
+        return(NULL);
+    }
+
+    tuner->stats.max_total = max_total;
+    return(tuner);
+}
+
+/* ******************************************************* */
+
+void sock_tuner_destroy(sock_tuner_t *tuner) {
+    free(tuner);
+}
+
+/* ******************************************************* */
+
+void sock_tune_init(sock_tune_t *st) {
+    memset(st, 0, sizeof(*st));
+    st->sock = -1;
+}
+
+/* ******************************************************* */
+
+static u_int32_t get_buf_size(int sock, int opt) {
+    int val = 0;
+    socklen_t len = sizeof(val);
+
+    if((getsockopt(sock, SOL_SOCKET, opt, &val, &len) != 0) || (val < 0))
+        return(0);
+
+    return((u_int32_t) val);
+}
+
+/* ******************************************************* */
+
+/* Read the current sizes, which the kernel auto-tuning may have changed */
+static void refresh_sizes(sock_tuner_t *tuner, sock_tune_t *st) {
+    u_int32_t rcvbuf = get_buf_size(st->sock, SO_RCVBUF);
+    u_int32_t sndbuf = get_buf_size(st->sock, SO_SNDBUF);
+
+    tuner->stats.tot_bufs = tuner->stats.tot_bufs - st->rcvbuf - st->sndbuf + rcvbuf + sndbuf;
+    st->rcvbuf = rcvbuf;
+    st->sndbuf = sndbuf;
+}
+
+/* ******************************************************* */
+
+void sock_tune_attach(sock_tuner_t *tuner, sock_tune_t *st, int sock) {
+    sock_tune_detach(tuner, st);
+
+    st->sock = sock;
+    st->pinned = false;
+    st->rcvbuf = st->sndbuf = 0;
+    refresh_sizes(tuner, st);
+    tuner->stats.num_sockets++;
+}
+
+/* ******************************************************* */
+
+/* Stop tracking the socket, e.g. because it is being closed. The last sizes are kept. */
+void sock_tune_detach(sock_tuner_t *tuner, sock_tune_t *st) {
+    if(st->sock < 0)
+        return;
+
+    tuner->stats.tot_bufs -= st->rcvbuf + st->sndbuf;
+    tuner->stats.num_sockets--;
+    st->sock = -1;
+}
+
+/* ******************************************************* */
+
+/* The buffer size, in kernel units, to hold 2x the BDP. Half of the buffer is overhead. */
+static u_int32_t target_size(u_int32_t rate, u_int32_t rtt_us) {
+    u_int64_t bdp = (u_int64_t) rate * rtt_us / 1000000;
+    u_int64_t size = bdp * 4;
+
+    if(size < SOCK_TUNE_MIN_BUF)
+        return(SOCK_TUNE_MIN_BUF);
+    if(size > SOCK_TUNE_MAX_BUF)
+        return(SOCK_TUNE_MAX_BUF);
+    return((u_int32_t) size);
+}
+
+/* ******************************************************* */
+
+/* Returns the new size, which the kernel may have clamped to net.core.[rw]mem_max */
+static u_int32_t set_buf_size(sock_tuner_t *tuner, sock_tune_t *st, int opt, u_int32_t cur, u_int32_t size) {
+    int val = (int)(size / 2); /* doubled by the kernel */
+
+    if(setsockopt(st->sock, SOL_SOCKET, opt, &val, sizeof(val)) != 0) {
+        log_android(ANDROID_LOG_DEBUG, "setsockopt(%s) failed[%d]: %s",
+                    (opt == SO_RCVBUF) ? "SO_RCVBUF" : "SO_SNDBUF", errno, strerror(errno));
+        return(cur);
+    }
+
+    st->pinned = true;
+
+    if((size = get_buf_size(st->sock, opt)) == 0)
+        size = val * 2;
+
+    tuner->stats.tot_bufs = tuner->stats.tot_bufs - cur + size;
+
+    if(size > cur)
+        tuner->stats.grown++;
+    else if(size < cur)
+        tuner->stats.shrunk++;
+
+    return(size);
+}
+
+/* ******************************************************* */
+
+/* Grow a buffer to the target size, within the global limit. Small increments are skipped, and
+ * so are the buffers which need no more than the minimum, which the kernel can manage. */
+static u_int32_t grow_buf(sock_tuner_t *tuner, sock_tune_t *st, int opt, u_int32_t cur, u_int32_t target) {
+    u_int64_t avail = (tuner->stats.tot_bufs < tuner->stats.max_total) ?
+                      (tuner->stats.max_total - tuner->stats.tot_bufs) : 0;
+
+    if((target <= SOCK_TUNE_MIN_BUF) || (target <= (cur + cur / 4)))
+        return(cur);
+
+    if((target - cur) > avail) {
+        tuner->stats.capped++;
+        target = cur + (u_int32_t) avail;
+
+        if(target <= (cur + cur / 4))
+            return(cur);
+    }
+
+    return(set_buf_size(tuner, st, opt, cur, target));
+}
+
+/* ******************************************************* */
+
+static inline u_int32_t decayed_peak(u_int32_t rate, u_int32_t cur) {
+    u_int32_t decayed = rate - rate / 4;
+
+    return((cur > decayed) ? cur : decayed);
+}
+
+/* ******************************************************* */
+
+/* Update the socket with the connection byte counters and the latest RTT (0 if unknown),
+ * elapsed_ms after the previous update. Returns true if the buffer sizes changed. */
+bool sock_tune_update(sock_tuner_t *tuner, sock_tune_t *st, u_int64_t sent_bytes, u_int64_t rcvd_bytes,
+                      u_int32_t rtt_us, u_int32_t elapsed_ms) {
+    u_int32_t old_rcvbuf = st->rcvbuf;
+    u_int32_t old_sndbuf = st->sndbuf;
+
+    if((st->sock < 0) || (elapsed_ms == 0))
+        return(false);
+
+    u_int64_t rx = rcvd_bytes - st->last_rcvd;
+    u_int64_t tx = sent_bytes - st->last_sent;
+
+    st->last_rcvd = rcvd_bytes;
+    st->last_sent = sent_bytes;
+    st->tput_kbps = (u_int32_t)((rx + tx) * 8 / elapsed_ms);
+    st->rx_rate = decayed_peak(st->rx_rate, (u_int32_t)(rx * 1000 / elapsed_ms));
+    st->tx_rate = decayed_peak(st->tx_rate, (u_int32_t)(tx * 1000 / elapsed_ms));
+
+    if(rx || tx) {
+        st->idle_rounds = 0;
+
+        if(!st->pinned)
+            refresh_sizes(tuner, st);
+
+        if(rtt_us == 0)
+            rtt_us = SOCK_TUNE_DEFAULT_RTT_US;
+
+        st->rcvbuf = grow_buf(tuner, st, SO_RCVBUF, st->rcvbuf, target_size(st->rx_rate, rtt_us));
+        st->sndbuf = grow_buf(tuner, st, SO_SNDBUF, st->sndbuf, target_size(st->tx_rate, rtt_us));
+    } else if(++st->idle_rounds == SOCK_TUNE_IDLE_ROUNDS) {
+        if(!st->pinned)
+            refresh_sizes(tuner, st);
+
+        if(st->rcvbuf > SOCK_TUNE_MIN_BUF)
+            st->rcvbuf = set_buf_size(tuner, st, SO_RCVBUF, st->rcvbuf, SOCK_TUNE_MIN_BUF);
+        if(st->sndbuf > SOCK_TUNE_MIN_BUF)
+            st->sndbuf = set_buf_size(tuner, st, SO_SNDBUF, st->sndbuf, SOCK_TUNE_MIN_BUF);
+    } else if(st->idle_rounds > SOCK_TUNE_IDLE_ROUNDS)
+        st->idle_rounds = SOCK_TUNE_IDLE_ROUNDS + 1; /* already shrunk */
+
+    return((st->rcvbuf != old_rcvbuf) || (st->sndbuf != old_sndbuf));
+}
+
+/* ******************************************************* */
+
+void sock_tuner_get_stats(const sock_tuner_t *tuner, sock_tuner_stats_t *stats) {
+    *stats = tuner->stats;
+}
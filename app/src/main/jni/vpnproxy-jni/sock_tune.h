@@ -0,0 +1,83 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __SOCK_TUNE_H__
+#define __SOCK_TUNE_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Adaptive sizing of the SO_RCVBUF/SO_SNDBUF of the upstream TCP sockets. Each socket is
+ * periodically updated with the byte counters of its connection: the achieved throughput
+ * (peak-hold, decaying) and the latest RTT sample (see tcp_health.h) give the bandwidth-delay
+ * product, and each buffer is grown to hold 2x the BDP of its direction. As long as a buffer
+ * is what limits a flow, the measured rate is buffer/RTT, so the buffer doubles each round
+ * until the flow is limited by something else. Sockets idle for SOCK_TUNE_IDLE_ROUNDS are
+ * shrunk to SOCK_TUNE_MIN_BUF.
+ *
+ * Growth is bounded by SOCK_TUNE_MAX_BUF per buffer and by a global limit on the sum of all the
+ * tracked buffers. Sizes are in kernel units, i.e. as reported by getsockopt, which is twice
+ * the value passed to setsockopt, the other half being the bookkeeping overhead. Setting a
+ * buffer disables the kernel auto-tuning for it, so the buffers are only set when growing past
+ * what the kernel chose, or when shrinking an idle socket.
+ */
+
+#define SOCK_TUNE_INTERVAL_MS       1000
+#define SOCK_TUNE_MIN_BUF           (32 * 1024)
+#define SOCK_TUNE_MAX_BUF           (4 * 1024 * 1024)
+#define SOCK_TUNE_DEFAULT_MAX_TOTAL (32 * 1024 * 1024)
+#define SOCK_TUNE_IDLE_ROUNDS       5
+#define SOCK_TUNE_DEFAULT_RTT_US    100000 /* if the RTT was not sampled */
+
+/* Per-socket state, embedded in the connection data */
+typedef struct sock_tune {
+    int sock;               /* -1 if not tracked */
+    bool pinned;            /* the buffers were set, the kernel no longer auto-tunes them */
+    u_int8_t idle_rounds;
+    u_int32_t rcvbuf;       /* current sizes, kept after the socket is detached */
+    u_int32_t sndbuf;
+    u_int32_t rx_rate;      /* bytes/s used for the sizing */
+    u_int32_t tx_rate;
+    u_int32_t tput_kbps;    /* throughput achieved in the last interval, both directions */
+    u_int64_t last_rcvd;    /* byte counters at the last update */
+    u_int64_t last_sent;
+} sock_tune_t;
+
+typedef struct sock_tuner_stats {
+    u_int32_t num_sockets;  /* currently tracked */
+    u_int64_t tot_bufs;     /* sum of the tracked buffers */
+    u_int64_t max_total;
+    u_int32_t grown;        /* buffers grown */
+    u_int32_t shrunk;       /* buffers shrunk */
+    u_int32_t capped;       /* growths limited by the global limit */
+} sock_tuner_stats_t;
+
+typedef struct sock_tuner sock_tuner_t;
+
+sock_tuner_t* sock_tuner_init(u_int64_t max_total);
+void sock_tuner_destroy(sock_tuner_t *tuner);
+void sock_tune_init(sock_tune_t *st);
+void sock_tune_attach(sock_tuner_t *tuner, sock_tune_t *st, int sock);
+void sock_tune_detach(sock_tuner_t *tuner, sock_tune_t *st);
+bool sock_tune_update(sock_tuner_t *tuner, sock_tune_t *st, u_int64_t sent_bytes, u_int64_t rcvd_bytes,
+                      u_int32_t rtt_us, u_int32_t elapsed_ms);
+void sock_tuner_get_stats(const sock_tuner_t *tuner, sock_tuner_stats_t *stats);
+
+#endif // __SOCK_TUNE_H__
@@ -0,0 +1,60 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+#include <android/log.h>
+#include "tcp_health.h"
+#include "jni_helpers.h"
+
+/* ******************************************************* */
+
+/* Update the health with a new TCP_INFO sample of the socket. Returns 1 if any metric changed,
+ * 0 if not, -1 on error. Older kernels return a shorter tcp_info, the missing fields are 0. */
+int tcp_health_sample(int sock, tcp_health_t *health, u_int64_t now_ms) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    tcp_health_t prev = *health;
+
+    memset(&info, 0, sizeof(info));
+    health->sampled_ms = now_ms;
+
+    if(getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        log_android(ANDROID_LOG_DEBUG, "getsockopt(TCP_INFO) failed[%d]: %s", errno, strerror(errno));
+        return(-1);
+    }
+
+    if(len < offsetof(struct tcp_info, tcpi_total_retrans) + sizeof(info.tcpi_total_retrans))
+        return(-1);
+
+    health->rtt_us = info.tcpi_rtt;
+    health->rttvar_us = info.tcpi_rttvar;
+    health->retrans = info.tcpi_total_retrans;
+    health->cwnd = info.tcpi_snd_cwnd;
+
+    if(len >= offsetof(struct tcp_info, tcpi_delivery_rate) + sizeof(info.tcpi_delivery_rate))
+        health->delivery_rate = info.tcpi_delivery_rate;
+
+    prev.sampled_ms = now_ms;
+    return(memcmp(&prev, health, sizeof(prev)) ? 1 : 0);
+}
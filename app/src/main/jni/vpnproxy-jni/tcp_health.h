@@ -0,0 +1,48 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+#ifndef __TCP_HEALTH_H__
+#define __TCP_HEALTH_H__
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/*
+ * Health metrics of the upstream TCP sockets, sampled via getsockopt(TCP_INFO). They tell the
+ * network conditions (RTT, losses, congestion) apart from the delays added by the engine. The
+ * sockets are sampled every TCP_HEALTH_INTERVAL_MS, at most TCP_HEALTH_TICK_BUDGET per tick,
+ * so that the syscalls cost is bounded regardless of the number of connections.
+ */
+
+#define TCP_HEALTH_TICK_MS          250
+#define TCP_HEALTH_INTERVAL_MS      2000    /* per socket */
+#define TCP_HEALTH_TICK_BUDGET      32      /* sockets sampled per tick */
+
+typedef struct tcp_health {
+    u_int32_t rtt_us;           /* smoothed RTT */
+    u_int32_t rttvar_us;
+    u_int32_t retrans;          /* total retransmitted segments */
+    u_int32_t cwnd;             /* congestion window, in segments */
+    u_int64_t delivery_rate;    /* bytes/s, 0 if not supported by the kernel */
+    u_int64_t sampled_ms;       /* 0 if never sampled */
+} tcp_health_t;
+
+int tcp_health_sample(int sock, tcp_health_t *health, u_int64_t now_ms);
+
+#endif // __TCP_HEALTH_H__
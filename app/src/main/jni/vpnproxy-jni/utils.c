@@ -18,6 +18,8 @@
  */
 
 #include <stdint.h>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
 
 /* ******************************************************* */
 
@@ -56,4 +58,48 @@ static inline u_int16_t wrapsum(u_int32_t sum) {
 
 static u_int16_t ip_checksum(const void *buf, size_t hdr_len) {
     return wrapsum(in_cksum(buf, hdr_len, 0));
+}
+
+/* ******************************************************* */
+
+#define IPV4_UDP_HDRS_LEN (sizeof(struct iphdr) + sizeof(struct udphdr))
+
+/* Build the IPv4 and UDP headers of a packet, whose payload must already be at
+ * buf + IPV4_UDP_HDRS_LEN. Addresses and ports are in network byte order.
+ * Returns the packet length. */
+static int build_udp4_packet(char *buf, u_int32_t src_ip, u_int16_t src_port,
+                             u_int32_t dst_ip, u_int16_t dst_port, int payload_len) {
+    struct iphdr *ip = (struct iphdr*) buf;
+    struct udphdr *udp = (struct udphdr*) (buf + sizeof(struct iphdr));
+    u_int16_t udp_len = sizeof(struct udphdr) + payload_len;
+    u_int32_t sum;
+
+    memset(ip, 0, sizeof(struct iphdr));
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->tot_len = htons(sizeof(struct iphdr) + udp_len);
+    ip->frag_off = htons(IP_DF);
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = src_ip;
+    ip->daddr = dst_ip;
+    ip->check = ip_checksum(ip, sizeof(struct iphdr));
+
+    udp->uh_sport = src_port;
+    udp->uh_dport = dst_port;
+    udp->uh_ulen = htons(udp_len);
+    udp->uh_sum = 0;
+
+    /* Pseudo header + UDP */
+    sum = in_cksum((const char*) &ip->saddr, 8, IPPROTO_UDP);
+    sum += udp_len;
+    if(sum > 0xFFFF)
+        sum -= 0xFFFF;
+    sum = in_cksum((const char*) udp, udp_len, sum);
+
+    udp->uh_sum = wrapsum(sum);
+    if(udp->uh_sum == 0)
+        udp->uh_sum = 0xFFFF;
+
+    return(sizeof(struct iphdr) + udp_len);
 }
\ No newline at end of file
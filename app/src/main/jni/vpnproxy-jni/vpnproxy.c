@@ -19,12 +19,15 @@
 
 #include <ndpi_api.h>
 #include <ndpi_typedefs.h>
+#include <pthread.h>
+#include <limits.h>
 #include "utils.c"
 #include "ndpi_master_protos.c"
 #include "jni_helpers.h"
 #include "vpnproxy.h"
 #include "uid_resolver.h"
 #include "pcap.h"
+#include "conn_export.h"
 #include "ndpi_protocol_ids.h"
 
 #define CAPTURE_STATS_UPDATE_FREQUENCY_MS 300
@@ -34,6 +37,14 @@
 #define MAX_HOST_LRU_SIZE 128
 #define JAVA_PCAP_BUFFER_SIZE (512*1024) // 512K
 #define PERIODIC_PURGE_TIMEOUT_MS 5000
+#define CONN_STORE_INITIAL_SIZE 256
+#define CONN_STORE_ITEM_SIZE (sizeof(zdtun_5tuple_t) + sizeof(conn_stats_t) + sizeof(jlong) + \
+        2 * sizeof(jint) + sizeof(ndpi_protocol) + sizeof(conn_data_t*) + 2 * sizeof(u_int32_t))
+#define NDPI_FLOW_MEM_SIZE (SIZEOF_FLOW_STRUCT + 2 * SIZEOF_ID_STRUCT)
+#define MEM_BUDGET_TARGET_PERC 90 /* eviction target, percentage of the budget */
+#define MEM_EVICTION_INTERVAL_MS 1000
+#define DNS_RECORD_TIMEOUT_MS 10000 /* see record_dns_query */
+#define TUN_READ_BUDGET 64 /* max packets read from the tun before servicing the sockets again */
 
 /* ******************************************************* */
 
@@ -59,12 +70,17 @@ typedef struct jni_methods {
     jmethodID protect;
     jmethodID dumpPcapData;
     jmethodID sendConnectionsDump;
+    jmethodID sendAppsStatsDump;
     jmethodID connInit;
     jmethodID connSetData;
+    jmethodID connSetSocketData;
     jmethodID sendServiceStatus;
     jmethodID sendStatsDump;
     jmethodID statsInit;
     jmethodID statsSetData;
+    jmethodID statsSetMemData;
+    jmethodID statsSetDnsCacheData;
+    jmethodID statsSetSchedData;
 } jni_methods_t;
 
 typedef struct jni_classes {
@@ -73,12 +89,31 @@ typedef struct jni_classes {
     jclass stats;
 } jni_classes_t;
 
-static bool check_dns_req_allowed(zdtun_t *tun, struct vpnproxy_data *proxy, zdtun_conn_t *conn);
+static bool check_dns_req_allowed(zdtun_t *tun, struct vpnproxy_data *proxy, zdtun_conn_t *conn,
+                                  const ip_rule_match_t *rule);
 
 static jni_classes_t cls;
 static jni_methods_t mids;
 static bool running = false;
 static bool dump_vpn_stats_now = false;
+static volatile int export_fd = -1;
+static conn_export_format_t export_format;
+
+/* The connections log outlives the capture, so that it can be browsed after the capture is
+ * stopped. It is replaced when a new capture starts. conn_log_mutex only protects the pointer:
+ * the readers take a reference, see get_conn_log. */
+static conn_log_t *conn_log = NULL;
+static pthread_mutex_t conn_log_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The bandwidth series and the heavy hitters are read via JNI from other threads. stats_mutex
+ * protects them and the apps table insertions, stats_proxy is only set while the capture is
+ * running. */
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static vpnproxy_data_t *stats_proxy = NULL;
+
+/* NOTE: must match ConnectionDescriptor::setData */
+#define CONN_SET_DATA_SIGNATURE \
+    "(Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;IIIIIJJJJIIII)V"
 static bool dump_capture_stats_now = false;
 static ndpi_protocol_bitmask_struct_t masterProtos;
 static uint32_t new_dns_server = 0;
@@ -91,74 +126,274 @@ static bool send_header;
 
 /* ******************************************************* */
 
-void free_ndpi(conn_data_t *data) {
+static void free_connection_data(vpnproxy_data_t *proxy, conn_data_t *data);
+static void publish_pending_traffic(vpnproxy_data_t *proxy);
+static void record_dns_query(vpnproxy_data_t *proxy, const zdtun_pkt_t *pkt, const char *qname, bool upstream);
+static bool record_dns_reply(vpnproxy_data_t *proxy, u_int32_t client_ip, u_int16_t client_port,
+                             const char *pkt_buf, int pkt_len);
+
+/* ******************************************************* */
+
+static inline u_int64_t get_now_ms() {
+    struct timeval now_tv;
+
+    gettimeofday(&now_tv, NULL);
+    return((u_int64_t) now_tv.tv_sec * 1000 + now_tv.tv_usec / 1000);
+}
+
+/* ******************************************************* */
+
+static void conn_store_free_columns(conn_store_t *store) {
+    free(store->tuple);
+    free(store->stats);
+    free(store->first_seen);
+    free(store->uid);
+    free(store->incr_id);
+    free(store->l7proto);
+    free(store->data);
+    free(store->order);
+    free(store->free_slots);
+}
+
+/* ******************************************************* */
+
+/* Moves the live connections into new columns of new_size items, at the slots [0, num_live),
+ * in creation order. The slot of each connection is updated. */
+static int conn_store_resize(conn_store_t *store, u_int32_t new_size) {
+    conn_store_t ns = *store;
+    u_int32_t num = 0;
+
+    ns.tuple = malloc(new_size * sizeof(*ns.tuple));
+    ns.stats = malloc(new_size * sizeof(*ns.stats));
+    ns.first_seen = malloc(new_size * sizeof(*ns.first_seen));
+    ns.uid = malloc(new_size * sizeof(*ns.uid));
+    ns.incr_id = malloc(new_size * sizeof(*ns.incr_id));
+    ns.l7proto = malloc(new_size * sizeof(*ns.l7proto));
+    ns.data = malloc(new_size * sizeof(*ns.data));
+    ns.order = malloc(new_size * sizeof(*ns.order));
+    ns.free_slots = malloc(new_size * sizeof(*ns.free_slots));
+    ns.size = new_size;
+
+    if(!ns.tuple || !ns.stats || !ns.first_seen || !ns.uid || !ns.incr_id || !ns.l7proto ||
+            !ns.data || !ns.order || !ns.free_slots) {
+        log_android(ANDROID_LOG_FATAL, "malloc(conn_store_t) (%u items) failed", new_size);
+        conn_store_free_columns(&ns);
+        return(-1);
+    }
+
+    for(u_int32_t i = 0; i < store->num_order; i++) {
+        u_int32_t from = store->order[i];
+
+        if(!store->data[from])
+            continue;
+
+        ns.tuple[num] = store->tuple[from];
+        ns.stats[num] = store->stats[from];
+        ns.first_seen[num] = store->first_seen[from];
+        ns.uid[num] = store->uid[from];
+        ns.incr_id[num] = store->incr_id[from];
+        ns.l7proto[num] = store->l7proto[from];
+        ns.data[num] = store->data[from];
+        ns.data[num]->slot = num;
+        ns.order[num] = num;
+        num++;
+    }
+
+    ns.num_order = num;
+    ns.num_released = 0;
+
+    /* lowest slots on top */
+    ns.num_free = 0;
+    for(u_int32_t slot = new_size; slot > num; slot--)
+        ns.free_slots[ns.num_free++] = slot - 1;
+
+    conn_store_free_columns(store);
+    *store = ns;
+
+    return(0);
+}
+
+/* ******************************************************* */
+
+/* Drop the released connections from the creation order and make their slots available. The
+ * columns are halved when mostly unused. Must not be called while iterating the store. */
+static void conn_store_compact(vpnproxy_data_t *proxy) {
+    conn_store_t *store = &proxy->conns;
+    u_int32_t num = 0;
+    u_int32_t export_cursor = 0, tcp_health_cursor = 0;
+    u_int32_t old_num = store->num_order;
+
+    if(store->num_released == 0)
+        return;
+
+    for(u_int32_t i = 0; i < store->num_order; i++) {
+        u_int32_t slot = store->order[i];
+
+        /* keep the scans in progress at the same connection */
+        if(i == proxy->export_cursor)
+            export_cursor = num;
+        if(i == proxy->tcp_health_cursor)
+            tcp_health_cursor = num;
+
+        if(store->data[slot])
+            store->order[num++] = slot;
+        else
+            store->free_slots[store->num_free++] = slot;
+    }
+
+    proxy->export_cursor = (proxy->export_cursor >= old_num) ? num : export_cursor;
+    proxy->tcp_health_cursor = (proxy->tcp_health_cursor >= old_num) ? num : tcp_health_cursor;
+    store->num_order = num;
+    store->num_released = 0;
+
+    if((store->size > CONN_STORE_INITIAL_SIZE) && (num < (store->size / 4)) &&
+            (conn_store_resize(store, store->size / 2) == 0))
+        proxy->mem.used[MEM_STORE] = (u_int64_t) store->size * CONN_STORE_ITEM_SIZE;
+}
+
+/* ******************************************************* */
+
+static conn_data_t* conn_store_add(vpnproxy_data_t *proxy, const zdtun_5tuple_t *tuple) {
+    conn_store_t *store = &proxy->conns;
+
+    /* Keep the scans proportional to the live connections */
+    if((store->num_free == 0) || (store->num_released > (store->num_order / 2)))
+        conn_store_compact(proxy);
+
+    if((store->data == NULL) || (store->num_free == 0)) {
+        if(conn_store_resize(store, (store->data == NULL) ? CONN_STORE_INITIAL_SIZE : (store->size * 2)) < 0)
+            return(NULL);
+
+        proxy->mem.used[MEM_STORE] = (u_int64_t) store->size * CONN_STORE_ITEM_SIZE;
+    }
+
+    conn_data_t *data = calloc(1, sizeof(conn_data_t));
+
+    if(!data) {
+        log_android(ANDROID_LOG_ERROR, "calloc(conn_data_t) failed with code %d/%s",
+                    errno, strerror(errno));
+        return(NULL);
+    }
+
+    u_int32_t slot = store->free_slots[--store->num_free];
+
+    store->order[store->num_order++] = slot;
+    proxy->mem.used[MEM_CONNS] += sizeof(conn_data_t);
+    data->slot = slot;
+    sock_tune_init(&data->tune);
+    store->tuple[slot] = *tuple;
+    memset(&store->stats[slot], 0, sizeof(conn_stats_t));
+    memset(&store->l7proto[slot], 0, sizeof(ndpi_protocol));
+    store->first_seen[slot] = 0;
+    store->uid[slot] = UID_UNKNOWN;
+    store->incr_id[slot] = -1;
+    store->data[slot] = data;
+
+    return(data);
+}
+
+/* ******************************************************* */
+
+/* The slot is reused after the next conn_store_compact, so this is safe while iterating */
+static void conn_store_release(vpnproxy_data_t *proxy, u_int32_t slot) {
+    conn_store_t *store = &proxy->conns;
+
+    free_connection_data(proxy, store->data[slot]);
+    store->data[slot] = NULL;
+    store->num_released++;
+}
+
+/* ******************************************************* */
+
+static void conn_store_destroy(vpnproxy_data_t *proxy) {
+    conn_store_t *store = &proxy->conns;
+
+    if(store->data) {
+        for(u_int32_t i = 0; i < store->num_order; i++)
+            free_connection_data(proxy, store->data[store->order[i]]);
+    }
+
+    conn_store_free_columns(store);
+    memset(store, 0, sizeof(*store));
+    proxy->mem.used[MEM_STORE] = 0;
+}
+
+/* ******************************************************* */
+
+static inline conn_stats_t* conn_get_stats(vpnproxy_data_t *proxy, const conn_data_t *data) {
+    return(&proxy->conns.stats[data->slot]);
+}
+
+/* ******************************************************* */
+
+void free_ndpi(vpnproxy_data_t *proxy, conn_data_t *data) {
     if(data->ndpi_flow) {
         ndpi_free_flow(data->ndpi_flow);
         data->ndpi_flow = NULL;
+        proxy->mem.used[MEM_NDPI] -= SIZEOF_FLOW_STRUCT;
     }
     if(data->src_id) {
         ndpi_free(data->src_id);
         data->src_id = NULL;
+        proxy->mem.used[MEM_NDPI] -= SIZEOF_ID_STRUCT;
     }
     if(data->dst_id) {
         ndpi_free(data->dst_id);
         data->dst_id = NULL;
+        proxy->mem.used[MEM_NDPI] -= SIZEOF_ID_STRUCT;
     }
 }
 
 /* ******************************************************* */
 
-static void free_connection_data(conn_data_t *data) {
-    if(!data)
-        return;
+/* Replace a connection string with a copy of value, which can be NULL */
+static void conn_str_set(vpnproxy_data_t *proxy, conn_str_t *str, const char *value) {
+    size_t len = (value ? strnlen(value, CONN_STR_MAX_LEN) : 0);
 
-    free_ndpi(data);
+    if(str->heap) {
+        proxy->mem.used[MEM_CONNS] -= strlen(str->heap) + 1;
+        free(str->heap);
+        str->heap = NULL;
+    }
 
-    if(data->info)
-        free(data->info);
+    if(len < CONN_STR_INLINE_SIZE) {
+        memcpy(str->inl, value, len);
+        str->inl[len] = '\0';
+        return;
+    }
 
-    if(data->url)
-        free(data->url);
+    /* only long strings, e.g. URLs, are allocated */
+    str->inl[0] = '\0';
 
-    free(data);
+    if((str->heap = strndup(value, len)) != NULL)
+        proxy->mem.used[MEM_CONNS] += len + 1;
 }
 
 /* ******************************************************* */
 
-static void conns_add(conn_array_t *arr, const zdtun_conn_t *conn) {
-    if(arr->cur_items >= arr->size) {
-        /* Extend array */
-        arr->size = (arr->size == 0) ? 8 : (arr->size * 2);
-        arr->items = realloc(arr->items, arr->size * sizeof(vpn_conn_t));
+static void free_connection_data(vpnproxy_data_t *proxy, conn_data_t *data) {
+    if(!data)
+        return;
+
+    /* the pending traffic may reference the connection */
+    publish_pending_traffic(proxy);
 
-        if(arr->items == NULL) {
-            log_android(ANDROID_LOG_FATAL, "realloc(conn_array_t) (%d items) failed", arr->size);
-            return;
-        }
-    }
+    free_ndpi(proxy, data);
+    conn_str_set(proxy, &data->info, NULL);
+    conn_str_set(proxy, &data->url, NULL);
 
-    vpn_conn_t *slot = &arr->items[arr->cur_items++];
-    slot->tuple = *zdtun_conn_get_5tuple(conn);
-    slot->data = zdtun_conn_get_userdata(conn);
+    free(data);
+    proxy->mem.used[MEM_CONNS] -= sizeof(conn_data_t);
 }
 
 /* ******************************************************* */
 
-static void conns_clear(conn_array_t *arr, bool free_all) {
-    if(arr->items) {
-        for(int i=0; i < arr->cur_items; i++) {
-            vpn_conn_t *slot = &arr->items[i];
-
-            if(slot->data && ((slot->data->status >= CONN_STATUS_CLOSED) || free_all))
-                free_connection_data(slot->data);
-        }
-
-        free(arr->items);
-        arr->items = NULL;
+/* Schedule a connection update for the next sendConnectionsDump */
+static void conn_notify_update(conn_store_t *store, conn_stats_t *stats) {
+    if(!(stats->flags & (CONN_FLAG_NEW | CONN_FLAG_PENDING_NOTIFICATION | CONN_FLAG_IGNORED))) {
+        stats->flags |= CONN_FLAG_PENDING_NOTIFICATION;
+        store->num_updates++;
     }
-
-    arr->size = 0;
-    arr->cur_items = 0;
 }
 
 /* ******************************************************* */
@@ -209,6 +444,27 @@ static struct in6_addr getIPv6Pref(JNIEnv *env, jobject vpn_inst, const char *ke
 
 /* ******************************************************* */
 
+static void getStringPref(JNIEnv *env, jobject vpn_inst, const char *key, char *buf, int bufsize) {
+    jmethodID midMethod = jniGetMethodID(env, cls.vpn_service, key, "()Ljava/lang/String;");
+    jstring obj = (*env)->CallObjectMethod(env, vpn_inst, midMethod);
+
+    buf[0] = '\0';
+
+    if(!jniCheckException(env) && (obj != NULL)) {
+        const char *value = (*env)->GetStringUTFChars(env, obj, 0);
+        log_android(ANDROID_LOG_DEBUG, "getStringPref(%s) = %s", key, value);
+
+        strncpy(buf, value, bufsize - 1);
+        buf[bufsize - 1] = '\0';
+
+        (*env)->ReleaseStringUTFChars(env, obj, value);
+    }
+
+    (*env)->DeleteLocalRef(env, obj);
+}
+
+/* ******************************************************* */
+
 static jint getIntPref(JNIEnv *env, jobject vpn_inst, const char *key) {
     jint value;
     jmethodID midMethod = jniGetMethodID(env, cls.vpn_service, key, "()I");
@@ -223,7 +479,7 @@ static jint getIntPref(JNIEnv *env, jobject vpn_inst, const char *key) {
 
 /* ******************************************************* */
 
-static void protectSocket(vpnproxy_data_t *proxy, socket_t sock) {
+static bool protectSocket(vpnproxy_data_t *proxy, socket_t sock) {
     JNIEnv *env = proxy->env;
 
     /* Call VpnService protect */
@@ -233,11 +489,25 @@ static void protectSocket(vpnproxy_data_t *proxy, socket_t sock) {
 
     if (!isProtected)
         log_android(ANDROID_LOG_ERROR, "socket protect failed");
+
+    return(isProtected);
 }
 
+/* The sockets are opened while forwarding the first packet of a connection: the TCP ones are
+ * attached to the connection for the buffers tuning */
 static void protectSocketCallback(zdtun_t *tun, socket_t sock) {
     vpnproxy_data_t *proxy = ((vpnproxy_data_t*)zdtun_userdata(tun));
+    conn_data_t *data = proxy->cur_conn;
+
     protectSocket(proxy, sock);
+
+    if(data && proxy->sock_tuner &&
+       (proxy->conns.tuple[data->slot].ipproto == IPPROTO_TCP))
+        sock_tune_attach(proxy->sock_tuner, &data->tune, sock);
+}
+
+static bool protectDnsSocket(int sock, void *userdata) {
+    return(protectSocket((vpnproxy_data_t*) userdata, sock));
 }
 
 /* ******************************************************* */
@@ -299,37 +569,57 @@ const char *getProtoName(struct ndpi_detection_module_struct *mod, ndpi_protocol
 
 /* ******************************************************* */
 
-static void end_ndpi_detection(conn_data_t *data, vpnproxy_data_t *proxy, const zdtun_conn_t *conn_info) {
-    const zdtun_5tuple_t *tuple = zdtun_conn_get_5tuple(conn_info);
+/* Match a domain against the blocklist, counting the hit. Returns true if blocked. */
+static bool is_blocked_domain(vpnproxy_data_t *proxy, const char *domain) {
+    int rule = blocklist_match(proxy->blocklist, domain);
+
+    if(rule < 0)
+        return(false);
+
+    /* the hits are read by getBlocklistHits */
+    pthread_mutex_lock(&stats_mutex);
+    blocklist_hit(proxy->blocklist, rule);
+    pthread_mutex_unlock(&stats_mutex);
+
+    log_android(ANDROID_LOG_DEBUG, "Blocked domain: %s", domain);
+    return(true);
+}
+
+/* ******************************************************* */
+
+static void end_ndpi_detection(conn_data_t *data, vpnproxy_data_t *proxy) {
+    u_int32_t slot = data->slot;
+    const zdtun_5tuple_t *tuple = &proxy->conns.tuple[slot];
+    ndpi_protocol *l7proto = &proxy->conns.l7proto[slot];
 
     if(!data->ndpi_flow)
         return;
 
-    if(data->l7proto.app_protocol == NDPI_PROTOCOL_UNKNOWN) {
+    if(l7proto->app_protocol == NDPI_PROTOCOL_UNKNOWN) {
         uint8_t proto_guessed;
 
-        data->l7proto = ndpi_detection_giveup(proxy->ndpi, data->ndpi_flow, 1 /* Guess */,
+        *l7proto = ndpi_detection_giveup(proxy->ndpi, data->ndpi_flow, 1 /* Guess */,
                                               &proto_guessed);
     }
 
-    if(data->l7proto.master_protocol == 0)
-        data->l7proto.master_protocol = data->l7proto.app_protocol;
+    if(l7proto->master_protocol == 0)
+        l7proto->master_protocol = l7proto->app_protocol;
 
     log_android(ANDROID_LOG_DEBUG, "nDPI completed[ipver=%d, proto=%d] -> l7proto: app=%d, master=%d",
-                tuple->ipver, tuple->ipproto, data->l7proto.app_protocol, data->l7proto.master_protocol);
+                tuple->ipver, tuple->ipproto, l7proto->app_protocol, l7proto->master_protocol);
 
-    switch (data->l7proto.master_protocol) {
+    switch (l7proto->master_protocol) {
         case NDPI_PROTOCOL_DNS:
             if(data->ndpi_flow->host_server_name[0]) {
                 u_int16_t rsp_type = data->ndpi_flow->protos.dns.rsp_type;
                 zdtun_ip_t rsp_addr = {0};
                 int ipver = 0;
+                const char *info;
 
-                if(data->info)
-                    free(data->info);
-                data->info = strndup((char*)data->ndpi_flow->host_server_name, 256);
+                conn_str_set(proxy, &data->info, (char*)data->ndpi_flow->host_server_name);
+                info = conn_str_get(&data->info);
 
-                if(data->info && strchr(data->info, '.')) { // ignore invalid domain names
+                if(info && strchr(info, '.')) { // ignore invalid domain names
                     if((rsp_type == 0x1) && (data->ndpi_flow->protos.dns.rsp_addr.ipv4 != 0)) { /* A */
                         rsp_addr.ip4 = data->ndpi_flow->protos.dns.rsp_addr.ipv4;
                         ipver = 4;
@@ -346,50 +636,129 @@ static void end_ndpi_detection(conn_data_t *data, vpnproxy_data_t *proxy, const
                         rspip[0] = '\0';
                         inet_ntop(family, &rsp_addr, rspip, sizeof(rspip));
 
-                        log_android(ANDROID_LOG_DEBUG, "Host LRU cache ADD [v%d]: %s -> %s", ipver, rspip, data->info);
+                        log_android(ANDROID_LOG_DEBUG, "Host LRU cache ADD [v%d]: %s -> %s", ipver, rspip, info);
 
-                        ip_lru_add(proxy->ip_to_host, &rsp_addr, data->info);
+                        ip_lru_add(proxy->ip_to_host, &rsp_addr, info);
                     }
                 }
             }
             break;
         case NDPI_PROTOCOL_HTTP:
-            if(data->ndpi_flow->host_server_name[0]) {
-                if(data->info)
-                    free(data->info);
-                data->info = strndup((char*) data->ndpi_flow->host_server_name, 256);
-            }
+            if(data->ndpi_flow->host_server_name[0])
+                conn_str_set(proxy, &data->info, (char*) data->ndpi_flow->host_server_name);
 
             if(data->ndpi_flow->http.url)
-                data->url = strndup(data->ndpi_flow->http.url, 256);
+                conn_str_set(proxy, &data->url, data->ndpi_flow->http.url);
             break;
         case NDPI_PROTOCOL_TLS:
-            if(data->ndpi_flow->protos.stun_ssl.ssl.client_requested_server_name[0]) {
-                if(data->info)
-                    free(data->info);
-
-                data->info = strndup(data->ndpi_flow->protos.stun_ssl.ssl.client_requested_server_name, 256);
-            }
+            if(data->ndpi_flow->protos.stun_ssl.ssl.client_requested_server_name[0])
+                conn_str_set(proxy, &data->info, data->ndpi_flow->protos.stun_ssl.ssl.client_requested_server_name);
             break;
     }
 
-    free_ndpi(data);
+    /* the info may have changed */
+    data->host_key = 0;
+
+    /* The SNI/Host of a blocked domain: the connection is destroyed by the main loop */
+    if(proxy->blocklist &&
+       ((l7proto->master_protocol == NDPI_PROTOCOL_HTTP) || (l7proto->master_protocol == NDPI_PROTOCOL_TLS))) {
+        const char *host = conn_str_get(&data->info);
+
+        if(host && is_blocked_domain(proxy, host))
+            proxy->conns.stats[slot].flags |= CONN_FLAG_BLOCKED;
+    }
+
+    free_ndpi(proxy, data);
+    proxy->conns.stats[slot].flags &= ~CONN_FLAG_NDPI;
 }
 
 /* ******************************************************* */
 
-static void process_ndpi_packet(conn_data_t *data, vpnproxy_data_t *proxy, const zdtun_conn_t *conn_info,
-        const char *packet, int size, uint8_t from_tun) {
-    bool giveup = ((data->sent_pkts + data->rcvd_pkts) >= MAX_DPI_PACKETS);
+static void process_ndpi_packet(conn_data_t *data, const conn_stats_t *stats, vpnproxy_data_t *proxy,
+        const zdtun_conn_t *conn_info, const char *packet, int size, uint8_t from_tun) {
+    bool giveup = ((stats->sent_pkts + stats->rcvd_pkts) >= MAX_DPI_PACKETS);
+    ndpi_protocol *l7proto = &proxy->conns.l7proto[data->slot];
 
-    data->l7proto = ndpi_detection_process_packet(proxy->ndpi, data->ndpi_flow, (const u_char *)packet,
-            size, data->last_seen,
+    *l7proto = ndpi_detection_process_packet(proxy->ndpi, data->ndpi_flow, (const u_char *)packet,
+            size, stats->last_seen,
             from_tun ? data->src_id : data->dst_id,
             from_tun ? data->dst_id : data->src_id);
 
-    if(giveup || ((data->l7proto.app_protocol != NDPI_PROTOCOL_UNKNOWN) &&
+    if(giveup || ((l7proto->app_protocol != NDPI_PROTOCOL_UNKNOWN) &&
             (!ndpi_extra_dissection_possible(proxy->ndpi, data->ndpi_flow))))
-        end_ndpi_detection(data, proxy, conn_info);
+        end_ndpi_detection(data, proxy);
+}
+
+/* ******************************************************* */
+
+static u_int64_t mem_total(vpnproxy_data_t *proxy) {
+    u_int64_t tot = 0;
+
+    proxy->mem.used[MEM_HOSTS] = ip_lru_mem_usage(proxy->ip_to_host) +
+            (proxy->dns_cache ? dns_cache_mem_usage(proxy->dns_cache) : 0) +
+            (proxy->dns_inflight ? dns_coalesce_mem_usage(proxy->dns_inflight) : 0) +
+            (proxy->dns_fwd ? dns_fwd_mem_usage(proxy->dns_fwd) : 0) +
+            (proxy->blocklist ? blocklist_mem_usage(proxy->blocklist) : 0) +
+            ip_rules_mem_usage(proxy->ip_rules);
+    proxy->mem.used[MEM_BUFFERS] = (proxy->java_dump.buffer ? JAVA_PCAP_BUFFER_SIZE : 0) +
+            (proxy->shaper ? shaper_mem_usage(proxy->shaper) : 0);
+
+    for(int i = 0; i < MEM_NUM_SUBSYS; i++)
+        tot += proxy->mem.used[i];
+
+    return(tot);
+}
+
+/* ******************************************************* */
+
+static inline bool mem_over_budget(vpnproxy_data_t *proxy) {
+    return((proxy->mem.budget > 0) && (mem_total(proxy) > proxy->mem.budget));
+}
+
+/* ******************************************************* */
+
+/* Bring the memory usage back under the budget. The store is compacted first, which may shrink
+ * its columns. The connections are then visited oldest first: the in-progress DPI is given up
+ * first, then the metadata of the closed connections not yet released is dropped. The
+ * connections themselves are never evicted. */
+static void mem_enforce_budget(vpnproxy_data_t *proxy) {
+    conn_store_t *store = &proxy->conns;
+    u_int64_t target = proxy->mem.budget * MEM_BUDGET_TARGET_PERC / 100;
+    u_int64_t tot = mem_total(proxy);
+
+    if(!store->data || (tot <= proxy->mem.budget))
+        return;
+
+    conn_store_compact(proxy);
+    tot = mem_total(proxy);
+
+    for(u_int32_t i = 0; (i < store->num_order) && (tot > target); i++) {
+        u_int32_t slot = store->order[i];
+        conn_data_t *data = store->data[slot];
+
+        if(data && data->ndpi_flow) {
+            end_ndpi_detection(data, proxy);
+            conn_notify_update(store, &store->stats[slot]);
+            proxy->mem.dpi_evictions++;
+            tot = mem_total(proxy);
+        }
+    }
+
+    for(u_int32_t i = 0; (i < store->num_order) && (tot > target); i++) {
+        u_int32_t slot = store->order[i];
+        conn_data_t *data = store->data[slot];
+
+        if(data && (store->stats[slot].flags & CONN_FLAG_CLOSED) && (conn_str_get(&data->info) || conn_str_get(&data->url))) {
+            conn_str_set(proxy, &data->info, NULL);
+            conn_str_set(proxy, &data->url, NULL);
+            proxy->mem.meta_evictions++;
+            tot = mem_total(proxy);
+        }
+    }
+
+    log_android(ANDROID_LOG_INFO, "Memory budget enforced: %llu/%llu B [dpi_evictions=%u, meta_evictions=%u]",
+                (unsigned long long) tot, (unsigned long long) proxy->mem.budget,
+                proxy->mem.dpi_evictions, proxy->mem.meta_evictions);
 }
 
 /* ******************************************************* */
@@ -415,6 +784,7 @@ static void javaPcapDump(vpnproxy_data_t *proxy) {
 
 /* ******************************************************* */
 
+/* NOTE: only evaluated once on new connections, see CONN_FLAG_IGNORED */
 static bool shouldIgnoreConn(vpnproxy_data_t *proxy, const zdtun_5tuple_t *tuple, const conn_data_t *data) {
 #if 0
     int uid = data.uid;
@@ -434,60 +804,9 @@ static bool shouldIgnoreConn(vpnproxy_data_t *proxy, const zdtun_5tuple_t *tuple
 
 /* ******************************************************* */
 
-static void account_packet(zdtun_t *tun, const char *packet, int size, uint8_t from_tun, const zdtun_conn_t *conn_info) {
+/* Dump the packet to the configured PCAP destinations */
+static void export_packet(vpnproxy_data_t *proxy, const char *packet, int size) {
     struct sockaddr_in servaddr = {0};
-    conn_data_t *data = zdtun_conn_get_userdata(conn_info);
-    vpnproxy_data_t *proxy;
-
-    if(!data) {
-        log_android(ANDROID_LOG_ERROR, "Missing user_data in connection");
-        return;
-    }
-
-    proxy = ((vpnproxy_data_t*)zdtun_userdata(tun));
-
-#if 0
-    if(from_tun)
-        log_android(ANDROID_LOG_DEBUG, "tun2net: %ld B", size);
-    else
-        log_android(ANDROID_LOG_DEBUG, "net2tun: %lu B", size);
-#endif
-
-    /* NOTE: account connection stats also for non-matched connections */
-    if(from_tun) {
-        data->sent_pkts++;
-        data->sent_bytes += size;
-    } else {
-        data->rcvd_pkts++;
-        data->rcvd_bytes += size;
-    }
-
-    data->last_seen = time(NULL);
-    data->status = zdtun_conn_get_status(conn_info);
-
-    if(data->ndpi_flow)
-        process_ndpi_packet(data, proxy, conn_info, packet, size, from_tun);
-
-    if(shouldIgnoreConn(proxy, zdtun_conn_get_5tuple(conn_info), data)) {
-        //log_android(ANDROID_LOG_DEBUG, "Ignoring connection: UID=%d [filter=%d]", data->uid, proxy->uid_filter);
-        return;
-    }
-
-    if(from_tun) {
-        proxy->capture_stats.sent_pkts++;
-        proxy->capture_stats.sent_bytes += size;
-    } else {
-        proxy->capture_stats.rcvd_pkts++;
-        proxy->capture_stats.rcvd_bytes += size;
-    }
-
-    /* New stats to notify */
-    proxy->capture_stats.new_stats = true;
-
-    if(!data->pending_notification) {
-        conns_add(&proxy->conns_updates, conn_info);
-        data->pending_notification = true;
-    }
 
     if(proxy->java_dump.buffer) {
         int tot_size = size + (int) sizeof(pcaprec_hdr_s);
@@ -520,121 +839,969 @@ static void account_packet(zdtun_t *tun, const char *packet, int size, uint8_t f
 
 /* ******************************************************* */
 
-static int resolve_uid(vpnproxy_data_t *proxy, const zdtun_5tuple_t *conn_info) {
-    char buf[256];
-    jint uid;
-
-    zdtun_5tuple2str(conn_info, buf, sizeof(buf));
-    uid = get_uid(proxy->resolver, conn_info);
-
-    if(uid >= 0) {
-        char appbuf[128];
+/* True if the tuple is a UDP query to the VPN DNS, which is served by the DNS cache */
+static inline bool is_vpn_dns_query(const vpnproxy_data_t *proxy, const zdtun_5tuple_t *tuple) {
+    return((tuple->ipver == 4) && (tuple->ipproto == IPPROTO_UDP) &&
+           (tuple->dst_ip.ip4 == proxy->vpn_dns) && (ntohs(tuple->dst_port) == 53));
+}
 
-        if(uid == 0)
-            strncpy(appbuf, "ROOT", sizeof(appbuf));
-        else if(uid == 1051)
-            strncpy(appbuf, "netd", sizeof(appbuf));
-        else
-            getApplicationByUid(proxy, uid, appbuf, sizeof(appbuf));
+/* ******************************************************* */
 
-        log_android(ANDROID_LOG_INFO, "%s [%d/%s]", buf, uid, appbuf);
+/* Account and dump a packet handled by the engine without a zdtun connection */
+static void account_raw_packet(vpnproxy_data_t *proxy, const char *packet, int size, bool from_tun) {
+    if(from_tun) {
+        proxy->capture_stats.sent_pkts++;
+        proxy->capture_stats.sent_bytes += size;
     } else {
-        uid = UID_UNKNOWN;
-        log_android(ANDROID_LOG_WARN, "%s => UID not found!", buf);
+        proxy->capture_stats.rcvd_pkts++;
+        proxy->capture_stats.rcvd_bytes += size;
     }
 
-    return(uid);
+    proxy->capture_stats.new_stats = true;
+    export_packet(proxy, packet, size);
 }
 
 /* ******************************************************* */
 
-static int handle_new_connection(zdtun_t *tun, zdtun_conn_t *conn_info) {
-    vpnproxy_data_t *proxy = ((vpnproxy_data_t*)zdtun_userdata(tun));
-    const zdtun_5tuple_t *tuple = zdtun_conn_get_5tuple(conn_info);
+/* Send a response from the VPN DNS to a client, writing it into the tun. The payload must
+ * already be at pkt_buf + IPV4_UDP_HDRS_LEN: the headers are built in place and the same
+ * buffer is exported. */
+static void send_dns_reply(vpnproxy_data_t *proxy, char *pkt_buf, int payload_len,
+                           u_int32_t client_ip, u_int16_t client_port) {
+    int pkt_len = build_udp4_packet(pkt_buf, proxy->vpn_dns, htons(53),
+                                    client_ip, client_port, payload_len);
 
-    if(!check_dns_req_allowed(tun, proxy, conn_info)) {
-        // block connection
-        proxy->last_conn_blocked = true;
-        return(1);
+    if(write(proxy->tunfd, pkt_buf, pkt_len) != pkt_len) {
+        log_android(ANDROID_LOG_ERROR, "tun write (%d) failed [%d]: %s", pkt_len, errno, strerror(errno));
+        return;
     }
 
-    conn_data_t *data = calloc(1, sizeof(conn_data_t));
-
-    if(!data) {
-        log_android(ANDROID_LOG_ERROR, "calloc(conn_data_t) failed with code %d/%s",
-                errno, strerror(errno));
-        /* reject connection */
-        return(1);
-    }
+    if(!record_dns_reply(proxy, client_ip, client_port, pkt_buf, pkt_len))
+        account_raw_packet(proxy, pkt_buf, pkt_len, false);
+}
 
-    /* nDPI */
-    if((data->ndpi_flow = calloc(1, SIZEOF_FLOW_STRUCT)) == NULL) {
-        log_android(ANDROID_LOG_ERROR, "ndpi_flow_malloc failed");
-        free_ndpi(data);
-    }
+/* ******************************************************* */
 
-    if((data->src_id = calloc(1, SIZEOF_ID_STRUCT)) == NULL) {
-        log_android(ANDROID_LOG_ERROR, "ndpi_malloc(src_id) failed");
-        free_ndpi(data);
-    }
+/* rsp is preceded by DNS_PKT_HEADROOM bytes, see dns_cache.h */
+static void dns_waiter_reply(const dns_waiter_t *waiter, u_int8_t *rsp, int rsp_len, void *userdata) {
+    vpnproxy_data_t *proxy = (vpnproxy_data_t*) userdata;
 
-    if((data->dst_id = calloc(1, SIZEOF_ID_STRUCT)) == NULL) {
-        log_android(ANDROID_LOG_ERROR, "ndpi_malloc(dst_id) failed");
-        free_ndpi(data);
-    }
+    send_dns_reply(proxy, (char*) rsp - IPV4_UDP_HDRS_LEN, rsp_len, waiter->ip, waiter->port);
+}
 
-    data->first_seen = data->last_seen = time(NULL);
-    data->uid = resolve_uid(proxy, tuple);
+/* ******************************************************* */
 
-    // Try to resolve host name via the LRU cache
-    zdtun_ip_t ip = tuple->dst_ip;
-    data->info = ip_lru_find(proxy->ip_to_host, &ip);
+/* Handle the upstream response to a query directed to the VPN DNS: cache it and fan it out to
+ * the coalesced queries */
+static void handle_dns_response(vpnproxy_data_t *proxy, u_int32_t client_ip, u_int16_t client_port,
+                                const u_int8_t *rsp, int rsp_len) {
+    int num_waiters;
 
-    if(data->info) {
-        char resip[INET6_ADDRSTRLEN];
-        int family = (tuple->ipver == 4) ? AF_INET : AF_INET6;
+    dns_cache_add_response(proxy->dns_cache, rsp, rsp_len, proxy->now_ms);
 
-        resip[0] = '\0';
-        inet_ntop(family, &ip, resip, sizeof(resip));
+    if(proxy->dns_inflight) {
+        num_waiters = dns_coalesce_response(proxy->dns_inflight, rsp, rsp_len,
+                                            client_ip, client_port, dns_waiter_reply, proxy);
 
-        log_android(ANDROID_LOG_DEBUG, "Host LRU cache HIT: %s -> %s", resip, data->info);
+        if(num_waiters > 0)
+            log_android(ANDROID_LOG_DEBUG, "DNS response fanned out to %d coalesced queries", num_waiters);
     }
+}
 
-    zdtun_conn_set_userdata(conn_info, data);
-
-    if(!shouldIgnoreConn(proxy, tuple, data)) {
-        // Important: only set the incr_id on registered connections since
-        // ConnectionsRegister::connectionsUpdates does not allow gaps
-        data->incr_id = proxy->incr_id++;
+/* ******************************************************* */
 
-        conns_add(&proxy->new_conns, conn_info);
-        data->pending_notification = true;
+/* Handle a response received on the DNS forwarder sockets. The reply is built in the headroom
+ * of rsp, which is left untouched. */
+static void dns_fwd_reply(const dns_fwd_client_t *client, u_int8_t *rsp, int rsp_len, void *userdata) {
+    vpnproxy_data_t *proxy = (vpnproxy_data_t*) userdata;
+    char qname[DNS_MAX_NAME_LEN + 1];
+    zdtun_ip_t addr;
+    u_int8_t ipver;
+
+    send_dns_reply(proxy, (char*) rsp - IPV4_UDP_HDRS_LEN, rsp_len, client->ip, client->port);
+
+    if(dns_response_answer(rsp, rsp_len, qname, &ipver, &addr) == 0) {
+        /* No DPI runs on the forwarded responses, keep the answer in the host names cache */
+        if(ipver && strchr(qname, '.')) {
+            log_android(ANDROID_LOG_DEBUG, "DNS response [%u ms]: %s", client->rtt_ms, qname);
+            ip_lru_add(proxy->ip_to_host, &addr, qname);
+        }
     }
 
-    /* accept connection */
+    handle_dns_response(proxy, client->ip, client->port, rsp, rsp_len);
+}
+
+/* ******************************************************* */
+
+/* Handle a query directed to the VPN DNS before it reaches zdtun. The query is either answered
+ * locally (blocked domains and DNS cache hits), by writing the response directly into the tun,
+ * held until the response of an identical in-flight query or sent upstream via the DNS
+ * forwarder. In all cases, no zdtun connection is created: the query is recorded as a
+ * lightweight connection, see record_dns_query. Returns true if the query was consumed. */
+static bool handle_dns_query(vpnproxy_data_t *proxy, zdtun_pkt_t *pkt) {
+    char reply[IPV4_UDP_HDRS_LEN + DNS_MAX_MSG_SIZE];
+    const zdtun_5tuple_t *tuple = &pkt->tuple;
+    dns_cache_hit_t hit;
+    dns_query_t query;
+    int payload_len;
+
+    if(!is_vpn_dns_query(proxy, tuple) ||
+       (dns_parse_query((const u_int8_t*) pkt->l7, pkt->l7_len, &query) != 0))
+        return(false);
+
+    if(proxy->blocklist && is_blocked_domain(proxy, query.qname)) {
+        payload_len = dns_build_blocked_response(&query, (const u_int8_t*) pkt->l7,
+                                                 (u_int8_t*) reply + IPV4_UDP_HDRS_LEN, DNS_MAX_MSG_SIZE);
+        if(payload_len < 0)
+            return(false);
+
+        record_dns_query(proxy, pkt, query.qname, false);
+        send_dns_reply(proxy, reply, payload_len, tuple->src_ip.ip4, tuple->src_port);
+        return(true);
+    }
+
+    payload_len = dns_cache_lookup(proxy->dns_cache, &query, (const u_int8_t*) pkt->l7, proxy->now_ms,
+                                   (u_int8_t*) reply + IPV4_UDP_HDRS_LEN, DNS_MAX_MSG_SIZE, &hit);
+
+    if(payload_len < 0) {
+        dns_cache_query_sent(proxy->dns_cache, &query, proxy->now_ms);
+
+        if(proxy->dns_inflight &&
+           dns_coalesce_query(proxy->dns_inflight, &query, (const u_int8_t*) pkt->l7,
+                              tuple->src_ip.ip4, tuple->src_port, proxy->now_ms))
+            log_android(ANDROID_LOG_DEBUG, "DNS query coalesced: %s", query.qname);
+        else if(!proxy->dns_fwd ||
+                (dns_fwd_query(proxy->dns_fwd, &query, (const u_int8_t*) pkt->l7, pkt->l7_len,
+                               tuple->src_ip.ip4, tuple->src_port, proxy->now_ms) != 0))
+            return(false);
+
+        record_dns_query(proxy, pkt, query.qname, true);
+        return(true);
+    }
+
+    log_android(ANDROID_LOG_DEBUG, "DNS cache HIT: %s", query.qname);
+
+    /* No DPI runs on the cached responses, keep the answer in the host names cache */
+    if(hit.ipver && strchr(query.qname, '.'))
+        ip_lru_add(proxy->ip_to_host, &hit.addr, query.qname);
+
+    record_dns_query(proxy, pkt, query.qname, false);
+    send_dns_reply(proxy, reply, payload_len, tuple->src_ip.ip4, tuple->src_port);
+
+    return(true);
+}
+
+/* ******************************************************* */
+
+static void hh_set_ip_label(char *label, const zdtun_5tuple_t *tuple) {
+    int family = (tuple->ipver == 4) ? AF_INET : AF_INET6;
+
+    if(inet_ntop(family, &tuple->dst_ip, label, HH_LABEL_SIZE) == NULL)
+        label[0] = '\0';
+}
+
+/* Must be called with the stats_mutex held */
+static void update_heavy_hitters(vpnproxy_data_t *proxy, conn_data_t *data,
+                                 const zdtun_5tuple_t *tuple, int size) {
+    const char *info = conn_str_get(&data->info);
+    u_int64_t app_key;
+    char *label;
+
+    if(!data->ip_key)
+        data->ip_key = hh_hash(&tuple->dst_ip, sizeof(tuple->dst_ip), tuple->ipver);
+    if(!data->host_key && info)
+        data->host_key = hh_hash(info, strlen(info), 0);
+
+    if((label = hh_tracker_add(proxy->top[TOP_IPS], data->ip_key, size, UID_UNKNOWN)) != NULL)
+        hh_set_ip_label(label, tuple);
+
+    if(data->host_key) {
+        if((label = hh_tracker_add(proxy->top[TOP_HOSTS], data->host_key, size, UID_UNKNOWN)) != NULL)
+            snprintf(label, HH_LABEL_SIZE, "%s", info);
+    }
+
+    if(data->app) {
+        app_key = hh_hash(&data->app->uid, sizeof(data->app->uid),
+                          data->host_key ? data->host_key : data->ip_key);
+
+        if((label = hh_tracker_add(proxy->top[TOP_APP_HOSTS], app_key, size, data->app->uid)) != NULL) {
+            if(data->host_key)
+                snprintf(label, HH_LABEL_SIZE, "%s", info);
+            else
+                hh_set_ip_label(label, tuple);
+        }
+    }
+}
+
+/* ******************************************************* */
+
+/* The kind of the request/response latency of a connection, -1 if not measured */
+static int response_latency_kind(vpnproxy_data_t *proxy, const conn_data_t *data) {
+    u_int32_t slot = data->slot;
+    const zdtun_5tuple_t *tuple = &proxy->conns.tuple[slot];
+    const ndpi_protocol *l7proto = &proxy->conns.l7proto[slot];
+    u_int16_t proto = l7proto->master_protocol ? l7proto->master_protocol : l7proto->app_protocol;
+    u_int16_t dport = ntohs(tuple->dst_port);
+
+    switch(proto) {
+        case NDPI_PROTOCOL_DNS:
+            return(LAT_DNS);
+        case NDPI_PROTOCOL_HTTP:
+            return(LAT_HTTP);
+        case NDPI_PROTOCOL_TLS:
+            return(LAT_TLS);
+        case NDPI_PROTOCOL_UNKNOWN:
+            /* not detected yet, or DPI is disabled for the connection */
+            if(dport == 53)
+                return(LAT_DNS);
+            if((tuple->ipproto == IPPROTO_TCP) && (dport == 80))
+                return(LAT_HTTP);
+            if((tuple->ipproto == IPPROTO_TCP) && (dport == 443))
+                return(LAT_TLS);
+    }
+
+    return(-1);
+}
+
+/* ******************************************************* */
+
+/* Must be called with the stats_mutex held */
+static void add_host_latency_sample(vpnproxy_data_t *proxy, const char *host, lat_kind_t kind, u_int32_t us) {
+    lat_hists_t *hists;
+
+    if(proxy->lat_hosts && ((hists = lat_hosts_get(proxy->lat_hosts, host)) != NULL))
+        lat_hist_add(&hists->kind[kind], us);
+}
+
+/* ******************************************************* */
+
+/* Add a latency sample to the histograms of the connection app and host. Takes the stats_mutex,
+ * which is only needed when a sample is recorded. */
+static void add_latency_sample(vpnproxy_data_t *proxy, conn_data_t *data, lat_kind_t kind, u_int32_t us) {
+    const char *host = conn_str_get(&data->info);
+    char label[HH_LABEL_SIZE];
+
+    if(!host) {
+        hh_set_ip_label(label, &proxy->conns.tuple[data->slot]);
+        host = label;
+    }
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if(data->app) {
+        if(!data->app->lat && !mem_over_budget(proxy)) {
+            if((data->app->lat = calloc(1, sizeof(lat_hists_t))) != NULL)
+                proxy->mem.used[MEM_SERIES] += sizeof(lat_hists_t);
+        }
+
+        if(data->app->lat)
+            lat_hist_add(&data->app->lat->kind[kind], us);
+    }
+
+    add_host_latency_sample(proxy, host, kind, us);
+
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/* ******************************************************* */
+
+/* Measure the setup latencies of a connection, up to its first response or LAT_MAX_PACKETS
+ * packets. Once the first request is seen, the client packets are skipped without parsing. */
+static void track_latency(vpnproxy_data_t *proxy, conn_data_t *data, const zdtun_5tuple_t *tuple,
+                          const char *packet, int size, bool from_tun) {
+    conn_latency_t *lat = &data->lat;
+    zdtun_pkt_t pkt;
+
+    if(++lat->num_pkts > LAT_MAX_PACKETS) {
+        lat->done = true;
+        return;
+    }
+
+    if(from_tun && lat->req_us)
+        return;
+
+    if(((tuple->ipproto != IPPROTO_TCP) && (tuple->ipproto != IPPROTO_UDP)) ||
+       (zdtun_parse_pkt(packet, size, &pkt) != 0)) {
+        lat->done = true;
+        return;
+    }
+
+    if((tuple->ipproto == IPPROTO_TCP) && (pkt.tcp->th_flags & TH_SYN)) {
+        if(from_tun && !(pkt.tcp->th_flags & TH_ACK)) {
+            if(!lat->syn_us)
+                lat->syn_us = lat_now_us();
+        } else if(!from_tun && lat->syn_us && !lat->connect_us) {
+            /* zdtun sends the SYN-ACK as soon as the upstream connect() completes */
+            lat->connect_us = lat_elapsed_us(lat->syn_us);
+            add_latency_sample(proxy, data, LAT_CONNECT, lat->connect_us);
+        }
+        return;
+    }
+
+    if(pkt.l7_len == 0)
+        return;
+
+    if(from_tun) {
+        if(!lat->req_us)
+            lat->req_us = lat_now_us();
+        return;
+    }
+
+    /* The first response. If no request was seen, the server talked first (e.g. a banner) */
+    lat->done = true;
+
+    if(lat->syn_us) {
+        lat->handshake_us = lat_elapsed_us(lat->syn_us);
+        add_latency_sample(proxy, data, LAT_HANDSHAKE, lat->handshake_us);
+    }
+
+    if(lat->req_us) {
+        int kind = response_latency_kind(proxy, data);
+
+        lat->response_us = lat_elapsed_us(lat->req_us);
+
+        if(kind >= 0)
+            add_latency_sample(proxy, data, kind, lat->response_us);
+    }
+}
+
+/* ******************************************************* */
+
+/* Publish the traffic batched by account_packet. The series and the heavy hitters are read by
+ * the JNI getters, so this takes the stats_mutex once per batch rather than once per packet. */
+static void publish_pending_traffic(vpnproxy_data_t *proxy) {
+    if(proxy->num_pending == 0)
+        return;
+
+    pthread_mutex_lock(&stats_mutex);
+
+    for(int i = 0; i < proxy->num_pending; i++) {
+        const pending_traffic_t *item = &proxy->pending[i];
+        conn_data_t *data = item->data;
+
+        bw_series_add(proxy->bw, item->now_sec, (int) item->size, item->sent);
+        if(data->app && data->app->bw)
+            bw_series_add(data->app->bw, item->now_sec, (int) item->size, item->sent);
+        update_heavy_hitters(proxy, data, &proxy->conns.tuple[data->slot], (int) item->size);
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+    proxy->num_pending = 0;
+}
+
+/* ******************************************************* */
+
+static void queue_pending_traffic(vpnproxy_data_t *proxy, conn_data_t *data, int size, bool sent) {
+    u_int32_t now_sec = (u_int32_t)(proxy->now_ms / 1000);
+    pending_traffic_t *item;
+
+    if(proxy->num_pending > 0) {
+        item = &proxy->pending[proxy->num_pending - 1];
+
+        if((item->data == data) && (item->now_sec == now_sec) && (item->sent == sent)) {
+            item->size += size;
+            return;
+        }
+    }
+
+    if(proxy->num_pending == MAX_PENDING_TRAFFIC)
+        publish_pending_traffic(proxy);
+
+    item = &proxy->pending[proxy->num_pending++];
+    item->data = data;
+    item->now_sec = now_sec;
+    item->size = size;
+    item->sent = sent;
+}
+
+/* ******************************************************* */
+
+static void account_app_packet(vpnproxy_data_t *proxy, app_stats_t *app, int ipproto, int size, bool from_tun) {
+    if(from_tun) {
+        app->sent_pkts++;
+        app->sent_bytes += size;
+    } else {
+        app->rcvd_pkts++;
+        app->rcvd_bytes += size;
+    }
+
+    app->proto_bytes[app_proto(ipproto)] += size;
+    proxy->apps.changed = true;
+}
+
+/* ******************************************************* */
+
+static void account_packet(zdtun_t *tun, const char *packet, int size, uint8_t from_tun, const zdtun_conn_t *conn_info) {
+    conn_data_t *data = zdtun_conn_get_userdata(conn_info);
+    vpnproxy_data_t *proxy;
+    conn_stats_t *stats;
+
+    if(!data) {
+        log_android(ANDROID_LOG_ERROR, "Missing user_data in connection");
+        return;
+    }
+
+    proxy = ((vpnproxy_data_t*)zdtun_userdata(tun));
+    stats = conn_get_stats(proxy, data);
+
+#if 0
+    if(from_tun)
+        log_android(ANDROID_LOG_DEBUG, "tun2net: %ld B", size);
+    else
+        log_android(ANDROID_LOG_DEBUG, "net2tun: %lu B", size);
+#endif
+
+    /* NOTE: account connection stats also for non-matched connections */
+    if(from_tun) {
+        stats->sent_pkts++;
+        stats->sent_bytes += size;
+    } else {
+        stats->rcvd_pkts++;
+        stats->rcvd_bytes += size;
+    }
+
+    /* now_ms is updated on every loop iteration, this avoids a time() call per packet */
+    stats->last_seen = (jlong)(proxy->now_ms / 1000);
+    stats->status = zdtun_conn_get_status(conn_info);
+
+    if(stats->flags & CONN_FLAG_NDPI)
+        process_ndpi_packet(data, stats, proxy, conn_info, packet, size, from_tun);
+
+    if(!from_tun && proxy->dns_cache && is_vpn_dns_query(proxy, zdtun_conn_get_5tuple(conn_info))) {
+        const zdtun_5tuple_t *tuple = zdtun_conn_get_5tuple(conn_info);
+        zdtun_pkt_t pkt;
+
+        if((zdtun_parse_pkt(packet, size, &pkt) == 0) && (pkt.l7_len > 0))
+            handle_dns_response(proxy, tuple->src_ip.ip4, tuple->src_port, (const u_int8_t*) pkt.l7, pkt.l7_len);
+    }
+
+    if(stats->flags & CONN_FLAG_IGNORED) {
+        //log_android(ANDROID_LOG_DEBUG, "Ignoring connection: UID=%d [filter=%d]", data->uid, proxy->uid_filter);
+        return;
+    }
+
+    if(from_tun) {
+        proxy->capture_stats.sent_pkts++;
+        proxy->capture_stats.sent_bytes += size;
+    } else {
+        proxy->capture_stats.rcvd_pkts++;
+        proxy->capture_stats.rcvd_bytes += size;
+    }
+
+    /* published on the stats tick, see publish_pending_traffic */
+    queue_pending_traffic(proxy, data, size, from_tun);
+
+    if(!data->lat.done)
+        track_latency(proxy, data, zdtun_conn_get_5tuple(conn_info), packet, size, from_tun);
+
+    if(data->app)
+        account_app_packet(proxy, data->app, zdtun_conn_get_5tuple(conn_info)->ipproto, size, from_tun);
+
+    /* New stats to notify */
+    proxy->capture_stats.new_stats = true;
+
+    conn_notify_update(&proxy->conns, stats);
+
+    if(!(stats->flags & CONN_FLAG_NO_EXPORT))
+        export_packet(proxy, packet, size);
+}
+
+
+/* ******************************************************* */
+
+static int resolve_uid(vpnproxy_data_t *proxy, const zdtun_5tuple_t *conn_info) {
+    char buf[256];
+    jint uid;
+
+    zdtun_5tuple2str(conn_info, buf, sizeof(buf));
+    uid = get_uid(proxy->resolver, conn_info);
+
+    if(uid >= 0) {
+        char appbuf[128];
+
+        if(uid == 0)
+            strncpy(appbuf, "ROOT", sizeof(appbuf));
+        else if(uid == 1051)
+            strncpy(appbuf, "netd", sizeof(appbuf));
+        else
+            getApplicationByUid(proxy, uid, appbuf, sizeof(appbuf));
+
+        log_android(ANDROID_LOG_INFO, "%s [%d/%s]", buf, uid, appbuf);
+    } else {
+        uid = UID_UNKNOWN;
+        log_android(ANDROID_LOG_WARN, "%s => UID not found!", buf);
+    }
+
+    return(uid);
+}
+
+/* ******************************************************* */
+
+/* Schedule a new connection for the next sendConnectionsDump and account it to its app */
+static void conn_register(vpnproxy_data_t *proxy, conn_data_t *data) {
+    conn_store_t *store = &proxy->conns;
+    u_int32_t slot = data->slot;
+
+    // Important: only set the incr_id on registered connections since
+    // ConnectionsRegister::connectionsUpdates does not allow gaps
+    store->incr_id[slot] = proxy->incr_id++;
+
+    store->stats[slot].flags |= CONN_FLAG_NEW;
+    store->num_new++;
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if((data->app = apps_stats_get(&proxy->apps, store->uid[slot])) != NULL) {
+        data->app->active_conns++;
+        data->app->tot_conns++;
+        proxy->apps.changed = true;
+
+        if(!data->app->bw && !mem_over_budget(proxy)) {
+            if((data->app->bw = calloc(1, sizeof(bw_series_t))) != NULL)
+                proxy->mem.used[MEM_SERIES] += sizeof(bw_series_t);
+        }
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/* ******************************************************* */
+
+static int handle_new_connection(zdtun_t *tun, zdtun_conn_t *conn_info) {
+    vpnproxy_data_t *proxy = ((vpnproxy_data_t*)zdtun_userdata(tun));
+    const zdtun_5tuple_t *tuple = zdtun_conn_get_5tuple(conn_info);
+    ip_rule_match_t rule = {0};
+
+    ip_rules_lookup(proxy->ip_rules, tuple->ipver, &tuple->dst_ip, &rule);
+
+    if((rule.actions & IP_RULE_BLOCK) || !check_dns_req_allowed(tun, proxy, conn_info, &rule)) {
+        // block connection
+        proxy->last_conn_blocked = true;
+        return(1);
+    }
+
+    conn_store_t *store = &proxy->conns;
+    conn_data_t *data = conn_store_add(proxy, tuple);
+
+    if(!data) {
+        /* reject connection */
+        return(1);
+    }
+
+    u_int32_t slot = data->slot;
+    conn_stats_t *stats = &store->stats[slot];
+
+    data->rule_tag = rule.tag;
+    if(rule.actions & IP_RULE_NO_EXPORT)
+        stats->flags |= CONN_FLAG_NO_EXPORT;
+
+    /* nDPI. When over the memory budget, new connections are not inspected */
+    if(!mem_over_budget(proxy) && !(rule.actions & IP_RULE_NO_DPI)) {
+        if((data->ndpi_flow = calloc(1, SIZEOF_FLOW_STRUCT)) == NULL) {
+            log_android(ANDROID_LOG_ERROR, "ndpi_flow_malloc failed");
+            free_ndpi(proxy, data);
+        } else
+            proxy->mem.used[MEM_NDPI] += SIZEOF_FLOW_STRUCT;
+
+        if((data->src_id = calloc(1, SIZEOF_ID_STRUCT)) == NULL) {
+            log_android(ANDROID_LOG_ERROR, "ndpi_malloc(src_id) failed");
+            free_ndpi(proxy, data);
+        } else
+            proxy->mem.used[MEM_NDPI] += SIZEOF_ID_STRUCT;
+
+        if((data->dst_id = calloc(1, SIZEOF_ID_STRUCT)) == NULL) {
+            log_android(ANDROID_LOG_ERROR, "ndpi_malloc(dst_id) failed");
+            free_ndpi(proxy, data);
+        } else
+            proxy->mem.used[MEM_NDPI] += SIZEOF_ID_STRUCT;
+    }
+
+    if(data->ndpi_flow)
+        stats->flags |= CONN_FLAG_NDPI;
+
+    store->first_seen[slot] = stats->last_seen = time(NULL);
+    store->uid[slot] = resolve_uid(proxy, tuple);
+
+    // Try to resolve host name via the LRU cache
+    zdtun_ip_t ip = tuple->dst_ip;
+    const char *host = ip_lru_find(proxy->ip_to_host, &ip);
+
+    if(host) {
+        char resip[INET6_ADDRSTRLEN];
+        int family = (tuple->ipver == 4) ? AF_INET : AF_INET6;
+
+        resip[0] = '\0';
+        inet_ntop(family, &ip, resip, sizeof(resip));
+
+        log_android(ANDROID_LOG_DEBUG, "Host LRU cache HIT: %s -> %s", resip, host);
+        conn_str_set(proxy, &data->info, host);
+    }
+
+    zdtun_conn_set_userdata(conn_info, data);
+
+    if(!shouldIgnoreConn(proxy, tuple, data))
+        conn_register(proxy, data);
+    else
+        stats->flags |= CONN_FLAG_IGNORED;
+
+    /* accept connection */
     return(0);
 }
 
 /* ******************************************************* */
 
-static void destroy_connection(zdtun_t *tun, const zdtun_conn_t *conn_info) {
-    vpnproxy_data_t *proxy = (vpnproxy_data_t*) zdtun_userdata(tun);
-    conn_data_t *data = zdtun_conn_get_userdata(conn_info);
+/* Append the connection to the on-disk connections log */
+static void log_closed_connection(vpnproxy_data_t *proxy, const conn_data_t *data) {
+    const conn_store_t *store = &proxy->conns;
+    u_int32_t slot = data->slot;
+    const zdtun_5tuple_t *tuple = &store->tuple[slot];
+    const conn_stats_t *stats = &store->stats[slot];
+    conn_log_record_t rec = {0};
+
+    memcpy(rec.src_ip, &tuple->src_ip, sizeof(rec.src_ip));
+    memcpy(rec.dst_ip, &tuple->dst_ip, sizeof(rec.dst_ip));
+    rec.first_seen = store->first_seen[slot];
+    rec.last_seen = stats->last_seen;
+    rec.closed_at = (int64_t)(proxy->now_ms / 1000);
+    rec.sent_bytes = stats->sent_bytes;
+    rec.rcvd_bytes = stats->rcvd_bytes;
+    rec.sent_pkts = stats->sent_pkts;
+    rec.rcvd_pkts = stats->rcvd_pkts;
+    rec.uid = store->uid[slot];
+    rec.src_port = tuple->src_port;
+    rec.dst_port = tuple->dst_port;
+    rec.ipver = tuple->ipver;
+    rec.ipproto = tuple->ipproto;
+    rec.status = stats->status;
+    strncpy(rec.l7proto, getProtoName(proxy->ndpi, store->l7proto[slot], tuple->ipproto), sizeof(rec.l7proto) - 1);
+
+    if(conn_log_append(proxy->conn_log, &rec, conn_str_get(&data->info), conn_str_get(&data->url)) != 0)
+        log_android(ANDROID_LOG_ERROR, "conn_log_append failed");
+}
+
+/* ******************************************************* */
+
+/* Account the closing of a registered connection and send its last notification. The
+ * connection will be released in sendConnectionsDump. */
+static void conn_closed(vpnproxy_data_t *proxy, conn_data_t *data) {
+    if(data->app) {
+        data->app->active_conns--;
+        proxy->apps.changed = true;
+    }
+
+    if(proxy->conn_log)
+        log_closed_connection(proxy, data);
+
+    conn_notify_update(&proxy->conns, conn_get_stats(proxy, data));
+}
+
+/* ******************************************************* */
+
+static void destroy_connection(zdtun_t *tun, const zdtun_conn_t *conn_info) {
+    vpnproxy_data_t *proxy = (vpnproxy_data_t*) zdtun_userdata(tun);
+    conn_data_t *data = zdtun_conn_get_userdata(conn_info);
+
+    if(!data) {
+        log_android(ANDROID_LOG_ERROR, "Missing user_data in connection");
+        return;
+    }
+
+    end_ndpi_detection(data, proxy);
+
+    /* The socket is being closed, its fd may be reused */
+    if(proxy->sock_tuner)
+        sock_tune_detach(proxy->sock_tuner, &data->tune);
+
+    conn_stats_t *stats = conn_get_stats(proxy, data);
+    stats->status = zdtun_conn_get_status(conn_info);
+    stats->flags |= CONN_FLAG_CLOSED;
+
+    if(stats->flags & CONN_FLAG_IGNORED) {
+        /* Never notified, release it now */
+        conn_store_release(proxy, data->slot);
+        return;
+    }
+
+    conn_closed(proxy, data);
+}
+
+/* ******************************************************* */
+
+static inline u_int64_t dns_pending_key(u_int32_t client_ip, u_int16_t client_port, const u_int8_t *dns) {
+    return(((u_int64_t) client_ip << 32) | ((u_int64_t) client_port << 16) | (u_int64_t)((dns[0] << 8) | dns[1]));
+}
 
-    if(!data) {
-        log_android(ANDROID_LOG_ERROR, "Missing user_data in connection");
+/* ******************************************************* */
+
+/* Account a packet of a recorded DNS query, see record_dns_query */
+static void account_dns_packet(vpnproxy_data_t *proxy, conn_data_t *data, const char *packet, int size, bool from_tun) {
+    conn_stats_t *stats = conn_get_stats(proxy, data);
+
+    if(from_tun) {
+        stats->sent_pkts++;
+        stats->sent_bytes += size;
+    } else {
+        stats->rcvd_pkts++;
+        stats->rcvd_bytes += size;
+    }
+    stats->last_seen = (jlong)(proxy->now_ms / 1000);
+
+    queue_pending_traffic(proxy, data, size, from_tun);
+
+    if(data->app)
+        account_app_packet(proxy, data->app, IPPROTO_UDP, size, from_tun);
+
+    conn_notify_update(&proxy->conns, stats);
+    account_raw_packet(proxy, packet, size, from_tun);
+}
+
+/* ******************************************************* */
+
+/* Record a query consumed by handle_dns_query as a connection, so that it still shows up in the
+ * connections, apps stats, connections log and exports. The record has no zdtun socket and no
+ * DPI: only the tuple, uid and query name are set. It is closed when the reply is written into
+ * the tun, see record_dns_reply, or after DNS_RECORD_TIMEOUT_MS. The latency is measured for
+ * the queries sent upstream. */
+static void record_dns_query(vpnproxy_data_t *proxy, const zdtun_pkt_t *pkt, const char *qname, bool upstream) {
+    conn_store_t *store = &proxy->conns;
+    const zdtun_5tuple_t *tuple = &pkt->tuple;
+    u_int64_t key = dns_pending_key(tuple->src_ip.ip4, tuple->src_port, (const u_int8_t*) pkt->l7);
+    dns_pending_t *pending;
+    conn_data_t *data = NULL;
+    u_int32_t slot;
+
+    proxy->num_dns_requests++;
+    HASH_FIND(hh, proxy->dns_pending, &key, sizeof(key), pending);
+
+    if(pending) {
+        /* retransmitted query */
+        account_dns_packet(proxy, pending->data, pkt->buf, pkt->len, true);
+        return;
+    }
+
+    if(((pending = calloc(1, sizeof(dns_pending_t))) == NULL) ||
+       ((data = conn_store_add(proxy, tuple)) == NULL)) {
+        free(pending);
+        account_raw_packet(proxy, pkt->buf, pkt->len, true);
+        return;
+    }
+
+    slot = data->slot;
+    store->first_seen[slot] = store->stats[slot].last_seen = (jlong)(proxy->now_ms / 1000);
+    store->stats[slot].status = CONN_STATUS_CONNECTED;
+    store->l7proto[slot].app_protocol = NDPI_PROTOCOL_DNS;
+    store->uid[slot] = resolve_uid(proxy, tuple);
+    conn_str_set(proxy, &data->info, qname);
+
+    data->lat.done = true;
+    if(upstream)
+        data->lat.req_us = lat_now_us();
+
+    conn_register(proxy, data);
+
+    pending->key = key;
+    pending->data = data;
+    pending->start_ms = proxy->now_ms;
+    HASH_ADD(hh, proxy->dns_pending, key, sizeof(pending->key), pending);
+    proxy->mem.used[MEM_CONNS] += sizeof(dns_pending_t);
+
+    account_dns_packet(proxy, data, pkt->buf, pkt->len, true);
+}
+
+/* ******************************************************* */
+
+static void close_dns_record(vpnproxy_data_t *proxy, dns_pending_t *pending) {
+    conn_data_t *data = pending->data;
+    conn_stats_t *stats = conn_get_stats(proxy, data);
+
+    stats->status = CONN_STATUS_CLOSED;
+    stats->flags |= CONN_FLAG_CLOSED;
+    conn_closed(proxy, data);
+
+    HASH_DELETE(hh, proxy->dns_pending, pending);
+    free(pending);
+    proxy->mem.used[MEM_CONNS] -= sizeof(dns_pending_t);
+}
+
+/* ******************************************************* */
+
+/* Account the reply written by send_dns_reply to its recorded query, which is then closed.
+ * Returns false if the query was not recorded. */
+static bool record_dns_reply(vpnproxy_data_t *proxy, u_int32_t client_ip, u_int16_t client_port,
+                             const char *pkt_buf, int pkt_len) {
+    u_int64_t key = dns_pending_key(client_ip, client_port, (const u_int8_t*) pkt_buf + IPV4_UDP_HDRS_LEN);
+    dns_pending_t *pending;
+    conn_data_t *data;
+
+    HASH_FIND(hh, proxy->dns_pending, &key, sizeof(key), pending);
+
+    if(!pending)
+        return(false);
+
+    data = pending->data;
+    account_dns_packet(proxy, data, pkt_buf, pkt_len, false);
+
+    if(data->lat.req_us) {
+        data->lat.response_us = lat_elapsed_us(data->lat.req_us);
+        add_latency_sample(proxy, data, LAT_DNS, data->lat.response_us);
+    }
+
+    close_dns_record(proxy, pending);
+    return(true);
+}
+
+/* ******************************************************* */
+
+/* Close the recorded queries which got no reply */
+static void purge_dns_records(vpnproxy_data_t *proxy) {
+    dns_pending_t *pending, *tmp;
+
+    HASH_ITER(hh, proxy->dns_pending, pending, tmp) {
+        if((proxy->now_ms - pending->start_ms) >= DNS_RECORD_TIMEOUT_MS)
+            close_dns_record(proxy, pending);
+    }
+}
+
+/* ******************************************************* */
+
+static void destroy_dns_records(vpnproxy_data_t *proxy) {
+    dns_pending_t *pending, *tmp;
+
+    HASH_ITER(hh, proxy->dns_pending, pending, tmp) {
+        HASH_DELETE(hh, proxy->dns_pending, pending);
+        free(pending);
+    }
+}
+
+/* ******************************************************* */
+
+/* Set the DNS forwarder upstreams: the DNS server, followed by the other servers in the
+ * comma separated list returned by getDnsServers. The server returned by getFallbackDnsServer
+ * is only used when these are down. */
+static void init_dns_upstreams(vpnproxy_data_t *proxy) {
+    u_int32_t servers[DNS_FWD_MAX_UPSTREAMS];
+    struct in_addr fallback;
+    char buf[256];
+    char *tok, *saveptr;
+    int num = 0;
+
+    servers[num++] = proxy->dns_server;
+    getStringPref(proxy->env, proxy->vpn_service, "getDnsServers", buf, sizeof(buf));
+
+    for(tok = strtok_r(buf, ",", &saveptr); tok && (num < DNS_FWD_MAX_UPSTREAMS); tok = strtok_r(NULL, ",", &saveptr)) {
+        struct in_addr addr;
+
+        if(inet_pton(AF_INET, tok, &addr) == 1)
+            servers[num++] = addr.s_addr;
+        else
+            log_android(ANDROID_LOG_WARN, "Invalid DNS upstream: %s", tok);
+    }
+
+    getStringPref(proxy->env, proxy->vpn_service, "getFallbackDnsServer", buf, sizeof(buf));
+    if(inet_pton(AF_INET, buf, &fallback) != 1)
+        fallback.s_addr = 0;
+
+    dns_fwd_set_upstreams(proxy->dns_fwd, servers, num, fallback.s_addr);
+}
+
+/* ******************************************************* */
+
+/* Update the DNS upstreams stats returned by getDnsUpstreamsStats */
+static void snapshot_dns_upstreams(vpnproxy_data_t *proxy) {
+    pthread_mutex_lock(&stats_mutex);
+    proxy->num_dns_upstreams = dns_fwd_get_upstreams(proxy->dns_fwd, proxy->now_ms,
+                                                     proxy->dns_upstreams, DNS_FWD_MAX_UPSTREAMS);
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/* ******************************************************* */
+
+/* Update the shaper stats returned by getAppsShaperStats */
+static void snapshot_shaper_stats(vpnproxy_data_t *proxy) {
+    pthread_mutex_lock(&stats_mutex);
+    proxy->num_shaper_classes = shaper_get_stats(proxy->shaper, proxy->shaper_classes, SHAPER_MAX_CLASSES);
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/* ******************************************************* */
+
+/* Adapt the buffers of the upstream sockets of the live connections, see sock_tune.h */
+static void tune_sockets(vpnproxy_data_t *proxy, u_int32_t elapsed_ms) {
+    conn_store_t *store = &proxy->conns;
+
+    if(!store->data)
+        return;
+
+    for(u_int32_t i = 0; i < store->num_order; i++) {
+        u_int32_t slot = store->order[i];
+        conn_data_t *data = store->data[slot];
+        conn_stats_t *stats = &store->stats[slot];
+
+        if(!data || (data->tune.sock < 0))
+            continue;
+
+        if(sock_tune_update(proxy->sock_tuner, &data->tune, stats->sent_bytes, stats->rcvd_bytes,
+                            data->tcp.rtt_us, elapsed_ms))
+            conn_notify_update(store, stats);
+    }
+}
+
+/* ******************************************************* */
+
+/* Sample the upstream TCP sockets due for it, see tcp_health.h. The scan resumes from the
+ * connection following the last visited one, so that all the sockets are eventually sampled
+ * when more than TCP_HEALTH_TICK_BUDGET are due. */
+static void sample_tcp_health(vpnproxy_data_t *proxy) {
+    conn_store_t *store = &proxy->conns;
+    u_int32_t num = store->num_order;
+    int budget = TCP_HEALTH_TICK_BUDGET;
+
+    if(!store->data || (num == 0))
         return;
+
+    /* the store was compacted meanwhile */
+    if(proxy->tcp_health_cursor >= num)
+        proxy->tcp_health_cursor = 0;
+
+    for(u_int32_t n = 0; (n < num) && (budget > 0); n++) {
+        u_int32_t slot = store->order[proxy->tcp_health_cursor];
+        conn_data_t *data = store->data[slot];
+
+        proxy->tcp_health_cursor = (proxy->tcp_health_cursor + 1) % num;
+
+        if(!data || (data->tune.sock < 0) || ((proxy->now_ms - data->tcp.sampled_ms) < TCP_HEALTH_INTERVAL_MS))
+            continue;
+
+        budget--;
+
+        if(tcp_health_sample(data->tune.sock, &data->tcp, proxy->now_ms) > 0)
+            conn_notify_update(store, &store->stats[slot]);
     }
+}
+
+/* ******************************************************* */
+
+/* Apply the DNS server set via setDnsServer, both to zdtun and to the DNS forwarder */
+static void check_dns_server_change(zdtun_t *tun, vpnproxy_data_t *proxy) {
+    if(new_dns_server == 0)
+        return;
 
-    /* Will free the other data in sendConnectionsDump */
-    end_ndpi_detection(data, proxy, conn_info);
-    data->status = zdtun_conn_get_status(conn_info);
+    // Reload DNS server
+    proxy->dns_server = new_dns_server;
+    new_dns_server = 0;
 
-    if(!data->pending_notification && !shouldIgnoreConn(proxy, zdtun_conn_get_5tuple(conn_info), data)) {
-        // Send last notification
-        conns_add(&proxy->conns_updates, conn_info);
-        data->pending_notification = true;
+    zdtun_ip_t ip = {0};
+    ip.ip4 = proxy->dns_server;
+    zdtun_set_dnat_info(tun, &ip, htons(53), 4);
+
+    /* The DNS server only changes when the network is lost, so the other upstreams of the
+     * network are likely unreachable too */
+    if(proxy->dns_fwd) {
+        dns_fwd_set_upstreams(proxy->dns_fwd, &proxy->dns_server, 1, 0);
+        snapshot_dns_upstreams(proxy);
     }
+
+    log_android(ANDROID_LOG_DEBUG, "Using new DNS server");
 }
 
 /* ******************************************************* */
@@ -644,38 +1811,17 @@ static void destroy_connection(zdtun_t *tun, const zdtun_conn_t *conn_info) {
  * with public DNS server. Non UDP DNS connections are dropped to block DoH queries which do not
  * allow us to extract the requested domain name.
  */
-static bool check_dns_req_allowed(zdtun_t *tun, struct vpnproxy_data *proxy, zdtun_conn_t *conn) {
+static bool check_dns_req_allowed(zdtun_t *tun, struct vpnproxy_data *proxy, zdtun_conn_t *conn,
+                                  const ip_rule_match_t *rule) {
     const zdtun_5tuple_t *tuple = zdtun_conn_get_5tuple(conn);
 
-    if(new_dns_server != 0) {
-        // Reload DNS server
-        proxy->dns_server = new_dns_server;
-        new_dns_server = 0;
-
-        zdtun_ip_t ip = {0};
-        ip.ip4 = proxy->dns_server;
-        zdtun_set_dnat_info(tun, &ip, htons(53), 4);
-
-        log_android(ANDROID_LOG_DEBUG, "Using new DNS server");
-    }
-
     bool is_internal_dns = (tuple->ipver == 4) && (tuple->dst_ip.ip4 == proxy->vpn_dns);
     bool is_dns_server = is_internal_dns
             || ((tuple->ipver == 6) && (memcmp(&tuple->dst_ip.ip6, &proxy->ipv6.dns_server, 16) == 0));
 
     if(!is_dns_server) {
         // try with known DNS servers
-        u_int32_t matched = 0;
-        ndpi_ip_addr_t addr = {0};
-
-        if(tuple->ipver == 4)
-            addr.ipv4 = tuple->dst_ip.ip4;
-        else
-            memcpy(&addr.ipv6, &tuple->dst_ip.ip6, 16);
-
-        ndpi_ptree_match_addr(proxy->known_dns_servers, &addr, &matched);
-
-        if(matched) {
+        if(rule->actions & IP_RULE_DNS_SERVER) {
             char ip[INET6_ADDRSTRLEN];
             int family = (tuple->ipver == 4) ? AF_INET : AF_INET6;
 
@@ -723,13 +1869,23 @@ static bool check_dns_req_allowed(zdtun_t *tun, struct vpnproxy_data *proxy, zdt
 
 /* ******************************************************* */
 
+/* True if the connection host was found in the blocklist */
+static inline bool is_conn_blocked(vpnproxy_data_t *proxy, zdtun_conn_t *conn) {
+    conn_data_t *data = zdtun_conn_get_userdata(conn);
+
+    return(data && (conn_get_stats(proxy, data)->flags & CONN_FLAG_BLOCKED));
+}
+
+/* ******************************************************* */
+
 static void check_socks5_redirection(zdtun_t *tun, struct vpnproxy_data *proxy, zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
     conn_data_t *data = zdtun_conn_get_userdata(conn);
+    const conn_stats_t *stats = conn_get_stats(proxy, data);
 
-    if(shouldIgnoreConn(proxy, zdtun_conn_get_5tuple(conn), data))
+    if(stats->flags & CONN_FLAG_IGNORED)
         return;
 
-    if((pkt->tuple.ipproto == IPPROTO_TCP) && (((data->sent_pkts + data->rcvd_pkts) == 0)))
+    if((pkt->tuple.ipproto == IPPROTO_TCP) && (((stats->sent_pkts + stats->rcvd_pkts) == 0)))
         zdtun_conn_proxy(conn);
 }
 
@@ -769,18 +1925,19 @@ static int net2tun(zdtun_t *tun, char *pkt_buf, int pkt_size, const zdtun_conn_t
 
 /* ******************************************************* */
 
-static int dumpConnection(vpnproxy_data_t *proxy, const vpn_conn_t *conn, jobject arr, int idx) {
+static int dumpConnection(vpnproxy_data_t *proxy, u_int32_t slot, jobject arr, int idx) {
     char srcip[INET6_ADDRSTRLEN], dstip[INET6_ADDRSTRLEN];
-    struct in_addr addr;
     JNIEnv *env = proxy->env;
-    const zdtun_5tuple_t *conn_info = &conn->tuple;
-    const conn_data_t *data = conn->data;
+    const conn_store_t *store = &proxy->conns;
+    const zdtun_5tuple_t *conn_info = &store->tuple[slot];
+    const conn_data_t *data = store->data[slot];
+    const conn_stats_t *stats = &store->stats[slot];
     int rv = 0;
-    int family = (conn->tuple.ipver == 4) ? AF_INET : AF_INET6;
+    int family = (conn_info->ipver == 4) ? AF_INET : AF_INET6;
 
     if((inet_ntop(family, &conn_info->src_ip, srcip, sizeof(srcip)) == NULL) ||
        (inet_ntop(family, &conn_info->dst_ip, dstip, sizeof(dstip)) == NULL)) {
-        log_android(ANDROID_LOG_WARN, "inet_ntop failed: ipver=%d, dstport=%d", conn->tuple.ipver, ntohs(conn_info->dst_port));
+        log_android(ANDROID_LOG_WARN, "inet_ntop failed: ipver=%d, dstport=%d", conn_info->ipver, ntohs(conn_info->dst_port));
         return 0;
     }
 
@@ -789,12 +1946,14 @@ static int dumpConnection(vpnproxy_data_t *proxy, const vpn_conn_t *conn, jobjec
                         conn_info->ipproto,
                         srcip, ntohs(conn_info->src_port),
                         dstip, ntohs(conn_info->dst_port),
-                        data->uid);
+                        store->uid[slot]);
 #endif
 
-    jobject info_string = (*env)->NewStringUTF(env, data->info ? data->info : "");
-    jobject url_string = (*env)->NewStringUTF(env, data->url ? data->url : "");
-    jobject proto_string = (*env)->NewStringUTF(env, getProtoName(proxy->ndpi, data->l7proto, conn_info->ipproto));
+    const char *info = conn_str_get(&data->info);
+    const char *url = conn_str_get(&data->url);
+    jobject info_string = (*env)->NewStringUTF(env, info ? info : "");
+    jobject url_string = (*env)->NewStringUTF(env, url ? url : "");
+    jobject proto_string = (*env)->NewStringUTF(env, getProtoName(proxy->ndpi, store->l7proto[slot], conn_info->ipproto));
     jobject src_string = (*env)->NewStringUTF(env, srcip);
     jobject dst_string = (*env)->NewStringUTF(env, dstip);
     jobject conn_descriptor = (*env)->NewObject(env, cls.conn, mids.connInit);
@@ -804,11 +1963,19 @@ static int dumpConnection(vpnproxy_data_t *proxy, const vpn_conn_t *conn, jobjec
          * SetIntField like methods could be used. */
         (*env)->CallVoidMethod(env, conn_descriptor, mids.connSetData,
                                src_string, dst_string, info_string, url_string, proto_string,
-                               data->status, conn_info->ipver, conn_info->ipproto,
+                               stats->status, conn_info->ipver, conn_info->ipproto,
                                ntohs(conn_info->src_port), ntohs(conn_info->dst_port),
-                               data->first_seen, data->last_seen, data->sent_bytes,
-                               data->rcvd_bytes, data->sent_pkts,
-                               data->rcvd_pkts, data->uid, data->incr_id);
+                               store->first_seen[slot], stats->last_seen, stats->sent_bytes,
+                               stats->rcvd_bytes, stats->sent_pkts,
+                               stats->rcvd_pkts, store->uid[slot], store->incr_id[slot]);
+
+        if(data->tune.rcvbuf && !jniCheckException(env))
+            (*env)->CallVoidMethod(env, conn_descriptor, mids.connSetSocketData,
+                                   (jint) data->tune.rcvbuf, (jint) data->tune.sndbuf,
+                                   (jint) data->tune.tput_kbps, (jint) data->tcp.rtt_us,
+                                   (jint) data->tcp.rttvar_us, (jint) data->tcp.retrans,
+                                   (jint) data->tcp.cwnd, (jlong) data->tcp.delivery_rate);
+
         if(jniCheckException(env))
             rv = -1;
         else {
@@ -834,55 +2001,109 @@ static int dumpConnection(vpnproxy_data_t *proxy, const vpn_conn_t *conn, jobjec
     return rv;
 }
 
-/* Perform a full dump of the active connections */
+/* Send the new and updated connections to Java. Connections are visited in creation order,
+ * which guarantees that the new connections are sent in incr_id order. */
 static void sendConnectionsDump(zdtun_t *tun, vpnproxy_data_t *proxy) {
-    if((proxy->new_conns.cur_items == 0) && (proxy->conns_updates.cur_items == 0))
+    conn_store_t *store = &proxy->conns;
+    int num_new = 0, num_updates = 0;
+
+    if((store->num_new == 0) && (store->num_updates == 0))
         return;
 
-    log_android(ANDROID_LOG_DEBUG, "sendConnectionsDump: new=%d, updates=%d", proxy->new_conns.cur_items, proxy->conns_updates.cur_items);
+    log_android(ANDROID_LOG_DEBUG, "sendConnectionsDump: new=%d, updates=%d", store->num_new, store->num_updates);
 
     JNIEnv *env = proxy->env;
-    jobject new_conns = (*env)->NewObjectArray(env, proxy->new_conns.cur_items, cls.conn, NULL);
-    jobject conns_updates = (*env)->NewObjectArray(env, proxy->conns_updates.cur_items, cls.conn, NULL);
+    jobject new_conns = (*env)->NewObjectArray(env, store->num_new, cls.conn, NULL);
+    jobject conns_updates = (*env)->NewObjectArray(env, store->num_updates, cls.conn, NULL);
 
     if((new_conns == NULL) || (conns_updates == NULL) || jniCheckException(env)) {
         log_android(ANDROID_LOG_ERROR, "NewObjectArray() failed");
         goto cleanup;
     }
 
-    // New connections
-    for(int i=0; i<proxy->new_conns.cur_items; i++) {
-        vpn_conn_t *conn = &proxy->new_conns.items[i];
-        conn->data->pending_notification = false;
-
-        if(dumpConnection(proxy, conn, new_conns, i) < 0)
-            goto cleanup;
-    }
+    for(u_int32_t i = 0; i < store->num_order; i++) {
+        u_int32_t slot = store->order[i];
+        u_int8_t flags = store->stats[slot].flags;
 
-    // Updated connections
-    for(int i=0; i<proxy->conns_updates.cur_items; i++) {
-        vpn_conn_t *conn = &proxy->conns_updates.items[i];
-        conn->data->pending_notification = false;
+        if(!store->data[slot])
+            continue;
 
-        if(dumpConnection(proxy, conn, conns_updates, i) < 0)
-            goto cleanup;
+        if((flags & CONN_FLAG_NEW) && (num_new < store->num_new)) {
+            if(dumpConnection(proxy, slot, new_conns, num_new++) < 0)
+                goto cleanup;
+        } else if((flags & CONN_FLAG_PENDING_NOTIFICATION) && (num_updates < store->num_updates)) {
+            if(dumpConnection(proxy, slot, conns_updates, num_updates++) < 0)
+                goto cleanup;
+        }
     }
 
     /* Send the dump */
     (*env)->CallVoidMethod(env, proxy->vpn_service, mids.sendConnectionsDump, new_conns, conns_updates);
     jniCheckException(env);
 
-cleanup:
-    conns_clear(&proxy->new_conns, false);
-    conns_clear(&proxy->conns_updates, false);
+    /* Mark the connections as notified and release the closed ones.
+     * On errors, the pending connections are retried on the next dump. */
+    for(u_int32_t i = 0; i < store->num_order; i++) {
+        u_int32_t slot = store->order[i];
+        conn_stats_t *stats = &store->stats[slot];
+
+        if(!store->data[slot] || !(stats->flags & (CONN_FLAG_NEW | CONN_FLAG_PENDING_NOTIFICATION)))
+            continue;
+
+        stats->flags &= ~(CONN_FLAG_NEW | CONN_FLAG_PENDING_NOTIFICATION);
+
+        if(stats->flags & CONN_FLAG_CLOSED)
+            conn_store_release(proxy, slot);
+    }
+
+    store->num_new = 0;
+    store->num_updates = 0;
 
+cleanup:
     (*env)->DeleteLocalRef(env, new_conns);
     (*env)->DeleteLocalRef(env, conns_updates);
 }
 
 /* ******************************************************* */
 
-static void sendVPNStats(const vpnproxy_data_t *proxy, const zdtun_statistics_t *stats) {
+/* Publish the per-app aggregates as a single long[] of APP_STATS_NUM_FIELDS items per app */
+static void sendAppsStatsDump(vpnproxy_data_t *proxy) {
+    JNIEnv *env = proxy->env;
+    apps_stats_t *apps = &proxy->apps;
+    jsize num_items = apps->num_apps * APP_STATS_NUM_FIELDS;
+    jlongArray arr;
+    jlong *buf;
+
+    if(!apps->changed)
+        return;
+
+    if((buf = malloc(num_items * sizeof(jlong))) == NULL) {
+        log_android(ANDROID_LOG_ERROR, "malloc(apps stats) failed");
+        return;
+    }
+
+    apps_stats_fill(apps, buf);
+    arr = (*env)->NewLongArray(env, num_items);
+
+    if((arr == NULL) || jniCheckException(env)) {
+        log_android(ANDROID_LOG_ERROR, "NewLongArray(apps stats) failed");
+        free(buf);
+        return;
+    }
+
+    (*env)->SetLongArrayRegion(env, arr, 0, num_items, buf);
+    (*env)->CallVoidMethod(env, proxy->vpn_service, mids.sendAppsStatsDump, arr);
+
+    if(!jniCheckException(env))
+        apps->changed = false;
+
+    (*env)->DeleteLocalRef(env, arr);
+    free(buf);
+}
+
+/* ******************************************************* */
+
+static void sendVPNStats(vpnproxy_data_t *proxy, const zdtun_statistics_t *stats) {
     JNIEnv *env = proxy->env;
     const capture_stats_t *capstats = &proxy->capture_stats;
 
@@ -902,6 +2123,34 @@ static void sendVPNStats(const vpnproxy_data_t *proxy, const zdtun_statistics_t
             proxy->num_dropped_connections,
             stats->num_open_sockets, stats->all_max_fd, active_conns, tot_conns, proxy->num_dns_requests);
 
+    if(!jniCheckException(env)) {
+        const mem_stats_t *mem = &proxy->mem;
+
+        mem_total(proxy); // refresh the hosts cache usage
+        (*env)->CallVoidMethod(env, stats_obj, mids.statsSetMemData,
+                (jlong) mem->used[MEM_CONNS], (jlong) mem->used[MEM_NDPI], (jlong) mem->used[MEM_HOSTS],
+                (jlong) mem->used[MEM_BUFFERS], (jlong) mem->used[MEM_STORE], (jlong) mem->used[MEM_SERIES],
+                (jlong) mem->budget,
+                (jint) mem->dpi_evictions, (jint) mem->meta_evictions);
+    }
+
+    if(!jniCheckException(env) && proxy->dns_cache) {
+        const dns_cache_stats_t *dns_stats = dns_cache_get_stats(proxy->dns_cache);
+
+        (*env)->CallVoidMethod(env, stats_obj, mids.statsSetDnsCacheData,
+                (jint) dns_stats->hits, (jint) dns_stats->misses,
+                (jint) (proxy->dns_inflight ? dns_coalesce_num_coalesced(proxy->dns_inflight) : 0),
+                (jlong) dns_stats->saved_ms);
+    }
+
+    if(!jniCheckException(env)) {
+        const sched_stats_t *sched = &proxy->sched;
+
+        (*env)->CallVoidMethod(env, stats_obj, mids.statsSetSchedData,
+                (jlong) sched->tun_pkts, (jlong) sched->sock_events,
+                (jint) sched->tun_budget_hits, (jint) sched->iterations);
+    }
+
     if(!jniCheckException(env)) {
         (*env)->CallVoidMethod(env, proxy->vpn_service, mids.sendStatsDump, stats_obj);
         jniCheckException(env);
@@ -960,14 +2209,134 @@ static int connect_dumper(vpnproxy_data_t *proxy) {
 /* ******************************************************* */
 
 static void add_known_dns_server(vpnproxy_data_t *proxy, const char *ip) {
-    ndpi_ip_addr_t parsed;
+    if(ip_rules_add(proxy->ip_rules, ip, IP_RULE_DNS_SERVER, NULL) != 0)
+        log_android(ANDROID_LOG_ERROR, "ip_rules_add(%s) failed", ip);
+}
+
+/* ******************************************************* */
+
+typedef struct {
+    zdtun_t *tun;
+    vpnproxy_data_t *proxy;
+} shaper_ctx_t;
+
+/* ******************************************************* */
+
+/* Forward a packet of the tun to its zdtun connection */
+static void forward_tun_packet(zdtun_t *tun, vpnproxy_data_t *proxy, zdtun_pkt_t *pkt, zdtun_conn_t *conn) {
+    if(is_conn_blocked(proxy, conn)) {
+        /* blocked while handling a packet from the network */
+        zdtun_destroy_conn(tun, conn);
+        return;
+    }
+
+    if(proxy->socks5.enabled)
+        check_socks5_redirection(tun, proxy, pkt, conn);
+
+    proxy->cur_conn = zdtun_conn_get_userdata(conn);
+    int rv = zdtun_forward(tun, pkt, conn);
+    proxy->cur_conn = NULL;
+
+    if(rv != 0) {
+        char buf[512];
 
-    if(ndpi_parse_ip_string(ip, &parsed) < 0) {
-        log_android(ANDROID_LOG_ERROR, "ndpi_parse_ip_string(%s) failed", ip);
+        log_android(ANDROID_LOG_ERROR, "zdtun_forward failed: %s",
+                    zdtun_5tuple2str(&pkt->tuple, buf, sizeof(buf)));
+
+        proxy->num_dropped_connections++;
+        zdtun_destroy_conn(tun, conn);
         return;
     }
 
-    ndpi_ptree_insert(proxy->known_dns_servers, &parsed, ndpi_is_ipv6(&parsed) ? 128 : 32, 1);
+    if(is_conn_blocked(proxy, conn)) {
+        /* the SNI/Host of this packet is blocked */
+        zdtun_destroy_conn(tun, conn);
+    }
+}
+
+/* ******************************************************* */
+
+/* Handle a packet read from the tun */
+static void handle_tun_packet(zdtun_t *tun, vpnproxy_data_t *proxy, char *buffer, int size) {
+    zdtun_pkt_t pkt;
+
+    if (zdtun_parse_pkt(buffer, size, &pkt) != 0) {
+        log_android(ANDROID_LOG_DEBUG, "zdtun_parse_pkt failed");
+        goto out;
+    }
+
+    proxy->last_pkt = &pkt;
+    proxy->last_conn_blocked = false;
+    check_dns_server_change(tun, proxy);
+
+    if(proxy->dns_cache && handle_dns_query(proxy, &pkt))
+        goto out;
+
+    if((pkt.tuple.ipver == 6) && (!proxy->ipv6.enabled)) {
+        char buf[512];
+
+        log_android(ANDROID_LOG_DEBUG, "ignoring IPv6 packet: %s",
+                    zdtun_5tuple2str(&pkt.tuple, buf, sizeof(buf)));
+        goto out;
+    }
+
+    // Skip established TCP connections
+    uint8_t is_tcp_established = ((pkt.tuple.ipproto == IPPROTO_TCP) &&
+                                  (!(pkt.tcp->th_flags & TH_SYN) || (pkt.tcp->th_flags & TH_ACK)));
+
+    zdtun_conn_t *conn = zdtun_lookup(tun, &pkt.tuple, !is_tcp_established);
+
+    if (!conn) {
+        if(proxy->last_conn_blocked) {
+            ;
+        } else if(!is_tcp_established) {
+            char buf[512];
+
+            proxy->num_dropped_connections++;
+            log_android(ANDROID_LOG_ERROR, "zdtun_lookup failed: %s",
+                        zdtun_5tuple2str(&pkt.tuple, buf, sizeof(buf)));
+        } else {
+            char buf[512];
+
+            log_android(ANDROID_LOG_DEBUG, "skipping established TCP: %s",
+                    zdtun_5tuple2str(&pkt.tuple, buf, sizeof(buf)));
+        }
+        goto out;
+    }
+
+    if(proxy->shaper) {
+        conn_data_t *data = zdtun_conn_get_userdata(conn);
+
+        /* Queued packets are forwarded later by shaper_send, dropped ones are recovered by
+         * the client retransmissions */
+        if(data && (shaper_enqueue(proxy->shaper, proxy->conns.uid[data->slot],
+                                   buffer, size, proxy->now_ms) != 0))
+            goto out;
+    }
+
+    forward_tun_packet(tun, proxy, &pkt, conn);
+
+out:
+    proxy->last_pkt = NULL;
+}
+
+/* ******************************************************* */
+
+/* Forward a packet released by the shaper, whose connection may have been closed meanwhile */
+static void shaper_send(const char *pkt_buf, int len, void *userdata) {
+    shaper_ctx_t *ctx = (shaper_ctx_t*) userdata;
+    zdtun_pkt_t pkt;
+    zdtun_conn_t *conn;
+
+    if(zdtun_parse_pkt(pkt_buf, len, &pkt) != 0)
+        return;
+
+    if((conn = zdtun_lookup(ctx->tun, &pkt.tuple, 0 /* no create */)) == NULL)
+        return;
+
+    ctx->proxy->last_pkt = &pkt;
+    forward_tun_packet(ctx->tun, ctx->proxy, &pkt, conn);
+    ctx->proxy->last_pkt = NULL;
 }
 
 /* ******************************************************* */
@@ -975,9 +2344,11 @@ static void add_known_dns_server(vpnproxy_data_t *proxy, const char *ip) {
 static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
     zdtun_t *tun;
     char buffer[32767];
-    struct timeval now_tv;
     u_int64_t now_ms;
     u_int64_t next_purge_ms;
+    u_int64_t last_mem_check_ms = 0;
+    u_int64_t last_sock_tune_ms;
+    u_int64_t last_tcp_health_ms;
     time_t last_connections_dump = (time(NULL) * 1000) - CONNECTION_DUMP_UPDATE_FREQUENCY_MS + 1000 /* update in a second */;
     jclass vpn_class = (*env)->GetObjectClass(env, vpn);
 
@@ -993,14 +2364,17 @@ static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
     mids.protect = jniGetMethodID(env, vpn_class, "protect", "(I)Z");
     mids.dumpPcapData = jniGetMethodID(env, vpn_class, "dumpPcapData", "([B)V");
     mids.sendConnectionsDump = jniGetMethodID(env, vpn_class, "sendConnectionsDump", "([Lcom/emanuelef/remote_capture/model/ConnectionDescriptor;[Lcom/emanuelef/remote_capture/model/ConnectionDescriptor;)V");
+    mids.sendAppsStatsDump = jniGetMethodID(env, vpn_class, "sendAppsStatsDump", "([J)V");
     mids.sendStatsDump = jniGetMethodID(env, vpn_class, "sendStatsDump", "(Lcom/emanuelef/remote_capture/model/VPNStats;)V");
     mids.sendServiceStatus = jniGetMethodID(env, vpn_class, "sendServiceStatus", "(Ljava/lang/String;)V");
     mids.connInit = jniGetMethodID(env, cls.conn, "<init>", "()V");
-    mids.connSetData = jniGetMethodID(env, cls.conn, "setData",
-            /* NOTE: must match ConnectionDescriptor::setData */
-            "(Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;Ljava/lang/String;IIIIIJJJJIIII)V");
+    mids.connSetData = jniGetMethodID(env, cls.conn, "setData", CONN_SET_DATA_SIGNATURE);
+    mids.connSetSocketData = jniGetMethodID(env, cls.conn, "setSocketData", "(IIIIIIIJ)V");
     mids.statsInit = jniGetMethodID(env, cls.stats, "<init>", "()V");
     mids.statsSetData = jniGetMethodID(env, cls.stats, "setData", "(JJIIIIIIII)V");
+    mids.statsSetMemData = jniGetMethodID(env, cls.stats, "setMemData", "(JJJJJJJII)V");
+    mids.statsSetDnsCacheData = jniGetMethodID(env, cls.stats, "setDnsCacheData", "(IIIJ)V");
+    mids.statsSetSchedData = jniGetMethodID(env, cls.stats, "setSchedData", "(JJII)V");
 
     vpnproxy_data_t proxy = {
             .tunfd = tunfd,
@@ -1008,8 +2382,10 @@ static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
             .env = env,
             .vpn_service = vpn,
             .resolver = init_uid_resolver(sdk, env, vpn),
-            .known_dns_servers = ndpi_ptree_create(),
+            .ip_rules = ip_rules_init(),
             .ip_to_host = ip_lru_init(MAX_HOST_LRU_SIZE),
+            .dns_cache = dns_cache_init(DNS_CACHE_MAX_ENTRIES),
+            .dns_inflight = dns_coalesce_init(),
             .vpn_ipv4 = getIPv4Pref(env, vpn, "getVpnIPv4"),
             .vpn_dns = getIPv4Pref(env, vpn, "getVpnDns"),
             .dns_server = getIPv4Pref(env, vpn, "getDnsServer"),
@@ -1031,6 +2407,9 @@ static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
             .ipv6 = {
                 .enabled = (bool) getIntPref(env, vpn, "getIPv6Enabled"),
                 .dns_server = getIPv6Pref(env, vpn, "getIpv6DnsServer"),
+            },
+            .mem = {
+                .budget = ((u_int64_t) getIntPref(env, vpn, "getMemoryBudgetMB")) * 1024 * 1024,
             }
     };
 
@@ -1056,6 +2435,11 @@ static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
         return(-1);
     }
 
+    if(proxy.ip_rules == NULL) {
+        log_android(ANDROID_LOG_FATAL, "ip_rules_init failed");
+        return(-1);
+    }
+
     // List of known DNS servers
     add_known_dns_server(&proxy, "8.8.8.8");
     add_known_dns_server(&proxy, "8.8.4.4");
@@ -1066,12 +2450,27 @@ static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
     add_known_dns_server(&proxy, "2606:4700:4700::64");
     add_known_dns_server(&proxy, "2606:4700:4700::6400");
 
+    char ip_rules_path[PATH_MAX];
+    getStringPref(env, vpn, "getIpRulesPath", ip_rules_path, sizeof(ip_rules_path));
+
+    if(ip_rules_path[0]) {
+        int num_rules = ip_rules_load(proxy.ip_rules, ip_rules_path);
+
+        if(num_rules >= 0)
+            log_android(ANDROID_LOG_INFO, "IP rules loaded: %d rules", num_rules);
+    }
+
+    if(ip_rules_build(proxy.ip_rules) != 0) {
+        log_android(ANDROID_LOG_FATAL, "ip_rules_build failed");
+        return(-1);
+    }
+
     signal(SIGPIPE, SIG_IGN);
 
-    // Set blocking
+    // Set non-blocking, so that the tun is drained until EAGAIN. The writes to a tun never block.
     int flags = fcntl(tunfd, F_GETFL, 0);
-    if (flags < 0 || fcntl(tunfd, F_SETFL, flags & ~O_NONBLOCK) < 0) {
-        log_android(ANDROID_LOG_FATAL, "fcntl ~O_NONBLOCK error [%d]: %s", errno,
+    if (flags < 0 || fcntl(tunfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        log_android(ANDROID_LOG_FATAL, "fcntl O_NONBLOCK error [%d]: %s", errno,
                             strerror(errno));
         return(-1);
     }
@@ -1092,16 +2491,89 @@ static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
             running = false;
     }
 
-    if(proxy.java_dump.enabled) {
-        proxy.java_dump.buffer = malloc(JAVA_PCAP_BUFFER_SIZE);
-        proxy.java_dump.buffer_idx = 0;
+    if(proxy.java_dump.enabled) {
+        proxy.java_dump.buffer = malloc(JAVA_PCAP_BUFFER_SIZE);
+        proxy.java_dump.buffer_idx = 0;
+
+        if(!proxy.java_dump.buffer) {
+            log_android(ANDROID_LOG_FATAL, "malloc(java_dump.buffer) failed with code %d/%s",
+                                errno, strerror(errno));
+            running = false;
+        }
+    }
+
+    if((proxy.lat_hosts = lat_hosts_init(LAT_HOSTS_CAPACITY)) != NULL)
+        proxy.mem.used[MEM_SERIES] += lat_hosts_mem_usage(proxy.lat_hosts);
+    else
+        log_android(ANDROID_LOG_ERROR, "lat_hosts_init failed, the latency by host will not be available");
+
+    for(int i = 0; i < TOP_NUM_TRACKERS; i++) {
+        if((proxy.top[i] = hh_tracker_init(TOP_TRACKER_CAPACITY)) == NULL) {
+            log_android(ANDROID_LOG_FATAL, "hh_tracker_init failed");
+            running = false;
+        } else
+            proxy.mem.used[MEM_SERIES] += hh_tracker_mem_usage(proxy.top[i]);
+    }
+
+    if(proxy.dns_cache) {
+        if((proxy.dns_fwd = dns_fwd_init(protectDnsSocket, &proxy)) != NULL) {
+            init_dns_upstreams(&proxy);
+            snapshot_dns_upstreams(&proxy);
+        } else
+            log_android(ANDROID_LOG_ERROR, "dns_fwd_init failed, DNS queries will go through zdtun");
+    }
+
+    if((proxy.bw = calloc(1, sizeof(bw_series_t))) == NULL) {
+        log_android(ANDROID_LOG_FATAL, "calloc(bw_series_t) failed with code %d/%s",
+                    errno, strerror(errno));
+        running = false;
+    } else {
+        proxy.mem.used[MEM_SERIES] += sizeof(bw_series_t);
+
+        pthread_mutex_lock(&stats_mutex);
+        stats_proxy = &proxy;
+        pthread_mutex_unlock(&stats_mutex);
+    }
+
+    /* The connections log of the previous capture is discarded */
+    char conn_log_path[PATH_MAX];
+    getStringPref(env, vpn, "getConnLogPath", conn_log_path, sizeof(conn_log_path));
+
+    pthread_mutex_lock(&conn_log_mutex);
+    if(conn_log) {
+        conn_log_unref(conn_log);
+        conn_log = NULL;
+    }
+    if(conn_log_path[0]) {
+        if((conn_log = conn_log_open(conn_log_path)) == NULL)
+            log_android(ANDROID_LOG_ERROR, "conn_log_open(%s) failed", conn_log_path);
+    }
+    proxy.conn_log = conn_log;
+    pthread_mutex_unlock(&conn_log_mutex);
+
+    char blocklist_path[PATH_MAX];
+    getStringPref(env, vpn, "getBlocklistPath", blocklist_path, sizeof(blocklist_path));
+
+    if(blocklist_path[0] && (proxy.blocklist = blocklist_open(blocklist_path)))
+        log_android(ANDROID_LOG_INFO, "Blocklist loaded: %u domains", blocklist_size(proxy.blocklist));
 
-        if(!proxy.java_dump.buffer) {
-            log_android(ANDROID_LOG_FATAL, "malloc(java_dump.buffer) failed with code %d/%s",
-                                errno, strerror(errno));
-            running = false;
+    char rate_limits[1024];
+    getStringPref(env, vpn, "getAppRateLimits", rate_limits, sizeof(rate_limits));
+
+    if(rate_limits[0] && (proxy.shaper = shaper_init())) {
+        shaper_load_config(proxy.shaper, rate_limits);
+
+        if(shaper_num_classes(proxy.shaper) > 0)
+            log_android(ANDROID_LOG_INFO, "Shaping %d apps", shaper_num_classes(proxy.shaper));
+        else {
+            shaper_destroy(proxy.shaper);
+            proxy.shaper = NULL;
         }
     }
+    shaper_ctx_t shaper_ctx = {.tun = tun, .proxy = &proxy};
+
+    if((proxy.sock_tuner = sock_tuner_init(SOCK_TUNE_DEFAULT_MAX_TOTAL)) == NULL)
+        log_android(ANDROID_LOG_ERROR, "sock_tuner_init failed, the socket buffers will not be tuned");
 
     zdtun_ip_t ip = {0};
     ip.ip4 = proxy.dns_server;
@@ -1114,15 +2586,18 @@ static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
     }
 
     new_dns_server = 0;
-    gettimeofday(&now_tv, NULL);
-    now_ms = now_tv.tv_sec * 1000 + now_tv.tv_usec / 1000;
+    now_ms = get_now_ms();
     next_purge_ms = now_ms + PERIODIC_PURGE_TIMEOUT_MS;
+    last_sock_tune_ms = now_ms;
+    last_tcp_health_ms = now_ms;
 
     while(running) {
         int max_fd;
         fd_set fdset;
         fd_set wrfds;
         int size;
+        int num_ready, num_fwd_ready = 0;
+        u_int64_t next_timeout_ms = UINT64_MAX;
         struct timeval timeout = {.tv_sec = 0, .tv_usec = 500*1000}; // wake every 500 ms
 
         zdtun_fds(tun, &max_fd, &fdset, &wrfds);
@@ -1130,95 +2605,111 @@ static int run_tun(JNIEnv *env, jclass vpn, int tunfd, jint sdk) {
         FD_SET(tunfd, &fdset);
         max_fd = max(max_fd, tunfd);
 
-        select(max_fd + 1, &fdset, &wrfds, NULL, &timeout);
-
-        if(!running)
-            break;
-
-        gettimeofday(&now_tv, NULL);
-        now_ms = now_tv.tv_sec * 1000 + now_tv.tv_usec / 1000;
-        proxy.now_ms = now_ms;
-
-        if(FD_ISSET(tunfd, &fdset)) {
-            /* Packet from VPN */
-            size = read(tunfd, buffer, sizeof(buffer));
+        if(proxy.export) {
+            /* wake up as soon as the export can proceed */
+            FD_SET(export_fd, &wrfds);
+            max_fd = max(max_fd, export_fd);
+        }
 
-            if (size > 0) {
-                zdtun_pkt_t pkt;
-                int rc;
+        if(proxy.dns_fwd) {
+            next_timeout_ms = dns_fwd_next_timeout(proxy.dns_fwd);
+            dns_fwd_fds(proxy.dns_fwd, &max_fd, &fdset);
+        }
 
-                if (zdtun_parse_pkt(buffer, size, &pkt) != 0) {
-                    log_android(ANDROID_LOG_DEBUG, "zdtun_parse_pkt failed");
-                    goto housekeeping;
-                }
+        if(proxy.shaper) {
+            u_int64_t shaper_timeout_ms;
 
-                proxy.last_pkt = &pkt;
-                proxy.last_conn_blocked = false;
+            /* now_ms was taken before processing the previous wakeup */
+            now_ms = get_now_ms();
+            shaper_timeout_ms = shaper_next_timeout(proxy.shaper, now_ms);
 
-                if((pkt.tuple.ipver == 6) && (!proxy.ipv6.enabled)) {
-                    char buf[512];
+            if(shaper_timeout_ms < next_timeout_ms)
+                next_timeout_ms = shaper_timeout_ms;
+        }
 
-                    log_android(ANDROID_LOG_DEBUG, "ignoring IPv6 packet: %s",
-                                zdtun_5tuple2str(&pkt.tuple, buf, sizeof(buf)));
-                    goto housekeeping;
-                }
+        /* wake up in time to race the late DNS queries and to release the shaped packets */
+        if(next_timeout_ms < (now_ms + 500)) {
+            timeout.tv_sec = 0;
+            timeout.tv_usec = (next_timeout_ms > now_ms) ? (next_timeout_ms - now_ms) * 1000 : 0;
+        }
 
-                // Skip established TCP connections
-                uint8_t is_tcp_established = ((pkt.tuple.ipproto == IPPROTO_TCP) &&
-                                              (!(pkt.tcp->th_flags & TH_SYN) || (pkt.tcp->th_flags & TH_ACK)));
+        num_ready = select(max_fd + 1, &fdset, &wrfds, NULL, &timeout);
 
-                zdtun_conn_t *conn = zdtun_lookup(tun, &pkt.tuple, !is_tcp_established);
+        if(!running)
+            break;
 
-                if (!conn) {
-                    if(proxy.last_conn_blocked) {
-                        ;
-                    } else if(!is_tcp_established) {
-                        char buf[512];
+        if(num_ready < 0) {
+            /* e.g. EINTR, the sets content is undefined */
+            FD_ZERO(&fdset);
+            FD_ZERO(&wrfds);
+            num_ready = 0;
+        }
+        proxy.sched.iterations++;
 
-                        proxy.num_dropped_connections++;
-                        log_android(ANDROID_LOG_ERROR, "zdtun_lookup failed: %s",
-                                    zdtun_5tuple2str(&pkt.tuple, buf, sizeof(buf)));
-                    } else {
-                        char buf[512];
+        now_ms = get_now_ms();
+        proxy.now_ms = now_ms;
 
-                        log_android(ANDROID_LOG_DEBUG, "skipping established TCP: %s",
-                                zdtun_5tuple2str(&pkt.tuple, buf, sizeof(buf)));
-                    }
-                    goto housekeeping;
-                }
+        if(proxy.dns_fwd) {
+            num_fwd_ready = dns_fwd_handle_fds(proxy.dns_fwd, &fdset, now_ms, dns_fwd_reply, &proxy);
 
-                if(proxy.socks5.enabled)
-                    check_socks5_redirection(tun, &proxy, &pkt, conn);
+            if(now_ms >= dns_fwd_next_timeout(proxy.dns_fwd))
+                dns_fwd_check_timeouts(proxy.dns_fwd, now_ms);
+        }
 
-                if((rc = zdtun_forward(tun, &pkt, conn)) != 0) {
-                    char buf[512];
+        /* Service the ready sockets first: processing the tun packets below may close some of
+         * them and reuse their fd numbers, which would then be stale in fdset */
+        zdtun_handle_fd(tun, &fdset, &wrfds);
 
-                    log_android(ANDROID_LOG_ERROR, "zdtun_forward failed: %s",
-                                zdtun_5tuple2str(&pkt.tuple, buf, sizeof(buf)));
+        /* Only count the zdtun sockets */
+        num_ready -= num_fwd_ready + (FD_ISSET(tunfd, &fdset) ? 1 : 0) +
+                ((proxy.export && FD_ISSET(export_fd, &wrfds)) ? 1 : 0);
+        proxy.sched.sock_events += num_ready;
 
-                    proxy.num_dropped_connections++;
-                    zdtun_destroy_conn(tun, conn);
-                    goto housekeeping;
+        if(FD_ISSET(tunfd, &fdset)) {
+            /* Packets from VPN. Read up to TUN_READ_BUDGET packets, then go back to the sockets,
+             * so that big uploads do not starve the downloads */
+            int num_pkts = 0;
+
+            while(running && (num_pkts < TUN_READ_BUDGET)) {
+                size = read(tunfd, buffer, sizeof(buffer));
+
+                if(size > 0) {
+                    handle_tun_packet(tun, &proxy, buffer, size);
+                    num_pkts++;
+                } else {
+                    /* EAGAIN: the tun is drained */
+                    if((size < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+                        log_android(ANDROID_LOG_ERROR, "recv(tunfd) returned error [%d]: %s", errno,
+                                    strerror(errno));
+                    break;
                 }
-            } else if (size < 0)
-                log_android(ANDROID_LOG_ERROR, "recv(tunfd) returned error [%d]: %s", errno,
-                            strerror(errno));
-        } else
-            zdtun_handle_fd(tun, &fdset, &wrfds);
+            }
+
+            proxy.sched.tun_pkts += num_pkts;
+            if(num_pkts == TUN_READ_BUDGET)
+                proxy.sched.tun_budget_hits++;
+        }
 
-housekeeping:
+        if(proxy.shaper) {
+            /* reading the tun may have taken a while */
+            now_ms = get_now_ms();
+            proxy.now_ms = now_ms;
+            shaper_dequeue(proxy.shaper, now_ms, TUN_READ_BUDGET, shaper_send, &shaper_ctx);
+        }
 
         if(proxy.capture_stats.new_stats
          && ((now_ms - proxy.capture_stats.last_update_ms) >= CAPTURE_STATS_UPDATE_FREQUENCY_MS) || dump_capture_stats_now) {
             zdtun_statistics_t stats;
             dump_capture_stats_now = false;
 
+            publish_pending_traffic(&proxy);
             zdtun_get_stats(tun, &stats);
             sendVPNStats(&proxy, &stats);
             proxy.capture_stats.new_stats = false;
             proxy.capture_stats.last_update_ms = now_ms;
         } else if((now_ms - last_connections_dump) >= CONNECTION_DUMP_UPDATE_FREQUENCY_MS) {
             sendConnectionsDump(tun, &proxy);
+            sendAppsStatsDump(&proxy);
             last_connections_dump = now_ms;
         } else if((proxy.java_dump.buffer_idx > 0)
          && (now_ms - proxy.java_dump.last_dump_ms) >= MAX_JAVA_DUMP_DELAY_MS) {
@@ -1227,15 +2718,106 @@ housekeeping:
             dump_vpn_stats_now = false;
 
             zdtun_purge_expired(tun, now_ms/1000);
+            purge_dns_records(&proxy);
+            conn_store_compact(&proxy);
+
+            if(proxy.dns_inflight)
+                dns_coalesce_purge(proxy.dns_inflight, now_ms);
+            if(proxy.dns_fwd)
+                snapshot_dns_upstreams(&proxy);
+            if(proxy.shaper)
+                snapshot_shaper_stats(&proxy);
             next_purge_ms = now_ms + PERIODIC_PURGE_TIMEOUT_MS;
         }
+
+        /* The tasks below are independent from the chain above: being due on most wakeups, they
+         * would otherwise starve the tasks following them */
+        if((now_ms - last_mem_check_ms) >= MEM_EVICTION_INTERVAL_MS) {
+            mem_enforce_budget(&proxy);
+            last_mem_check_ms = now_ms;
+        }
+
+        if(proxy.sock_tuner && ((now_ms - last_sock_tune_ms) >= SOCK_TUNE_INTERVAL_MS)) {
+            tune_sockets(&proxy, (u_int32_t)(now_ms - last_sock_tune_ms));
+            last_sock_tune_ms = now_ms;
+        }
+
+        if(proxy.sock_tuner && ((now_ms - last_tcp_health_ms) >= TCP_HEALTH_TICK_MS)) {
+            sample_tcp_health(&proxy);
+            last_tcp_health_ms = now_ms;
+        }
+
+        if((export_fd >= 0) && !proxy.export) {
+            proxy.export = conn_export_start(export_fd, export_format, now_ms);
+            proxy.export_cursor = 0;
+
+            if(!proxy.export) {
+                close(export_fd);
+                export_fd = -1;
+            }
+        }
+
+        if(proxy.export && (conn_export_step(&proxy, proxy.export, &proxy.export_cursor, now_ms) != 0)) {
+            conn_export_destroy(proxy.export);
+            proxy.export = NULL;
+            close(export_fd);
+            export_fd = -1;
+        }
+    }
+
+    log_android(ANDROID_LOG_DEBUG, "Stopped packet loop: %u iterations, %llu tun packets (%u full batches), %llu socket events",
+                proxy.sched.iterations, (unsigned long long) proxy.sched.tun_pkts,
+                proxy.sched.tun_budget_hits, (unsigned long long) proxy.sched.sock_events);
+
+    if(proxy.export) {
+        conn_export_destroy(proxy.export);
+        proxy.export = NULL;
+    }
+    if(export_fd >= 0) {
+        close(export_fd);
+        export_fd = -1;
     }
 
-    log_android(ANDROID_LOG_DEBUG, "Stopped packet loop");
+    publish_pending_traffic(&proxy);
+
+    pthread_mutex_lock(&stats_mutex);
+    stats_proxy = NULL;
+    pthread_mutex_unlock(&stats_mutex);
 
     ztdun_finalize(tun);
-    conns_clear(&proxy.new_conns, true);
-    conns_clear(&proxy.conns_updates, true);
+    destroy_dns_records(&proxy);
+    conn_store_destroy(&proxy);
+    apps_stats_destroy(&proxy.apps);
+
+    if(proxy.sock_tuner) {
+        sock_tuner_stats_t tune_stats;
+
+        sock_tuner_get_stats(proxy.sock_tuner, &tune_stats);
+        log_android(ANDROID_LOG_DEBUG, "Socket buffers: %u grown, %u shrunk, %u capped by the %llu B limit",
+                    tune_stats.grown, tune_stats.shrunk, tune_stats.capped,
+                    (unsigned long long) tune_stats.max_total);
+        sock_tuner_destroy(proxy.sock_tuner);
+        proxy.sock_tuner = NULL;
+    }
+
+    if(proxy.bw) {
+        free(proxy.bw);
+        proxy.bw = NULL;
+    }
+
+    for(int i = 0; i < TOP_NUM_TRACKERS; i++) {
+        if(proxy.top[i]) {
+            hh_tracker_destroy(proxy.top[i]);
+            proxy.top[i] = NULL;
+        }
+    }
+
+    if(proxy.lat_hosts) {
+        log_android(ANDROID_LOG_DEBUG, "Latency histograms: %d hosts, %u evictions",
+                    lat_hosts_num(proxy.lat_hosts), lat_hosts_evictions(proxy.lat_hosts));
+        lat_hosts_destroy(proxy.lat_hosts);
+        proxy.lat_hosts = NULL;
+    }
 
     ndpi_exit_detection_module(proxy.ndpi);
 
@@ -1254,11 +2836,64 @@ housekeeping:
 
     notifyServiceStatus(&proxy, "stopped");
     destroy_uid_resolver(proxy.resolver);
-    ndpi_ptree_destroy(proxy.known_dns_servers);
+    ip_rules_destroy(proxy.ip_rules);
 
     log_android(ANDROID_LOG_DEBUG, "Host LRU cache size: %d", ip_lru_size(proxy.ip_to_host));
     ip_lru_destroy(proxy.ip_to_host);
 
+    if(proxy.dns_cache) {
+        const dns_cache_stats_t *dns_stats = dns_cache_get_stats(proxy.dns_cache);
+
+        log_android(ANDROID_LOG_DEBUG, "DNS cache: %d entries, %u hits, %u misses",
+                    dns_cache_size(proxy.dns_cache), dns_stats->hits, dns_stats->misses);
+        dns_cache_destroy(proxy.dns_cache);
+    }
+
+    if(proxy.dns_inflight) {
+        log_android(ANDROID_LOG_DEBUG, "DNS coalesced queries: %u",
+                    dns_coalesce_num_coalesced(proxy.dns_inflight));
+        dns_coalesce_destroy(proxy.dns_inflight);
+    }
+
+    if(proxy.blocklist) {
+        log_android(ANDROID_LOG_DEBUG, "Blocklist: %u hits", blocklist_total_hits(proxy.blocklist));
+        blocklist_close(proxy.blocklist);
+    }
+
+    if(proxy.shaper) {
+        shaper_class_stats_t classes[SHAPER_MAX_CLASSES];
+        int num_classes = shaper_get_stats(proxy.shaper, classes, SHAPER_MAX_CLASSES);
+
+        for(int i = 0; i < num_classes; i++)
+            log_android(ANDROID_LOG_DEBUG, "Shaper[uid=%d]: %u pkts (%u queued, %u dropped), delay avg %u ms, max %u ms",
+                        classes[i].uid, classes[i].sent_pkts, classes[i].queued_pkts, classes[i].dropped_pkts,
+                        classes[i].avg_delay_ms, classes[i].max_delay_ms);
+        shaper_destroy(proxy.shaper);
+    }
+
+    if(proxy.dns_fwd) {
+        const dns_fwd_stats_t *fwd_stats = dns_fwd_get_stats(proxy.dns_fwd);
+
+        dns_upstream_stats_t upstreams[DNS_FWD_MAX_UPSTREAMS];
+        int num_upstreams = dns_fwd_get_upstreams(proxy.dns_fwd, now_ms, upstreams, DNS_FWD_MAX_UPSTREAMS);
+
+        log_android(ANDROID_LOG_DEBUG, "DNS forwarder: %u forwarded, %u answered, %u raced, %u timeouts, %u dropped",
+                    fwd_stats->forwarded, fwd_stats->answered, fwd_stats->raced, fwd_stats->timeouts, fwd_stats->dropped);
+        log_android(ANDROID_LOG_DEBUG, "DNS forwarder: %u recv calls (GRO %s, %u segments), batches 1/2+/4+/8+/16+/32+: %u/%u/%u/%u/%u/%u",
+                    fwd_stats->recv_calls, fwd_stats->gro ? "on" : "off", fwd_stats->gro_segments, fwd_stats->batches[0], fwd_stats->batches[1], fwd_stats->batches[2],
+                    fwd_stats->batches[3], fwd_stats->batches[4], fwd_stats->batches[5]);
+
+        for(int i = 0; i < num_upstreams; i++) {
+            char ip[INET_ADDRSTRLEN];
+
+            inet_ntop(AF_INET, &upstreams[i].ip, ip, sizeof(ip));
+            log_android(ANDROID_LOG_DEBUG, "DNS upstream %s: %u queries, %u failures, RTT p50/p90/p99 %u/%u/%u ms",
+                        ip, upstreams[i].queries, upstreams[i].failures, upstreams[i].rtt_p50_ms,
+                        upstreams[i].rtt_p90_ms, upstreams[i].rtt_p99_ms);
+        }
+        dns_fwd_destroy(proxy.dns_fwd);
+    }
+
     finish_log();
     return(0);
 }
@@ -1287,6 +2922,564 @@ Java_com_emanuelef_remote_1capture_CaptureService_askStatsDump(JNIEnv *env, jcla
     }
 }
 
+/* Asks the capture thread to export the active connections to fd, which is duplicated.
+ * Returns false if the capture is not running or another export is in progress. */
+JNIEXPORT jboolean JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_exportConnectionsToFd(JNIEnv *env, jclass clazz,
+                                                                        jint fd, jint format) {
+    int dup_fd;
+
+    if(!running || (export_fd >= 0))
+        return(JNI_FALSE);
+
+    if((dup_fd = dup(fd)) < 0) {
+        log_android(ANDROID_LOG_ERROR, "dup failed[%d]: %s", errno, strerror(errno));
+        return(JNI_FALSE);
+    }
+
+    export_format = (format == CONN_EXPORT_NDJSON) ? CONN_EXPORT_NDJSON : CONN_EXPORT_CSV;
+    export_fd = dup_fd;
+    return(JNI_TRUE);
+}
+
+/* Returns the bandwidth series of the given uid (Utils.UID_NO_FILTER for the global series),
+ * resolution is a BW_RES_*. The first item is the time, in seconds, of the newest slot, followed
+ * by num_slots (sent, rcvd) bytes pairs, oldest first. Returns null if not available. */
+JNIEXPORT jlongArray JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_getBandwidthSeries(JNIEnv *env, jclass clazz,
+                                                                     jint uid, jint resolution, jint num_slots) {
+    u_int32_t now = (u_int32_t) time(NULL);
+    jlongArray rv = NULL;
+    int filled = -1;
+    jlong *out;
+
+    if((num_slots <= 0) || (num_slots > BW_MINS_SLOTS) ||
+       ((resolution != BW_RES_SECONDS) && (resolution != BW_RES_MINUTES)))
+        return(NULL);
+
+    if((out = malloc((1 + 2 * num_slots) * sizeof(jlong))) == NULL)
+        return(NULL);
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if(stats_proxy) {
+        const bw_series_t *bw = NULL;
+
+        if(uid == UID_NO_FILTER)
+            bw = stats_proxy->bw;
+        else {
+            app_stats_t *app = apps_stats_find(&stats_proxy->apps, uid);
+
+            if(app)
+                bw = app->bw;
+        }
+
+        if(bw)
+            filled = bw_series_get(bw, now, resolution, num_slots, &out[1]);
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    if(filled >= 0) {
+        out[0] = (resolution == BW_RES_SECONDS) ? now : (now / 60 * 60);
+        rv = (*env)->NewLongArray(env, 1 + 2 * filled);
+
+        if((rv != NULL) && !jniCheckException(env))
+            (*env)->SetLongArrayRegion(env, rv, 0, 1 + 2 * filled, out);
+    }
+
+    free(out);
+    return(rv);
+}
+
+/* Returns the top k items of the given heavy hitters tracker (a TOP_*), sorted by bytes.
+ * Returns null if not available. */
+JNIEXPORT jobjectArray JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_getHeavyHitters(JNIEnv *env, jclass clazz,
+                                                                  jint tracker, jint k) {
+    jobjectArray rv = NULL;
+    hh_item_t *items;
+    char *labels;
+    int num = -1;
+
+    if((tracker < 0) || (tracker >= TOP_NUM_TRACKERS) || (k <= 0) || (k > TOP_TRACKER_CAPACITY))
+        return(NULL);
+
+    items = malloc(k * sizeof(hh_item_t));
+    labels = malloc(k * HH_LABEL_SIZE);
+
+    if(!items || !labels)
+        goto out;
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if(stats_proxy && stats_proxy->top[tracker]) {
+        num = hh_tracker_top(stats_proxy->top[tracker], items, k);
+
+        /* the labels are owned by the tracker */
+        for(int i = 0; i < num; i++) {
+            memcpy(&labels[i * HH_LABEL_SIZE], items[i].label, HH_LABEL_SIZE);
+            items[i].label = &labels[i * HH_LABEL_SIZE];
+        }
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    if(num < 0)
+        goto out;
+
+    /* The cached classes are only valid within run_tun */
+    jclass hh_cls = jniFindClass(env, "com/emanuelef/remote_capture/model/HeavyHitter");
+    jmethodID hh_init = jniGetMethodID(env, hh_cls, "<init>", "(Ljava/lang/String;IJJ)V");
+
+    rv = (*env)->NewObjectArray(env, num, hh_cls, NULL);
+
+    if((rv == NULL) || jniCheckException(env)) {
+        rv = NULL;
+        goto out;
+    }
+
+    for(int i = 0; i < num; i++) {
+        jobject label = (*env)->NewStringUTF(env, items[i].label);
+        jobject item = (*env)->NewObject(env, hh_cls, hh_init, label, items[i].uid,
+                                         (jlong) items[i].count, (jlong) items[i].error);
+
+        if((item != NULL) && !jniCheckException(env)) {
+            (*env)->SetObjectArrayElement(env, rv, i, item);
+            jniCheckException(env);
+        }
+
+        (*env)->DeleteLocalRef(env, item);
+        (*env)->DeleteLocalRef(env, label);
+    }
+
+    (*env)->DeleteLocalRef(env, hh_cls);
+
+out:
+    if(items)
+        free(items);
+    if(labels)
+        free(labels);
+
+    return(rv);
+}
+
+/* Returns up to k blocklist rules with the most hits, NULL if the blocklist is not loaded */
+JNIEXPORT jobjectArray JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_getBlocklistHits(JNIEnv *env, jclass clazz, jint k) {
+    jobjectArray rv = NULL;
+    blocklist_hit_t *hits;
+    char *domains;
+    int num = -1;
+
+    if(k <= 0)
+        return(NULL);
+
+    hits = malloc(k * sizeof(blocklist_hit_t));
+    domains = malloc(k * BLOCKLIST_DOMAIN_SIZE);
+
+    if(!hits || !domains)
+        goto out;
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if(stats_proxy && stats_proxy->blocklist) {
+        num = blocklist_top_hits(stats_proxy->blocklist, hits, k);
+
+        /* the domains are owned by the blocklist */
+        for(int i = 0; i < num; i++) {
+            char *domain = &domains[i * BLOCKLIST_DOMAIN_SIZE];
+
+            memcpy(domain, hits[i].domain, hits[i].domain_len);
+            domain[hits[i].domain_len] = '\0';
+            hits[i].domain = domain;
+        }
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    if(num < 0)
+        goto out;
+
+    /* The cached classes are only valid within run_tun */
+    jclass hit_cls = jniFindClass(env, "com/emanuelef/remote_capture/model/BlocklistHit");
+    jmethodID hit_init = jniGetMethodID(env, hit_cls, "<init>", "(Ljava/lang/String;I)V");
+
+    rv = (*env)->NewObjectArray(env, num, hit_cls, NULL);
+
+    if((rv == NULL) || jniCheckException(env)) {
+        rv = NULL;
+        goto out;
+    }
+
+    for(int i = 0; i < num; i++) {
+        jobject domain = (*env)->NewStringUTF(env, hits[i].domain);
+        jobject item = (*env)->NewObject(env, hit_cls, hit_init, domain, (jint) hits[i].hits);
+
+        if((item != NULL) && !jniCheckException(env)) {
+            (*env)->SetObjectArrayElement(env, rv, i, item);
+            jniCheckException(env);
+        }
+
+        (*env)->DeleteLocalRef(env, item);
+        (*env)->DeleteLocalRef(env, domain);
+    }
+
+    (*env)->DeleteLocalRef(env, hit_cls);
+
+out:
+    if(hits)
+        free(hits);
+    if(domains)
+        free(domains);
+
+    return(rv);
+}
+
+/* Returns the stats of the DNS upstreams, as of the last periodic update */
+JNIEXPORT jobjectArray JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_getDnsUpstreamsStats(JNIEnv *env, jclass clazz) {
+    dns_upstream_stats_t upstreams[DNS_FWD_MAX_UPSTREAMS];
+    jobjectArray rv;
+    int num = -1;
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if(stats_proxy) {
+        num = stats_proxy->num_dns_upstreams;
+        memcpy(upstreams, stats_proxy->dns_upstreams, num * sizeof(dns_upstream_stats_t));
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    if(num < 0)
+        return(NULL);
+
+    /* The cached classes are only valid within run_tun */
+    jclass upstream_cls = jniFindClass(env, "com/emanuelef/remote_capture/model/DnsUpstream");
+    jmethodID upstream_init = jniGetMethodID(env, upstream_cls, "<init>", "(Ljava/lang/String;ZIIIIIII)V");
+
+    rv = (*env)->NewObjectArray(env, num, upstream_cls, NULL);
+
+    if((rv == NULL) || jniCheckException(env))
+        return(NULL);
+
+    for(int i = 0; i < num; i++) {
+        const dns_upstream_stats_t *upstream = &upstreams[i];
+        char ip[INET_ADDRSTRLEN];
+
+        inet_ntop(AF_INET, &upstream->ip, ip, sizeof(ip));
+
+        jobject address = (*env)->NewStringUTF(env, ip);
+        jobject item = (*env)->NewObject(env, upstream_cls, upstream_init, address, (jboolean) upstream->healthy,
+                                         upstream->queries, upstream->responses, upstream->failures,
+                                         upstream->srtt_ms, upstream->rtt_p50_ms, upstream->rtt_p90_ms,
+                                         upstream->rtt_p99_ms);
+
+        if((item != NULL) && !jniCheckException(env)) {
+            (*env)->SetObjectArrayElement(env, rv, i, item);
+            jniCheckException(env);
+        }
+
+        (*env)->DeleteLocalRef(env, item);
+        (*env)->DeleteLocalRef(env, address);
+    }
+
+    (*env)->DeleteLocalRef(env, upstream_cls);
+    return(rv);
+}
+
+/* Returns the stats of the shaped apps, as of the last periodic update */
+JNIEXPORT jobjectArray JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_getAppsShaperStats(JNIEnv *env, jclass clazz) {
+    shaper_class_stats_t classes[SHAPER_MAX_CLASSES];
+    jobjectArray rv;
+    int num = -1;
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if(stats_proxy) {
+        num = stats_proxy->num_shaper_classes;
+        memcpy(classes, stats_proxy->shaper_classes, num * sizeof(shaper_class_stats_t));
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    if(num < 0)
+        return(NULL);
+
+    /* The cached classes are only valid within run_tun */
+    jclass shaper_cls = jniFindClass(env, "com/emanuelef/remote_capture/model/AppShaperStats");
+    jmethodID shaper_init = jniGetMethodID(env, shaper_cls, "<init>", "(IIIIIJIIIII)V");
+
+    rv = (*env)->NewObjectArray(env, num, shaper_cls, NULL);
+
+    if((rv == NULL) || jniCheckException(env))
+        return(NULL);
+
+    for(int i = 0; i < num; i++) {
+        const shaper_class_stats_t *cls = &classes[i];
+        jobject item = (*env)->NewObject(env, shaper_cls, shaper_init, cls->uid, (jint) cls->rate_kbps,
+                                         (jint) cls->weight, (jint) cls->backlog_pkts, (jint) cls->backlog_bytes,
+                                         (jlong) cls->sent_bytes, (jint) cls->sent_pkts, (jint) cls->queued_pkts,
+                                         (jint) cls->dropped_pkts, (jint) cls->avg_delay_ms, (jint) cls->max_delay_ms);
+
+        if((item != NULL) && !jniCheckException(env)) {
+            (*env)->SetObjectArrayElement(env, rv, i, item);
+            jniCheckException(env);
+        }
+
+        (*env)->DeleteLocalRef(env, item);
+    }
+
+    (*env)->DeleteLocalRef(env, shaper_cls);
+    return(rv);
+}
+
+/* A latency histograms snapshot, see getLatencyHistograms */
+typedef struct {
+    char host[LAT_HOST_SIZE];
+    jint uid;
+    lat_hists_t hists;
+} lat_snapshot_t;
+
+/* Returns the connection setup latency histograms, by app or by host (see
+ * CaptureService.LATENCY_BY_*) */
+JNIEXPORT jobjectArray JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_getLatencyHistograms(JNIEnv *env, jclass clazz, jint by) {
+    lat_snapshot_t *items = NULL;
+    jobjectArray rv = NULL;
+    int num = -1;
+
+    pthread_mutex_lock(&stats_mutex);
+
+    if(stats_proxy && (by == LATENCY_BY_APP)) {
+        app_stats_t *app, *tmp;
+
+        if((items = malloc(stats_proxy->apps.num_apps * sizeof(lat_snapshot_t) + 1)) != NULL) {
+            num = 0;
+
+            HASH_ITER(hh, stats_proxy->apps.table, app, tmp) {
+                if(app->lat) {
+                    items[num].host[0] = '\0';
+                    items[num].uid = app->uid;
+                    items[num++].hists = *app->lat;
+                }
+            }
+        }
+    } else if(stats_proxy && (by == LATENCY_BY_HOST) && stats_proxy->lat_hosts) {
+        const lat_host_t *host = NULL;
+
+        if((items = malloc(lat_hosts_num(stats_proxy->lat_hosts) * sizeof(lat_snapshot_t) + 1)) != NULL) {
+            num = 0;
+
+            while((host = lat_hosts_iter(stats_proxy->lat_hosts, host)) != NULL) {
+                memcpy(items[num].host, host->host, LAT_HOST_SIZE);
+                items[num].uid = UID_UNKNOWN;
+                items[num++].hists = host->hists;
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&stats_mutex);
+
+    if(num < 0)
+        goto out;
+
+    /* The cached classes are only valid within run_tun */
+    jclass lat_cls = jniFindClass(env, "com/emanuelef/remote_capture/model/LatencyHistograms");
+    jmethodID lat_init = jniGetMethodID(env, lat_cls, "<init>", "(Ljava/lang/String;I[I[J)V");
+
+    rv = (*env)->NewObjectArray(env, num, lat_cls, NULL);
+
+    if((rv == NULL) || jniCheckException(env)) {
+        rv = NULL;
+        goto out;
+    }
+
+    for(int i = 0; i < num; i++) {
+        jint counts[LAT_NUM_KINDS * LAT_NUM_BUCKETS];
+        jlong sums[LAT_NUM_KINDS];
+
+        for(int k = 0; k < LAT_NUM_KINDS; k++) {
+            for(int b = 0; b < LAT_NUM_BUCKETS; b++)
+                counts[k * LAT_NUM_BUCKETS + b] = (jint) items[i].hists.kind[k].buckets[b];
+            sums[k] = (jlong) items[i].hists.kind[k].sum_us;
+        }
+
+        jobject host = items[i].host[0] ? (*env)->NewStringUTF(env, items[i].host) : NULL;
+        jintArray counts_arr = (*env)->NewIntArray(env, LAT_NUM_KINDS * LAT_NUM_BUCKETS);
+        jlongArray sums_arr = (*env)->NewLongArray(env, LAT_NUM_KINDS);
+        jobject item = NULL;
+
+        if(counts_arr && sums_arr && !jniCheckException(env)) {
+            (*env)->SetIntArrayRegion(env, counts_arr, 0, LAT_NUM_KINDS * LAT_NUM_BUCKETS, counts);
+            (*env)->SetLongArrayRegion(env, sums_arr, 0, LAT_NUM_KINDS, sums);
+            item = (*env)->NewObject(env, lat_cls, lat_init, host, items[i].uid, counts_arr, sums_arr);
+
+            if((item != NULL) && !jniCheckException(env)) {
+                (*env)->SetObjectArrayElement(env, rv, i, item);
+                jniCheckException(env);
+            }
+        }
+
+        (*env)->DeleteLocalRef(env, item);
+        (*env)->DeleteLocalRef(env, counts_arr);
+        (*env)->DeleteLocalRef(env, sums_arr);
+        (*env)->DeleteLocalRef(env, host);
+    }
+
+    (*env)->DeleteLocalRef(env, lat_cls);
+
+out:
+    if(items)
+        free(items);
+
+    return(rv);
+}
+
+/* Get a reference to the connections log, NULL if none. Must be released with conn_log_unref. */
+static conn_log_t* get_conn_log() {
+    conn_log_t *log;
+
+    pthread_mutex_lock(&conn_log_mutex);
+    if((log = conn_log) != NULL)
+        conn_log_ref(log);
+    pthread_mutex_unlock(&conn_log_mutex);
+
+    return(log);
+}
+
+/* Returns the ids of the logged connections closed in the [from, to] interval (in seconds),
+ * newest first. uid can be Utils.UID_NO_FILTER. */
+JNIEXPORT jintArray JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_connLogQuery(JNIEnv *env, jclass clazz,
+                                                               jlong from, jlong to, jint uid, jint max) {
+    conn_log_t *log;
+    jintArray rv;
+    u_int32_t *ids;
+    int num = 0;
+
+    if(max <= 0)
+        return(NULL);
+
+    if((ids = malloc(max * sizeof(u_int32_t))) == NULL)
+        return(NULL);
+
+    if((log = get_conn_log()) != NULL) {
+        num = conn_log_query(log, from, to, uid, ids, max);
+        conn_log_unref(log);
+    }
+
+    if(num < 0)
+        num = 0;
+
+    rv = (*env)->NewIntArray(env, num);
+
+    if((rv != NULL) && !jniCheckException(env))
+        (*env)->SetIntArrayRegion(env, rv, 0, num, (jint*) ids);
+
+    free(ids);
+    return(rv);
+}
+
+/* Loads the logged connections with the given ids. The log id is used as the incr_id. */
+JNIEXPORT jobjectArray JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_connLogGet(JNIEnv *env, jclass clazz,
+                                                             jintArray ids) {
+    /* The cached classes are only valid within run_tun */
+    jclass conn_cls = jniFindClass(env, "com/emanuelef/remote_capture/model/ConnectionDescriptor");
+    jmethodID conn_init = jniGetMethodID(env, conn_cls, "<init>", "()V");
+    jmethodID conn_set_data = jniGetMethodID(env, conn_cls, "setData", CONN_SET_DATA_SIGNATURE);
+    int num_ids = (*env)->GetArrayLength(env, ids);
+    jobjectArray rv = (*env)->NewObjectArray(env, num_ids, conn_cls, NULL);
+    char info[CONN_STR_MAX_LEN], url[CONN_STR_MAX_LEN];
+    conn_log_t *log;
+
+    if((rv == NULL) || jniCheckException(env))
+        return(NULL);
+
+    if((log = get_conn_log()) == NULL)
+        num_ids = 0;
+
+    for(int i = 0; i < num_ids; i++) {
+        char srcip[INET6_ADDRSTRLEN], dstip[INET6_ADDRSTRLEN];
+        conn_log_record_t rec;
+        jint id;
+
+        (*env)->GetIntArrayRegion(env, ids, i, 1, &id);
+
+        if(conn_log_get(log, (u_int32_t) id, &rec, info, sizeof(info), url, sizeof(url)) != 0)
+            continue;
+
+        int family = (rec.ipver == 4) ? AF_INET : AF_INET6;
+
+        if((inet_ntop(family, rec.src_ip, srcip, sizeof(srcip)) == NULL) ||
+           (inet_ntop(family, rec.dst_ip, dstip, sizeof(dstip)) == NULL))
+            continue;
+
+        jobject info_string = (*env)->NewStringUTF(env, info);
+        jobject url_string = (*env)->NewStringUTF(env, url);
+        jobject proto_string = (*env)->NewStringUTF(env, rec.l7proto);
+        jobject src_string = (*env)->NewStringUTF(env, srcip);
+        jobject dst_string = (*env)->NewStringUTF(env, dstip);
+        jobject conn_descriptor = (*env)->NewObject(env, conn_cls, conn_init);
+        bool failed = true;
+
+        if((conn_descriptor != NULL) && !jniCheckException(env)) {
+            (*env)->CallVoidMethod(env, conn_descriptor, conn_set_data,
+                                   src_string, dst_string, info_string, url_string, proto_string,
+                                   (jint) rec.status, (jint) rec.ipver, (jint) rec.ipproto,
+                                   ntohs(rec.src_port), ntohs(rec.dst_port),
+                                   (jlong) rec.first_seen, (jlong) rec.last_seen, (jlong) rec.sent_bytes,
+                                   (jlong) rec.rcvd_bytes, (jint) rec.sent_pkts,
+                                   (jint) rec.rcvd_pkts, (jint) rec.uid, id);
+
+            if(!jniCheckException(env)) {
+                (*env)->SetObjectArrayElement(env, rv, i, conn_descriptor);
+                failed = jniCheckException(env);
+            }
+
+            (*env)->DeleteLocalRef(env, conn_descriptor);
+        }
+
+        (*env)->DeleteLocalRef(env, info_string);
+        (*env)->DeleteLocalRef(env, url_string);
+        (*env)->DeleteLocalRef(env, proto_string);
+        (*env)->DeleteLocalRef(env, src_string);
+        (*env)->DeleteLocalRef(env, dst_string);
+
+        if(failed)
+            break;
+    }
+
+    if(log)
+        conn_log_unref(log);
+    (*env)->DeleteLocalRef(env, conn_cls);
+
+    return(rv);
+}
+
+/* Exports the logged connections closed in the [from, to] interval to fd, oldest first.
+ * Runs in the calling thread, which may block on fd. */
+JNIEXPORT jboolean JNICALL
+Java_com_emanuelef_remote_1capture_CaptureService_connLogExport(JNIEnv *env, jclass clazz,
+                                                                jint fd, jint format,
+                                                                jlong from, jlong to, jint uid) {
+    conn_log_t *log;
+    int rv = -1;
+
+    if((log = get_conn_log()) != NULL) {
+        /* the number of rows, -1 on error */
+        rv = conn_export_log(log, fd,
+                             (format == CONN_EXPORT_NDJSON) ? CONN_EXPORT_NDJSON : CONN_EXPORT_CSV,
+                             from, to, uid);
+        conn_log_unref(log);
+    }
+
+    return((rv >= 0) ? JNI_TRUE : JNI_FALSE);
+}
+
 JNIEXPORT jint JNICALL
 Java_com_emanuelef_remote_1capture_CaptureService_getFdSetSize(JNIEnv *env, jclass clazz) {
     return FD_SETSIZE;
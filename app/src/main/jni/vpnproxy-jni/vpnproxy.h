@@ -22,12 +22,25 @@
 #include "zdtun.h"
 #include "uid_resolver.h"
 #include "ip_lru.h"
+#include "app_stats.h"
+#include "conn_log.h"
+#include "heavy_hitters.h"
+#include "dns_cache.h"
+#include "dns_coalesce.h"
+#include "dns_forward.h"
+#include "blocklist.h"
+#include "ip_rules.h"
+#include "shaper.h"
+#include "sock_tune.h"
+#include "tcp_health.h"
+#include "latency.h"
 #include <ndpi_api.h>
 
 #ifndef REMOTE_CAPTURE_VPNPROXY_H
 #define REMOTE_CAPTURE_VPNPROXY_H
 
 #define UID_UNKNOWN -1
+#define UID_NO_FILTER -2
 
 typedef struct capture_stats {
     jlong sent_bytes;
@@ -39,37 +52,147 @@ typedef struct capture_stats {
     u_int64_t last_update_ms;
 } capture_stats_t;
 
+/* Per-packet connection state, updated by account_packet */
+typedef struct conn_stats {
+    jlong sent_bytes;
+    jlong rcvd_bytes;
+    jlong last_seen;
+    jint sent_pkts;
+    jint rcvd_pkts;
+    u_int8_t status; /* zdtun_conn_status_t */
+    u_int8_t flags;  /* CONN_FLAG_* */
+} conn_stats_t;
+
+#define CONN_FLAG_PENDING_NOTIFICATION  0x01 /* to be sent as an update */
+#define CONN_FLAG_NDPI                  0x02 /* nDPI detection in progress */
+#define CONN_FLAG_IGNORED               0x04 /* see shouldIgnoreConn */
+#define CONN_FLAG_NEW                   0x08 /* to be sent as a new connection */
+#define CONN_FLAG_CLOSED                0x10 /* the zdtun connection was destroyed */
+#define CONN_FLAG_BLOCKED               0x20 /* the host is in the blocklist, to be destroyed */
+#define CONN_FLAG_NO_EXPORT             0x40 /* matched an IP_RULE_NO_EXPORT rule */
+
+/* A connection string (e.g. info, url). Short strings, like most host names, are stored inline,
+ * longer strings are allocated. Must be accessed via conn_str_get/conn_str_set. */
+#define CONN_STR_INLINE_SIZE 48
+#define CONN_STR_MAX_LEN 256
+
+typedef struct conn_str {
+    char *heap;
+    char inl[CONN_STR_INLINE_SIZE];
+} conn_str_t;
+
+/* Connection metadata which is only needed during DPI and dumps */
 typedef struct conn_data {
-    jint incr_id; /* an incremental identifier */
+    u_int32_t slot; /* the index in the conn_store_t columns, changed when they are resized */
 
     /* nDPI */
     struct ndpi_flow_struct *ndpi_flow;
     struct ndpi_id_struct *src_id, *dst_id;
-    ndpi_protocol l7proto;
 
-    jlong first_seen;
-    jlong last_seen;
-    jlong sent_bytes;
-    jlong rcvd_bytes;
-    jint sent_pkts;
-    jint rcvd_pkts;
-    zdtun_conn_status_t status;
-    char *info;
-    char *url;
-    jint uid;
-    bool pending_notification;
+    conn_str_t info;
+    conn_str_t url;
+
+    app_stats_t *app; /* NULL for the ignored connections */
+
+    /* heavy hitters keys, 0 if not computed yet */
+    u_int64_t host_key;
+    u_int64_t ip_key;
+
+    u_int8_t rule_tag; /* the tag of the matched IP rule, see ip_rules_tag_name */
+
+    /* the upstream socket, TCP only. tune.sock is the socket, -1 once closed */
+    sock_tune_t tune;
+    tcp_health_t tcp;
+
+    conn_latency_t lat;
 } conn_data_t;
 
-typedef struct vpn_conn {
-    zdtun_5tuple_t tuple;
+/*
+ * The native connections store. Each column is an array indexed by the connection slot. The
+ * slots of the released connections are kept in a free list and reused. Periodic scans (e.g.
+ * the connections dump) are linear sweeps of the order array, which holds the slots in creation
+ * order. Released slots are dropped from it, and the columns shrunk when mostly unused, by
+ * conn_store_compact, so that the scans are proportional to the live connections.
+ */
+typedef struct conn_store {
+    zdtun_5tuple_t *tuple;
+    conn_stats_t *stats;
+    jlong *first_seen;
+    jint *uid;
+    jint *incr_id; /* the id of the connection in the ConnectionsRegister, -1 if ignored */
+    ndpi_protocol *l7proto;
+    conn_data_t **data; /* NULL if the connection was released */
+
+    u_int32_t *order;       /* the slots in creation order, including the released ones */
+    u_int32_t *free_slots;
+    u_int32_t size;         /* columns size */
+    u_int32_t num_order;
+    u_int32_t num_free;
+    u_int32_t num_released; /* released slots still in order */
+    int num_new;
+    int num_updates;
+} conn_store_t;
+
+/* Subsystems accounted in the engine memory budget */
+typedef enum {
+    MEM_CONNS = 0,  /* conn_data_t and the info/url strings */
+    MEM_NDPI,       /* nDPI flows and ids */
+    MEM_HOSTS,      /* the ip_to_host and DNS caches, the blocklist hits, the IP rules */
+    MEM_BUFFERS,    /* export buffers, shaper queues */
+    MEM_STORE,      /* conn_store_t columns */
+    MEM_SERIES,     /* bandwidth series and heavy hitters */
+    MEM_NUM_SUBSYS
+} mem_subsys_t;
+
+/* The heavy hitters trackers. Must match CaptureService.TOP_* */
+typedef enum {
+    TOP_HOSTS = 0,      /* by host name (info) */
+    TOP_IPS,            /* by destination IP */
+    TOP_APP_HOSTS,      /* by uid + host name, or destination IP if unknown */
+    TOP_NUM_TRACKERS
+} top_tracker_t;
+
+#define TOP_TRACKER_CAPACITY 256
+
+/* The latency histograms aggregations. Must match CaptureService.LATENCY_BY_* */
+#define LATENCY_BY_APP  0
+#define LATENCY_BY_HOST 1
+
+/* Event loop service counters, see run_tun */
+typedef struct sched_stats {
+    u_int64_t tun_pkts;         /* packets read from the tun (upstream) */
+    u_int64_t sock_events;      /* ready zdtun sockets serviced     */
+    u_int32_t tun_budget_hits;  /* iterations which read TUN_READ_BUDGET packets */
+    u_int32_t iterations;
+} sched_stats_t;
+
+/* A query to the VPN DNS answered by the engine, waiting for its reply. The query is recorded as
+ * a connection without a zdtun socket or DPI, see record_dns_query. */
+typedef struct dns_pending {
+    u_int64_t key;      /* client IP, port and DNS transaction id */
+    conn_data_t *data;
+    u_int64_t start_ms;
+    UT_hash_handle hh;
+} dns_pending_t;
+
+/* Traffic accounted by the capture thread and not yet published to the bandwidth series and
+ * the heavy hitters, see publish_pending_traffic. Consecutive packets of the same connection,
+ * direction and second are merged into one item. */
+typedef struct pending_traffic {
     conn_data_t *data;
-} vpn_conn_t;
+    u_int32_t now_sec;
+    u_int32_t size;
+    bool sent;
+} pending_traffic_t;
 
-typedef struct conn_array {
-    vpn_conn_t *items;
-    int size;
-    int cur_items;
-} conn_array_t;
+#define MAX_PENDING_TRAFFIC 256
+
+typedef struct mem_stats {
+    u_int64_t used[MEM_NUM_SUBSYS];
+    u_int64_t budget;
+    u_int32_t dpi_evictions;
+    u_int32_t meta_evictions;
+} mem_stats_t;
 
 typedef struct vpnproxy_data {
     int tunfd;
@@ -81,15 +204,25 @@ typedef struct vpnproxy_data {
     u_int32_t dns_server;
     u_int32_t vpn_ipv4;
     struct ndpi_detection_module_struct *ndpi;
-    ndpi_ptree_t *known_dns_servers;
+    ip_rules_t *ip_rules;
     uid_resolver_t *resolver;
     ip_lru_t *ip_to_host;
+    dns_cache_t *dns_cache;
+    dns_coalesce_t *dns_inflight;
+    dns_fwd_t *dns_fwd; /* NULL if unavailable, queries go through zdtun */
+    dns_pending_t *dns_pending;
+    blocklist_t *blocklist; /* NULL if disabled */
+    shaper_t *shaper; /* NULL if no app is shaped */
+    sock_tuner_t *sock_tuner;
+    u_int32_t tcp_health_cursor; /* the next order index to sample, see sample_tcp_health */
+    struct conn_export *export; /* the export in progress, NULL if none */
+    u_int32_t export_cursor; /* the next order index to export, see conn_export_step */
     uint64_t now_ms;
+    conn_store_t conns;
     u_int32_t num_dropped_connections;
     u_int32_t num_dns_requests;
-    conn_array_t new_conns;
-    conn_array_t conns_updates;
     zdtun_pkt_t *last_pkt;
+    conn_data_t *cur_conn; /* the connection being forwarded, see protectSocketCallback */
     bool last_conn_blocked;
 
     struct {
@@ -118,6 +251,33 @@ typedef struct vpnproxy_data {
     } ipv6;
 
     capture_stats_t capture_stats;
+    apps_stats_t apps;
+    mem_stats_t mem;
+    sched_stats_t sched;
+    bw_series_t *bw; /* global bandwidth series */
+    pending_traffic_t pending[MAX_PENDING_TRAFFIC];
+    int num_pending;
+    hh_tracker_t *top[TOP_NUM_TRACKERS];
+    lat_hosts_t *lat_hosts; /* guarded by the stats mutex */
+    conn_log_t *conn_log; /* NULL if disabled */
+
+    /* snapshot of the DNS upstreams stats, guarded by the stats mutex */
+    dns_upstream_stats_t dns_upstreams[DNS_FWD_MAX_UPSTREAMS];
+    int num_dns_upstreams;
+
+    /* snapshot of the shaper stats, guarded by the stats mutex */
+    shaper_class_stats_t shaper_classes[SHAPER_MAX_CLASSES];
+    int num_shaper_classes;
 } vpnproxy_data_t;
 
+/* Returns NULL if the string is not set */
+static inline const char* conn_str_get(const conn_str_t *str) {
+    if(str->heap)
+        return(str->heap);
+
+    return(str->inl[0] ? str->inl : NULL);
+}
+
+const char *getProtoName(struct ndpi_detection_module_struct *mod, ndpi_protocol l7proto, int ipproto);
+
 #endif //REMOTE_CAPTURE_H
@@ -0,0 +1,263 @@
+/*
+ * This file is part of PCAPdroid.
+ *
+ * PCAPdroid is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PCAPdroid is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PCAPdroid.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Copyright 2020-21 - Emanuele Faranda
+ */
+
+package com.emanuelef.remote_capture;
+
+import com.emanuelef.remote_capture.model.ConnectionDescriptor;
+
+import org.junit.Ignore;
+import org.junit.Test;
+
+import java.util.Arrays;
+import java.util.concurrent.atomic.AtomicBoolean;
+import java.util.concurrent.atomic.AtomicLong;
+import java.util.concurrent.atomic.AtomicReference;
+
+import static org.junit.Assert.assertEquals;
+import static org.junit.Assert.assertFalse;
+import static org.junit.Assert.assertNotNull;
+import static org.junit.Assert.assertNull;
+import static org.junit.Assert.assertSame;
+import static org.junit.Assert.assertTrue;
+
+public class ConnectionsRegisterTest {
+    private static final int SIZE = 8;
+    private int mNextIncrId = 0;
+
+    private static ConnectionDescriptor newConn(int uid, int incr_id) {
+        ConnectionDescriptor conn = new ConnectionDescriptor();
+
+        conn.setData("10.0.0.1", "1.1.1.1", "", "", "", 0, 4, 6,
+                1000 + (incr_id % 50000), 443, 0, 0, 0, 0, 0, 0, uid, incr_id);
+        return conn;
+    }
+
+    private ConnectionDescriptor[] newConns(int... uids) {
+        ConnectionDescriptor[] conns = new ConnectionDescriptor[uids.length];
+
+        for(int i = 0; i < uids.length; i++)
+            conns[i] = newConn(uids[i], mNextIncrId++);
+
+        return conns;
+    }
+
+    /* Connections of 50 different apps */
+    private ConnectionDescriptor[] newAppConns(int count) {
+        int[] uids = new int[count];
+
+        for(int i = 0; i < count; i++)
+            uids[i] = 10000 + (mNextIncrId + i) % 50;
+
+        return newConns(uids);
+    }
+
+    /* As sendConnectionsDump: updates of the connections in [first, first + count) */
+    private static ConnectionDescriptor[] updatesOf(ConnectionsRegister.Snapshot snap, int first, int count) {
+        ConnectionDescriptor[] updates = new ConnectionDescriptor[count];
+
+        for(int i = 0; i < count; i++) {
+            ConnectionDescriptor old = snap.getConn(first + i);
+            updates[i] = newConn(old.uid, old.incr_id);
+        }
+
+        return updates;
+    }
+
+    /* Checks the uid index against the connections in the ring */
+    private static void assertUidIndexConsistent(ConnectionsRegister reg) {
+        assertUidIndexConsistent(reg.getSnapshot());
+    }
+
+    private static void assertUidIndexConsistent(ConnectionsRegister.Snapshot snap) {
+        int total = 0;
+
+        for(int uid: snap.getSeenUids()) {
+            int count = snap.getUidConnCount(uid);
+            int expected = 0;
+
+            assertTrue(count > 0);
+
+            for(int i = 0; i < snap.getConnCount(); i++) {
+                if(snap.getConn(i).uid == uid)
+                    expected++;
+            }
+            assertEquals("uid " + uid, expected, count);
+
+            for(int i = 0; i < count; i++) {
+                ConnectionDescriptor conn = snap.getUidConn(uid, i);
+
+                assertNotNull("uid " + uid + " pos " + i, conn);
+                assertEquals(uid, conn.uid);
+            }
+
+            total += count;
+        }
+
+        assertEquals(snap.getConnCount(), total);
+    }
+
+    @Test
+    public void batchOverflowsPartiallyFilledRing() {
+        ConnectionsRegister reg = new ConnectionsRegister(SIZE);
+
+        reg.newConnections(newConns(1, 1, 2));
+        assertUidIndexConsistent(reg);
+
+        // 3 + 7 > SIZE: the oldest 2 connections (uid 1) are evicted
+        reg.newConnections(newConns(3, 3, 3, 3, 3, 3, 2));
+        assertUidIndexConsistent(reg);
+
+        assertEquals(SIZE, reg.getConnCount());
+        assertEquals(2, reg.getUntrackedConnCount());
+        assertFalse(reg.getSeenUids().contains(1));
+        assertEquals(2, reg.getUidConnCount(2));
+        assertEquals(6, reg.getUidConnCount(3));
+    }
+
+    @Test
+    public void batchLargerThanRing() {
+        ConnectionsRegister reg = new ConnectionsRegister(SIZE);
+
+        reg.newConnections(newConns(1, 2, 1));
+        reg.newConnections(newConns(4, 4, 4, 4, 4, 4, 4, 4, 5, 5));
+        assertUidIndexConsistent(reg);
+
+        assertEquals(SIZE, reg.getConnCount());
+        assertEquals(5, reg.getUntrackedConnCount());
+        assertEquals(2, reg.getUidConnCount(5));
+        assertEquals(6, reg.getUidConnCount(4));
+    }
+
+    @Test
+    public void wrapAroundFullRing() {
+        ConnectionsRegister reg = new ConnectionsRegister(SIZE);
+
+        for(int round = 0; round < 10; round++) {
+            reg.newConnections(newConns(round % 3, (round + 1) % 3, 7));
+            assertUidIndexConsistent(reg);
+        }
+
+        assertEquals(SIZE, reg.getConnCount());
+        assertEquals(30 - SIZE, reg.getUntrackedConnCount());
+    }
+
+    /* A snapshot must not change when the following dumps add, evict and update connections in
+     * the pages it shares, or append to the uid index it shares */
+    @Test
+    public void snapshotUnchangedByLaterDumps() {
+        final int size = 1000; // not a multiple of the page size
+        ConnectionsRegister reg = new ConnectionsRegister(size);
+
+        reg.newConnections(newAppConns(size - 10));
+
+        ConnectionsRegister.Snapshot snap = reg.getSnapshot();
+        ConnectionDescriptor[] conns = new ConnectionDescriptor[snap.getConnCount()];
+
+        for(int i = 0; i < conns.length; i++)
+            conns[i] = snap.getConn(i);
+
+        for(int d = 0; d < 50; d++) {
+            ConnectionsRegister.Snapshot cur;
+
+            reg.newConnections(newAppConns(32));
+
+            // the most recent connections, and some in another page
+            cur = reg.getSnapshot();
+            reg.connectionsUpdates(updatesOf(cur, cur.getConnCount() - 32, 32));
+            reg.connectionsUpdates(updatesOf(cur, (d * 97) % (size - 8), 8));
+
+            assertUidIndexConsistent(reg);
+        }
+
+        assertEquals(size, reg.getConnCount());
+        assertEquals(conns.length, snap.getConnCount());
+
+        for(int i = 0; i < conns.length; i++)
+            assertSame("position " + i, conns[i], snap.getConn(i));
+
+        assertUidIndexConsistent(snap);
+    }
+
+    /* Benchmark: dumps into a full register while readers iterate its snapshots, as the UI and
+     * the CSV export do. Reports the dump latency, and checks that the readers never see a torn
+     * view. Not run by default, as its timings depend on the host. */
+    @Ignore("benchmark")
+    @Test
+    public void dumpLatencyWithConcurrentReaders() throws InterruptedException {
+        final int size = 8192;
+        final int numDumps = 2000;
+        final int batch = 32;
+        final ConnectionsRegister reg = new ConnectionsRegister(size);
+        final AtomicBoolean stop = new AtomicBoolean(false);
+        final AtomicLong scanned = new AtomicLong();
+        final AtomicReference<String> failure = new AtomicReference<>();
+        Thread[] readers = new Thread[4];
+        long[] latencies = new long[numDumps];
+
+        reg.newConnections(newAppConns(size));
+
+        for(int r = 0; r < readers.length; r++) {
+            readers[r] = new Thread(() -> {
+                while(!stop.get()) {
+                    ConnectionsRegister.Snapshot snap = reg.getSnapshot();
+                    int prev_id = -1;
+
+                    // the ring is in incr_id order, updates keep the incr_id
+                    for(int i = 0; i < snap.getConnCount(); i++) {
+                        ConnectionDescriptor conn = snap.getConn(i);
+
+                        if((conn == null) || (conn.incr_id <= prev_id)) {
+                            failure.compareAndSet(null, "torn snapshot at position " + i);
+                            return;
+                        }
+                        prev_id = conn.incr_id;
+                    }
+
+                    scanned.addAndGet(snap.getConnCount());
+                }
+            });
+            readers[r].start();
+        }
+
+        for(int d = 0; d < numDumps; d++) {
+            ConnectionsRegister.Snapshot snap = reg.getSnapshot();
+
+            // as sendConnectionsDump: the new connections, then the updates of the recent ones
+            ConnectionDescriptor[] updates = updatesOf(snap, snap.getConnCount() - batch, batch);
+
+            long start = System.nanoTime();
+            reg.newConnections(newAppConns(batch));
+            reg.connectionsUpdates(updates);
+            latencies[d] = System.nanoTime() - start;
+        }
+
+        stop.set(true);
+        for(Thread reader: readers)
+            reader.join();
+
+        assertNull(failure.get());
+        assertTrue(scanned.get() > 0);
+        assertUidIndexConsistent(reg);
+
+        Arrays.sort(latencies);
+        System.out.printf("Dump latency with %d readers (%d connections scanned): p50 %d us, p99 %d us, max %d us%n",
+                readers.length, scanned.get(), latencies[numDumps / 2] / 1000,
+                latencies[numDumps * 99 / 100] / 1000, latencies[numDumps - 1] / 1000);
+    }
+}